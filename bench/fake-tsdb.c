@@ -0,0 +1,681 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+/*
+ * In-process stand-in for the local and cloud redis-tsdb APIs, used to
+ * benchmark the publication path without any database nor network.
+ *
+ * The local API serves a deterministic data set through ts_mrange() and keeps
+ * the get/set/del keys in memory. The cloud API accepts ts_minsert() calls
+ * after a configurable latency, fails them as "disconnected" during the
+ * windows of a disconnect schedule, and counts the distinct samples received.
+ * It also serves identified ts_minsert() calls through 'ts_batch', applying
+ * each batch ID once.
+ * The 'fake-tsdb/status' verb reports the end-to-end throughput and the
+ * resident memory of the binder once every sample has been published.
+ *
+ * Everything is configured through FAKE_TSDB_* environment variables, see
+ * bench/README.md.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define  AFB_BINDING_VERSION 3
+#include <afb/afb-binding.h>
+#include <wrap-json.h>
+
+#define FAKE_DEFAULT_LOCAL_API "redis"
+#define FAKE_DEFAULT_CLOUD_API "redis-cloud"
+#define FAKE_DEFAULT_CLASS "BENCH"
+#define FAKE_DEFAULT_KEYS 150
+#define FAKE_DEFAULT_RATE_HZ 1.0
+#define FAKE_DEFAULT_DAYS 1.0
+#define FAKE_DEFAULT_EPOCH_MS 1600000000000
+#define FAKE_DEFAULT_MRANGE_COUNT 3600
+#define FAKE_DEFAULT_MRANGE_LATENCY_MS 2
+#define FAKE_DEFAULT_MINSERT_LATENCY_MS 20
+#define FAKE_DEFAULT_SEED 1
+
+#define FAKE_MAX_DISCONNECTS 16
+#define FAKE_KEY_MAX_LEN 128
+// batch IDs remembered by 'ts_batch'
+#define FAKE_BATCH_IDS 256
+
+// One window of the disconnect schedule, relative to the first ts_minsert()
+typedef struct fakeWindow {
+    int64_t start_ms;
+    int64_t end_ms;
+} fakeWindowT;
+
+typedef struct fakeTsdb {
+    // configuration
+    const char * local_api;
+    const char * cloud_api;
+    const char * sensor_class;
+    size_t key_count;
+    int64_t period_ms;
+    int64_t samples_per_key;
+    int64_t epoch_ms;
+    int64_t mrange_count;
+    int mrange_latency_ms;
+    int minsert_latency_ms;
+    int jitter_ms;
+    fakeWindowT windows[FAKE_MAX_DISCONNECTS];
+    int window_count;
+
+    // runtime state, protected by the lock
+    pthread_mutex_t lock;
+    uint64_t seed;
+    json_object * storeJ;
+    // one bit per sample of each key
+    uint8_t * received;
+    int64_t started_us;
+    int64_t minsert_started_us;
+    int64_t finished_us;
+    int64_t samples_received;
+    int64_t duplicates;
+    int64_t unknown_keys;
+    int64_t mrange_calls;
+    int64_t minsert_calls;
+    int64_t minsert_disconnected;
+    char * batch_ids[FAKE_BATCH_IDS];
+    size_t batch_next;
+    int64_t batches_deduplicated;
+} fakeTsdbT;
+
+// A reply held back for the simulated latency
+typedef struct fakeReply {
+    afb_req_t request;
+    json_object * replyJ;
+    const char * error;
+} fakeReplyT;
+
+static fakeTsdbT fake;
+
+static int64_t fake_mono_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char * env_string(const char * name, const char * fallback) {
+    const char * value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+static int64_t env_int(const char * name, int64_t fallback) {
+    const char * value = getenv(name);
+    return value && *value ? strtoll(value, NULL, 10) : fallback;
+}
+
+static double env_double(const char * name, double fallback) {
+    const char * value = getenv(name);
+    return value && *value ? strtod(value, NULL) : fallback;
+}
+
+// Deterministic jitter, so that two runs with the same seed see the same delays
+static int fake_delay(int latency_ms) {
+    uint64_t x;
+
+    if (fake.jitter_ms <= 0)
+        return latency_ms;
+
+    x = fake.seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    fake.seed = x;
+    return latency_ms + (int)(x % (uint64_t)(fake.jitter_ms + 1));
+}
+
+/**
+ * @brief Parse the disconnect schedule: "<start_s>:<duration_s>[,...]"
+ */
+static int parse_disconnects(afb_api_t api, const char * schedule) {
+    const char * cursor = schedule;
+    double start, duration;
+    int consumed;
+
+    while (cursor && *cursor) {
+        if (fake.window_count == FAKE_MAX_DISCONNECTS ||
+            sscanf(cursor, "%lf:%lf%n", &start, &duration, &consumed) != 2 ||
+            start < 0 || duration <= 0) {
+            AFB_API_ERROR(api, "invalid FAKE_TSDB_DISCONNECT schedule '%s'", schedule);
+            return -1;
+        }
+        fake.windows[fake.window_count].start_ms = (int64_t)(start * 1000);
+        fake.windows[fake.window_count].end_ms = (int64_t)((start + duration) * 1000);
+        fake.window_count++;
+
+        cursor += consumed;
+        if (*cursor == ',')
+            cursor++;
+    }
+
+    return 0;
+}
+
+static bool fake_disconnected(int64_t now_us) {
+    int64_t elapsed_ms = (now_us - fake.minsert_started_us) / 1000;
+    int ix;
+
+    for (ix = 0; ix < fake.window_count; ix++) {
+        if (elapsed_ms >= fake.windows[ix].start_ms && elapsed_ms < fake.windows[ix].end_ms)
+            return true;
+    }
+
+    return false;
+}
+
+static int64_t sample_ts(int64_t idx) {
+    return fake.epoch_ms + idx * fake.period_ms;
+}
+
+static double sample_value(size_t key, int64_t idx) {
+    return 20.0 + (double)(((int64_t)key * 7919 + idx * 104729) % 10000) / 100.0;
+}
+
+// Key names are "<class>.<index>", the index being zero padded
+static void key_name(size_t key, char * buffer, size_t size) {
+    snprintf(buffer, size, "%s.%04zu", fake.sensor_class, key);
+}
+
+static bool key_index(const char * name, size_t * key) {
+    const char * dot = strrchr(name, '.');
+    char * end;
+    unsigned long idx;
+
+    if (dot == NULL || strncmp(name, fake.sensor_class, (size_t)(dot - name)) != 0 ||
+        strlen(fake.sensor_class) != (size_t)(dot - name))
+        return false;
+
+    idx = strtoul(dot + 1, &end, 10);
+    if (*end != '\0' || idx >= fake.key_count)
+        return false;
+
+    *key = idx;
+    return true;
+}
+
+static void reply_job(int signum, void * arg) {
+    fakeReplyT * reply = arg;
+
+    if (reply->error)
+        afb_req_fail(reply->request, reply->error, NULL);
+    else
+        afb_req_success(reply->request, reply->replyJ, NULL);
+
+    afb_req_unref(reply->request);
+    free(reply);
+}
+
+/**
+ * @brief Reply to a request after a delay, the reply object being taken over
+ */
+static void reply_later(afb_req_t request, json_object * replyJ, const char * error, int delay_ms) {
+    fakeReplyT * reply;
+
+    if (delay_ms <= 0)
+        goto reply_now;
+
+    reply = malloc(sizeof(*reply));
+    if (reply == NULL)
+        goto reply_now;
+
+    reply->request = afb_req_addref(request);
+    reply->replyJ = replyJ;
+    reply->error = error;
+    if (afb_api_queue_job(afb_req_get_api(request), reply_job, reply, NULL, -delay_ms) < 0) {
+        afb_req_unref(request);
+        free(reply);
+        goto reply_now;
+    }
+    return;
+
+reply_now:
+    if (error)
+        afb_req_fail(request, error, NULL);
+    else
+        afb_req_success(request, replyJ, NULL);
+}
+
+/**
+ * @brief Convert a ts_mrange() bound to a sample index range
+ *
+ * @return the index of the first sample whose timestamp is greater or equal to
+ * the bound when 'lower' is set, of the last sample whose timestamp is lower or
+ * equal to the bound otherwise
+ */
+static int64_t bound_index(const char * bound, bool lower) {
+    int64_t ts, offset;
+
+    if (bound == NULL || strcmp(bound, "-") == 0)
+        return 0;
+    if (strcmp(bound, "+") == 0)
+        return fake.samples_per_key - 1;
+
+    ts = strtoll(bound, NULL, 10);
+    offset = ts - fake.epoch_ms;
+    if (lower)
+        return offset <= 0 ? 0 : (offset + fake.period_ms - 1) / fake.period_ms;
+
+    return offset < 0 ? -1 : offset / fake.period_ms;
+}
+
+static void ts_mrange_cb(afb_req_t request) {
+    const char * sensor_class = NULL;
+    const char * fromts = NULL;
+    const char * tots = NULL;
+    char name[FAKE_KEY_MAX_LEN];
+    json_object * replyJ;
+    json_object * seriesJ;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    int64_t first, last, idx;
+    size_t key;
+    int delay;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s:s, s?:s, s?:s}", "class", &sensor_class,
+                         "fromts", &fromts, "tots", &tots)) {
+        afb_req_fail(request, "invalid-request", "ts_mrange expects {class, fromts, tots}");
+        return;
+    }
+
+    replyJ = json_object_new_object();
+
+    pthread_mutex_lock(&fake.lock);
+    if (fake.started_us == 0)
+        fake.started_us = fake_mono_us();
+    fake.mrange_calls++;
+    delay = fake_delay(fake.mrange_latency_ms);
+    pthread_mutex_unlock(&fake.lock);
+
+    if (strcmp(sensor_class, fake.sensor_class) == 0) {
+        first = bound_index(fromts, true);
+        last = bound_index(tots, false);
+        if (last >= fake.samples_per_key)
+            last = fake.samples_per_key - 1;
+        if (fake.mrange_count > 0 && last - first + 1 > fake.mrange_count)
+            last = first + fake.mrange_count - 1;
+
+        for (key = 0; first <= last && key < fake.key_count; key++) {
+            timestampsJ = json_object_new_array();
+            valuesJ = json_object_new_array();
+            for (idx = first; idx <= last; idx++) {
+                json_object_array_add(timestampsJ, json_object_new_int64(sample_ts(idx)));
+                json_object_array_add(valuesJ, json_object_new_double(sample_value(key, idx)));
+            }
+
+            seriesJ = json_object_new_object();
+            json_object_object_add(seriesJ, "timestamps", timestampsJ);
+            json_object_object_add(seriesJ, "values", valuesJ);
+            key_name(key, name, sizeof(name));
+            json_object_object_add(replyJ, name, seriesJ);
+        }
+    }
+
+    reply_later(request, replyJ, NULL, delay);
+}
+
+/**
+ * @brief Account for the samples of ts_minsert() arguments
+ *
+ * Samples are counted once: replays of already received samples, after a
+ * retry or a spool drain, are reported as duplicates. Each sample is tracked
+ * on its own, concurrent batches arriving in any order; timestamps off the
+ * sampling grid, from aggregation, are counted as received.
+ */
+static void account_samples(json_object * argsJ) {
+    json_object * timestampsJ;
+    size_t key, ix, len;
+    int64_t ts, idx;
+    uint8_t * bit;
+
+    json_object_object_foreach(argsJ, name, seriesJ) {
+        if (!key_index(name, &key) ||
+            !json_object_object_get_ex(seriesJ, "timestamps", &timestampsJ)) {
+            fake.unknown_keys++;
+            continue;
+        }
+
+        len = json_object_array_length(timestampsJ);
+        for (ix = 0; ix < len; ix++) {
+            ts = json_object_get_int64(json_object_array_get_idx(timestampsJ, ix)) - fake.epoch_ms;
+            idx = ts / fake.period_ms;
+            if (ts >= 0 && ts % fake.period_ms == 0 && idx < fake.samples_per_key) {
+                idx += (int64_t)key * fake.samples_per_key;
+                bit = &fake.received[idx / 8];
+                if (*bit & (1 << (idx % 8))) {
+                    fake.duplicates++;
+                    continue;
+                }
+                *bit |= (uint8_t)(1 << (idx % 8));
+            }
+            fake.samples_received++;
+        }
+    }
+
+    if (fake.finished_us == 0 &&
+        fake.samples_received == (int64_t)fake.key_count * fake.samples_per_key)
+        fake.finished_us = fake_mono_us();
+}
+
+static void ts_minsert_cb(afb_req_t request) {
+    json_object * argsJ = afb_req_json(request);
+    const char * error = NULL;
+    int64_t now;
+    int delay;
+
+    if (!json_object_is_type(argsJ, json_type_object)) {
+        afb_req_fail(request, "invalid-request", "ts_minsert expects an object");
+        return;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    now = fake_mono_us();
+    if (fake.minsert_started_us == 0)
+        fake.minsert_started_us = now;
+    fake.minsert_calls++;
+    delay = fake_delay(fake.minsert_latency_ms);
+
+    if (fake_disconnected(now)) {
+        fake.minsert_disconnected++;
+        error = "disconnected";
+    }
+    else {
+        account_samples(argsJ);
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    reply_later(request, NULL, error, delay);
+}
+
+/**
+ * @brief Tell whether a batch was already applied, remembering its ID
+ *
+ * A batch is known by its ID, among the last FAKE_BATCH_IDS ones. Its ranges
+ * tell nothing: concurrent batches may split a key and arrive in any order.
+ */
+static bool batch_applied(const char * id) {
+    size_t ix;
+
+    for (ix = 0; ix < FAKE_BATCH_IDS; ix++) {
+        if (fake.batch_ids[ix] && strcmp(fake.batch_ids[ix], id) == 0)
+            return true;
+    }
+
+    free(fake.batch_ids[fake.batch_next]);
+    fake.batch_ids[fake.batch_next] = strdup(id);
+    fake.batch_next = (fake.batch_next + 1) % FAKE_BATCH_IDS;
+    return false;
+}
+
+static void ts_batch_cb(afb_req_t request) {
+    const char * id = NULL;
+    const char * verb = NULL;
+    json_object * rangesJ = NULL;
+    json_object * argsJ = NULL;
+    json_object * replyJ = NULL;
+    const char * error = NULL;
+    int64_t now;
+    int delay;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s:s, s:o, s:s, s:o}", "id", &id, "ranges", &rangesJ,
+                         "verb", &verb, "args", &argsJ) ||
+        !json_object_is_type(rangesJ, json_type_object) || !json_object_is_type(argsJ, json_type_object)) {
+        afb_req_fail(request, "invalid-request", "ts_batch expects {id, ranges, verb, args}");
+        return;
+    }
+    if (strcmp(verb, "ts_minsert") != 0) {
+        afb_req_fail_f(request, "unsupported", "ts_batch does not serve '%s'", verb);
+        return;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    now = fake_mono_us();
+    if (fake.minsert_started_us == 0)
+        fake.minsert_started_us = now;
+    fake.minsert_calls++;
+    delay = fake_delay(fake.minsert_latency_ms);
+
+    if (fake_disconnected(now)) {
+        fake.minsert_disconnected++;
+        error = "disconnected";
+    }
+    else if (batch_applied(id)) {
+        fake.batches_deduplicated++;
+        replyJ = json_object_new_object();
+        json_object_object_add(replyJ, "duplicate", json_object_new_boolean(true));
+    }
+    else {
+        account_samples(argsJ);
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    reply_later(request, replyJ, error, delay);
+}
+
+static void ts_encodings_cb(afb_req_t request) {
+    // no packed encoding: the binding falls back to plain ts_minsert()
+    afb_req_success(request, json_object_new_array(), NULL);
+}
+
+static void get_cb(afb_req_t request) {
+    const char * key = NULL;
+    json_object * valueJ = NULL;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s:s}", "key", &key)) {
+        afb_req_fail(request, "invalid-request", "get expects {key}");
+        return;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    if (json_object_object_get_ex(fake.storeJ, key, &valueJ))
+        valueJ = json_object_get(valueJ);
+    pthread_mutex_unlock(&fake.lock);
+
+    afb_req_success(request, valueJ, NULL);
+}
+
+static void set_cb(afb_req_t request) {
+    const char * key = NULL;
+    const char * value = NULL;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s:s, s:s}", "key", &key, "value", &value)) {
+        afb_req_fail(request, "invalid-request", "set expects {key, value}");
+        return;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    json_object_object_add(fake.storeJ, key, json_object_new_string(value));
+    pthread_mutex_unlock(&fake.lock);
+
+    afb_req_success(request, NULL, NULL);
+}
+
+static void del_cb(afb_req_t request) {
+    const char * key = NULL;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s:s}", "key", &key)) {
+        afb_req_fail(request, "invalid-request", "del expects {key}");
+        return;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    json_object_object_del(fake.storeJ, key);
+    pthread_mutex_unlock(&fake.lock);
+
+    afb_req_success(request, NULL, NULL);
+}
+
+// VmRSS and VmHWM of the binder, in kB
+static void read_rss(int64_t * rss_kb, int64_t * peak_kb) {
+    char line[256];
+    FILE * status;
+
+    *rss_kb = *peak_kb = -1;
+    status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            *rss_kb = strtoll(line + 6, NULL, 10);
+        else if (strncmp(line, "VmHWM:", 6) == 0)
+            *peak_kb = strtoll(line + 6, NULL, 10);
+    }
+    fclose(status);
+}
+
+static void status_cb(afb_req_t request) {
+    json_object * statusJ = NULL;
+    int64_t expected, elapsed_us, rss_kb, peak_kb;
+    double rate = 0.0;
+    bool done;
+
+    read_rss(&rss_kb, &peak_kb);
+
+    pthread_mutex_lock(&fake.lock);
+    expected = (int64_t)fake.key_count * fake.samples_per_key;
+    done = fake.finished_us != 0;
+    elapsed_us = fake.started_us == 0 ? 0 :
+                 (done ? fake.finished_us : fake_mono_us()) - fake.started_us;
+    if (elapsed_us > 0)
+        rate = (double)fake.samples_received * 1e6 / (double)elapsed_us;
+
+    wrap_json_pack(&statusJ, "{s:b, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:f, s:I, s:I}",
+                   "done", done,
+                   "samples_expected", expected,
+                   "samples_received", fake.samples_received,
+                   "duplicates", fake.duplicates,
+                   "unknown_keys", fake.unknown_keys,
+                   "mrange_calls", fake.mrange_calls,
+                   "minsert_calls", fake.minsert_calls,
+                   "minsert_disconnected", fake.minsert_disconnected,
+                   "batches_deduplicated", fake.batches_deduplicated,
+                   "elapsed_ms", elapsed_us / 1000,
+                   "samples_per_s", rate,
+                   "rss_kb", rss_kb,
+                   "rss_peak_kb", peak_kb);
+    pthread_mutex_unlock(&fake.lock);
+
+    if (statusJ == NULL) {
+        afb_req_fail(request, "failed", "status packing failed!");
+        return;
+    }
+    afb_req_success(request, statusJ, NULL);
+}
+
+static const afb_verb_t localVerbs[] = {
+    { .verb = "ts_mrange", .callback = ts_mrange_cb, .info = "Serves the synthetic data set" },
+    { .verb = "get", .callback = get_cb, .info = "Reads an in-memory key" },
+    { .verb = "set", .callback = set_cb, .info = "Writes an in-memory key" },
+    { .verb = "del", .callback = del_cb, .info = "Deletes an in-memory key" },
+    { .verb = NULL }
+};
+
+static const afb_verb_t cloudVerbs[] = {
+    { .verb = "ts_minsert", .callback = ts_minsert_cb, .info = "Accepts samples after the configured latency" },
+    { .verb = "ts_encodings", .callback = ts_encodings_cb, .info = "Reports no packed encoding" },
+    { .verb = "ts_batch", .callback = ts_batch_cb, .info = "Applies each identified ts_minsert() call once" },
+    { .verb = NULL }
+};
+
+static const afb_verb_t benchVerbs[] = {
+    { .verb = "status", .callback = status_cb, .info = "Reports the benchmark progress and figures" },
+    { .verb = NULL }
+};
+
+static int fake_preinit(void * closure, afb_api_t api) {
+    return afb_api_set_verbs_v3(api, closure);
+}
+
+static int fake_config(afb_api_t api) {
+    double rate, days;
+
+    fake.local_api = env_string("FAKE_TSDB_LOCAL_API", FAKE_DEFAULT_LOCAL_API);
+    fake.cloud_api = env_string("FAKE_TSDB_CLOUD_API", FAKE_DEFAULT_CLOUD_API);
+    fake.sensor_class = env_string("FAKE_TSDB_CLASS", FAKE_DEFAULT_CLASS);
+    fake.key_count = (size_t)env_int("FAKE_TSDB_KEYS", FAKE_DEFAULT_KEYS);
+    rate = env_double("FAKE_TSDB_RATE_HZ", FAKE_DEFAULT_RATE_HZ);
+    days = env_double("FAKE_TSDB_DAYS", FAKE_DEFAULT_DAYS);
+    fake.epoch_ms = env_int("FAKE_TSDB_EPOCH_MS", FAKE_DEFAULT_EPOCH_MS);
+    fake.mrange_count = env_int("FAKE_TSDB_MRANGE_COUNT", FAKE_DEFAULT_MRANGE_COUNT);
+    fake.mrange_latency_ms = (int)env_int("FAKE_TSDB_MRANGE_LATENCY_MS", FAKE_DEFAULT_MRANGE_LATENCY_MS);
+    fake.minsert_latency_ms = (int)env_int("FAKE_TSDB_MINSERT_LATENCY_MS", FAKE_DEFAULT_MINSERT_LATENCY_MS);
+    fake.jitter_ms = (int)env_int("FAKE_TSDB_JITTER_MS", 0);
+    fake.seed = (uint64_t)env_int("FAKE_TSDB_SEED", FAKE_DEFAULT_SEED);
+
+    if (fake.key_count == 0 || rate <= 0 || days <= 0 || fake.seed == 0) {
+        AFB_API_ERROR(api, "FAKE_TSDB_KEYS, FAKE_TSDB_RATE_HZ, FAKE_TSDB_DAYS and FAKE_TSDB_SEED must be positive");
+        return -1;
+    }
+
+    // the rate is rounded to a whole sampling period in ms
+    fake.period_ms = llround(1000.0 / rate);
+    if (fake.period_ms < 1)
+        fake.period_ms = 1;
+    fake.samples_per_key = (int64_t)(days * 86400000.0) / fake.period_ms;
+
+    if (parse_disconnects(api, getenv("FAKE_TSDB_DISCONNECT")) < 0)
+        return -1;
+
+    fake.received = calloc((fake.key_count * (size_t)fake.samples_per_key + 7) / 8, 1);
+    fake.storeJ = json_object_new_object();
+    if (fake.received == NULL || fake.storeJ == NULL) {
+        AFB_API_ERROR(api, "out of memory");
+        return -1;
+    }
+
+    pthread_mutex_init(&fake.lock, NULL);
+
+    AFB_API_NOTICE(api, "fake tsdb: %zu keys of class %s, %" PRId64 " samples each every %" PRId64 " ms",
+                   fake.key_count, fake.sensor_class, fake.samples_per_key, fake.period_ms);
+    return 0;
+}
+
+int afbBindingEntry(afb_api_t api) {
+    if (fake_config(api) < 0)
+        return -1;
+
+    if (!afb_api_new_api(api, fake.local_api, "Fake local redis-tsdb", 0, fake_preinit, (void *)localVerbs) ||
+        !afb_api_new_api(api, fake.cloud_api, "Fake cloud redis-tsdb", 0, fake_preinit, (void *)cloudVerbs) ||
+        !afb_api_new_api(api, "fake-tsdb", "Benchmark figures", 0, fake_preinit, (void *)benchVerbs)) {
+        AFB_API_ERROR(api, "failed to create the fake redis-tsdb APIs");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+###########################################################################
+# Copyright (C) 2020 "IoT.bzh"
+# Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Publish the fake-tsdb data set through the cloud publication binding and
+# print the end-to-end figures as JSON. See bench/README.md.
+#
+# usage: run-bench.sh [build directory]
+
+BUILD_DIR=$(cd "${1:-build}" && pwd) || exit 1
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+PORT=${BENCH_PORT:-21234}
+AFB_BINDER=${AFB_BINDER:-afb-binder}
+AFB_CLIENT=${AFB_CLIENT:-afb-client}
+TIMEOUT_S=${BENCH_TIMEOUT_S:-3600}
+
+export CONTROL_CONFIG_PATH=${BENCH_CONFIG_PATH:-$BENCH_DIR/etc}
+
+call() {
+    $AFB_CLIENT --raw "ws://localhost:$PORT/api?token=" "$@" 2>/dev/null
+}
+
+field() {
+    python3 -c 'import json,sys
+reply = json.loads(sys.stdin.read() or "null") or {}
+print(reply.get("response", {}).get(sys.argv[1], ""))' "$1"
+}
+
+WORKDIR=$(mktemp -d)
+$AFB_BINDER --name=afb-cloud-publication-bench --port="$PORT" --workdir="$WORKDIR" --token= \
+    --binding="$BUILD_DIR/bench/fake-tsdb.so" \
+    --binding="$BUILD_DIR/src/cloud-publication.so" > "$WORKDIR/binder.log" 2>&1 &
+BINDER=$!
+trap 'kill $BINDER 2>/dev/null; wait $BINDER 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+
+ready=0
+for _ in $(seq 50); do
+    if [ -n "$(call fake-tsdb status | field done)" ]; then
+        ready=1
+        break
+    fi
+    sleep 0.2
+done
+if [ $ready -eq 0 ]; then
+    echo "binder did not start, see its log:" >&2
+    cat "$WORKDIR/binder.log" >&2
+    exit 1
+fi
+
+call cloud-pub start > /dev/null
+
+elapsed=0
+while [ "$(call fake-tsdb status | field done)" != "True" ]; do
+    if [ $elapsed -ge "$TIMEOUT_S" ]; then
+        echo "benchmark timed out after $TIMEOUT_S s" >&2
+        exit 1
+    fi
+    sleep 1
+    elapsed=$((elapsed + 1))
+done
+
+STATUS=$(call fake-tsdb status)
+STATS=$(call cloud-pub stats)
+
+python3 -c 'import json,sys
+status = json.loads(sys.argv[1])["response"]
+stats = json.loads(sys.argv[2])["response"]
+minsert = stats["ts_minsert_latency"]
+mrange = stats["ts_mrange_latency"]
+print(json.dumps({
+    "samples": status["samples_received"],
+    "duplicates": status["duplicates"],
+    "batches_deduplicated": status["batches_deduplicated"],
+    "elapsed_ms": status["elapsed_ms"],
+    "samples_per_s": round(status["samples_per_s"]),
+    "publish_p50_us": minsert.get("p50", 0),
+    "publish_p99_us": minsert.get("p99", 0),
+    "read_p50_us": mrange.get("p50", 0),
+    "read_p99_us": mrange.get("p99", 0),
+    "rounds": stats["rounds"],
+    "disconnects": stats["disconnects"],
+    "rss_kb": status["rss_kb"],
+    "rss_peak_kb": status["rss_peak_kb"],
+}, indent=2))' "$STATUS" "$STATS"
@@ -47,15 +47,24 @@ class SeanaticConfig:
         self.redis_cloud_port = cfg_yaml['databases']['redis-cloud']['port']
         self.sync_autostart = cfg_yaml['sync']['autostart']
         self.sync_db_poll_freq = cfg_yaml['sync']['db_poll_freq']
+        trigger = cfg_yaml['sync'].get('trigger', {})
+        self.sync_trigger_mode = trigger.get('mode', 'poll')
+        self.sync_trigger_min_samples = trigger.get('min_samples', 1000)
+        self.sync_trigger_max_delay = trigger.get('max_delay',
+                                                  self.sync_db_poll_freq)
         self.time_interval_start_idx = cfg_yaml['sync']['time_interval_start_idx']
         self.time_interval_nb = cfg_yaml['sync']['time_interval_nb']
         self.time_interval_size = cfg_yaml['sync']['time_interval_size']
+        self.sync_reconcile = cfg_yaml['sync'].get('reconcile', True)
         self.sync_key_label_ts = cfg_yaml['sync']['key_label_ts']
         self.sync_key_label = cfg_yaml['sync']['key_label']
         self.compaction_enabled = cfg_yaml['sync']['compaction']['enabled']
         self.compaction_key_suffix = cfg_yaml['sync']['compaction']['key_suffix']
         self.bucket_duration = cfg_yaml['sync']['compaction']['bucket_duration']
         self.aggregator = cfg_yaml['sync']['compaction']['aggregator']
+        key_index = cfg_yaml['sync'].get('key_index', {})
+        self.key_index_scan_count = key_index.get('scan_count', 1000)
+        self.key_info_batch = key_index.get('info_batch', 500)
 
     def __str__(self):
         s = f'''Synchronization engine configuration:
@@ -63,14 +72,18 @@ verbosity                 : {self.verbosity}
 redis_local               : host={self.redis_local_host} port={self.redis_local_port}
 redis_cloud               : host={self.redis_cloud_host} port={self.redis_cloud_port}
 db poll frequency         : {self.sync_db_poll_freq} secs
+sync trigger              : {self.sync_trigger_mode} (min samples={self.sync_trigger_min_samples}, max delay={self.sync_trigger_max_delay} secs)
 sync autostart            : {'enabled' if self.sync_autostart else 'disabled'}
 time interval start index : {self.time_interval_start_idx}
 time intervals to sync    : {self.time_interval_nb}
 time interval size        : {self.time_interval_size}
+reconciliation            : {'enabled' if self.sync_reconcile else 'disabled'}
 compaction enabled        : {'yes' if self.compaction_enabled else 'no'}
 compaction key suffix     : {self.compaction_key_suffix}
 bucket duration           : {self.bucket_duration}
-aggregator                : {self.aggregator}'''
+aggregator                : {self.aggregator}
+key index scan count      : {self.key_index_scan_count}
+key info batch            : {self.key_info_batch}'''
         return s
 
 
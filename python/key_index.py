@@ -0,0 +1,254 @@
+###########################################################################
+# Copyright (C) 2022 IoT.bzh Company
+# Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+#
+# $RP_BEGIN_LICENSE$
+# Commercial License Usage
+#  Licensees holding valid commercial IoT.bzh licenses may use this file in
+#  accordance with the commercial license agreement provided with the
+#  Software or, alternatively, in accordance with the terms contained in
+#  a written agreement between you and The IoT.bzh Company. For licensing terms
+#  and conditions see https://www.iot.bzh/terms-conditions. For further
+#  information use the contact form at https://www.iot.bzh/contact.
+#
+# GNU General Public License Usage
+#  Alternatively, this file may be used under the terms of the GNU General
+#  Public license version 3. This license is as published by the Free Software
+#  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+#  of this file. Please review the following information to ensure the GNU
+#  General Public License requirements will be met
+#  https://www.gnu.org/licenses/gpl-3.0.html.
+# $RP_END_LICENSE$
+#
+###########################################################################
+
+import hashlib
+import logging
+import redis
+
+logger = logging.getLogger('seanatic')
+
+KIND_TS = 'ts'
+KIND_STR = 'str'
+
+
+class KeyIndex:
+    """Persistent index of the local keys replicated to the cloud side.
+
+    The index is stored in the local DB, as a hash mapping each replicated key
+    name to '<kind>:<generation>:<digest>', where the digest is the SHA-1 of the
+    value last copied for standard keys, and empty for TS keys.
+
+    The keys to look at are gathered from two sources:
+    - keyevent notifications for created TS keys and written or deleted
+      standard keys, when the local DB emits them
+    - a SCAN of the synchronized key patterns, resumed at each sync for
+      scan_count keys, which catches whatever notifications missed. Once a full
+      pass is over, the generation counter is increased: the keys not seen
+      during the pass were deleted and are forgotten.
+
+    Each sync thus costs what changed plus one SCAN step, rather than a listing
+    of both DBs. Only the first start, with an empty index, runs a full pass.
+    """
+
+    INDEX_KEY = 'CLOUD_PUB_KEY_INDEX'
+    STATE_KEY = 'CLOUD_PUB_KEY_INDEX_STATE'
+
+    FIELD_GENERATION = 'generation'
+    FIELD_PATTERN_IDX = 'pattern_index'
+    FIELD_CURSOR = 'cursor'
+
+    def __init__(self, r_handle, config):
+        self.redis = r_handle
+        self.scan_count = config.key_index_scan_count
+        self.prefixes = [(f'{config.sync_key_label_ts}.', KIND_TS),
+                         (f'{config.sync_key_label}.', KIND_STR)]
+
+        # key name -> [kind, generation, digest]
+        self.entries = {}
+        for name, entry in self.redis.hgetall(self.INDEX_KEY).items():
+            (kind, generation, digest) = entry.decode().split(':', 2)
+            self.entries[name] = [kind, int(generation), digest]
+
+        state = {k.decode(): int(v)
+                 for k, v in self.redis.hgetall(self.STATE_KEY).items()}
+        self.generation = state.get(self.FIELD_GENERATION, 0)
+        self.pattern_idx = state.get(self.FIELD_PATTERN_IDX, 0)
+        self.cursor = state.get(self.FIELD_CURSOR, 0)
+        if self.pattern_idx >= len(self.prefixes):
+            self.pattern_idx = 0
+            self.cursor = 0
+
+        # key name -> kind, for the keys to look at during the next sync
+        self.dirty = {}
+        # index changes not persisted yet
+        self.updated = set()
+        self.removed = set()
+
+        self.pubsub = self.subscribe()
+        logger.info(f'key index: {len(self.entries)} replicated keys, '
+                    f'generation {self.generation}, notifications '
+                    f'{"enabled" if self.pubsub else "disabled"}')
+
+    def subscribe(self):
+        """Subscribe to the notifications of key creations and writes."""
+
+        try:
+            # keyevent ('E') notifications of module ('d'), string ('$') and
+            # generic ('g') commands, or all of them ('A')
+            flags = self.redis.config_get('notify-keyspace-events')
+            flags = flags.get('notify-keyspace-events', '')
+            if 'E' not in flags or ('A' not in flags and not
+                                    all(f in flags for f in 'd$g')):
+                return None
+
+            pubsub = self.redis.pubsub(ignore_subscribe_messages=True)
+            pubsub.psubscribe('__keyevent@*__:ts.create',
+                              '__keyevent@*__:set', '__keyevent@*__:del')
+        except redis.exceptions.RedisError as e:
+            logger.warning(f'key index: cannot subscribe to keyevent '
+                           f'notifications: {e}')
+            return None
+
+        return pubsub
+
+    def kind(self, name):
+        """Kind of a key, from its name, None if not synchronized."""
+
+        for (prefix, kind) in self.prefixes:
+            if name.startswith(prefix.encode()):
+                return kind
+        return None
+
+    def poll_notifications(self):
+        """Mark the keys notified since the last sync as dirty."""
+
+        if self.pubsub is None:
+            return
+
+        try:
+            msg = self.pubsub.get_message()
+            while msg is not None:
+                kind = self.kind(msg['data'])
+                if msg['type'] == 'pmessage' and kind is not None:
+                    self.dirty[msg['data']] = kind
+                msg = self.pubsub.get_message()
+        except redis.exceptions.RedisError as e:
+            logger.warning(f'key index: keyevent notifications lost: {e}, '
+                           f'relying on key scans')
+            self.pubsub = None
+
+    def seen(self, name, kind):
+        """Account for a key found by the scan."""
+
+        entry = self.entries.get(name)
+        if entry is None:
+            self.dirty[name] = kind
+            return
+
+        if entry[1] != self.generation:
+            entry[1] = self.generation
+            self.updated.add(name)
+        # without notifications, value changes are only found by the scan
+        if kind == KIND_STR and self.pubsub is None:
+            self.dirty[name] = kind
+
+    def scan_step(self):
+        """Resume the key scan for scan_count keys.
+
+        Returns True once a full pass is over.
+        """
+
+        (prefix, kind) = self.prefixes[self.pattern_idx]
+        (self.cursor, names) = self.redis.scan(self.cursor, match=prefix + '*',
+                                               count=self.scan_count)
+        for name in names:
+            self.seen(name, kind)
+
+        if self.cursor != 0:
+            return False
+
+        self.pattern_idx += 1
+        if self.pattern_idx < len(self.prefixes):
+            return False
+
+        # pass over: forget the keys deleted meanwhile
+        self.pattern_idx = 0
+        stale = [name for name, entry in self.entries.items()
+                 if entry[1] < self.generation]
+        for name in stale:
+            self.forget(name)
+        logger.info(f'key index: pass {self.generation} over, '
+                    f'{len(self.entries)} keys, {len(stale)} forgotten')
+        self.generation += 1
+        return True
+
+    def forget(self, name):
+        """Remove a key from the index."""
+
+        if self.entries.pop(name, None) is not None:
+            self.updated.discard(name)
+            self.removed.add(name)
+
+    def record(self, name, kind, value=None):
+        """Record a key as replicated, with its value for standard keys."""
+
+        digest = '' if value is None else hashlib.sha1(value).hexdigest()
+        self.entries[name] = [kind, self.generation, digest]
+        self.dirty.pop(name, None)
+        self.removed.discard(name)
+        self.updated.add(name)
+
+    def collect(self):
+        """Gather the keys to replicate.
+
+        Returns the TS keys to create on the cloud side, and the standard keys
+        whose value is to be copied, with that value. Those which are not
+        recorded afterwards are collected again by the next sync.
+        """
+
+        self.poll_notifications()
+        if self.generation == 0:
+            # first start: the full key set is needed before any interval sync
+            while not self.scan_step():
+                pass
+        else:
+            self.scan_step()
+
+        keys_ts = []
+        keys = {}
+        for name, kind in list(self.dirty.items()):
+            if kind == KIND_TS:
+                if name not in self.entries and self.redis.exists(name):
+                    keys_ts.append(name)
+                    continue
+            else:
+                value = self.redis.get(name)
+                entry = self.entries.get(name)
+                if value is None:
+                    self.forget(name)
+                elif (entry is None or
+                      entry[2] != hashlib.sha1(value).hexdigest()):
+                    keys[name] = value
+                    continue
+            del self.dirty[name]
+
+        return (keys_ts, keys)
+
+    def persist(self):
+        """Write the index changes down to the local DB."""
+
+        pipe = self.redis.pipeline(transaction=False)
+        for name in self.updated:
+            pipe.hset(self.INDEX_KEY, name, ':'.join(str(field) for field in
+                                                     self.entries[name]))
+        if self.removed:
+            pipe.hdel(self.INDEX_KEY, *self.removed)
+        pipe.hset(self.STATE_KEY, mapping={
+            self.FIELD_GENERATION: self.generation,
+            self.FIELD_PATTERN_IDX: self.pattern_idx,
+            self.FIELD_CURSOR: self.cursor})
+        pipe.execute()
+
+        self.updated = set()
+        self.removed = set()
@@ -78,11 +78,72 @@ def connect_databases(config):
     return (redis_local, redis_cloud)
 
 
+def subscribe_local_writes(name, redis_local, config):
+    """Subscribe to the keyspace notifications of the synchronized keys.
+
+    Returns None when notifications cannot be received, the engine then polling
+    the database.
+    """
+
+    if config.sync_trigger_mode != 'event':
+        return None
+
+    try:
+        # keyspace ('K') notifications of module keys ('d', or 'A' for all)
+        flags = redis_local.redis.config_get('notify-keyspace-events')
+        flags = flags.get('notify-keyspace-events', '')
+        if 'K' not in flags or ('d' not in flags and 'A' not in flags):
+            logger.warning(f'{name}: local DB keyspace notifications disabled'
+                           f' ({flags!r}), polling instead')
+            return None
+
+        pubsub = redis_local.redis.pubsub(ignore_subscribe_messages=True)
+        pubsub.psubscribe(f'__keyspace@*__:{config.sync_key_label_ts}.*')
+    except redis.exceptions.RedisError as e:
+        logger.warning(f'{name}: cannot subscribe to keyspace notifications:'
+                       f' {e}, polling instead')
+        return None
+
+    return pubsub
+
+
+def wait_for_writes(name, pubsub, config):
+    """Wait for enough writes to the local database to start a new sync.
+
+    Returns once min_samples writes were notified, or max_delay seconds after
+    the first of them. Blocks without waking up while no write is notified.
+    """
+
+    pending = 0
+    deadline = None
+
+    while pending < config.sync_trigger_min_samples:
+        if deadline is None:
+            msg = next(pubsub.listen())
+        else:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                break
+            msg = pubsub.get_message(timeout=remaining)
+
+        if msg is None or msg['type'] != 'pmessage':
+            continue
+
+        if deadline is None:
+            deadline = time.monotonic() + config.sync_trigger_max_delay
+        pending += 1
+
+    logger.info(f'{name}: {pending} writes notified, syncing')
+
+
 def start_sync_entry(*args):
     """Entry point for the synchronization engine."""
 
     (name, redis_local, redis_cloud, config) = args
 
+    # subscribed before the first sync so that no write is missed
+    pubsub = subscribe_local_writes(name, redis_local, config)
+
     while True:
         logger.info(f'{name}: syncing keys ...')
         sync_keys(redis_local, redis_cloud, config.sync_key_label_ts,
@@ -91,16 +152,27 @@ def start_sync_entry(*args):
 
         logger.info(f'{name}: syncing intervals ...')
         status = sync_intervals(redis_local, redis_cloud,
-                                config.sync_key_label_ts, config.verbosity)
+                                config.sync_key_label_ts, config.verbosity,
+                                config.sync_reconcile)
 
         if status != 0:
             logger.critical(f'{name}: critical sync error! Exiting.')
             return -1
 
-        poll_freq = config.sync_db_poll_freq
-        s = f'{name}: sleeping for {poll_freq} secs before next DB poll'
-        logger.info(s)
-        time.sleep(poll_freq)
+        if pubsub is not None:
+            logger.info(f'{name}: waiting for new DB entries')
+            try:
+                wait_for_writes(name, pubsub, config)
+            except redis.exceptions.RedisError as e:
+                logger.warning(f'{name}: keyspace notifications lost: {e},'
+                               f' polling instead')
+                pubsub = None
+
+        if pubsub is None:
+            poll_freq = config.sync_db_poll_freq
+            s = f'{name}: sleeping for {poll_freq} secs before next DB poll'
+            logger.info(s)
+            time.sleep(poll_freq)
 
         # At this point, a sync has been completed. Refresh both keys and
         # intervals before going on with the next round of sync.
@@ -108,16 +180,10 @@ def start_sync_entry(*args):
         # constructor has already done key parsing+interval computation for the
         # first sync iteration.
 
-        # Refresh keys. This will give the new timestamps for the TS keys and
-        # fetch potentially new keys (the latter would mean new sensors got
-        # added to a system during sync so unlikely ...)
-        logger.info(f'{name}: refreshing key list ...')
-        redis_local.parse_db_keys()
-        redis_cloud.parse_db_keys()
-
-        # Recompute a new sync time range from the key information
+        # New keys and values are found by the key index during the next
+        # sync_keys() call. Only the sync range end is needed here.
         logger.info(f'{name}: refreshing interval list ...')
-        (firstTs, lastTs) = redis_local.get_sync_time_range()
+        lastTs = redis_local.get_last_timestamp()
 
         if lastTs != redis_local.lastTs:
             # The new end timestamp differs from the current one, this means new
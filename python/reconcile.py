@@ -0,0 +1,162 @@
+###########################################################################
+# Copyright (C) 2022 IoT.bzh Company
+# Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+#
+# $RP_BEGIN_LICENSE$
+# Commercial License Usage
+#  Licensees holding valid commercial IoT.bzh licenses may use this file in
+#  accordance with the commercial license agreement provided with the
+#  Software or, alternatively, in accordance with the terms contained in
+#  a written agreement between you and The IoT.bzh Company. For licensing terms
+#  and conditions see https://www.iot.bzh/terms-conditions. For further
+#  information use the contact form at https://www.iot.bzh/contact.
+#
+# GNU General Public License Usage
+#  Alternatively, this file may be used under the terms of the GNU General
+#  Public license version 3. This license is as published by the Free Software
+#  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+#  of this file. Please review the following information to ensure the GNU
+#  General Public License requirements will be met
+#  https://www.gnu.org/licenses/gpl-3.0.html.
+# $RP_END_LICENSE$
+#
+###########################################################################
+
+import bisect
+import json
+import logging
+import math
+
+logger = logging.getLogger('seanatic')
+
+# Local side hash of the (interval, key) pairs to send again, as found by the
+# last reconciliation: interval index -> JSON object mapping each key name to
+# whether the cloud side holds samples of it in the interval. The marker field
+# tells an empty plan from no plan.
+RECONCILE_PLAN_KEY = 'CLOUD_PUB_SYNC_RECONCILE_PLAN'
+RECONCILE_MARKER = 'reconciled'
+
+# Per interval and key summary: sample count and value sum, min and max
+SUMMARY_AGGREGATORS = ('count', 'sum', 'min', 'max')
+
+
+def summarize(r_handle, intervals, interval_size, key_label_ts):
+    """Summarize the samples of every key, interval by interval.
+
+    Summaries are computed by the DB itself, with one aggregated TS.MRANGE
+    call per aggregator over the whole range: buckets are interval_size wide
+    and aligned on the interval ends, each of them thus falling in a single
+    interval. Only summaries cross the network, whatever the sample count.
+
+    Returns a dict mapping (interval index, key) to [count, sum, min, max].
+    """
+
+    ends = [inter.end for inter in intervals]
+    summaries = {}
+
+    for pos, aggregator in enumerate(SUMMARY_AGGREGATORS):
+        replies = r_handle.ts().mrange(intervals[0].start, intervals[-1].end,
+                                       [f'class={key_label_ts}'],
+                                       aggregation_type=aggregator,
+                                       bucket_size_msec=interval_size,
+                                       align=intervals[0].end + 1)
+        for rec in replies:
+            key = next(iter(rec))
+            for (bucket_ts, value) in rec[key][1]:
+                idx = bisect.bisect_left(ends, bucket_ts)
+                if idx >= len(ends):
+                    continue
+
+                summary = summaries.setdefault((idx, key), [0, 0.0, None, None])
+                # The first interval may span two buckets: merge them
+                if aggregator in ('count', 'sum'):
+                    summary[pos] += value
+                elif summary[pos] is None:
+                    summary[pos] = value
+                else:
+                    summary[pos] = (min if aggregator == 'min' else max)(
+                        summary[pos], value)
+
+    return summaries
+
+
+def summaries_match(local, cloud):
+    """Compare two summaries, sums being floating point."""
+
+    if cloud is None or local[0] != cloud[0]:
+        return False
+
+    return all(math.isclose(a, b, rel_tol=1e-9, abs_tol=1e-9)
+               for a, b in zip(local[1:], cloud[1:]))
+
+
+def build_plan(redis_local, redis_cloud, intervals, interval_size,
+               key_label_ts):
+    """Find the (interval, key) pairs the cloud side does not hold as is.
+
+    Returns a dict mapping interval indexes to dicts mapping key names to
+    whether the cloud side holds samples of the key in the interval, for the
+    intervals to send again only.
+    """
+
+    if len(intervals) == 0:
+        return {}
+
+    local = summarize(redis_local.redis, intervals, interval_size,
+                      key_label_ts)
+    cloud = summarize(redis_cloud.redis, intervals, interval_size,
+                      key_label_ts)
+
+    plan = {}
+    for (idx, key), summary in local.items():
+        if summary[0] == 0:
+            continue
+        cloud_summary = cloud.get((idx, key))
+        if not summaries_match(summary, cloud_summary):
+            plan.setdefault(idx, {})[key] = \
+                cloud_summary is not None and cloud_summary[0] > 0
+
+    pairs = sum(len(keys) for keys in plan.values())
+    logger.info(f'reconcile: {pairs} of {len(local)} key intervals differ, '
+                f'over {len(plan)} of {len(intervals)} intervals')
+    return plan
+
+
+def save_plan(r_handle, plan):
+    """Persist the plan, for the sync to resume with it."""
+
+    mapping = {idx: json.dumps(keys) for idx, keys in plan.items()}
+    mapping[RECONCILE_MARKER] = 1
+
+    pipe = r_handle.pipeline(transaction=True)
+    pipe.delete(RECONCILE_PLAN_KEY)
+    pipe.hset(RECONCILE_PLAN_KEY, mapping=mapping)
+    pipe.execute()
+
+
+def load_plan(r_handle):
+    """Load the persisted plan, None when the sync is not a reconciliation."""
+
+    stored = r_handle.hgetall(RECONCILE_PLAN_KEY)
+    if stored.pop(RECONCILE_MARKER.encode(), None) is None:
+        return None
+
+    return {int(idx): json.loads(keys) for idx, keys in stored.items()}
+
+
+def delete_plan(r_handle):
+    """Forget the plan, once the reconciliation is over or obsolete."""
+
+    r_handle.delete(RECONCILE_PLAN_KEY)
+
+
+def missing_samples(r_handle, key, inter, ts_data):
+    """Keep the samples the cloud side does not hold, of a differing interval.
+
+    Only the timestamps of the cloud side samples of the interval are
+    compared: a sample whose value differs is left as is.
+    """
+
+    present = {ts for (ts, _) in r_handle.ts().range(key, inter.start,
+                                                        inter.end)}
+    return [vals for vals in ts_data if vals[0] not in present]
@@ -27,6 +27,7 @@ import logging
 import redis
 import textwrap
 
+from key_index import KeyIndex
 from sync import SyncInterval, SyncInfo
 from utils import ts_to_str
 
@@ -41,14 +42,18 @@ class RedisDB:
     cloud/remote).
     """
 
+    # TS key infos cache, see load_ts_key_infos()
+    KEY_INFO_CACHE = 'CLOUD_PUB_SYNC_KEY_INFO'
+
     def __init__(self, desc, hostname, port, config, sync_support):
         self.redis = redis.Redis(hostname, port)
         self.desc = desc
         self.config = config
 
-        self.parse_db_keys()
-
+        # keys are replicated from the local DB, as told by its key index
         if sync_support:
+            self.parse_db_keys()
+            self.key_index = KeyIndex(self.redis, config)
             (self.firstTs, self.lastTs) = self.get_sync_time_range()
             self.generate_sync_info()
 
@@ -100,6 +105,77 @@ class RedisDB:
         # keys in Redis (TimeSeries or no) so the conversion is not an issue.
         return set(keys)
 
+    def load_ts_key_infos(self, r_handle, keynames):
+        """Gather the first and last timestamps and sample count of TS keys.
+
+        Those are cached in the DB alongside the sync state, as a hash mapping
+        each key name to '<first>:<last>:<samples>'. Cached keys only get their
+        first and last timestamps checked, all of them by a TS.MRANGE call
+        returning the first sample of each key and a TS.MGET call, their sample
+        count then being the cached one. A key whose first timestamp moved, its
+        oldest samples having been trimmed by retention since, is handled as an
+        uncached one. Those get pipelined TS.INFO calls, key_info_batch keys per
+        round trip. A restart with an unchanged key set thus makes no per key
+        call at all.
+
+        Returns a dictionary of (first, last, samples) tuples, indexed by key
+        names.
+        """
+
+        cache = {}
+        for k, v in r_handle.hgetall(self.KEY_INFO_CACHE).items():
+            cache[k] = tuple(int(field) for field in v.decode().split(':'))
+
+        infos = {k: cache[k] for k in keynames if k in cache}
+        if infos:
+            first_ts = r_handle.ts().mrange(
+                '-', '+', [f'class={self.config.sync_key_label_ts}'], count=1)
+            firsts = {}
+            for rec in first_ts:
+                (k, reply) = next(iter(rec.items()))
+                k = k.encode() if isinstance(k, str) else k
+                if reply[1]:
+                    firsts[k] = reply[1][0][0]
+            for k in list(infos):
+                if firsts.get(k) != infos[k][0]:
+                    del infos[k]
+
+        if infos:
+            last_ts = r_handle.ts().mget(
+                [f'class={self.config.sync_key_label_ts}'])
+            for rec in last_ts:
+                (k, reply) = next(iter(rec.items()))
+                k = k.encode() if isinstance(k, str) else k
+                if k in infos and reply[1] is not None:
+                    (first, last, samples) = infos[k]
+                    infos[k] = (first, max(last, reply[1]), samples)
+
+        missing = [k for k in keynames if k not in infos]
+        batch = self.config.key_info_batch
+        pipe = r_handle.ts().pipeline(transaction=False)
+        for i in range(0, len(missing), batch):
+            names = missing[i:i + batch]
+            for k in names:
+                pipe.info(k)
+            for k, k_info in zip(names, pipe.execute()):
+                infos[k] = (k_info.first_timestamp, k_info.last_timestamp,
+                            k_info.total_samples)
+
+        logger.info(f'{self.desc}: {len(infos) - len(missing)} cached key '
+                    f'infos, {len(missing)} retrieved')
+
+        pipe = r_handle.pipeline(transaction=False)
+        stale = [k for k in cache if k not in infos]
+        if stale:
+            pipe.hdel(self.KEY_INFO_CACHE, *stale)
+        if infos:
+            pipe.hset(self.KEY_INFO_CACHE, mapping={
+                k: ':'.join(str(field) for field in info)
+                for k, info in infos.items()})
+        pipe.execute()
+
+        return infos
+
     def key_objects_from_names(self, r_handle, keynames, sync_key_label,
                                key_type):
         """Build key objects from a list of key names.
@@ -109,17 +185,19 @@ class RedisDB:
         """
 
         keyobjs = {}
-        for k in keynames:
-            if key_type == 'RedisTS':
-                k_info = r_handle.ts().info(k)
-                key = RedisTSKey(k.decode(), k_info.first_timestamp,
-                                 k_info.last_timestamp, k_info.total_samples,
-                                 sync_key_label)
-            else:
-                k_value = r_handle.get(k)
-                key = RedisKey(k.decode(), k_value.decode(), sync_key_label)
-
-            keyobjs[k] = key
+        if key_type == 'RedisTS':
+            infos = self.load_ts_key_infos(r_handle, keynames)
+            for k, (first, last, samples) in infos.items():
+                keyobjs[k] = RedisTSKey(k.decode(), first, last, samples,
+                                        sync_key_label)
+        else:
+            names = list(keynames)
+            values = r_handle.mget(names) if names else []
+            for k, k_value in zip(names, values):
+                # deleted since listed
+                if k_value is not None:
+                    keyobjs[k] = RedisKey(k.decode(), k_value.decode(),
+                                          sync_key_label)
 
         total_nb_samples = 0
         for k in keyobjs.keys():
@@ -161,6 +239,22 @@ class RedisDB:
             f'{self.desc}: time range span: {ts_to_str(first)} to {ts_to_str(last)}')
         return (first, last)
 
+    def get_last_timestamp(self):
+        """
+        Get the last timestamp over all TS keys.
+
+        A single TS.MGET call is made, rather than one TS.INFO call per key.
+        """
+
+        replies = self.redis.ts().mget([f'class={self.config.sync_key_label_ts}'])
+        last = None
+        for rec in replies:
+            ts = next(iter(rec.values()))[1]
+            if ts is not None and (last is None or ts > last):
+                last = ts
+
+        return last
+
     def dump_intervals(self, intervals):
         """Debugging aid to dump interval lists."""
 
@@ -26,6 +26,9 @@ import logging
 import redis
 import textwrap
 
+from key_index import KIND_STR, KIND_TS
+from reconcile import build_plan, save_plan, load_plan, delete_plan, \
+    missing_samples
 from utils import ts_to_str
 
 logger = logging.getLogger('seanatic')
@@ -34,6 +37,11 @@ logger = logging.getLogger('seanatic')
 # the redisDB class
 
 
+# Cloud side hash of the last timestamp written by the sync engine for each key,
+# updated along with the samples so that replays are skipped
+SYNC_LEDGER_KEY = 'CLOUD_PUB_SYNC_LEDGER'
+
+
 def check_redis_reply(key, reply):
     """Check a given Redis reply for errors."""
 
@@ -320,6 +328,22 @@ class SyncInterval:
         return textwrap.dedent(s)
 
 
+def create_ts_key(r_handle, key, labels):
+    """Create a TS key, which may already exist.
+
+    The key index of a fresh local DB does not know what the cloud side
+    already holds: existing keys and rules are fine.
+    """
+
+    try:
+        r_handle.ts().create(key, labels=labels)
+    except redis.exceptions.ResponseError as e:
+        if 'already exists' not in str(e):
+            logger.warning(f'main: redis error for {key}: {e}')
+            return -1
+    return 0
+
+
 def sync_keys(redis_local, redis_cloud, key_label_ts, compaction_key_suffix,
               compaction_enabled, aggregator, bucket_duration, verbosity):
     """
@@ -327,57 +351,65 @@ def sync_keys(redis_local, redis_cloud, key_label_ts, compaction_key_suffix,
 
     Both standard and TS keys are supported:
     - for standard keys: this is where the actual sync occurs as we also insert
-      their value.
+      their value, again whenever it changes.
     - for TS keys: we only create the time series here, this ensures that
       interval sync which occurs later (and adds the associated values) works fine.
+
+    Only the keys not replicated yet, or whose value changed, are handled, as
+    told by the key index of the local DB (see key_index.py).
     """
 
-    # Sync RedisTS keys
-    keys_ts = redis_local.keynames_ts - redis_cloud.keynames_ts
+    index = redis_local.key_index
+    (keys_ts, keys) = index.collect()
+
+    # Sync RedisTS keys, along with their compacted counterpart and rule if
+    # compaction is enabled
     logger.info(f'{redis_cloud.desc}: need to add {len(keys_ts)} TS keys')
 
     for k in keys_ts:
         logger.debug(f'{redis_cloud.desc}: adding TS key {k}')
-        reply = redis_cloud.redis.ts().create(k,
-                                              labels={'class': key_label_ts})
-        check_redis_reply(k, reply)
-
-    # Create rules and TS keys if compaction is enabled
-    if compaction_enabled:
-        logger.info(f'{redis_cloud.desc}: creating {len(keys_ts)} '
-                    f'aggregated keys')
-        for k in keys_ts:
+        if create_ts_key(redis_cloud.redis, k, {'class': key_label_ts}) != 0:
+            continue
+
+        if compaction_enabled:
             s = key_label_ts + compaction_key_suffix
             # k is a byte array, convert the strings to perform the replacement
             # operation
             compaction_key_name = k.replace(key_label_ts.encode(), s.encode())
             logger.debug(f'{redis_cloud.desc}: adding compaction TS key '
                          f'{compaction_key_name}')
-            reply = redis_cloud.redis.ts().create(compaction_key_name,
-                                                  labels={'class': s})
-            check_redis_reply(k, reply)
+            if create_ts_key(redis_cloud.redis, compaction_key_name,
+                             {'class': s}) != 0:
+                continue
 
             logger.debug(f'{redis_cloud.desc}: adding compaction rule for '
                          f'key {k}')
-            reply = redis_cloud.redis.ts().createrule(k,
-                                                      compaction_key_name,
-                                                      aggregator,
-                                                      bucket_duration)
-            check_redis_reply(k, reply)
+            try:
+                redis_cloud.redis.ts().createrule(k, compaction_key_name,
+                                                  aggregator, bucket_duration)
+            except redis.exceptions.ResponseError as e:
+                if 'already' not in str(e):
+                    logger.warning(f'main: redis error for {k}: {e}')
+                    continue
+
+        index.record(k, KIND_TS)
 
     # Sync normal keys. For those, we also insert their value
-    keys = redis_local.keynames - redis_cloud.keynames
-    logger.info(f'{redis_cloud.desc}: need to add {len(keys)} standard keys')
+    logger.info(f'{redis_cloud.desc}: need to update {len(keys)} standard '
+                f'keys')
 
-    for k in keys:
-        value = redis_local.keyobjs[k].value
-        logger.debug(f'{redis_cloud.desc}: adding standard key {k} '
-                     f'with value {value}')
+    for k, value in keys.items():
+        logger.debug(f'{redis_cloud.desc}: setting standard key {k} '
+                     f'to value {value}')
         reply = redis_cloud.redis.set(k, value)
-        check_redis_reply(k, reply)
+        if check_redis_reply(k, reply) == 0:
+            index.record(k, KIND_STR, value)
+
+    index.persist()
 
 
-def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
+def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity,
+                   reconcile=False):
     """Sync each time interval.
 
     This is the main synchronization engine routine. We can either, for each
@@ -409,6 +441,19 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
 
     Early profiling data shows that most time is spent at the connection layer,
     reading data from the DB (parse_response()).
+
+    Writes are idempotent: the samples of each key and interval are written in
+    a transaction along with their last timestamp in the cloud side ledger
+    (SYNC_LEDGER_KEY), and samples at or below that timestamp are skipped. A
+    write interrupted after being applied is thus not applied again on
+    resumption, whatever the DB duplicate policy.
+
+    When the sync cannot be resumed and reconcile is set, the cloud side is
+    not assumed to be empty: both sides are summarized interval by interval
+    (see reconcile.py), and only the keys of the intervals whose summaries
+    differ are sent again, without the samples the cloud side already holds.
+    The plan is persisted along with the sync info so that an interrupted
+    reconciliation resumes as such.
     """
 
     intervals = redis_local.intervals
@@ -430,12 +475,32 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
             logger.info(f'sync: resuming synchronization at interval index '
                         f'{interval_idx}, on key at index '
                         f'#{interval_key_idx} - {interval_key}')
+            plan = load_plan(redis_local.redis)
         else:
             interval_idx = 0
             interval_key = None
             interval_key_idx = 0
-            logger.info(f'sync: resume information not available. Syncing from '
-                        f'scratch.')
+            plan = None
+            if reconcile:
+                logger.info(f'sync: resume information not available. '
+                            f'Reconciling with the cloud side.')
+                plan = build_plan(redis_local, redis_cloud, intervals,
+                                  sync_info.get('interval_size'),
+                                  sync_key_label)
+                save_plan(redis_local.redis, plan)
+            else:
+                logger.info(f'sync: resume information not available. Syncing '
+                            f'from scratch.')
+                delete_plan(redis_local.redis)
+
+            # The ledger belongs to the sync being restarted: its timestamps
+            # would skip samples of the new one, the cloud side possibly no
+            # longer holding them
+            redis_cloud.redis.delete(SYNC_LEDGER_KEY)
+
+    ledger = {k.decode(): int(v) for k, v in
+              redis_cloud.redis.hgetall(SYNC_LEDGER_KEY).items()}
+    logger.info(f'sync: {len(ledger)} keys in the cloud side ledger')
 
     resumation_done = False
     while interval_idx < nb_inter:
@@ -443,6 +508,14 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
         # For the sake of prettiness, we display the interval counter (starting
         # at 1) whereas we operate on/save the indexes (starting at 0)
         hdr = f'[{interval_idx+1}/{nb_inter}]'
+
+        # Reconciliation: the cloud side holds this interval as is
+        if plan is not None and interval_idx not in plan:
+            logger.debug(f'{hdr} Skipping reconciled interval {inter}')
+            interval_idx += 1
+            interval_key_idx = 0
+            continue
+
         logger.info(f'{hdr} Synchronizing interval {inter}')
 
         # Mark sync info for the interval. This is actually a double write in
@@ -495,14 +568,23 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
             ts_data = rec[key][1]
 
             hdr2 = f'[{interval_key_idx}/{nb_key_records}]'
-            # Build format expected by ts.madd()
+            # Build format expected by ts.madd(), without the samples the
+            # ledger tells were already written. When reconciling, the
+            # interval is rather compared with what the cloud side holds.
+            written_to = ledger.get(key)
+            if plan is not None:
+                if key not in plan[interval_idx]:
+                    ts_data = []
+                elif plan[interval_idx][key]:
+                    ts_data = missing_samples(redis_cloud.redis, key, inter,
+                                              ts_data)
+            elif written_to is not None:
+                ts_data = [vals for vals in ts_data if vals[0] > written_to]
             values = [(key,) + vals for vals in ts_data]
 
             # Record the key we were at. The write operation can take some time
             # (e.g for 1k records at once). In case of a resumal, we'll restart
-            # on this key, potentially triggering 'Error at upsert' errors for
-            # the already written values if the DB is in BLOCK mode. This is
-            # deemed acceptable for now.
+            # on this key, the ledger skipping the already written values.
             sync_info.set(sync_info.FIELD_INTERVAL_KEY, key)
             sync_info.set(sync_info.FIELD_INTERVAL_KEY_IDX, interval_key_idx)
             sync_info.persist_settings_to_db([sync_info.FIELD_INTERVAL_KEY,
@@ -513,13 +595,35 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
                 logger.info(f'{hdr} {hdr2} Inserting {len(ts_data)} '
                             f'key records via ts.madd() for {key}')
                 logger.debug(f'{hdr} {hdr2} ts.madd() args: {values}')
-                replies = redis_cloud.redis.ts().madd(values)
-                for r in replies:
-                    check_redis_reply(key, r)
+                last_ts = max(ts_data[-1][0],
+                              written_to if written_to is not None else
+                              ts_data[-1][0])
+                pipe = redis_cloud.redis.ts().pipeline(transaction=True)
+                pipe.madd(values)
+                pipe.hset(SYNC_LEDGER_KEY, key, last_ts)
+                (replies, ledger_reply) = pipe.execute(raise_on_error=False)
+
+                # MULTI/EXEC does not roll back: a rejected sample leaves the
+                # ledger past it. Put the ledger back and stop, the saved
+                # position making the next run write this key again.
+                errors = 0
+                if not isinstance(replies, list):
+                    replies = [replies]
+                for r in replies + [ledger_reply]:
+                    errors += check_redis_reply(key, r) != 0
+                if errors:
+                    if written_to is not None:
+                        redis_cloud.redis.hset(SYNC_LEDGER_KEY, key, written_to)
+                    else:
+                        redis_cloud.redis.hdel(SYNC_LEDGER_KEY, key)
+                    logger.critical(f'{hdr} {hdr2} {errors} write errors for '
+                                    f'{key}, stopping the synchronization')
+                    return -1
+                ledger[key] = last_ts
 
             else:
-                logger.info(f'{hdr} Skipping entry for {key} as it is empty '
-                            f'in interval {inter}')
+                logger.info(f'{hdr} Skipping entry for {key} as it is empty or already '
+                            f'synchronized in interval {inter}')
 
             interval_key_idx += 1
 
@@ -531,5 +635,7 @@ def sync_intervals(redis_local, redis_cloud, sync_key_label, verbosity):
             interval_key_idx = 0
 
     # Sync done, update markers
+    if plan is not None:
+        delete_plan(redis_local.redis)
     sync_info.mark_sync_as_finished()
     return 0
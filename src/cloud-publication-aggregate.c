@@ -0,0 +1,246 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "cloud-publication-aggregate.h"
+
+static const char * aggregator_names[] = { "avg", "min", "max", "last", "count" };
+
+/**
+ * @brief Parse the 'aggregation' entry of a sensor class
+ *
+ * { "aggregator": "avg", "bucket_duration_ms": 60000, "bandwidth_levels": ["low"] }
+ *
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int aggregate_config(afb_api_t api, cloudAggregationT * aggregation, json_object * aggregationJ) {
+    const char * aggregator = NULL;
+    json_object * levelsJ = NULL;
+    json_object * levelJ;
+    int64_t bucket_ms = 0;
+    size_t ix;
+    int level;
+    int err;
+
+    memset(aggregation, 0, sizeof(*aggregation));
+    if (aggregationJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(aggregationJ, "{s:s, s:I, s?:o !}", "aggregator", &aggregator,
+                           "bucket_duration_ms", &bucket_ms, "bandwidth_levels", &levelsJ);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse aggregation config at '%s'. Error is: %s",
+                      json_object_to_json_string(aggregationJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    for (ix = 0; ix < sizeof(aggregator_names) / sizeof(*aggregator_names); ix++) {
+        if (strcmp(aggregator, aggregator_names[ix]) == 0)
+            break;
+    }
+    if (ix == sizeof(aggregator_names) / sizeof(*aggregator_names)) {
+        AFB_API_ERROR(api, "Unknown aggregator '%s'!", aggregator);
+        return -1;
+    }
+    aggregation->aggregator = (aggregatorT)ix;
+
+    if (bucket_ms <= 0) {
+        AFB_API_ERROR(api, "Aggregation bucket duration must be positive!");
+        return -1;
+    }
+    aggregation->bucket_ms = bucket_ms;
+
+    // aggregated at every level unless told otherwise
+    if (levelsJ == NULL) {
+        aggregation->levels = ~0u;
+    }
+    else if (!json_object_is_type(levelsJ, json_type_array)) {
+        AFB_API_ERROR(api, "Aggregation bandwidth levels must be an array!");
+        return -1;
+    }
+    else {
+        for (ix = 0; ix < json_object_array_length(levelsJ); ix++) {
+            levelJ = json_object_array_get_idx(levelsJ, ix);
+            level = json_object_is_type(levelJ, json_type_string) ?
+                    bandwidth_level_parse(json_object_get_string(levelJ)) : -1;
+            if (level < 0) {
+                AFB_API_ERROR(api, "Unknown aggregation bandwidth level %s!",
+                              json_object_to_json_string(levelJ));
+                return -1;
+            }
+            aggregation->levels |= 1u << level;
+        }
+    }
+
+    aggregation->enabled = true;
+    AFB_API_DEBUG(api, "Aggregation %s over %" PRId64 " ms buckets", aggregator_names[aggregation->aggregator],
+                  aggregation->bucket_ms);
+    return 0;
+}
+
+/**
+ * @brief Tell whether samples are aggregated at a bandwidth level
+ */
+bool aggregate_active(const cloudAggregationT * aggregation, bandwidthLevelT level) {
+    return aggregation->enabled && (aggregation->levels & (1u << level));
+}
+
+/**
+ * @brief Timestamp of the last sample of the last closed bucket
+ *
+ * Buckets are aligned on multiples of their duration.
+ */
+int64_t aggregate_closed_to(const cloudAggregationT * aggregation, int64_t now) {
+    return now - now % aggregation->bucket_ms - 1;
+}
+
+// Running state of the bucket being aggregated
+typedef struct bucket {
+    int64_t start;
+    size_t count;
+    double sum;
+    double min;
+    double max;
+    json_object * lastJ;
+} bucketT;
+
+static bool series_numeric(const cloudSeriesT * series) {
+    size_t ix;
+    json_object * valueJ;
+
+    for (ix = 0; ix < series->samples; ix++) {
+        valueJ = json_object_array_get_idx(series->values, ix);
+        if (!json_object_is_type(valueJ, json_type_double) && !json_object_is_type(valueJ, json_type_int))
+            return false;
+    }
+    return true;
+}
+
+static json_object * bucket_value(const cloudAggregationT * aggregation, const bucketT * bucket) {
+    switch (aggregation->aggregator) {
+    case AGGREGATOR_AVG:
+        return json_object_new_double(bucket->sum / (double)bucket->count);
+    case AGGREGATOR_MIN:
+        return json_object_new_double(bucket->min);
+    case AGGREGATOR_MAX:
+        return json_object_new_double(bucket->max);
+    case AGGREGATOR_LAST:
+        return json_object_get(bucket->lastJ);
+    case AGGREGATOR_COUNT:
+    default:
+        return json_object_new_int64((int64_t)bucket->count);
+    }
+}
+
+// Append the sample of a bucket and reset it
+static void bucket_flush(const cloudAggregationT * aggregation, bucketT * bucket,
+                         json_object * timestampsJ, json_object * valuesJ) {
+    json_object_array_add(timestampsJ, json_object_new_int64(bucket->start));
+    json_object_array_add(valuesJ, bucket_value(aggregation, bucket));
+    memset(bucket, 0, sizeof(*bucket));
+}
+
+/**
+ * @brief Replace the samples of a series by one sample per bucket
+ *
+ * The series is walked once, holding a single bucket state. Its last_ts is
+ * left untouched: the watermark keeps tracking the raw samples.
+ *
+ * @return the number of samples removed, 0 when left as is
+ */
+static size_t aggregate_series(const cloudAggregationT * aggregation, cloudSeriesT * series) {
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    json_object * valueJ;
+    bucketT bucket = { .count = 0 };
+    size_t ix, kept = 0, len = series->samples;
+    int64_t ts, start;
+    double value;
+
+    // only 'last' and 'count' make sense for non numeric values
+    if (aggregation->aggregator != AGGREGATOR_LAST && aggregation->aggregator != AGGREGATOR_COUNT &&
+        !series_numeric(series))
+        return 0;
+
+    timestampsJ = json_object_new_array();
+    valuesJ = json_object_new_array();
+    if (timestampsJ == NULL || valuesJ == NULL) {
+        json_object_put(timestampsJ);
+        json_object_put(valuesJ);
+        return 0;
+    }
+
+    for (ix = 0; ix < len; ix++) {
+        ts = json_object_get_int64(json_object_array_get_idx(series->timestamps, ix));
+        start = ts - ts % aggregation->bucket_ms;
+
+        // the current bucket is over
+        if (bucket.count && start != bucket.start) {
+            bucket_flush(aggregation, &bucket, timestampsJ, valuesJ);
+            kept++;
+        }
+        if (bucket.count == 0)
+            bucket.start = start;
+
+        valueJ = json_object_array_get_idx(series->values, ix);
+        value = json_object_get_double(valueJ);
+        if (bucket.count == 0 || value < bucket.min)
+            bucket.min = value;
+        if (bucket.count == 0 || value > bucket.max)
+            bucket.max = value;
+        bucket.sum += value;
+        bucket.lastJ = valueJ;
+        bucket.count++;
+    }
+    if (bucket.count) {
+        bucket_flush(aggregation, &bucket, timestampsJ, valuesJ);
+        kept++;
+    }
+
+    json_object_put(series->timestamps);
+    json_object_put(series->values);
+    series->timestamps = timestampsJ;
+    series->values = valuesJ;
+    series->samples = kept;
+    return len - kept;
+}
+
+/**
+ * @brief Aggregate the series of a freshly read batch
+ *
+ * @return the number of samples removed
+ */
+size_t aggregate_batch(const cloudAggregationT * aggregation, cloudBatchT * batch) {
+    size_t ix, removed = 0;
+
+    for (ix = 0; ix < batch->count; ix++)
+        removed += aggregate_series(aggregation, &batch->series[ix]);
+
+    batch->samples -= removed;
+    return removed;
+}
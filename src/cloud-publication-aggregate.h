@@ -0,0 +1,57 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_AGGREGATE_
+#define _CLOUD_PUB_AGGREGATE_
+
+#include "cloud-publication-binding.h"
+#include "cloud-publication-batch.h"
+#include "cloud-publication-bandwidth.h"
+
+// Bucket aggregators, same names as the Redis TimeSeries ones
+typedef enum {
+    AGGREGATOR_AVG,
+    AGGREGATOR_MIN,
+    AGGREGATOR_MAX,
+    AGGREGATOR_LAST,
+    AGGREGATOR_COUNT
+} aggregatorT;
+
+// Per class downsampling of the published samples: each key is published as
+// one sample per bucket of bucket_ms, timestamped with the bucket start. Only
+// closed buckets are read, so that every bucket is aggregated at once.
+typedef struct cloudAggregation {
+    bool enabled;
+    aggregatorT aggregator;
+    int64_t bucket_ms;
+    // bitmask of the bandwidthLevelT levels the aggregation applies to
+    unsigned levels;
+} cloudAggregationT;
+
+int aggregate_config(afb_api_t api, cloudAggregationT * aggregation, json_object * aggregationJ);
+bool aggregate_active(const cloudAggregationT * aggregation, bandwidthLevelT level);
+int64_t aggregate_closed_to(const cloudAggregationT * aggregation, int64_t now);
+size_t aggregate_batch(const cloudAggregationT * aggregation, cloudBatchT * batch);
+
+#endif /* _CLOUD_PUB_AGGREGATE_ */
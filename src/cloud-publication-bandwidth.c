@@ -0,0 +1,279 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "cloud-publication-bandwidth.h"
+
+static const char * bandwidth_level_names[] = { "none", "low", "medium", "high" };
+static const char * priority_names[] = { "high_priority", "medium_priority", "low_priority" };
+
+static int priorities_config(afb_api_t api, cloudBandwidthT * bandwidth, json_object * keysJ,
+                             keyPriorityT priority) {
+    size_t ix;
+    json_object * keyJ;
+
+    if (keysJ == NULL)
+        return 0;
+
+    if (!json_object_is_type(keysJ, json_type_array)) {
+        AFB_API_ERROR(api, "Bandwidth '%s' keys must be an array!", priority_names[priority]);
+        return -1;
+    }
+
+    for (ix = 0; ix < json_object_array_length(keysJ); ix++) {
+        keyJ = json_object_array_get_idx(keysJ, ix);
+        if (!json_object_is_type(keyJ, json_type_string)) {
+            AFB_API_ERROR(api, "Invalid bandwidth '%s' key %s!", priority_names[priority],
+                          json_object_to_json_string(keyJ));
+            return -1;
+        }
+        json_object_object_add(bandwidth->prioritiesJ, json_object_get_string(keyJ),
+                               json_object_new_int(priority));
+    }
+    return 0;
+}
+
+int bandwidth_config(afb_api_t api, cloudBandwidthT * bandwidth, json_object * bandwidthJ) {
+    int err;
+    int rates[BANDWIDTH_LEVEL_COUNT] = { 0, BANDWIDTH_DEFAULT_LOW_KBPS, BANDWIDTH_DEFAULT_MEDIUM_KBPS,
+                                         BANDWIDTH_DEFAULT_HIGH_KBPS };
+    int level;
+    const char * level_name = NULL;
+    json_object * ratesJ = NULL;
+    json_object * highJ = NULL;
+    json_object * lowJ = NULL;
+
+    memset(bandwidth, 0, sizeof(*bandwidth));
+    pthread_mutex_init(&bandwidth->lock, NULL);
+    bandwidth->api = api;
+    bandwidth->level = BANDWIDTH_HIGH;
+    bandwidth->burst_ms = BANDWIDTH_DEFAULT_BURST_MS;
+    bandwidth->prioritiesJ = json_object_new_object();
+    if (bandwidth->prioritiesJ == NULL)
+        return -1;
+
+    // without configuration, everything is published as fast as possible
+    if (bandwidthJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(bandwidthJ, "{s?:s, s?:o, s?:i, s?:o, s?:o !}", "level", &level_name,
+                           "rates_kbps", &ratesJ, "burst_ms", &bandwidth->burst_ms,
+                           "high_priority", &highJ, "low_priority", &lowJ);
+    if (!err && ratesJ)
+        err = wrap_json_unpack(ratesJ, "{s?:i, s?:i, s?:i !}", "low", &rates[BANDWIDTH_LOW],
+                               "medium", &rates[BANDWIDTH_MEDIUM], "high", &rates[BANDWIDTH_HIGH]);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse bandwidth config at '%s'. Error is: %s",
+                      json_object_to_json_string(bandwidthJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    for (level = BANDWIDTH_LOW; level < BANDWIDTH_LEVEL_COUNT; level++) {
+        if (rates[level] < 0) {
+            AFB_API_ERROR(api, "Bandwidth rates must not be negative!");
+            return -1;
+        }
+        // kbit/s to bytes/s
+        bandwidth->rates[level] = (int64_t)rates[level] * 1000 / 8;
+    }
+
+    if (bandwidth->burst_ms <= 0) {
+        AFB_API_ERROR(api, "Bandwidth burst duration must be positive!");
+        return -1;
+    }
+
+    if (level_name && bandwidth_set_level(bandwidth, level_name) < 0) {
+        AFB_API_ERROR(api, "Unknown bandwidth level '%s'!", level_name);
+        return -1;
+    }
+
+    if (priorities_config(api, bandwidth, highJ, PRIORITY_HIGH) < 0 ||
+        priorities_config(api, bandwidth, lowJ, PRIORITY_LOW) < 0)
+        return -1;
+
+    AFB_API_DEBUG(api, "Bandwidth level %s, rates %d/%d/%d kbit/s, %d prioritized keys",
+                  bandwidth_level_name(bandwidth), rates[BANDWIDTH_LOW], rates[BANDWIDTH_MEDIUM],
+                  rates[BANDWIDTH_HIGH], json_object_object_length(bandwidth->prioritiesJ));
+    return 0;
+}
+
+/**
+ * @brief Convert a bandwidth level name
+ *
+ * @return the bandwidthLevelT level, -1 on unknown level
+ */
+int bandwidth_level_parse(const char * name) {
+    int level;
+
+    for (level = BANDWIDTH_NONE; level < BANDWIDTH_LEVEL_COUNT; level++) {
+        if (strcmp(name, bandwidth_level_names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
+
+/**
+ * @brief Change the bandwidth level
+ *
+ * The token bucket starts full at the new rate.
+ *
+ * @return 0 on success, -1 on unknown level
+ */
+int bandwidth_set_level(cloudBandwidthT * bandwidth, const char * name) {
+    int level;
+
+    level = bandwidth_level_parse(name);
+    if (level < 0)
+        return -1;
+
+    pthread_mutex_lock(&bandwidth->lock);
+    bandwidth->level = (bandwidthLevelT)level;
+    bandwidth->tokens = (double)(bandwidth->rates[level] * bandwidth->burst_ms / 1000);
+    bandwidth->refilled_at = now_ms();
+    pthread_mutex_unlock(&bandwidth->lock);
+    return 0;
+}
+
+const char * bandwidth_level_name(cloudBandwidthT * bandwidth) {
+    return bandwidth_level_names[bandwidth_level(bandwidth)];
+}
+
+bandwidthLevelT bandwidth_level(cloudBandwidthT * bandwidth) {
+    bandwidthLevelT level;
+
+    pthread_mutex_lock(&bandwidth->lock);
+    level = bandwidth->level;
+    pthread_mutex_unlock(&bandwidth->lock);
+    return level;
+}
+
+/**
+ * @brief Tell whether nothing is to be published at the current level
+ */
+bool bandwidth_paused(cloudBandwidthT * bandwidth) {
+    return bandwidth_level(bandwidth) == BANDWIDTH_NONE;
+}
+
+keyPriorityT bandwidth_key_priority(cloudBandwidthT * bandwidth, const char * key) {
+    json_object * priorityJ;
+
+    if (!json_object_object_get_ex(bandwidth->prioritiesJ, key, &priorityJ))
+        return PRIORITY_MEDIUM;
+    return (keyPriorityT)json_object_get_int(priorityJ);
+}
+
+/**
+ * @brief Refill the bucket, and tell whether a series of a given priority may
+ * be published at the current level
+ *
+ * Called with the lock held.
+ */
+static bool bandwidth_refill(cloudBandwidthT * bandwidth, keyPriorityT priority) {
+    static const keyPriorityT lowest_priority[BANDWIDTH_LEVEL_COUNT] = {
+        [BANDWIDTH_LOW] = PRIORITY_HIGH,
+        [BANDWIDTH_MEDIUM] = PRIORITY_MEDIUM,
+        [BANDWIDTH_HIGH] = PRIORITY_LOW
+    };
+    int64_t now, rate, capacity;
+
+    if (bandwidth->level == BANDWIDTH_NONE || priority > lowest_priority[bandwidth->level])
+        return false;
+
+    rate = bandwidth->rates[bandwidth->level];
+    if (rate == 0)
+        return true;
+
+    now = now_ms();
+    capacity = rate * bandwidth->burst_ms / 1000;
+    bandwidth->tokens += (double)(rate * (now - bandwidth->refilled_at)) / 1000.0;
+    if (bandwidth->tokens > (double)capacity)
+        bandwidth->tokens = (double)capacity;
+    bandwidth->refilled_at = now;
+
+    return bandwidth->tokens > 0;
+}
+
+/**
+ * @brief Decide whether a series is published now
+ *
+ * The series must have a priority published at the current level, and the
+ * bucket must hold tokens. A series larger than what is left is still
+ * admitted, the bucket going into debt, so that no series starves; the next
+ * ones wait for the debt to be paid back at the level rate.
+ *
+ * @param bandwidth - the scheduler
+ * @param priority - the priority of the series key
+ * @param bytes - the estimated size of the series
+ * @return true if the series is to be published
+ */
+bool bandwidth_admit(cloudBandwidthT * bandwidth, keyPriorityT priority, size_t bytes) {
+    bool admitted;
+
+    pthread_mutex_lock(&bandwidth->lock);
+    admitted = bandwidth_refill(bandwidth, priority);
+    if (admitted && bandwidth->rates[bandwidth->level] != 0)
+        bandwidth->tokens -= (double)bytes;
+
+    if (admitted) {
+        bandwidth->admitted_series++;
+        bandwidth->admitted_bytes += bytes;
+    } else {
+        bandwidth->deferred_series++;
+    }
+    pthread_mutex_unlock(&bandwidth->lock);
+    return admitted;
+}
+
+/**
+ * @brief Tell whether a series of a given priority would be published now,
+ * without accounting for it
+ *
+ * Used to read the deferred keys again only once they may be published.
+ */
+bool bandwidth_admissible(cloudBandwidthT * bandwidth, keyPriorityT priority) {
+    bool admissible;
+
+    pthread_mutex_lock(&bandwidth->lock);
+    admissible = bandwidth_refill(bandwidth, priority);
+    pthread_mutex_unlock(&bandwidth->lock);
+    return admissible;
+}
+
+json_object * bandwidth_status(cloudBandwidthT * bandwidth) {
+    json_object * statusJ = NULL;
+
+    pthread_mutex_lock(&bandwidth->lock);
+    wrap_json_pack(&statusJ, "{s:s, s:I, s:I, s:I, s:I, s:I}",
+                   "bandwidth_level", bandwidth_level_names[bandwidth->level],
+                   "rate_kbps", bandwidth->rates[bandwidth->level] * 8 / 1000,
+                   "tokens", (int64_t)bandwidth->tokens,
+                   "admitted_series", (int64_t)bandwidth->admitted_series,
+                   "admitted_kb", (int64_t)(bandwidth->admitted_bytes / 1024),
+                   "deferred_series", (int64_t)bandwidth->deferred_series);
+    pthread_mutex_unlock(&bandwidth->lock);
+    return statusJ;
+}
@@ -0,0 +1,87 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_BANDWIDTH_
+#define _CLOUD_PUB_BANDWIDTH_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+
+// Default link rates of the bandwidth levels, in kbit/s, 0 meaning unlimited
+#define BANDWIDTH_DEFAULT_LOW_KBPS 64
+#define BANDWIDTH_DEFAULT_MEDIUM_KBPS 512
+#define BANDWIDTH_DEFAULT_HIGH_KBPS 0
+#define BANDWIDTH_DEFAULT_BURST_MS 1000
+
+// Bandwidth levels, as set by the bandwidth/set verb. Same names as the
+// Python engine ones.
+typedef enum {
+    BANDWIDTH_NONE,
+    BANDWIDTH_LOW,
+    BANDWIDTH_MEDIUM,
+    BANDWIDTH_HIGH,
+    BANDWIDTH_LEVEL_COUNT
+} bandwidthLevelT;
+
+// Key priorities: high priority keys are published at all levels but 'none',
+// medium priority ones at the 'medium' and 'high' levels, low priority ones at
+// the 'high' level only. Keys are medium priority unless configured otherwise.
+typedef enum {
+    PRIORITY_HIGH,
+    PRIORITY_MEDIUM,
+    PRIORITY_LOW
+} keyPriorityT;
+
+// Token bucket scheduler of the publication path: each round, series are
+// admitted in priority order as long as the bucket holds tokens (bytes).
+typedef struct cloudBandwidth {
+    // configuration
+    int64_t rates[BANDWIDTH_LEVEL_COUNT];
+    int burst_ms;
+    json_object * prioritiesJ;
+
+    afb_api_t api;
+    pthread_mutex_t lock;
+    bandwidthLevelT level;
+    double tokens;
+    int64_t refilled_at;
+
+    // statistics
+    uint64_t admitted_bytes;
+    uint64_t admitted_series;
+    uint64_t deferred_series;
+} cloudBandwidthT;
+
+int bandwidth_config(afb_api_t api, cloudBandwidthT * bandwidth, json_object * bandwidthJ);
+int bandwidth_level_parse(const char * name);
+int bandwidth_set_level(cloudBandwidthT * bandwidth, const char * name);
+const char * bandwidth_level_name(cloudBandwidthT * bandwidth);
+bandwidthLevelT bandwidth_level(cloudBandwidthT * bandwidth);
+bool bandwidth_paused(cloudBandwidthT * bandwidth);
+keyPriorityT bandwidth_key_priority(cloudBandwidthT * bandwidth, const char * key);
+bool bandwidth_admit(cloudBandwidthT * bandwidth, keyPriorityT priority, size_t bytes);
+bool bandwidth_admissible(cloudBandwidthT * bandwidth, keyPriorityT priority);
+json_object * bandwidth_status(cloudBandwidthT * bandwidth);
+
+#endif /* _CLOUD_PUB_BANDWIDTH_ */
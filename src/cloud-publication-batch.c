@@ -0,0 +1,435 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cloud-publication-batch.h"
+
+#define BATCH_INITIAL_CAPACITY 16
+
+static int batch_grow(cloudBatchT * batch) {
+    size_t capacity;
+    cloudSeriesT * series;
+
+    if (batch->count < batch->capacity)
+        return 0;
+
+    capacity = batch->capacity ? batch->capacity * 2 : BATCH_INITIAL_CAPACITY;
+    series = realloc(batch->series, capacity * sizeof(cloudSeriesT));
+    if (series == NULL)
+        return -1;
+
+    batch->series = series;
+    batch->capacity = capacity;
+    return 0;
+}
+
+static void series_release(cloudSeriesT * series) {
+    free(series->key);
+    json_object_put(series->timestamps);
+    json_object_put(series->values);
+    memset(series, 0, sizeof(*series));
+}
+
+/**
+ * @brief Append the series contained in a ts_mrange() reply to a batch
+ *
+ * The sample arrays are not copied: the batch holds a reference on them.
+ *
+ * @param batch - the batch to fill
+ * @param mRangeResultJ - the ts_mrange() reply
+ * @return 0 on success
+ * @return -1 on malformed reply or allocation failure
+ */
+int batch_add_mrange_reply(cloudBatchT * batch, json_object * mRangeResultJ) {
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    size_t len;
+
+    if (mRangeResultJ == NULL)
+        return 0;
+
+    if (!json_object_is_type(mRangeResultJ, json_type_object))
+        return -1;
+
+    json_object_object_foreach(mRangeResultJ, key, seriesJ) {
+        if (!json_object_object_get_ex(seriesJ, SERIES_FIELD_TIMESTAMPS, &timestampsJ) ||
+            !json_object_object_get_ex(seriesJ, SERIES_FIELD_VALUES, &valuesJ) ||
+            !json_object_is_type(timestampsJ, json_type_array) ||
+            !json_object_is_type(valuesJ, json_type_array))
+            return -1;
+
+        len = json_object_array_length(timestampsJ);
+        if (len == 0 || len != json_object_array_length(valuesJ))
+            continue;
+
+        if (batch_grow(batch) < 0)
+            return -1;
+
+        cloudSeriesT * series = &batch->series[batch->count];
+        series->key = strdup(key);
+        if (series->key == NULL)
+            return -1;
+        series->timestamps = json_object_get(timestampsJ);
+        series->values = json_object_get(valuesJ);
+        series->samples = len;
+        series->last_ts = json_object_get_int64(json_object_array_get_idx(timestampsJ, len - 1));
+
+        batch->count++;
+        batch->samples += len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drop the samples of a series whose timestamp is lower or equal to a limit
+ *
+ * Samples are sorted by timestamp. Shared arrays are never modified in place:
+ * new arrays referencing the kept samples are built instead.
+ *
+ * @param series - the series to trim
+ * @param upto - the highest timestamp to drop
+ * @return the number of dropped samples
+ */
+size_t batch_series_trim(cloudSeriesT * series, int64_t upto) {
+    size_t len, first, ix;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+
+    len = json_object_array_length(series->timestamps);
+    for (first = 0; first < len; first++) {
+        if (json_object_get_int64(json_object_array_get_idx(series->timestamps, first)) > upto)
+            break;
+    }
+
+    if (first == 0)
+        return 0;
+
+    if (first == len) {
+        json_object_put(series->timestamps);
+        json_object_put(series->values);
+        series->timestamps = json_object_new_array();
+        series->values = json_object_new_array();
+        series->samples = 0;
+        return len;
+    }
+
+    timestampsJ = json_object_new_array();
+    valuesJ = json_object_new_array();
+    for (ix = first; ix < len; ix++) {
+        json_object_array_add(timestampsJ, json_object_get(json_object_array_get_idx(series->timestamps, ix)));
+        json_object_array_add(valuesJ, json_object_get(json_object_array_get_idx(series->values, ix)));
+    }
+
+    json_object_put(series->timestamps);
+    json_object_put(series->values);
+    series->timestamps = timestampsJ;
+    series->values = valuesJ;
+    series->samples = len - first;
+    return first;
+}
+
+/**
+ * @brief Estimate the size of a series in ts_minsert() arguments
+ */
+size_t batch_series_size(const cloudSeriesT * series) {
+    return strlen(series->key) + series->samples * SERIES_SAMPLE_SIZE_ESTIMATE;
+}
+
+/**
+ * @brief Remove the series left without any sample and refresh the sample count
+ */
+void batch_compact(cloudBatchT * batch) {
+    size_t ix, kept = 0;
+
+    batch->samples = 0;
+    for (ix = 0; ix < batch->count; ix++) {
+        if (batch->series[ix].samples == 0) {
+            series_release(&batch->series[ix]);
+            continue;
+        }
+        batch->series[kept++] = batch->series[ix];
+        batch->samples += batch->series[ix].samples;
+    }
+    batch->count = kept;
+}
+
+/**
+ * @brief Release the sample arrays of a batch, keeping its keys and counts
+ *
+ * What is left is enough to commit the watermark once the samples are
+ * acknowledged, the samples themselves only living in the cloud call payload.
+ */
+void batch_drop_samples(cloudBatchT * batch) {
+    size_t ix;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        json_object_put(batch->series[ix].timestamps);
+        json_object_put(batch->series[ix].values);
+        batch->series[ix].timestamps = NULL;
+        batch->series[ix].values = NULL;
+    }
+}
+
+/**
+ * @brief Add the series of a batch to ts_minsert() arguments
+ *
+ * This allows several batches to be coalesced into a single ts_minsert() call.
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+int batch_add_minsert_args(const cloudBatchT * batch, json_object * argsJ) {
+    size_t ix;
+    json_object * seriesJ;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        seriesJ = json_object_new_object();
+        if (seriesJ == NULL)
+            return -1;
+        json_object_object_add(seriesJ, SERIES_FIELD_TIMESTAMPS, json_object_get(batch->series[ix].timestamps));
+        json_object_object_add(seriesJ, SERIES_FIELD_VALUES, json_object_get(batch->series[ix].values));
+        json_object_object_add(argsJ, batch->series[ix].key, seriesJ);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Build the ts_minsert() arguments for a batch
+ *
+ * @return a new JSON object, NULL on allocation failure
+ */
+json_object * batch_to_minsert_args(const cloudBatchT * batch) {
+    json_object * argsJ;
+
+    argsJ = json_object_new_object();
+    if (argsJ == NULL)
+        return NULL;
+
+    if (batch_add_minsert_args(batch, argsJ) < 0) {
+        json_object_put(argsJ);
+        return NULL;
+    }
+
+    return argsJ;
+}
+
+// Reference the samples [first, first + count) of a series in ts_minsert() arguments
+static int add_series_slice(json_object * argsJ, const cloudSeriesT * series, size_t first, size_t count) {
+    json_object * seriesJ;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    size_t ix;
+
+    if (first == 0 && count == series->samples) {
+        timestampsJ = json_object_get(series->timestamps);
+        valuesJ = json_object_get(series->values);
+    }
+    else {
+        timestampsJ = json_object_new_array();
+        valuesJ = json_object_new_array();
+        for (ix = first; timestampsJ && valuesJ && ix < first + count; ix++) {
+            json_object_array_add(timestampsJ, json_object_get(json_object_array_get_idx(series->timestamps, ix)));
+            json_object_array_add(valuesJ, json_object_get(json_object_array_get_idx(series->values, ix)));
+        }
+    }
+
+    seriesJ = json_object_new_object();
+    if (seriesJ == NULL || timestampsJ == NULL || valuesJ == NULL) {
+        json_object_put(seriesJ);
+        json_object_put(timestampsJ);
+        json_object_put(valuesJ);
+        return -1;
+    }
+
+    json_object_object_add(seriesJ, SERIES_FIELD_TIMESTAMPS, timestampsJ);
+    json_object_object_add(seriesJ, SERIES_FIELD_VALUES, valuesJ);
+    json_object_object_add(argsJ, series->key, seriesJ);
+    return 0;
+}
+
+static bool chunk_full(const cloudChunkListT * list, const cloudChunkT * chunk) {
+    return (list->max_samples && chunk->samples >= list->max_samples) ||
+           (list->max_bytes && chunk->bytes >= list->max_bytes);
+}
+
+static cloudChunkT * chunk_new(cloudChunkListT * list) {
+    size_t capacity;
+    cloudChunkT * chunks;
+    cloudChunkT * chunk;
+
+    if (list->count == list->capacity) {
+        capacity = list->capacity ? list->capacity * 2 : BATCH_INITIAL_CAPACITY;
+        chunks = realloc(list->chunks, capacity * sizeof(cloudChunkT));
+        if (chunks == NULL)
+            return NULL;
+        list->chunks = chunks;
+        list->capacity = capacity;
+    }
+
+    chunk = &list->chunks[list->count];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->argsJ = json_object_new_object();
+    if (chunk->argsJ == NULL)
+        return NULL;
+
+    list->count++;
+    return chunk;
+}
+
+/**
+ * @brief Split the series of a batch into bounded ts_minsert() arguments
+ *
+ * Series are appended to the last chunk of the list until it is full, series
+ * larger than the room left being split across chunks. Whole series reference
+ * the batch sample arrays, split ones reference the batch samples.
+ *
+ * @param batch - the batch to split
+ * @param list - the chunk list to append to, whose limits are set
+ * @return 0 on success, -1 on allocation failure
+ */
+int batch_add_minsert_chunks(const cloudBatchT * batch, cloudChunkListT * list) {
+    cloudChunkT * chunk = list->count ? &list->chunks[list->count - 1] : NULL;
+    const cloudSeriesT * series;
+    size_t ix, first, room, key_bytes;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        series = &batch->series[ix];
+        key_bytes = strlen(series->key);
+
+        for (first = 0; first < series->samples; first += room) {
+            if (chunk == NULL || chunk_full(list, chunk)) {
+                chunk = chunk_new(list);
+                if (chunk == NULL)
+                    return -1;
+            }
+
+            room = series->samples - first;
+            if (list->max_samples && room > list->max_samples - chunk->samples)
+                room = list->max_samples - chunk->samples;
+            if (list->max_bytes) {
+                if (chunk->bytes + key_bytes >= list->max_bytes)
+                    room = 0;
+                else if (room > (list->max_bytes - chunk->bytes - key_bytes) / SERIES_SAMPLE_SIZE_ESTIMATE)
+                    room = (list->max_bytes - chunk->bytes - key_bytes) / SERIES_SAMPLE_SIZE_ESTIMATE;
+            }
+
+            // a chunk always takes at least one sample
+            if (room == 0) {
+                if (chunk->samples) {
+                    chunk->bytes = list->max_bytes;
+                    continue;
+                }
+                room = 1;
+            }
+
+            if (add_series_slice(chunk->argsJ, series, first, room) < 0)
+                return -1;
+            chunk->samples += room;
+            chunk->bytes += key_bytes + room * SERIES_SAMPLE_SIZE_ESTIMATE;
+        }
+    }
+
+    return 0;
+}
+
+void batch_chunks_release(cloudChunkListT * list) {
+    size_t ix;
+
+    for (ix = 0; ix < list->count; ix++)
+        json_object_put(list->chunks[ix].argsJ);
+
+    free(list->chunks);
+    list->chunks = NULL;
+    list->count = list->capacity = 0;
+}
+
+/**
+ * @brief Append ts_minsert() arguments to other ones
+ *
+ * The samples of keys present in both are appended to the destination ones,
+ * the source samples being expected to be the most recent.
+ *
+ * @return 0 on success, -1 on malformed arguments or allocation failure
+ */
+int batch_merge_minsert_args(json_object * dstJ, json_object * srcJ) {
+    json_object * dstSeriesJ;
+    json_object * sources[2][2];
+    json_object * mergedJ;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    size_t ix, jx, len;
+
+    json_object_object_foreach(srcJ, key, seriesJ) {
+        if (!json_object_object_get_ex(dstJ, key, &dstSeriesJ)) {
+            json_object_object_add(dstJ, key, json_object_get(seriesJ));
+            continue;
+        }
+
+        if (!json_object_object_get_ex(dstSeriesJ, SERIES_FIELD_TIMESTAMPS, &sources[0][0]) ||
+            !json_object_object_get_ex(dstSeriesJ, SERIES_FIELD_VALUES, &sources[0][1]) ||
+            !json_object_object_get_ex(seriesJ, SERIES_FIELD_TIMESTAMPS, &sources[1][0]) ||
+            !json_object_object_get_ex(seriesJ, SERIES_FIELD_VALUES, &sources[1][1]))
+            return -1;
+
+        // the destination arrays may be shared: build new ones
+        mergedJ = json_object_new_object();
+        timestampsJ = json_object_new_array();
+        valuesJ = json_object_new_array();
+        if (mergedJ == NULL || timestampsJ == NULL || valuesJ == NULL) {
+            json_object_put(mergedJ);
+            json_object_put(timestampsJ);
+            json_object_put(valuesJ);
+            return -1;
+        }
+
+        for (jx = 0; jx < 2; jx++) {
+            len = json_object_array_length(sources[jx][0]);
+            for (ix = 0; ix < len; ix++) {
+                json_object_array_add(timestampsJ, json_object_get(json_object_array_get_idx(sources[jx][0], ix)));
+                json_object_array_add(valuesJ, json_object_get(json_object_array_get_idx(sources[jx][1], ix)));
+            }
+        }
+
+        json_object_object_add(mergedJ, SERIES_FIELD_TIMESTAMPS, timestampsJ);
+        json_object_object_add(mergedJ, SERIES_FIELD_VALUES, valuesJ);
+        json_object_object_add(dstJ, key, mergedJ);
+    }
+
+    return 0;
+}
+
+void batch_release(cloudBatchT * batch) {
+    size_t ix;
+
+    for (ix = 0; ix < batch->count; ix++)
+        series_release(&batch->series[ix]);
+
+    free(batch->series);
+    memset(batch, 0, sizeof(*batch));
+}
@@ -0,0 +1,92 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_BATCH_
+#define _CLOUD_PUB_BATCH_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <json-c/json.h>
+
+// Field names of one time series entry, as returned by ts_mrange() and
+// expected by ts_minsert():
+// { "<key>": { "timestamps": [ts, ...], "values": [value, ...] }, ... }
+#define SERIES_FIELD_TIMESTAMPS "timestamps"
+#define SERIES_FIELD_VALUES "values"
+
+// Rough size of one sample in ts_minsert() arguments, used to account for
+// series without serializing them
+#define SERIES_SAMPLE_SIZE_ESTIMATE 32
+
+// One time series key worth of samples. The sample arrays are json-c
+// references shared with the originating ts_mrange() reply whenever possible.
+typedef struct cloudSeries {
+    char * key;
+    json_object * timestamps;
+    json_object * values;
+    // sample count, still valid once the sample arrays are dropped
+    size_t samples;
+    int64_t last_ts;
+} cloudSeriesT;
+
+// The set of series read from the local side in one go, and published to the
+// cloud side as a whole.
+typedef struct cloudBatch {
+    cloudSeriesT * series;
+    size_t count;
+    size_t capacity;
+    size_t samples;
+} cloudBatchT;
+
+// One ts_minsert() call worth of series, see batch_add_minsert_chunks()
+typedef struct cloudChunk {
+    json_object * argsJ;
+    size_t samples;
+    size_t bytes;
+} cloudChunkT;
+
+// The ts_minsert() calls the series of a round are split into, each of them
+// holding at most max_samples samples and about max_bytes bytes (0 when
+// unbounded).
+typedef struct cloudChunkList {
+    size_t max_samples;
+    size_t max_bytes;
+    cloudChunkT * chunks;
+    size_t count;
+    size_t capacity;
+} cloudChunkListT;
+
+int batch_add_mrange_reply(cloudBatchT * batch, json_object * mRangeResultJ);
+size_t batch_series_trim(cloudSeriesT * series, int64_t upto);
+size_t batch_series_size(const cloudSeriesT * series);
+void batch_compact(cloudBatchT * batch);
+void batch_drop_samples(cloudBatchT * batch);
+int batch_add_minsert_args(const cloudBatchT * batch, json_object * argsJ);
+json_object * batch_to_minsert_args(const cloudBatchT * batch);
+int batch_add_minsert_chunks(const cloudBatchT * batch, cloudChunkListT * list);
+void batch_chunks_release(cloudChunkListT * list);
+int batch_merge_minsert_args(json_object * dstJ, json_object * srcJ);
+void batch_release(cloudBatchT * batch);
+
+#endif /* _CLOUD_PUB_BATCH_ */
@@ -24,9 +24,26 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "cloud-publication-binding.h"
+#include "cloud-publication-batch.h"
+#include "cloud-publication-watermark.h"
+#include "cloud-publication-sync.h"
+#include "cloud-publication-spool.h"
+#include "cloud-publication-codec.h"
+#include "cloud-publication-compress.h"
+#include "cloud-publication-bandwidth.h"
+#include "cloud-publication-stats.h"
+#include "cloud-publication-aggregate.h"
+#include "cloud-publication-deadband.h"
+#include "cloud-publication-trigger.h"
+#include "cloud-publication-congestion.h"
+#include "cloud-publication-idempotent.h"
+#include "cloud-publication-ring.h"
+#include "cloud-publication-retention.h"
 
 #include <ctl-config.h>
 #include <afb/afb-binding.h>
@@ -38,45 +55,218 @@
 
 #define API_REPLY_FAILURE "failed"
 
-#define TIMER_RETRY_MAX_DELAY 10000
-
 #define SENSOR_CLASS_ID_MAX_LEN 51
 
+#define TIMESTAMP_ARG_MAX_LEN 24
+
+#define DEFAULT_MAX_INFLIGHT_QUERIES 4
+#define DEFAULT_MAX_SAMPLES_PER_BATCH 50000
+#define DEFAULT_MAX_BYTES_PER_BATCH (1024 * 1024)
+#define DEFAULT_MAX_INFLIGHT_BATCHES 2
+#define DEFAULT_PIPELINE_DEPTH 2
+
+// ts_minsert() argument encodings, see the "encoding" configuration key
+typedef enum {
+    ENCODING_JSON,
+    ENCODING_AUTO,
+    ENCODING_GORILLA
+} encodingModeT;
+
+// How the samples of a cloud_insert() call were sent, passed as reply closure
+#define CLOUD_INSERT_ENCODED 0x1
+#define CLOUD_INSERT_COMPRESSED 0x2
+#define CLOUD_INSERT_DICTIONARY 0x4
+#define CLOUD_INSERT_BATCH 0x8
+#define CLOUD_INSERT_FALLBACKS (CLOUD_INSERT_ENCODED | CLOUD_INSERT_COMPRESSED | CLOUD_INSERT_BATCH)
+// the generation of the dictionary sent along, see compress_wrap()
+#define CLOUD_INSERT_DICTIONARY_SHIFT 8
+#define CLOUD_INSERT_DICTIONARY_MASK 0xffff
+
 // redis binding currently crashes/abort on resampling
 #undef BINDING_HAS_RESAMPLING_SUPPORT
 
+typedef enum {
+    CHUNK_PENDING,
+    CHUNK_INFLIGHT,
+    CHUNK_ACKED
+} chunkStateT;
+
+// The cloud call of one chunk of the round, built once and sent again as is
+// on retries
+typedef struct roundChunk {
+    json_object * payloadJ;
+    const char * verb;
+    intptr_t flags;
+    chunkStateT state;
+    int64_t started;
+} roundChunkT;
+
+// Reply closure of a chunk call: replies to the calls of a released round,
+// e.g. after a stop, do not match the current round generation
+typedef struct chunkReply {
+    size_t index;
+    unsigned generation;
+} chunkReplyT;
+
+// What a round read for one class, committed once the round is acknowledged
+typedef struct roundClass {
+    bool due;
+    // upper bound of the samples acknowledged by the round
+    int64_t ack_to;
+    // the series of the round, without their samples once split into chunks
+    cloudBatchT batch;
+    // the keys deferred by the round, with their first unpublished sample
+    json_object * deferredJ;
+} roundClassT;
+
+// A round read by the reader stage, waiting for the sender stage to publish it
+typedef struct stagedRound {
+    cloudChunkListT chunks;
+    roundClassT * classes;
+    size_t samples;
+    int epoch;
+} stagedRoundT;
+
+// What the reader stage waits for before reading the next round
+typedef enum {
+    READER_RUNNING,
+    // a free slot in the ring of staged rounds
+    READER_WAIT_SLOT
+} readerWaitT;
+
 struct publication_state
 {
     bool in_progress;
     int retry_count;
-    afb_api_t api;
-    json_object *obj;
-};
-
-struct publication_state current_state = {
-    .in_progress = false,
-    .retry_count = 0,
-    .api = 0,
-    .obj = 0
+    // the round being published, its classes being indexed as the sensors
+    roundClassT * classes;
+    size_t samples;
+    // the ts_minsert() calls of the round, 'sends' being indexed as 'chunks'
+    cloudChunkListT chunks;
+    roundChunkT * sends;
+    unsigned round_generation;
+    size_t chunks_next;
+    size_t chunks_acked;
+    int chunks_inflight;
+    // the round waits for its in-flight chunks before retrying or spooling
+    // the others, or before being read again
+    bool round_disconnected;
+    bool round_abandoned;
+    // read/publish pipeline: the reader stage reads the next rounds while the
+    // sender stage publishes the oldest one, staged rounds waiting in 'ready'
+    cloudRingT ready;
+    bool sending;
+    readerWaitT reader_wait;
+    // bumped when staged rounds are dropped, along with the reads in progress
+    int read_epoch;
+    int reader_epoch;
+    // bumped when the publication stops, the local reads still pending being
+    // then ignored
+    unsigned run_epoch;
+    // round bookkeeping, shared by concurrent replies. The fields of the
+    // round being published, the spool draining and the encoding are
+    // protected by the lock as well.
+    pthread_mutex_t lock;
+    int loads_pending;
+    int queries_next;
+    int queries_inflight;
+    int queries_pending;
+    // spool draining, independent from the publication rounds
+    bool draining;
+    int drain_retry_count;
+    // consecutive rejections of the spooled record being published
+    int drain_reject_count;
+    // samples are sent packed to the cloud side
+    bool encoded;
+    // spooled record being published
+    int64_t drain_started;
+    json_object * drain_recordJ;
 };
 
 typedef struct cloudSensor {
   char * class;
   char class_id[SENSOR_CLASS_ID_MAX_LEN+1];
+  int publish_period;
+  int64_t next_due;
+  // set when the class takes part in the current publication round
+  bool due;
+  // event-driven mode: samples were notified since the class was last read
+  bool notified;
+  // a staged round of the class is to be acknowledged before the class is
+  // read again: its deadband filter, or the read of its deferred keys, need
+  // that outcome
+  bool held;
+  int64_t query_to;
+  // the keys deferred by the bandwidth scheduler, with their first
+  // unpublished sample, the staged rounds included, and those deferred by the
+  // round being read
+  json_object * deferredJ;
+  json_object * round_deferredJ;
+  // lower bound of the read of the deferred keys the scheduler now admits,
+  // WATERMARK_NONE when the round reads the new samples only
+  int64_t catch_up;
+  // upper bound of the samples of the staged rounds, ahead of the watermark
+  // horizon until they are acknowledged
+  int64_t read_to;
+  // ts_mrange() latency measurement
+  int64_t query_started;
+  cloudBatchT batch;
+  cloudWatermarkT watermark;
+  // downsampling, and whether it applies to the current round
+  cloudAggregationT aggregation;
+  bool aggregated;
+  // change-only publication filter
+  cloudDeadbandT deadband;
 } cloudSensorT;
 
 typedef struct binding_parameters {
     int publish_freq;
+    int tick;
+    int max_inflight_queries;
+    int max_samples_per_batch;
+    int max_bytes_per_batch;
+    int max_inflight_batches;
+    int pipeline_depth;
+    int sensor_count;
     cloudSensorT * cloud_sensors;
     const char * autostart;
     const char * redis_local_api;
     const char * redis_cloud_api;
+    cloudSpoolT spool;
+    encodingModeT encoding;
+    cloudCompressorT compressor;
+    cloudBandwidthT bandwidth;
+    cloudTriggerT trigger;
+    cloudBackoffT backoff;
+    cloudCongestionT congestion;
+    cloudIdempotenceT idempotence;
+    cloudRetentionT retention;
 } binding_paramsT;
 
-binding_paramsT binding_params = {0};
-
-int retryDelays[] = {1000, 2000, 2000, TIMER_RETRY_MAX_DELAY};
-int retryDelaysSz = (sizeof(retryDelays)/sizeof(retryDelays[0]));
+// One publication pipeline: its destination, sensors, timer and retry state.
+// Each entry of the 'cloud-pub' section gets its own, bound to the API serving
+// its verbs as the API userdata.
+typedef struct cloudPubCtx {
+    afb_api_t api;
+    struct publication_state state;
+    binding_paramsT params;
+    cloudSyncT sync;
+    cloudStatsT stats;
+    // configuration entry, until the context API is created
+    json_object * configJ;
+    // debug counters of the jobs and of the ping verb
+    int repush_count;
+    int round_count;
+    int ping_count;
+} cloudPubCtxT;
+
+// Reply closure of a local read: replies to the reads of a stopped
+// publication do not match the current run epoch
+typedef struct localReply {
+    cloudPubCtxT * ctx;
+    cloudSensorT * sensor;
+    unsigned epoch;
+} localReplyT;
 
 static int cloud_config(afb_api_t api, CtlSectionT *section, json_object *rtusJ);
 
@@ -86,10 +276,15 @@ static void call_verb_async (afb_api_t api, const char * apiToCall, const char *
                           *object, const char *error, const char * info,
                           afb_api_t api), void *closure);
 static void publication_job_entry(int signum, void *arg);
+static void start_retention(cloudPubCtxT * ctx);
+static void next_round(cloudPubCtxT * ctx);
+static void send_rounds(cloudPubCtxT * ctx);
 static void repush_job(int signum, void *arg);
+static void trigger_job(int signum, void *arg);
+static void start_drain(cloudPubCtxT * ctx, int delay);
 
 #ifdef BINDING_HAS_RESAMPLING_SUPPORT
-static int resample_sensor_values (afb_req_t request);
+static int resample_sensor_values (cloudPubCtxT * ctx, afb_req_t request);
 static int call_verb_sync (afb_api_t api, const char * apiToCall, const char * verbToCall,
                          json_object * argsJ, int * disconnected);
 #endif /* BINDING_HAS_RESAMPLING_SUPPORT */
@@ -100,174 +295,1748 @@ static CtlSectionT ctrlStaticSectionsCloud[] = {
     { .key = NULL }
 };
 
-static void stop_publication() {
-    if (current_state.in_progress) {
-        current_state.in_progress = false;
-	json_object_put(current_state.obj);
-	current_state.obj = NULL;
+// Release the chunks of the round, the replies still to come being ignored
+static void round_release(cloudPubCtxT * ctx) {
+    size_t ix;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    for (ix = 0; ctx->state.sends && ix < ctx->state.chunks.count; ix++)
+        json_object_put(ctx->state.sends[ix].payloadJ);
+    free(ctx->state.sends);
+    ctx->state.sends = NULL;
+    ctx->state.round_generation++;
+    batch_chunks_release(&ctx->state.chunks);
+    ctx->state.chunks_next = 0;
+    ctx->state.chunks_acked = 0;
+    ctx->state.chunks_inflight = 0;
+    ctx->state.round_disconnected = false;
+    ctx->state.round_abandoned = false;
+    pthread_mutex_unlock(&ctx->state.lock);
+}
+
+// Release the classes of the round
+static void round_classes_release(cloudPubCtxT * ctx, roundClassT * classes) {
+    int ix;
+
+    for (ix = 0; classes && ix < ctx->params.sensor_count; ix++) {
+        batch_release(&classes[ix].batch);
+        json_object_put(classes[ix].deferredJ);
+    }
+    free(classes);
+}
+
+static void staged_round_release(cloudPubCtxT * ctx, stagedRoundT * stage) {
+    batch_chunks_release(&stage->chunks);
+    round_classes_release(ctx, stage->classes);
+    free(stage);
+}
+
+// Take the classes of the round over, once: whoever gets them releases them
+static roundClassT * round_classes_take(cloudPubCtxT * ctx) {
+    roundClassT * classes;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    classes = ctx->state.classes;
+    ctx->state.classes = NULL;
+    pthread_mutex_unlock(&ctx->state.lock);
+    return classes;
+}
+
+// Drop the staged rounds, and the rounds being read: they are read again.
+// The ring is popped under the state lock, both stop_publication() and the
+// sender stage consuming it.
+static void staged_rounds_drop(cloudPubCtxT * ctx) {
+    stagedRoundT * stage;
+
+    __atomic_add_fetch(&ctx->state.read_epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&ctx->state.lock);
+    while ((stage = ring_pop(&ctx->state.ready)) != NULL)
+        staged_round_release(ctx, stage);
+    pthread_mutex_unlock(&ctx->state.lock);
+}
+
+/**
+ * @brief Stop the publication, once whatever the stage asking for it
+ *
+ * The reader and the sender stages may both fail at the same time: only the
+ * caller switching in_progress off tears the rounds down. The sender stage
+ * takes the staged rounds and the classes under the state lock, after
+ * checking in_progress, so they are released by one side only.
+ */
+static void stop_publication(cloudPubCtxT * ctx) {
+    int ix;
+    bool running = true;
+
+    if (!__atomic_compare_exchange_n(&ctx->state.in_progress, &running, false, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.run_epoch++;
+    pthread_mutex_unlock(&ctx->state.lock);
+    round_release(ctx);
+    round_classes_release(ctx, round_classes_take(ctx));
+    staged_rounds_drop(ctx);
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        ctx->params.cloud_sensors[ix].due = false;
+        __atomic_store_n(&ctx->params.cloud_sensors[ix].held, false, __ATOMIC_RELEASE);
+        batch_release(&ctx->params.cloud_sensors[ix].batch);
+        json_object_put(ctx->params.cloud_sensors[ix].round_deferredJ);
+        ctx->params.cloud_sensors[ix].round_deferredJ = NULL;
+    }
+}
+
+static void queue_publication_job(cloudPubCtxT * ctx, void (*job)(int, void*), int delay) {
+    int err;
+
+    err = afb_api_queue_job(ctx->api, job, ctx, 0, -delay);
+    if (err < 0) {
+        AFB_API_ERROR(ctx->api, "failure to queue publication job!");
+        stop_publication(ctx);
+    }
+}
+
+static void publication_done(cloudPubCtxT * ctx) {
+    int ix;
+    int64_t now;
+    int delay;
+    bool notified = false;
+    cloudSensorT * sensor;
+    roundClassT * classes;
+    roundClassT * cls;
+
+    // released by stop_publication() meanwhile
+    classes = round_classes_take(ctx);
+    if (classes == NULL)
+        return;
+
+    // everything read during the round is now on the cloud side, the per-key
+    // marks being shared with the ts_mrange() replies of the next rounds
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        cls = &classes[ix];
+        if (!cls->due)
+            continue;
+
+        pthread_mutex_lock(&ctx->state.lock);
+        watermark_commit(&sensor->watermark, &cls->batch, cls->ack_to, cls->deferredJ);
+        pthread_mutex_unlock(&ctx->state.lock);
+        watermark_persist(&sensor->watermark);
+        deadband_commit(&sensor->deadband, &cls->batch);
+
+        // the class may be read again, from its committed state
+        if (__atomic_exchange_n(&sensor->held, false, __ATOMIC_ACQ_REL))
+            notified |= __atomic_load_n(&sensor->notified, __ATOMIC_RELAXED);
+    }
+
+    round_classes_release(ctx, classes);
+
+    // event-driven rounds skipped the classes held meanwhile
+    if (notified && ctx->params.trigger.enabled && __atomic_load_n(&ctx->state.in_progress, __ATOMIC_SEQ_CST)) {
+        now = now_ms();
+        delay = trigger_defer(&ctx->params.trigger, now, now);
+        if (delay >= 0)
+            queue_publication_job(ctx, trigger_job, delay);
+    }
+}
+
+// Forget the samples read during the round, and during the rounds staged
+// after it: they are read again next time
+static void publication_abandon(cloudPubCtxT * ctx) {
+    round_classes_release(ctx, round_classes_take(ctx));
+    staged_rounds_drop(ctx);
+}
+
+/**
+ * @brief Hand the sender stage over once the round is acknowledged, spooled
+ * or abandoned
+ */
+static void round_end(cloudPubCtxT * ctx) {
+    congestion_round_end(&ctx->params.congestion);
+    __atomic_store_n(&ctx->state.sending, false, __ATOMIC_SEQ_CST);
+    send_rounds(ctx);
+}
+
+/**
+ * @brief Store the samples of the round in the spool rather than publishing them
+ *
+ * Once on disk, the samples are considered published as far as the local side
+ * is concerned: the next rounds go on with newer samples. Takes ownership of
+ * the ts_minsert() arguments.
+ */
+static void spool_round(cloudPubCtxT * ctx, json_object * argsJ) {
+    int status;
+
+    status = spool_append(&ctx->params.spool, argsJ);
+    json_object_put(argsJ);
+
+    if (status < 0) {
+        AFB_API_ERROR(ctx->api, "cannot store samples in the spool!");
+        stop_publication(ctx);
+        return;
+    }
+
+    if (status == 0) {
+        publication_done(ctx);
+    } else {
+        AFB_API_WARNING(ctx->api, "spool full, samples left in the local database");
+        publication_abandon(ctx);
+    }
+
+    round_end(ctx);
+}
+
+// Account for the samples of ts_minsert() arguments acknowledged by the cloud side
+static void stats_record_published(cloudPubCtxT * ctx, json_object * argsJ) {
+    json_object * timestampsJ;
+    size_t samples;
+
+    json_object_object_foreach(argsJ, key, seriesJ) {
+        if (!json_object_object_get_ex(seriesJ, SERIES_FIELD_TIMESTAMPS, &timestampsJ))
+            continue;
+        samples = json_object_array_length(timestampsJ);
+        stats_record_series(&ctx->stats, key, samples, strlen(key) + samples * SERIES_SAMPLE_SIZE_ESTIMATE, true);
+    }
+}
+
+// Account for the samples of the round acknowledged by the cloud side
+static void stats_record_round(cloudPubCtxT * ctx) {
+    int ix;
+    size_t jx;
+    cloudSeriesT * series;
+
+    // the classes may be released by stop_publication() meanwhile
+    pthread_mutex_lock(&ctx->state.lock);
+    for (ix = 0; ctx->state.classes && ix < ctx->params.sensor_count; ix++) {
+        if (!ctx->state.classes[ix].due)
+            continue;
+        for (jx = 0; jx < ctx->state.classes[ix].batch.count; jx++) {
+            series = &ctx->state.classes[ix].batch.series[jx];
+            stats_record_series(&ctx->stats, series->key, series->samples, batch_series_size(series), true);
+        }
+    }
+    pthread_mutex_unlock(&ctx->state.lock);
+}
+
+/**
+ * @brief Build the cloud call of samples, packed, compressed and identified
+ * if enabled
+ *
+ * @param argsJ - the ts_minsert() arguments, left untouched
+ * @param verb - set to the cloud side verb to call
+ * @param flags - set to the CLOUD_INSERT_* flags telling how the samples are
+ *                sent (see encoding_rejected() and cloud_insert_done())
+ * @return the arguments of the call, a new reference on argsJ when sent as is
+ *
+ * Called with the state lock held.
+ */
+static json_object * cloud_payload(cloudPubCtxT * ctx, json_object * argsJ, const char ** verb,
+                                   intptr_t * flags) {
+    json_object * payloadJ = NULL;
+    json_object * compressedJ;
+    json_object * batchJ;
+    unsigned dictionary_sent;
+
+    *verb = "ts_minsert";
+    *flags = 0;
+
+    if (ctx->state.encoded) {
+        payloadJ = codec_encode_minsert_args(argsJ);
+        if (payloadJ) {
+            *verb = REDIS_VERB_TS_MINSERT_ENCODED;
+            *flags |= CLOUD_INSERT_ENCODED;
+        }
+        else {
+            AFB_API_WARNING(ctx->api, "samples packing failed, sending them as JSON");
+        }
+    }
+    if (payloadJ == NULL)
+        payloadJ = json_object_get(argsJ);
+
+    compressedJ = compress_wrap(&ctx->params.compressor, *verb, payloadJ, argsJ, &dictionary_sent);
+    if (compressedJ) {
+        json_object_put(payloadJ);
+        payloadJ = compressedJ;
+        *verb = REDIS_VERB_TS_COMPRESSED;
+        *flags |= CLOUD_INSERT_COMPRESSED;
+        if (dictionary_sent)
+            *flags |= CLOUD_INSERT_DICTIONARY |
+                      (intptr_t)(dictionary_sent & CLOUD_INSERT_DICTIONARY_MASK) << CLOUD_INSERT_DICTIONARY_SHIFT;
+    }
+
+    batchJ = idempotent_wrap(&ctx->params.idempotence, *verb, payloadJ, argsJ);
+    if (batchJ) {
+        json_object_put(payloadJ);
+        payloadJ = batchJ;
+        *verb = REDIS_VERB_TS_BATCH;
+        *flags |= CLOUD_INSERT_BATCH;
+    }
+
+    return payloadJ;
+}
+
+/**
+ * @brief Send samples to the cloud side, packed and compressed if enabled
+ *
+ * @param argsJ - the ts_minsert() arguments, left untouched
+ * @param callback - the reply callback, whose closure holds the
+ *                   CLOUD_INSERT_* flags telling how the samples were sent
+ */
+static void cloud_insert(cloudPubCtxT * ctx, json_object * argsJ,
+                         void (*callback)(void *closure, struct json_object *object,
+                                          const char *error, const char * info, afb_api_t api)) {
+    const char * verb;
+    intptr_t flags;
+    json_object * payloadJ;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    payloadJ = cloud_payload(ctx, argsJ, &verb, &flags);
+    pthread_mutex_unlock(&ctx->state.lock);
+    afb_api_call(ctx->api, ctx->params.redis_cloud_api, verb, payloadJ, callback, (void *)flags);
+}
+
+/**
+ * @brief Account for the successful completion of a cloud_insert() call
+ */
+static void cloud_insert_done(cloudPubCtxT * ctx, void * closure, json_object * resultJ) {
+    intptr_t flags = (intptr_t)closure;
+
+    if (flags & CLOUD_INSERT_DICTIONARY)
+        compress_dictionary_acked(&ctx->params.compressor,
+                                  (unsigned)(flags >> CLOUD_INSERT_DICTIONARY_SHIFT) & CLOUD_INSERT_DICTIONARY_MASK);
+    if (flags & CLOUD_INSERT_BATCH)
+        idempotent_acked(&ctx->params.idempotence, resultJ);
+}
+
+// Whether the cloud side told it does not serve a call, rather than failed it
+static bool cloud_call_unsupported(const char * error) {
+    return strcmp(error, REDIS_ERROR_UNKNOWN_VERB) == 0 || strcmp(error, REDIS_ERROR_UNSUPPORTED) == 0;
+}
+
+/**
+ * @brief Tell whether a failed call is to be sent again as is, later
+ *
+ * Lost connections are, and so are the other failures of the packed,
+ * compressed or identified calls, unless the cloud side told it does not
+ * serve them.
+ */
+static bool cloud_call_transient(void * closure, const char * error) {
+    intptr_t flags = (intptr_t)closure;
+
+    return strcmp(error, "disconnected") == 0 ||
+           ((flags & CLOUD_INSERT_FALLBACKS) && !cloud_call_unsupported(error));
+}
+
+/**
+ * @brief Fall back to plain calls, then to uncompressed, then to JSON samples
+ * when the cloud side does not serve them
+ *
+ * Called with the state lock held.
+ *
+ * @return true if the failed call should be retried
+ */
+static bool encoding_rejected(cloudPubCtxT * ctx, void * closure, const char * error) {
+    intptr_t flags = (intptr_t)closure;
+
+    if (!cloud_call_unsupported(error))
+        return false;
+
+    if (flags & CLOUD_INSERT_BATCH) {
+        if (idempotent_enabled(&ctx->params.idempotence)) {
+            AFB_API_WARNING(ctx->api, "cloud side rejected identified batches [%s], "
+                            "sending plain calls", error);
+            idempotent_disable(&ctx->params.idempotence);
+        }
+        return true;
+    }
+
+    if (flags & CLOUD_INSERT_COMPRESSED) {
+        if (compress_enabled(&ctx->params.compressor)) {
+            AFB_API_WARNING(ctx->api, "cloud side rejected compressed samples [%s], "
+                            "sending them uncompressed", error);
+            compress_disable(&ctx->params.compressor);
+        }
+        return true;
+    }
+
+    if (flags & CLOUD_INSERT_ENCODED) {
+        if (ctx->state.encoded) {
+            AFB_API_WARNING(ctx->api, "cloud side rejected packed samples [%s], falling back to JSON",
+                            error);
+            ctx->state.encoded = false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static void encodings_reply_cb(void *closure, struct json_object *resultJ,
+                               const char *error, const char * info, afb_api_t api) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+    size_t ix;
+
+    if (error) {
+        AFB_API_NOTICE(api, "cloud side does not support packed samples [%s], using JSON", error);
+        return;
+    }
+
+    if (json_object_is_type(resultJ, json_type_array)) {
+        for (ix = 0; ix < json_object_array_length(resultJ); ix++) {
+            if (strcmp(json_object_get_string(json_object_array_get_idx(resultJ, ix)),
+                       CODEC_ENCODING_GORILLA) == 0) {
+                AFB_API_NOTICE(api, "cloud side supports %s, packing samples", CODEC_ENCODING_GORILLA);
+                pthread_mutex_lock(&ctx->state.lock);
+                ctx->state.encoded = true;
+                pthread_mutex_unlock(&ctx->state.lock);
+                return;
+            }
+        }
+    }
+
+    AFB_API_NOTICE(api, "cloud side does not support %s, using JSON", CODEC_ENCODING_GORILLA);
+}
+
+/**
+ * @brief Choose how samples are sent, according to the "encoding" setting
+ *
+ * With "auto", samples are sent as JSON until the cloud side has told it
+ * supports the packed encoding.
+ */
+static void negotiate_encoding(cloudPubCtxT * ctx) {
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.encoded = ctx->params.encoding == ENCODING_GORILLA;
+    pthread_mutex_unlock(&ctx->state.lock);
+    if (ctx->params.encoding == ENCODING_AUTO)
+        afb_api_call(ctx->api, ctx->params.redis_cloud_api, REDIS_VERB_TS_ENCODINGS,
+                     NULL, encodings_reply_cb, 0);
+}
+
+static void drain_job(int signum, void *arg);
+
+// The spool is not drained anymore, until the next start_drain()
+static void drain_stop(cloudPubCtxT * ctx) {
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.draining = false;
+    pthread_mutex_unlock(&ctx->state.lock);
+}
+
+static void drain_reply_cb(void *closure, struct json_object *resultJ,
+                           const char *error, const char * info, afb_api_t api) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+    json_object * recordJ;
+    int64_t started;
+    int retry_count;
+    int reject_count = 0;
+    bool rejected = false;
+    int delay = 0;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    recordJ = ctx->state.drain_recordJ;
+    ctx->state.drain_recordJ = NULL;
+    started = ctx->state.drain_started;
+    retry_count = ctx->state.drain_retry_count;
+    if (error == NULL) {
+        ctx->state.drain_retry_count = 0;
+        ctx->state.drain_reject_count = 0;
+    } else if (cloud_call_transient(closure, error) || !(rejected = encoding_rejected(ctx, closure, error))) {
+        ctx->state.drain_retry_count += retry_count < ctx->params.backoff.levels;
+    }
+    if (error && !rejected && !cloud_call_transient(closure, error)) {
+        reject_count = ++ctx->state.drain_reject_count;
+        if (reject_count >= SPOOL_MAX_REJECTIONS) {
+            ctx->state.drain_retry_count = 0;
+            ctx->state.drain_reject_count = 0;
+        }
+    }
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    if (error == NULL) {
+        stats_histogram_record(&ctx->stats.minsert_latency, mono_us() - started);
+        stats_record_published(ctx, recordJ);
+        cloud_insert_done(ctx, closure, resultJ);
+        spool_ack(&ctx->params.spool);
+    }
+    else if (cloud_call_transient(closure, error)) {
+        delay = backoff_delay(&ctx->params.backoff, retry_count);
+        stats_record_backoff(&ctx->stats, backoff_level(&ctx->params.backoff, retry_count), delay);
+        congestion_loss(&ctx->params.congestion);
+        AFB_API_NOTICE(api, "cloud side unavailable [%s], draining the spool again in %d ms", error, delay);
+    }
+    else if (rejected) {
+        // the record is sent again, uncompressed or as JSON
+    }
+    else if (reject_count >= SPOOL_MAX_REJECTIONS) {
+        // rejected for good: moved aside, so that neither the next records
+        // nor retention wait for it
+        AFB_API_ERROR(api, "spooled samples rejected %d times [%s], moved to the dead-letter file",
+                      reject_count, error);
+        if (spool_reject(&ctx->params.spool, recordJ) < 0)
+            AFB_API_ERROR(api, "rejected spooled samples lost!");
+    }
+    else {
+        // the record is kept: the watermark already moved past its samples,
+        // and retention waits for the spool to be empty
+        delay = backoff_delay(&ctx->params.backoff, retry_count);
+        stats_record_backoff(&ctx->stats, backoff_level(&ctx->params.backoff, retry_count), delay);
+        AFB_API_ERROR(api, "failure to publish spooled samples [%s], trying again in %d ms", error, delay);
+    }
+
+    json_object_put(recordJ);
+
+    if (afb_api_queue_job(api, drain_job, ctx, 0, -delay) < 0) {
+        AFB_API_ERROR(api, "failure to queue spool job!");
+        drain_stop(ctx);
+    }
+}
+
+static void drain_job(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
+    json_object * recordJ;
+
+    if (signum) {
+        AFB_API_ERROR(ctx->api, "signal %s caught in spool job", strsignal(signum));
+        drain_stop(ctx);
+        return;
+    }
+
+    // spooled samples wait for the next start
+    if (!ctx->state.in_progress) {
+        drain_stop(ctx);
+        return;
+    }
+
+    recordJ = spool_peek(&ctx->params.spool);
+    if (recordJ == NULL) {
+        AFB_API_NOTICE(ctx->api, "spool drained");
+        drain_stop(ctx);
+        return;
+    }
+
+    // kept until acknowledged, for the statistics
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.drain_recordJ = recordJ;
+    ctx->state.drain_started = mono_us();
+    pthread_mutex_unlock(&ctx->state.lock);
+    cloud_insert(ctx, recordJ, drain_reply_cb);
+}
+
+/**
+ * @brief Publish the spooled samples, oldest first, as fast as acknowledged
+ */
+static void start_drain(cloudPubCtxT * ctx, int delay) {
+    bool start;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    start = !ctx->state.draining;
+    ctx->state.draining = true;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    if (start && afb_api_queue_job(ctx->api, drain_job, ctx, 0, -delay) < 0) {
+        AFB_API_ERROR(ctx->api, "failure to queue spool job!");
+        drain_stop(ctx);
+    }
+}
+
+static void stop_publication_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+
+    AFB_REQ_DEBUG(request, "%s called", __func__);
+
+    if (!ctx->state.in_progress) {
+        AFB_REQ_ERROR(request, "replication has not been started yet!");
+        afb_req_success_f(request, NULL, "Already stopped");
+        return;
+    }
+    stop_publication(ctx);
+    afb_req_success_f(request, NULL, "Replication stopped");
+    return;
+}
+
+static void push_data(cloudPubCtxT * ctx);
+
+/**
+ * @brief Go on with a round whose in-flight chunks have all been answered,
+ * after a disconnection or a rejected encoding
+ */
+static void round_settle(cloudPubCtxT * ctx) {
+    int delay;
+    int retry_count;
+    size_t ix, pending, count;
+    bool abandoned;
+    json_object * argsJ;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    abandoned = ctx->state.round_abandoned;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    if (abandoned) {
+        // the plain samples of a rejected chunk are gone: read the round
+        // again, acknowledged chunks included
+        round_release(ctx);
+        publication_abandon(ctx);
+        round_end(ctx);
+        return;
+    }
+
+    if (spool_enabled(&ctx->params.spool)) {
+        // the cloud side is disconnected: keep the samples not acknowledged
+        // yet on disk and go on collecting, the spool being drained once the
+        // cloud side is back
+        AFB_API_NOTICE(ctx->api, "cloud side disconnected, spooling samples");
+        delay = backoff_delay(&ctx->params.backoff, 0);
+        stats_record_backoff(&ctx->stats, 0, delay);
+
+        argsJ = json_object_new_object();
+        pthread_mutex_lock(&ctx->state.lock);
+        for (ix = 0; argsJ && ix < ctx->state.chunks.count; ix++) {
+            if (ctx->state.sends[ix].state != CHUNK_ACKED &&
+                batch_merge_minsert_args(argsJ, ctx->state.chunks.chunks[ix].argsJ) < 0) {
+                json_object_put(argsJ);
+                argsJ = NULL;
+            }
+        }
+        pthread_mutex_unlock(&ctx->state.lock);
+        round_release(ctx);
+        if (argsJ == NULL) {
+            AFB_API_ERROR(ctx->api, "cannot gather the samples to spool!");
+            stop_publication(ctx);
+            return;
+        }
+
+        spool_round(ctx, argsJ);
+        start_drain(ctx, delay);
+        return;
+    }
+
+    // the cloud side is disconnected: set the next job to be a retry of the
+    // chunks not acknowledged yet, potentially with an updated delay if there
+    // was already a previous disconnection
+    pthread_mutex_lock(&ctx->state.lock);
+    retry_count = ctx->state.retry_count;
+    ctx->state.retry_count += retry_count < ctx->params.backoff.levels;
+    ctx->state.round_disconnected = false;
+    pending = ctx->state.chunks.count - ctx->state.chunks_acked;
+    count = ctx->state.chunks.count;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    delay = backoff_delay(&ctx->params.backoff, retry_count);
+    stats_record_backoff(&ctx->stats, backoff_level(&ctx->params.backoff, retry_count), delay);
+    AFB_API_NOTICE(ctx->api, "cloud side disconnected, retrying %zu of %zu batches in %d ms",
+                   pending, count, delay);
+    queue_publication_job(ctx, repush_job, delay);
+}
+
+static void push_data_reply_cb(void *closure, struct json_object *mResultJ,
+                               const char *error, const char * info, afb_api_t api) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+    chunkReplyT * reply = closure;
+    roundChunkT * send;
+    cloudChunkT * chunk;
+    size_t index = reply->index;
+    bool round_complete = false;
+    bool settle;
+
+    // nothing if stopped, or if the round of the chunk was released meanwhile
+    pthread_mutex_lock(&ctx->state.lock);
+    if (!ctx->state.in_progress || reply->generation != ctx->state.round_generation) {
+        pthread_mutex_unlock(&ctx->state.lock);
+        free(reply);
+        return;
+    }
+    free(reply);
+
+    send = &ctx->state.sends[index];
+    chunk = &ctx->state.chunks.chunks[index];
+
+    // check status
+    if (error == NULL) {
+        // we are connected: this could be normal execution flow or a reconnection
+        stats_histogram_record(&ctx->stats.minsert_latency, mono_us() - send->started);
+        congestion_ack(&ctx->params.congestion, chunk->bytes, mono_us() - send->started);
+        cloud_insert_done(ctx, (void *)send->flags, mResultJ);
+
+        send->state = CHUNK_ACKED;
+        json_object_put(send->payloadJ);
+        send->payloadJ = NULL;
+        json_object_put(chunk->argsJ);
+        chunk->argsJ = NULL;
+        ctx->state.chunks_inflight--;
+        ctx->state.retry_count = 0;
+        round_complete = ++ctx->state.chunks_acked == ctx->state.chunks.count;
+    }
+    else if (cloud_call_transient((void *)send->flags, error)) {
+        send->state = CHUNK_PENDING;
+        ctx->state.chunks_inflight--;
+        ctx->state.round_disconnected = true;
+        congestion_loss(&ctx->params.congestion);
+    }
+    else if (encoding_rejected(ctx, (void *)send->flags, error)) {
+        // build the call again with the fallback encoding, from the local
+        // database when the plain samples are gone
+        send->state = CHUNK_PENDING;
+        json_object_put(send->payloadJ);
+        send->payloadJ = NULL;
+        ctx->state.chunks_inflight--;
+        if (chunk->argsJ == NULL)
+            ctx->state.round_abandoned = true;
+    }
+    else {
+        // the error is of another unexpected kind
+        pthread_mutex_unlock(&ctx->state.lock);
+        AFB_API_ERROR(ctx->api, "failure to call ts_minsert() to publish data [%s]!",
+                      error ? error : "-");
+        stop_publication(ctx);
+        return;
+    }
+
+    if (send->state == CHUNK_PENDING && index < ctx->state.chunks_next)
+        ctx->state.chunks_next = index;
+    settle = ctx->state.chunks_inflight == 0 &&
+             (ctx->state.round_disconnected || ctx->state.round_abandoned);
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    if (round_complete) {
+        stats_record_round(ctx);
+        round_release(ctx);
+        publication_done(ctx);
+        round_end(ctx);
+    }
+    else if (settle) {
+        round_settle(ctx);
+    }
+    else {
+        push_data(ctx);
+    }
+}
+
+/**
+ * @brief Build the cloud call of a chunk, once for all its attempts
+ *
+ * When the samples are packed or compressed, the call payload is all that is
+ * sent: the plain samples are released right away rather than kept alongside
+ * it until acknowledged. They are only kept when the spool may need them.
+ */
+static void prepare_payload(cloudPubCtxT * ctx, roundChunkT * send, cloudChunkT * chunk) {
+    send->payloadJ = cloud_payload(ctx, chunk->argsJ, &send->verb, &send->flags);
+
+    if (send->flags != 0 && !spool_enabled(&ctx->params.spool)) {
+        json_object_put(chunk->argsJ);
+        chunk->argsJ = NULL;
+    }
+}
+
+/**
+ * @brief Send the pending chunks of the round, max_inflight_batches at a time
+ *
+ * Each chunk is acknowledged on its own: after a disconnection, only the
+ * chunks not acknowledged yet are sent again.
+ */
+static void push_data(cloudPubCtxT * ctx) {
+    roundChunkT * send;
+    chunkReplyT * reply;
+    json_object * payloadJ = NULL;
+    const char * verb = NULL;
+    size_t ix;
+
+    while (ctx->state.in_progress) {
+        send = NULL;
+        reply = malloc(sizeof(*reply));
+        if (reply == NULL) {
+            AFB_API_ERROR(ctx->api, "cannot allocate a chunk reply closure!");
+            stop_publication(ctx);
+            return;
+        }
+
+        pthread_mutex_lock(&ctx->state.lock);
+        if (ctx->state.sends && !ctx->state.round_disconnected && !ctx->state.round_abandoned &&
+            ctx->state.chunks_inflight < ctx->params.max_inflight_batches) {
+            for (ix = ctx->state.chunks_next; ix < ctx->state.chunks.count; ix++) {
+                if (ctx->state.sends[ix].state == CHUNK_PENDING) {
+                    send = &ctx->state.sends[ix];
+                    send->state = CHUNK_INFLIGHT;
+                    ctx->state.chunks_inflight++;
+                    ctx->state.chunks_next = ix + 1;
+                    break;
+                }
+            }
+        }
+        if (send) {
+            if (send->payloadJ == NULL)
+                prepare_payload(ctx, send, &ctx->state.chunks.chunks[ix]);
+            send->started = mono_us();
+            payloadJ = json_object_get(send->payloadJ);
+            verb = send->verb;
+            reply->index = ix;
+            reply->generation = ctx->state.round_generation;
+        }
+        pthread_mutex_unlock(&ctx->state.lock);
+
+        if (send == NULL) {
+            free(reply);
+            return;
+        }
+
+        afb_api_call(ctx->api, ctx->params.redis_cloud_api, verb, payloadJ, push_data_reply_cb, reply);
+    }
+}
+
+// One series of the round, as ordered by the bandwidth scheduler
+typedef struct scheduledSeries {
+    cloudSensorT * sensor;
+    cloudSeriesT * series;
+    keyPriorityT priority;
+    size_t order;
+} scheduledSeriesT;
+
+static int scheduled_series_cmp(const void * a, const void * b) {
+    const scheduledSeriesT * sa = a;
+    const scheduledSeriesT * sb = b;
+
+    if (sa->priority != sb->priority)
+        return sa->priority < sb->priority ? -1 : 1;
+    return sa->order < sb->order ? -1 : sa->order > sb->order;
+}
+
+/**
+ * @brief Tell whether the series of a deferred key waits for a read of its
+ * first unpublished sample
+ *
+ * Publishing the newer samples of the key before would move its per-key
+ * watermark past the deferred ones.
+ */
+static bool schedule_waits(cloudSensorT * sensor, cloudSeriesT * series) {
+    int64_t deferred = watermark_key_deferred(sensor->deferredJ, series->key);
+
+    return deferred != WATERMARK_NONE && (sensor->catch_up == WATERMARK_NONE || sensor->catch_up > deferred);
+}
+
+/**
+ * @brief Defer a series to a later round
+ *
+ * Its key keeps its first unpublished sample, recorded with the round when
+ * deferred for the first time: the class watermark moves on past it.
+ *
+ * @return 0 on success, -1 when the deferral cannot be recorded
+ */
+static int schedule_defer(cloudSensorT * sensor, cloudSeriesT * series) {
+    int64_t first_ts;
+
+    first_ts = json_object_get_int64(json_object_array_get_idx(series->timestamps, 0));
+    if (watermark_key_deferred(sensor->deferredJ, series->key) == WATERMARK_NONE) {
+        if (sensor->round_deferredJ == NULL)
+            sensor->round_deferredJ = json_object_new_object();
+        if (sensor->deferredJ == NULL)
+            sensor->deferredJ = json_object_new_object();
+        if (sensor->round_deferredJ == NULL || sensor->deferredJ == NULL)
+            return -1;
+        watermark_defer(sensor->round_deferredJ, series->key, first_ts);
+        watermark_defer(sensor->deferredJ, series->key, first_ts);
+    }
+
+    batch_series_trim(series, INT64_MAX);
+    return 0;
+}
+
+/**
+ * @brief Select the series published this round, highest priority first
+ *
+ * Deferred series are dropped from the batches, their keys recording their
+ * first unpublished sample: the other keys of their class go on, and they are
+ * read again from there once the scheduler admits them again (see
+ * schedule_catch_up()). Until then, their newer samples are deferred as well.
+ */
+static void schedule_round(cloudPubCtxT * ctx) {
+    int ix;
+    size_t jx, count = 0;
+    size_t bytes;
+    cloudSensorT * sensor;
+    scheduledSeriesT * scheduled;
+
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        if (!sensor->due)
+            continue;
+        for (jx = 0; jx < sensor->batch.count; jx++) {
+            if (schedule_waits(sensor, &sensor->batch.series[jx]))
+                schedule_defer(sensor, &sensor->batch.series[jx]);
+            else if (sensor->batch.series[jx].samples != 0)
+                count++;
+        }
+    }
+
+    scheduled = count ? malloc(count * sizeof(*scheduled)) : NULL;
+    if (count && scheduled == NULL) {
+        AFB_API_WARNING(ctx->api, "cannot allocate the round schedule, publishing everything");
+        for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+            sensor = &ctx->params.cloud_sensors[ix];
+            for (jx = 0; sensor->due && sensor->deferredJ && jx < sensor->batch.count; jx++) {
+                if (sensor->batch.series[jx].samples != 0)
+                    json_object_object_del(sensor->deferredJ, sensor->batch.series[jx].key);
+            }
+        }
+    }
+
+    count = 0;
+    for (ix = 0; scheduled && ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        if (!sensor->due)
+            continue;
+        for (jx = 0; jx < sensor->batch.count; jx++) {
+            if (sensor->batch.series[jx].samples == 0)
+                continue;
+            scheduled[count].sensor = sensor;
+            scheduled[count].series = &sensor->batch.series[jx];
+            scheduled[count].priority = bandwidth_key_priority(&ctx->params.bandwidth,
+                                                               sensor->batch.series[jx].key);
+            scheduled[count].order = count;
+            count++;
+        }
+    }
+    if (scheduled)
+        qsort(scheduled, count, sizeof(*scheduled), scheduled_series_cmp);
+
+    for (jx = 0; scheduled && jx < count; jx++) {
+        sensor = scheduled[jx].sensor;
+        bytes = batch_series_size(scheduled[jx].series);
+        if (bandwidth_admit(&ctx->params.bandwidth, scheduled[jx].priority, bytes)) {
+            // read again from its first unpublished sample
+            if (sensor->deferredJ)
+                json_object_object_del(sensor->deferredJ, scheduled[jx].series->key);
+            continue;
+        }
+
+        if (schedule_defer(sensor, scheduled[jx].series) < 0)
+            AFB_API_WARNING(ctx->api, "cannot defer '%s', publishing it", scheduled[jx].series->key);
+    }
+    free(scheduled);
+
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        if (sensor->due)
+            batch_compact(&sensor->batch);
+    }
+}
+
+/**
+ * @brief Tell where to read the deferred keys of a class from
+ *
+ * Only the deferred keys the scheduler would now admit are read again: the
+ * class is read from the oldest of their first unpublished samples, the keys
+ * already published being trimmed by their per-key watermark. Nothing of the
+ * class is to be staged meanwhile, its newer samples being read again.
+ *
+ * @return the lower bound of the read, WATERMARK_NONE for none
+ */
+static int64_t schedule_catch_up(cloudPubCtxT * ctx, cloudSensorT * sensor) {
+    int64_t from = WATERMARK_NONE;
+    int64_t deferred;
+
+    if (sensor->deferredJ == NULL)
+        return WATERMARK_NONE;
+
+    json_object_object_foreach(sensor->deferredJ, key, deferredTsJ) {
+        deferred = json_object_get_int64(deferredTsJ);
+        if ((from == WATERMARK_NONE || deferred < from) &&
+            bandwidth_admissible(&ctx->params.bandwidth, bandwidth_key_priority(&ctx->params.bandwidth, key)))
+            from = deferred;
+    }
+
+    return from;
+}
+
+/**
+ * @brief Start again from the committed deferred keys, those of the staged
+ * rounds being read again
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+static int schedule_reset(cloudPubCtxT * ctx, cloudSensorT * sensor) {
+    json_object_put(sensor->deferredJ);
+    json_object_put(sensor->round_deferredJ);
+    sensor->round_deferredJ = NULL;
+    sensor->catch_up = WATERMARK_NONE;
+
+    pthread_mutex_lock(&ctx->state.lock);
+    sensor->deferredJ = watermark_deferred(&sensor->watermark);
+    pthread_mutex_unlock(&ctx->state.lock);
+    return sensor->deferredJ ? 0 : -1;
+}
+
+/**
+ * @brief Read the next round once what the reader stage waits for happened
+ *
+ * Called by both stages, the first one to see the condition met resuming the
+ * reader stage.
+ */
+static void reader_wake(cloudPubCtxT * ctx) {
+    readerWaitT wait = __atomic_load_n(&ctx->state.reader_wait, __ATOMIC_SEQ_CST);
+
+    switch (wait) {
+    case READER_RUNNING:
+        return;
+    case READER_WAIT_SLOT:
+        if (ring_full(&ctx->state.ready))
+            return;
+        break;
+    }
+
+    if (__atomic_compare_exchange_n(&ctx->state.reader_wait, &wait, READER_RUNNING, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) && ctx->state.in_progress)
+        next_round(ctx);
+}
+
+/**
+ * @brief Schedule the next read, or hold it back until the sender stage
+ * catches up
+ */
+static void reader_pause(cloudPubCtxT * ctx) {
+    if (!ring_full(&ctx->state.ready)) {
+        next_round(ctx);
+        return;
+    }
+
+    stats_count(&ctx->stats.reader_stalls);
+    __atomic_store_n(&ctx->state.reader_wait, READER_WAIT_SLOT, __ATOMIC_SEQ_CST);
+    // the sender stage may have caught up meanwhile
+    reader_wake(ctx);
+}
+
+/**
+ * @brief Publish the samples read by all the classes of the round at once
+ */
+static void publish_round(cloudPubCtxT * ctx) {
+    size_t ix;
+    json_object * argsJ;
+    roundChunkT * sends;
+
+    if (!ctx->state.in_progress) {
+        return;
+    }
+
+    // no new samples: skip the cloud round trip altogether
+    if (ctx->state.samples == 0) {
+        round_release(ctx);
+        publication_done(ctx);
+        round_end(ctx);
+        return;
+    }
+
+    // keep the publication order while the spool is not drained
+    if (!spool_empty(&ctx->params.spool)) {
+        // coalesce the chunks into a single spool record
+        argsJ = json_object_new_object();
+        pthread_mutex_lock(&ctx->state.lock);
+        for (ix = 0; argsJ && ix < ctx->state.chunks.count; ix++) {
+            if (batch_merge_minsert_args(argsJ, ctx->state.chunks.chunks[ix].argsJ) < 0) {
+                json_object_put(argsJ);
+                argsJ = NULL;
+            }
+        }
+        pthread_mutex_unlock(&ctx->state.lock);
+        round_release(ctx);
+        if (argsJ == NULL) {
+            AFB_API_ERROR(ctx->api, "ts_minsert() argument packing failed!");
+            stop_publication(ctx);
+            return;
+        }
+
+        AFB_API_DEBUG(ctx->api, "%s: spooling %zu samples", __func__, ctx->state.samples);
+        spool_round(ctx, argsJ);
+        start_drain(ctx, 0);
+        return;
+    }
+
+    sends = calloc(ctx->state.chunks.count, sizeof(roundChunkT));
+    if (sends == NULL) {
+        AFB_API_ERROR(ctx->api, "ts_minsert() argument packing failed!");
+        stop_publication(ctx);
+        return;
+    }
+    // not when the round was released by stop_publication() meanwhile
+    pthread_mutex_lock(&ctx->state.lock);
+    if (ctx->state.in_progress) {
+        ctx->state.sends = sends;
+        sends = NULL;
+    }
+    pthread_mutex_unlock(&ctx->state.lock);
+    free(sends);
+
+    AFB_API_DEBUG(ctx->api, "%s: publishing %zu samples in %zu batches", __func__, ctx->state.samples,
+                  ctx->state.chunks.count);
+    push_data(ctx);
+}
+
+/**
+ * @brief Publish the staged rounds, one at a time and in order
+ *
+ * Called by the reader stage once it staged a round, and by the sender stage
+ * once it is done with one: the first caller to claim the sender stage goes
+ * on with the oldest staged round. Rounds read before staged rounds were
+ * dropped are dropped as well.
+ */
+static void send_rounds(cloudPubCtxT * ctx) {
+    stagedRoundT * stage;
+    bool idle;
+
+    while (ctx->state.in_progress) {
+        idle = false;
+        if (!__atomic_compare_exchange_n(&ctx->state.sending, &idle, true, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return;
+
+        // popped under the state lock, and taken only while running: what
+        // stop_publication() did not drop is released by it
+        stage = NULL;
+        pthread_mutex_lock(&ctx->state.lock);
+        if (__atomic_load_n(&ctx->state.in_progress, __ATOMIC_SEQ_CST)) {
+            while ((stage = ring_pop(&ctx->state.ready)) != NULL &&
+                   stage->epoch != __atomic_load_n(&ctx->state.read_epoch, __ATOMIC_SEQ_CST))
+                staged_round_release(ctx, stage);
+        }
+        if (stage) {
+            ctx->state.chunks = stage->chunks;
+            ctx->state.classes = stage->classes;
+            ctx->state.samples = stage->samples;
+        }
+        pthread_mutex_unlock(&ctx->state.lock);
+
+        if (stage) {
+            free(stage);
+
+            // a slot is free again
+            reader_wake(ctx);
+            publish_round(ctx);
+            return;
+        }
+
+        __atomic_store_n(&ctx->state.sending, false, __ATOMIC_SEQ_CST);
+
+        // dropped rounds freed their slots, unless a round was staged
+        // meanwhile
+        if (ring_count(&ctx->state.ready) == 0) {
+            reader_wake(ctx);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Hand the round just read over to the sender stage
+ *
+ * The series are split into bounded ts_minsert() calls right away, the sender
+ * stage only having to send them. The next round is read as soon as the ring
+ * has a free slot. The classes whose deadband filter, or whose series deferred
+ * by the bandwidth scheduler, need the outcome of this round are held until
+ * it is acknowledged: the next rounds read the other classes, and read them
+ * again from their committed state.
+ */
+static void stage_round(cloudPubCtxT * ctx) {
+    int ix;
+    cloudSensorT * sensor;
+    stagedRoundT * stage;
+
+    if (!ctx->state.in_progress) {
+        return;
+    }
+
+    schedule_round(ctx);
+
+    stage = calloc(1, sizeof(*stage));
+    if (stage)
+        stage->classes = calloc((size_t)ctx->params.sensor_count, sizeof(roundClassT));
+    if (stage == NULL || stage->classes == NULL) {
+        free(stage);
+        AFB_API_ERROR(ctx->api, "cannot allocate the round!");
+        stop_publication(ctx);
+        return;
+    }
+    stage->epoch = ctx->state.reader_epoch;
+
+    // split the classes into bounded ts_minsert() calls
+    stage->chunks.max_samples = (size_t)ctx->params.max_samples_per_batch;
+    stage->chunks.max_bytes = congestion_batch_bytes(&ctx->params.congestion,
+                                                     (size_t)ctx->params.max_bytes_per_batch);
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        if (!sensor->due)
+            continue;
+
+        if (batch_add_minsert_chunks(&sensor->batch, &stage->chunks) < 0) {
+            AFB_API_ERROR(ctx->api, "ts_minsert() argument packing failed!");
+            staged_round_release(ctx, stage);
+            stop_publication(ctx);
+            return;
+        }
+        if (sensor->deadband.enabled || schedule_catch_up(ctx, sensor) != WATERMARK_NONE)
+            __atomic_store_n(&sensor->held, true, __ATOMIC_RELEASE);
+
+        // the chunks now hold the only references on the samples, each of
+        // them being released once acknowledged
+        batch_drop_samples(&sensor->batch);
+        stage->samples += sensor->batch.samples;
+        stage->classes[ix].due = true;
+        stage->classes[ix].ack_to = sensor->query_to;
+        stage->classes[ix].batch = sensor->batch;
+        stage->classes[ix].deferredJ = sensor->round_deferredJ;
+        memset(&sensor->batch, 0, sizeof(sensor->batch));
+        sensor->round_deferredJ = NULL;
+        sensor->due = false;
+        sensor->read_to = sensor->query_to;
+    }
+
+    AFB_API_DEBUG(ctx->api, "%s: staging %zu samples in %zu batches", __func__, stage->samples,
+                  stage->chunks.count);
+
+    // the reader stage only reads a round when a slot is free
+    if (!ring_push(&ctx->state.ready, stage)) {
+        AFB_API_ERROR(ctx->api, "no free slot for the round!");
+        staged_round_release(ctx, stage);
+        stop_publication(ctx);
+        return;
+    }
+
+    send_rounds(ctx);
+    reader_pause(ctx);
+}
+
+static void launch_queries(cloudPubCtxT * ctx);
+
+static void ts_mrange_call_cb(void *closure, struct json_object *mRangeResultJ, const char *error, 
+                              const char * info, afb_api_t api) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+    localReplyT * reply = closure;
+    cloudSensorT * sensor = reply->sensor;
+    size_t dropped;
+    int err;
+    bool round_complete;
+
+    size_t ix;
+
+    // nothing if stopped, even when started again meanwhile: the reply
+    // belongs to a round of the previous run
+    pthread_mutex_lock(&ctx->state.lock);
+    if (!ctx->state.in_progress || reply->epoch != ctx->state.run_epoch) {
+        pthread_mutex_unlock(&ctx->state.lock);
+        free(reply);
+        return;
+    }
+    pthread_mutex_unlock(&ctx->state.lock);
+    free(reply);
+
+    stats_histogram_record(&ctx->stats.mrange_latency, mono_us() - sensor->query_started);
+
+    AFB_API_DEBUG(api, "%s: called for %s", __func__, sensor->class);
+
+    // check errors
+    if (error){
+        AFB_API_ERROR(api, "failure to retrieve database records via ts_mrange(): %s [%s]!",
+                      error, info == NULL ? "[no info]": info);
+        stop_publication(ctx);
+        return;
+    }
+
+    //AFB_API_DEBUG(api, "ts_mrange() returned %s", json_object_get_string(mRangeResultJ));
+
+    pthread_mutex_lock(&ctx->state.lock);
+    err = batch_add_mrange_reply(&sensor->batch, mRangeResultJ);
+    dropped = watermark_trim_batch(&sensor->watermark, &sensor->batch);
+    ctx->state.queries_inflight--;
+    round_complete = --ctx->state.queries_pending == 0;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    if (err < 0) {
+        AFB_API_ERROR(api, "unexpected ts_mrange() reply format for %s!", sensor->class);
+        stop_publication(ctx);
+        return;
+    }
+
+    AFB_API_DEBUG(api, "%s: %s: %zu new samples over %zu keys (%zu already published)", __func__,
+                  sensor->class, sensor->batch.samples, sensor->batch.count, dropped);
+
+    for (ix = 0; ix < sensor->batch.count; ix++) {
+        stats_record_series(&ctx->stats, sensor->batch.series[ix].key,
+                            sensor->batch.series[ix].samples,
+                            batch_series_size(&sensor->batch.series[ix]), false);
+    }
+
+    if (sensor->aggregated) {
+        dropped = aggregate_batch(&sensor->aggregation, &sensor->batch);
+        AFB_API_DEBUG(api, "%s: %s: %zu samples aggregated away", __func__, sensor->class, dropped);
+    }
+
+    if (sensor->deadband.enabled) {
+        dropped = deadband_filter_batch(&sensor->deadband, &sensor->batch);
+        AFB_API_DEBUG(api, "%s: %s: %zu samples within deadband", __func__, sensor->class, dropped);
+    }
+
+    if (round_complete)
+        stage_round(ctx);
+    else
+        launch_queries(ctx);
+}
+
+static void repush_job(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
+
+    if (signum) {
+        AFB_API_ERROR(ctx->api, "signal %s caught in repush job", strsignal(signum));
+        stop_publication(ctx);
+    }
+    else {
+        AFB_API_DEBUG(ctx->api, "repush_job iter %d", ++ctx->repush_count);
+        stats_count(&ctx->stats.retries);
+        push_data(ctx);
+    }
+}
+
+static void query_sensor(cloudPubCtxT * ctx, cloudSensorT * sensor) {
+    int err;
+    localReplyT * reply;
+    json_object * mrangeArgsJ;
+    char fromts[TIMESTAMP_ARG_MAX_LEN];
+    char tots[TIMESTAMP_ARG_MAX_LEN];
+
+    // only query what was neither acknowledged nor staged yet: (watermark, now],
+    // and the deferred keys now admitted
+    if (sensor->catch_up != WATERMARK_NONE)
+        snprintf(fromts, sizeof(fromts), "%" PRId64, sensor->catch_up);
+    else if (sensor->read_to > sensor->watermark.horizon)
+        snprintf(fromts, sizeof(fromts), "%" PRId64, sensor->read_to + 1);
+    else
+        watermark_fromts(&sensor->watermark, fromts, sizeof(fromts));
+    snprintf(tots, sizeof(tots), "%" PRId64, sensor->query_to);
+
+    err = wrap_json_pack (&mrangeArgsJ, "{ s:s, s:s, s:s }", "class", sensor->class,
+                          "fromts", fromts, "tots", tots);
+    if (err) {
+        AFB_API_ERROR(ctx->api, "ts_mrange() argument packing failed!");
+        stop_publication(ctx);
+        return;
+    }
+
+    reply = malloc(sizeof(*reply));
+    if (reply == NULL) {
+        json_object_put(mrangeArgsJ);
+        AFB_API_ERROR(ctx->api, "cannot allocate a ts_mrange() reply closure!");
+        stop_publication(ctx);
+        return;
+    }
+    reply->ctx = ctx;
+    reply->sensor = sensor;
+    pthread_mutex_lock(&ctx->state.lock);
+    reply->epoch = ctx->state.run_epoch;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    sensor->query_started = mono_us();
+    call_verb_async (ctx->api, ctx->params.redis_local_api,
+                     "ts_mrange", mrangeArgsJ, ts_mrange_call_cb, reply);
+}
+
+/**
+ * @brief Issue the ts_mrange() queries of the due classes
+ *
+ * At most max_inflight_queries queries are pending at a given time, the next
+ * ones being issued as replies come back.
+ */
+static void launch_queries(cloudPubCtxT * ctx) {
+    cloudSensorT * sensor;
+
+    while (ctx->state.in_progress) {
+        sensor = NULL;
+
+        pthread_mutex_lock(&ctx->state.lock);
+        while (ctx->state.queries_inflight < ctx->params.max_inflight_queries &&
+               ctx->state.queries_next < ctx->params.sensor_count) {
+            if (ctx->params.cloud_sensors[ctx->state.queries_next++].due) {
+                sensor = &ctx->params.cloud_sensors[ctx->state.queries_next - 1];
+                ctx->state.queries_inflight++;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ctx->state.lock);
+
+        if (sensor == NULL)
+            return;
+
+        query_sensor(ctx, sensor);
+    }
+}
+
+static void publication_job_entry(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
+    int ix;
+    int due_count = 0;
+    int epoch;
+    int64_t now, query_to, deferred_at;
+    cloudSensorT * sensor;
+
+    if (signum) {
+        AFB_API_ERROR(ctx->api, "signal %s caught in publication job", strsignal(signum));
+        stop_publication(ctx);
+        return;
+    }
+
+    // staged rounds were dropped: read them again from the watermarks
+    epoch = __atomic_load_n(&ctx->state.read_epoch, __ATOMIC_SEQ_CST);
+    if (ctx->state.reader_epoch != epoch) {
+        ctx->state.reader_epoch = epoch;
+        for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+            ctx->params.cloud_sensors[ix].read_to = WATERMARK_NONE;
+            __atomic_store_n(&ctx->params.cloud_sensors[ix].held, false, __ATOMIC_RELEASE);
+            if (schedule_reset(ctx, &ctx->params.cloud_sensors[ix]) < 0) {
+                AFB_API_ERROR(ctx->api, "cannot allocate the deferred keys of %s!",
+                              ctx->params.cloud_sensors[ix].class);
+                stop_publication(ctx);
+                return;
+            }
+        }
+    }
+
+    AFB_API_DEBUG(ctx->api, "publication_job_entry iter %d", ++ctx->round_count);
+
+    // nothing is published at the 'none' bandwidth level, samples wait in the
+    // local database. Event-driven rounds are run again once the level is
+    // raised (see bandwidth_set_cb()), rather than polled.
+    if (bandwidth_paused(&ctx->params.bandwidth)) {
+        if (ctx->params.trigger.enabled)
+            next_round(ctx);
+        else
+            queue_publication_job(ctx, publication_job_entry, ctx->params.tick);
+        return;
+    }
+
+    // select the classes whose publication period has elapsed. In
+    // event-driven mode, the notified classes not due yet get a round of
+    // their own once they are.
+    now = now_ms();
+    deferred_at = TRIGGER_NONE;
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        sensor = &ctx->params.cloud_sensors[ix];
+        if (sensor->next_due > now) {
+            if (__atomic_load_n(&sensor->notified, __ATOMIC_RELAXED) && sensor->next_due < deferred_at)
+                deferred_at = sensor->next_due;
+            continue;
+        }
+
+        // read again once its staged round is acknowledged (see
+        // publication_done())
+        if (__atomic_load_n(&sensor->held, __ATOMIC_ACQUIRE))
+            continue;
+
+        // aggregated classes are read up to their last closed bucket, once it
+        // is over
+        query_to = now;
+        sensor->aggregated = aggregate_active(&sensor->aggregation, bandwidth_level(&ctx->params.bandwidth));
+        if (sensor->aggregated) {
+            query_to = aggregate_closed_to(&sensor->aggregation, now);
+            if (query_to <= sensor->watermark.horizon || query_to <= sensor->read_to)
+                continue;
+        }
+
+        // the deferred keys now admitted are read again, once nothing of the
+        // class is staged: its newer samples are then read again as well
+        sensor->catch_up = schedule_catch_up(ctx, sensor);
+        pthread_mutex_lock(&ctx->state.lock);
+        if (sensor->read_to > sensor->watermark.horizon)
+            sensor->catch_up = WATERMARK_NONE;
+        pthread_mutex_unlock(&ctx->state.lock);
+
+        sensor->due = true;
+        sensor->query_to = query_to;
+        sensor->next_due = now + sensor->publish_period;
+        __atomic_store_n(&sensor->notified, false, __ATOMIC_RELAXED);
+        due_count++;
+    }
+
+    if (ctx->params.trigger.enabled && deferred_at != TRIGGER_NONE)
+        trigger_defer(&ctx->params.trigger, deferred_at, now);
+
+    if (due_count == 0) {
+        next_round(ctx);
+        return;
+    }
+
+    stats_count(&ctx->stats.rounds);
+
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.queries_next = 0;
+    ctx->state.queries_inflight = 0;
+    ctx->state.queries_pending = due_count;
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    launch_queries(ctx);
+}
+
+static void watermark_loaded(cloudWatermarkT * wm, int status, void * closure) {
+    localReplyT * reply = closure;
+    cloudPubCtxT * ctx = reply->ctx;
+    int ix;
+    bool all_loaded;
+
+    // the loads of a previous run do not count
+    pthread_mutex_lock(&ctx->state.lock);
+    if (!ctx->state.in_progress || reply->epoch != ctx->state.run_epoch) {
+        pthread_mutex_unlock(&ctx->state.lock);
+        free(reply);
+        return;
+    }
+    all_loaded = --ctx->state.loads_pending == 0;
+    pthread_mutex_unlock(&ctx->state.lock);
+    free(reply);
+
+    if (status) {
+        AFB_API_WARNING(ctx->api, "no usable watermark for '%s', publishing from the start",
+                        wm->store_key);
+    }
+
+    if (!all_loaded)
+        return;
+
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        ctx->params.cloud_sensors[ix].next_due = 0;
+        if (schedule_reset(ctx, &ctx->params.cloud_sensors[ix]) < 0) {
+            AFB_API_ERROR(ctx->api, "cannot allocate the deferred keys of %s!",
+                          ctx->params.cloud_sensors[ix].class);
+            stop_publication(ctx);
+            return;
+        }
     }
+
+    queue_publication_job(ctx, publication_job_entry, ctx->params.tick);
+    start_retention(ctx);
 }
 
-static void stop_publication_cb (afb_req_t request) {
+// Whether samples may be deleted from the local side: neither a historical
+// sync nor the spool still needs them
+static bool retention_allowed(cloudPubCtxT * ctx) {
+    syncStateT sync_state = ctx->sync.state;
 
-    AFB_REQ_DEBUG(request, "%s called", __func__);
+    return ctx->state.in_progress && ctx->params.retention.enabled && spool_empty(&ctx->params.spool) &&
+           sync_state != SYNC_STATE_SCANNING && sync_state != SYNC_STATE_LOADING &&
+           sync_state != SYNC_STATE_RUNNING;
+}
 
-    if (!current_state.in_progress) {
-        AFB_REQ_ERROR(request, "replication has not been started yet!");
-        afb_req_success_f(request, NULL, "Already stopped");
+static void retention_sync_checked(void *closure, struct json_object *resultJ,
+                                   const char *error, const char * info, afb_api_t api) {
+    cloudPubCtxT * ctx = closure;
+    cloudRetentionT * retention = &ctx->params.retention;
+    cloudSensorT * sensor;
+    const char * finished = NULL;
+    json_object * probe_keysJ = NULL;
+    int64_t acked_to;
+    int64_t deferred_from;
+    int64_t upto;
+    int ix;
+
+    // a historical sync left unfinished, by either engine, still reads the
+    // oldest samples
+    if (!error && json_object_is_type(resultJ, json_type_string))
+        finished = json_object_get_string(resultJ);
+    if (error || (finished && strcmp(finished, "1") != 0)) {
+        retention_end(retention);
+        return;
+    }
+
+    ix = retention->next_class;
+    retention->next_class = (ix + 1) % ctx->params.sensor_count;
+    sensor = &ctx->params.cloud_sensors[ix];
+
+    // only what the cloud side acknowledged is deleted, the deferred keys
+    // holding the class back
+    pthread_mutex_lock(&ctx->state.lock);
+    acked_to = sensor->watermark.horizon;
+    deferred_from = watermark_deferred_from(&sensor->watermark);
+    if (deferred_from != WATERMARK_NONE && deferred_from - 1 < acked_to)
+        acked_to = deferred_from - 1;
+    // the first deletion of the class spans from the oldest sample of its
+    // published keys
+    if (retention->trimmed_to[ix] == RETENTION_NONE && sensor->watermark.marksJ) {
+        probe_keysJ = json_object_new_array();
+        json_object_object_foreach(sensor->watermark.marksJ, key, markJ) {
+            (void)markJ;
+            if (probe_keysJ)
+                json_object_array_add(probe_keysJ, json_object_new_string(key));
+        }
+    }
+    pthread_mutex_unlock(&ctx->state.lock);
+
+    // spooled rounds move the watermark on before the cloud side gets them:
+    // the horizon is only trusted when the spool was empty after reading it
+    upto = retention_bound(retention, ix, acked_to, now_ms());
+    if (upto == RETENTION_NONE || !retention_allowed(ctx)) {
+        json_object_put(probe_keysJ);
+        retention_end(retention);
         return;
     }
-    stop_publication();
-    afb_req_success_f(request, NULL, "Replication stopped");
-    return;
-}
 
-void push_data_reply_cb(void *closure, struct json_object *mResultJ,
-                    const char *error, const char * info, afb_api_t api) {
+    AFB_API_DEBUG(api, "%s: trimming '%s' up to %" PRId64, __func__, sensor->class, upto);
+    retention_trim(retention, api, ctx->params.redis_local_api, ctx->params.redis_cloud_api, ix,
+                   sensor->class, probe_keysJ, !sensor->aggregation.enabled && !sensor->deadband.enabled, upto);
+}
 
-    int err;
-    int delay;
-    void (*job)(int,void*);
+/**
+ * @brief Delete acknowledged samples older than the retention period
+ *
+ * Runs every retention period while the publication runs, deleting the samples
+ * of one class at a time.
+ */
+static void retention_job(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
+    cloudRetentionT * retention = &ctx->params.retention;
+    json_object * argsJ;
 
-    // nothing if stopped
-    if (!current_state.in_progress) {
+    if (signum || !ctx->state.in_progress || !retention->enabled) {
+        retention->job_queued = false;
         return;
     }
 
-    // check status
-    if (error == NULL) {
-        // we are connected: this could be normal execution flow or a reconnection
-        // In any case, we restart publication.
-        json_object_put(current_state.obj);
-        current_state.obj = NULL;
-        job = publication_job_entry;
-        delay = binding_params.publish_freq;
-        current_state.retry_count = 0;
-    }
-    else if (strcmp(error, "disconnected") == 0) {
-        // the cloud side is disconnected: stop the current timer and set the
-        // next job to be a retry, potentially with an updated delay if there was
-        // already a previous disconnection
-        job = repush_job;
-        delay = retryDelays[current_state.retry_count];
-        current_state.retry_count += current_state.retry_count < 
-                        ((sizeof retryDelays / sizeof *retryDelays) - 1);
-
-        AFB_API_NOTICE(current_state.api, "cloud side disconnected, retrying in %d seconds", delay / 1000);
-    }
-    else {
-        // the error is of another unexpected kind
-        AFB_API_ERROR(current_state.api, "failure to call ts_minsert() to publish data [%s]!",
-                      error ? error : "-");
-        stop_publication();
+    if (afb_api_queue_job(ctx->api, retention_job, ctx, 0, -retention->period_ms) < 0) {
+        AFB_API_ERROR(ctx->api, "failure to queue retention job!");
+        retention->job_queued = false;
         return;
     }
 
-    // queue publication job
-    err = afb_api_queue_job(current_state.api, job, 0, 0, -delay);
-    if (err < 0) {
-        AFB_API_ERROR(current_state.api, "failure to queue publication job!");
-        stop_publication();
+    if (!retention_allowed(ctx) || !retention_begin(retention))
+        return;
+
+    if (wrap_json_pack(&argsJ, "{s:s}", "key", ctx->sync.metric_keys[SYNC_METRIC_FINISHED])) {
+        retention_end(retention);
+        return;
     }
+    afb_api_call(ctx->api, ctx->params.redis_local_api, REDIS_VERB_GET, argsJ, retention_sync_checked, ctx);
 }
 
-void push_data() {
-    // nothing if stopped
-    if (!current_state.in_progress) {
+static void start_retention(cloudPubCtxT * ctx) {
+    cloudRetentionT * retention = &ctx->params.retention;
+
+    // the job of a previous run keeps going if not over yet
+    if (!retention->enabled || retention->job_queued)
         return;
-    }
 
-    afb_api_call(current_state.api, binding_params.redis_cloud_api, "ts_minsert",
-                         json_object_get(current_state.obj), push_data_reply_cb, 0);
+    retention->job_queued = true;
+    if (afb_api_queue_job(ctx->api, retention_job, ctx, 0, -retention->period_ms) < 0) {
+        AFB_API_ERROR(ctx->api, "failure to queue retention job!");
+        retention->job_queued = false;
+    }
 }
 
-void ts_mrange_call_cb(void *closure, struct json_object *mRangeResultJ, const char *error, 
-                    const char * info, afb_api_t api) {
-
-    AFB_API_DEBUG(api, "%s: called, retry count: %d, in-progress %d", __func__, 
-                            current_state.retry_count, (int)current_state.in_progress);
+static void trigger_job(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
 
-    // check errors
-    if (error){
-        AFB_API_ERROR(api, "failure to retrieve database records via ts_mrange(): %s [%s]!",
-                      error, info == NULL ? "[no info]": info);
-        stop_publication();
+    if (signum) {
+        AFB_API_ERROR(ctx->api, "signal %s caught in trigger job", strsignal(signum));
+        stop_publication(ctx);
         return;
     }
 
-    // nothing if stopped
-    if (!current_state.in_progress) {
+    if (ctx->state.in_progress && trigger_round_begin(&ctx->params.trigger, now_ms()))
+        publication_job_entry(0, ctx);
+}
+
+/**
+ * @brief Schedule the read of the round following the current one
+ *
+ * One tick later in periodic mode, the tick being adapted to the cloud link
+ * when enabled. In event-driven mode, once enough samples are notified, or
+ * never when the local side stays idle.
+ */
+static void next_round(cloudPubCtxT * ctx) {
+    int delay;
+
+    if (!ctx->params.trigger.enabled) {
+        queue_publication_job(ctx, publication_job_entry,
+                              congestion_tick(&ctx->params.congestion, ctx->params.tick));
         return;
     }
 
-    //AFB_API_DEBUG(api, "ts_mrange() returned %s", json_object_get_string(mRangeResultJ));
-
-    current_state.obj = json_object_get(mRangeResultJ);
-    push_data();
+    delay = trigger_round_end(&ctx->params.trigger, now_ms());
+    if (delay >= 0)
+        queue_publication_job(ctx, trigger_job, delay);
 }
 
-static void repush_job(int signum, void *arg) {
-    static int callCnt = 0;
-    if (signum) {
-        AFB_API_ERROR(current_state.api, "signal %s caught in repush job", strsignal(signum));
-        stop_publication();
-    }
-    else {
-        AFB_API_DEBUG(current_state.api, "repush_job iter %d", ++callCnt);
-        push_data();
-    }
+static void trigger_event_handler(void *closure, const char *event, json_object *dataJ, afb_api_t api) {
+    cloudPubCtxT * ctx = closure;
+    int delay;
+    int ix;
+
+    // notifications do not tell the class of the samples
+    for (ix = 0; ix < ctx->params.sensor_count; ix++)
+        __atomic_store_n(&ctx->params.cloud_sensors[ix].notified, true, __ATOMIC_RELAXED);
+
+    delay = trigger_event(&ctx->params.trigger, dataJ, now_ms());
+    if (ctx->state.in_progress && delay >= 0)
+        queue_publication_job(ctx, trigger_job, delay);
 }
 
-static void publication_job_entry(int signum, void *arg) {
-    int err;
-    static int callCnt = 0;
-    json_object * mrangeArgsJ;
+static void trigger_subscribed(cloudTriggerT * trigger, int status, void * closure) {
+    cloudPubCtxT * ctx = closure;
 
-    if (signum) {
-        AFB_API_ERROR(current_state.api, "signal %s caught in publication job", strsignal(signum));
-        stop_publication();
-    }
-    else {
-        AFB_API_DEBUG(current_state.api, "publication_job_entry iter %d", ++callCnt);
-        err = wrap_json_pack (&mrangeArgsJ, "{ s:s, s:s, s:s }", "class", 
-                              binding_params.cloud_sensors[0].class, 
-                              "fromts", "-", "tots", "+");
-        if (!err) {
-            call_verb_async (current_state.api, binding_params.redis_local_api,
-                             "ts_mrange", mrangeArgsJ, ts_mrange_call_cb, NULL);
-        } else {
-            AFB_API_ERROR(current_state.api, "ts_mrange() argument packing failed!");
-            stop_publication();
-            return;
-        }
-    }
+    if (status == 0)
+        return;
+
+    AFB_API_WARNING(ctx->api, "no sample notification, publishing every %d ms", ctx->params.tick);
+    if (trigger_fallback(trigger) && ctx->state.in_progress)
+        queue_publication_job(ctx, publication_job_entry, ctx->params.tick);
 }
 
 static void start_publication_cb (afb_req_t request) {
     afb_api_t api = afb_req_get_api(request);
-    int err;
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+    localReplyT * reply;
+    unsigned epoch;
+    int ix;
 
     assert (api);
 
     // check state
-    if (current_state.in_progress) {
+    if (ctx->state.in_progress) {
         afb_req_success_f(request, NULL, "already started");
         return;
     }
-    current_state.api = api;
-    current_state.in_progress = true;
-    current_state.retry_count = 0;
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.in_progress = true;
+    ctx->state.retry_count = 0;
+    pthread_mutex_unlock(&ctx->state.lock);
+    ctx->state.sending = false;
+    ctx->state.reader_wait = READER_RUNNING;
+    negotiate_encoding(ctx);
 
 #ifdef BINDING_HAS_RESAMPLING_SUPPORT
-    if (resample_sensor_values (request) != 0)
+    if (resample_sensor_values (ctx, request) != 0)
         return;
 #endif /* BINDING_HAS_RESAMPLING_SUPPORT */
 
-    err = afb_api_queue_job(api, publication_job_entry, 0, 0, -binding_params.publish_freq);
-    if (err < 0) {
-        current_state.in_progress = false;
-        afb_req_fail_f(request,API_REPLY_FAILURE, "queuing publication job failed!");
-        return;
+    // publish what was spooled during a previous run first
+    if (!spool_empty(&ctx->params.spool))
+        start_drain(ctx, 0);
+
+    // what was stored while stopped is published right away, whatever the
+    // trigger
+    trigger_reset(&ctx->params.trigger);
+    if (ctx->params.trigger.enabled) {
+        trigger_subscribe(&ctx->params.trigger, api, ctx->params.redis_local_api,
+                          trigger_event_handler, trigger_subscribed, ctx);
+    }
+
+    // resume from the last acknowledged samples before the first publication
+    pthread_mutex_lock(&ctx->state.lock);
+    ctx->state.loads_pending = ctx->params.sensor_count;
+    epoch = ctx->state.run_epoch;
+    pthread_mutex_unlock(&ctx->state.lock);
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        reply = malloc(sizeof(*reply));
+        if (reply == NULL) {
+            AFB_API_ERROR(api, "cannot allocate a watermark reply closure!");
+            stop_publication(ctx);
+            afb_req_fail_f(request, API_REPLY_FAILURE, "out of memory");
+            return;
+        }
+        reply->ctx = ctx;
+        reply->sensor = &ctx->params.cloud_sensors[ix];
+        reply->epoch = epoch;
+        watermark_load(&ctx->params.cloud_sensors[ix].watermark, api, ctx->params.redis_local_api,
+                       watermark_loaded, reply);
     }
 
     afb_req_success_f(request, NULL, "replication successfully started");
@@ -275,7 +2044,7 @@ static void start_publication_cb (afb_req_t request) {
 }
 
 #ifdef BINDING_HAS_RESAMPLING_SUPPORT
-static int resample_sensor_values (afb_req_t request) {
+static int resample_sensor_values (cloudPubCtxT * ctx, afb_req_t request) {
     afb_api_t api = afb_req_get_api(request);
     int err, idx;
     json_object * aggregArgsJ;
@@ -284,23 +2053,23 @@ static int resample_sensor_values (afb_req_t request) {
     assert (api);
 
     // Loop over sensors and request resampling for each of them
-    for (idx = 0; binding_params.cloud_sensors[idx].class != NULL; idx ++) {
+    for (idx = 0; ctx->params.cloud_sensors[idx].class != NULL; idx ++) {
         err = wrap_json_pack (&aggregArgsJ, "{s:s, s:s, s: {s:s, s:i}}", "name", 
-                            binding_params.cloud_sensors[idx].class_id, "class", 
-                            binding_params.cloud_sensors[idx].class, "aggregation", 
+                            ctx->params.cloud_sensors[idx].class_id, "class", 
+                            ctx->params.cloud_sensors[idx].class, "aggregation", 
                             "type", "avg", "bucket", 500);
         if (err){
-            current_state.in_progress = false;
+            ctx->state.in_progress = false;
             afb_req_fail_f(request, API_REPLY_FAILURE, 
                            "aggregation argument packing failed [idx:%d]!", idx);
             return -1; 
         }
 
         // Request resampling being done for all future records
-        err = call_verb_sync (api, binding_params.redis_local_api, "ts_maggregate", 
+        err = call_verb_sync (api, ctx->params.redis_local_api, "ts_maggregate", 
                               aggregArgsJ, &disconnected);
         if (err) {
-            current_state.in_progress = false;
+            ctx->state.in_progress = false;
             afb_req_fail_f(request,API_REPLY_FAILURE, 
                            "redis resampling request failed [idx:%d]!", idx);
             return -1;
@@ -371,13 +2140,194 @@ static void call_verb_async (afb_api_t api, const char * apiToCall, const char *
     AFB_API_DEBUG(api, "%s: %s/%s async call performed", __func__, apiToCall, verbToCall);
 }
 
+static void sync_start_cb (afb_req_t request) {
+    afb_api_t api = afb_req_get_api(request);
+    cloudPubCtxT * ctx = afb_api_get_userdata(api);
+
+    if (sync_start(&ctx->sync, api, ctx->params.redis_local_api,
+                   ctx->params.redis_cloud_api, &ctx->params.backoff) < 0) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "sync already in progress or cannot be started!");
+        return;
+    }
+
+    afb_req_success_f(request, NULL, "sync started");
+}
+
+static void sync_stop_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    if (sync_stop(&ctx->sync) < 0) {
+        afb_req_success_f(request, NULL, "Already stopped");
+        return;
+    }
+
+    afb_req_success_f(request, NULL, "sync stopping");
+}
+
+static void sync_status_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * statusJ = sync_status(&ctx->sync);
+
+    if (statusJ == NULL) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "sync status packing failed!");
+        return;
+    }
+    afb_req_success_f(request, statusJ, NULL);
+}
+
+static void spool_status_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * statusJ = spool_status(&ctx->params.spool);
+
+    if (statusJ == NULL) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "spool status packing failed!");
+        return;
+    }
+    afb_req_success_f(request, statusJ, NULL);
+}
+
+static void compression_status_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * statusJ = compress_status(&ctx->params.compressor);
+
+    if (statusJ == NULL) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "compression status packing failed!");
+        return;
+    }
+    afb_req_success_f(request, statusJ, NULL);
+}
+
+static void bandwidth_set_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * argsJ = afb_req_json(request);
+    const char * level = NULL;
+    bool was_paused = bandwidth_paused(&ctx->params.bandwidth);
+    int64_t now;
+    int delay;
+
+    // the level is given as is or as a "level" field
+    if (json_object_is_type(argsJ, json_type_string))
+        level = json_object_get_string(argsJ);
+    else
+        wrap_json_unpack(argsJ, "{s:s}", "level", &level);
+
+    if (level == NULL || bandwidth_set_level(&ctx->params.bandwidth, level) < 0) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "invalid bandwidth level, expecting none/low/medium/high!");
+        return;
+    }
+
+    AFB_REQ_NOTICE(request, "bandwidth level set to %s", level);
+
+    // event-driven rounds skipped while paused are run now
+    if (was_paused && !bandwidth_paused(&ctx->params.bandwidth) && ctx->state.in_progress &&
+        ctx->params.trigger.enabled) {
+        now = now_ms();
+        delay = trigger_defer(&ctx->params.trigger, now, now);
+        if (delay >= 0)
+            queue_publication_job(ctx, trigger_job, delay);
+    }
+
+    afb_req_success_f(request, NULL, "bandwidth level updated");
+}
+
+static void bandwidth_get_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * statusJ = bandwidth_status(&ctx->params.bandwidth);
+
+    if (statusJ == NULL) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "bandwidth status packing failed!");
+        return;
+    }
+    afb_req_success_f(request, statusJ, NULL);
+}
+
+// Statistics, along with the lag of each class: now minus its watermark
+static json_object * ctx_stats(cloudPubCtxT * ctx) {
+    json_object * statsJ;
+    json_object * lagsJ;
+    int64_t now = now_ms();
+    uint64_t filtered = 0;
+    int ix;
+
+    statsJ = stats_to_json(&ctx->stats);
+    lagsJ = json_object_new_object();
+    if (statsJ == NULL || lagsJ == NULL) {
+        json_object_put(statsJ);
+        json_object_put(lagsJ);
+        return NULL;
+    }
+
+    for (ix = 0; ix < ctx->params.sensor_count; ix++) {
+        cloudWatermarkT * wm = &ctx->params.cloud_sensors[ix].watermark;
+
+        json_object_object_add(lagsJ, ctx->params.cloud_sensors[ix].class, wm->horizon == WATERMARK_NONE ?
+                               NULL : json_object_new_int64(now - wm->horizon));
+        filtered += ctx->params.cloud_sensors[ix].deadband.dropped;
+    }
+    json_object_object_add(statsJ, "lag_ms", lagsJ);
+    json_object_object_add(statsJ, "samples_filtered", json_object_new_int64((int64_t)filtered));
+    json_object_object_add(statsJ, "congestion", congestion_status(&ctx->params.congestion));
+    json_object_object_add(statsJ, "duplicate_batches",
+                           json_object_new_int64((int64_t)ctx->params.idempotence.duplicates));
+    json_object_object_add(statsJ, "retention", retention_status(&ctx->params.retention));
+    return statsJ;
+}
+
+static void stats_event_job(int signum, void *arg) {
+    cloudPubCtxT * ctx = arg;
+    json_object * statsJ;
+
+    // stop pushing once nobody listens anymore
+    statsJ = signum ? NULL : ctx_stats(ctx);
+    if (statsJ == NULL || afb_event_push(ctx->stats.event, statsJ) <= 0 ||
+        afb_api_queue_job(ctx->api, stats_event_job, ctx, 0, -ctx->stats.event_period_ms) < 0)
+        ctx->stats.event_running = false;
+}
+
+static void stats_cb (afb_req_t request) {
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
+    json_object * statsJ;
+    int subscribe = 0;
+    int unsubscribe = 0;
+
+    if (wrap_json_unpack(afb_req_json(request), "{s?:b, s?:b}", "subscribe", &subscribe,
+                         "unsubscribe", &unsubscribe) == 0 && (subscribe || unsubscribe)) {
+        if (!afb_event_is_valid(ctx->stats.event)) {
+            afb_req_fail_f(request, API_REPLY_FAILURE, "stats event disabled, see 'event_period_ms'!");
+            return;
+        }
+        if (unsubscribe) {
+            afb_req_unsubscribe(request, ctx->stats.event);
+            afb_req_success_f(request, NULL, "unsubscribed");
+            return;
+        }
+        if (afb_req_subscribe(request, ctx->stats.event) < 0) {
+            afb_req_fail_f(request, API_REPLY_FAILURE, "stats event subscription failed!");
+            return;
+        }
+        if (!ctx->stats.event_running) {
+            ctx->stats.event_running = true;
+            if (afb_api_queue_job(ctx->api, stats_event_job, ctx, 0, -ctx->stats.event_period_ms) < 0)
+                ctx->stats.event_running = false;
+        }
+    }
+
+    statsJ = ctx_stats(ctx);
+    if (statsJ == NULL) {
+        afb_req_fail_f(request, API_REPLY_FAILURE, "stats packing failed!");
+        return;
+    }
+    afb_req_success_f(request, statsJ, NULL);
+}
+
 static void ping_cb (afb_req_t request) {
-    static int count=0;
+    cloudPubCtxT * ctx = afb_api_get_userdata(afb_req_get_api(request));
     char response[PING_VERB_RESPONSE_SIZE];
     json_object *queryJ =  afb_req_json(request);
+    int count;
 
-    snprintf (response, sizeof(response), "Pong=%d", count++);
-    AFB_API_NOTICE (request->api, "%s:ping count=%d query=%s", afb_api_name(request->api), count, json_object_get_string(queryJ));
+    count = __atomic_fetch_add(&ctx->ping_count, 1, __ATOMIC_RELAXED);
+    snprintf (response, sizeof(response), "Pong=%d", count);
+    AFB_API_NOTICE (request->api, "%s:ping count=%d query=%s", afb_api_name(request->api), count + 1, json_object_get_string(queryJ));
     afb_req_success_f(request, json_object_new_string(response), NULL);
 
     return;
@@ -402,40 +2352,126 @@ static afb_verb_t CtrlApiVerbs[] = {
     { .verb = "info",     .callback = info_cb, .info = "Cloud publication info request"},
     { .verb = "start",     .callback = start_publication_cb     , .info = "Start cloud publication"},
     { .verb = "stop",     .callback = stop_publication_cb     , .info = "Stop cloud publication"},
+    { .verb = "sync/start", .callback = sync_start_cb , .info = "Start historical database synchronization"},
+    { .verb = "sync/stop",  .callback = sync_stop_cb  , .info = "Stop historical database synchronization"},
+    { .verb = "sync/status", .callback = sync_status_cb, .info = "Historical database synchronization status"},
+    { .verb = "spool/status", .callback = spool_status_cb, .info = "Offline spool status"},
+    { .verb = "compression/status", .callback = compression_status_cb, .info = "Payload compression statistics"},
+    { .verb = "bandwidth/set", .callback = bandwidth_set_cb, .info = "Set bandwidth level (high/medium/low/none)"},
+    { .verb = "bandwidth/get", .callback = bandwidth_get_cb, .info = "Get current bandwidth level"},
+    { .verb = "stats",     .callback = stats_cb , .info = "Live publication statistics"},
     { .verb = NULL} /* marker for end of the array */
 };
 
-static int cloud_config(afb_api_t api, CtlSectionT *section, json_object *cloudSectionJ) {
+static int process_required_apis (afb_api_t api, json_object * requireJ, const char ** redis_cloud_api,
+                                  const char ** redis_local_api);
+
+/**
+ * @brief Parse the configuration of one publication context
+ *
+ * @param api - the API serving the context
+ * @param ctx - the context, whose Redis APIs are set to the defaults
+ * @param cloudSectionJ - the context entry of the 'cloud-pub' section
+ * @param scope - the context name scoping its persisted state, NULL for the
+ *                first context
+ * @return 0 on success, -1 on error
+ */
+static int ctx_config(afb_api_t api, cloudPubCtxT * ctx, json_object * cloudSectionJ, const char * scope) {
 
     size_t count;
     int err;
     int ix;
-    static bool config_call = true;
     json_object * sensorsJ;
-
-    // first call is config call, we want to check if the config has a problem
-    // second call is exec call, the section pointer will be NULL
-    if (config_call) {
-        if (cloudSectionJ == NULL) {
-            AFB_API_ERROR(api, "cloud binding configuration section is NULL!");
-            goto error_exit;
-        }
-        config_call = false;
-    } else {
-        return 0; // is done, nothing to do
-    }
+    json_object * syncJ = NULL;
+    json_object * spoolJ = NULL;
+    json_object * compressionJ = NULL;
+    json_object * bandwidthJ = NULL;
+    json_object * statsJ = NULL;
+    json_object * triggerJ = NULL;
+    json_object * retryJ = NULL;
+    json_object * congestionJ = NULL;
+    json_object * retentionJ = NULL;
+    json_object * aggregationJ;
+    json_object * deadbandJ;
+    const char * encoding = "json";
+    int idempotent = 0;
+    const char * redis_cloud_api = NULL;
+    const char * redis_local_api = NULL;
 
     AFB_API_DEBUG (api, "%s: parsing cloud publication binding configuration", __func__);
 
-    err = wrap_json_unpack(cloudSectionJ, "{s:i, s:s, s:o}", "publish_frequency_ms", 
-                           &binding_params.publish_freq, "autostart", 
-                           &binding_params.autostart, "sensors", &sensorsJ);
+    ctx->params.max_inflight_queries = DEFAULT_MAX_INFLIGHT_QUERIES;
+    ctx->params.max_samples_per_batch = DEFAULT_MAX_SAMPLES_PER_BATCH;
+    ctx->params.max_bytes_per_batch = DEFAULT_MAX_BYTES_PER_BATCH;
+    ctx->params.max_inflight_batches = DEFAULT_MAX_INFLIGHT_BATCHES;
+    ctx->params.pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+
+    err = wrap_json_unpack(cloudSectionJ, "{s:i, s:s, s:o, s?:i, s?:i, s?:i, s?:i, s?:o, s?:o, s?:s, s?:o, s?:o, s?:s, s?:s, s?:o, s?:o, s?:o, s?:o, s?:b, s?:i, s?:o}", "publish_frequency_ms", 
+                           &ctx->params.publish_freq, "autostart", 
+                           &ctx->params.autostart, "sensors", &sensorsJ,
+                           "max_inflight_queries", &ctx->params.max_inflight_queries,
+                           "max_samples_per_batch", &ctx->params.max_samples_per_batch,
+                           "max_bytes_per_batch", &ctx->params.max_bytes_per_batch,
+                           "max_inflight_batches", &ctx->params.max_inflight_batches,
+                           "sync", &syncJ, "spool", &spoolJ, "encoding", &encoding,
+                           "compression", &compressionJ, "bandwidth", &bandwidthJ,
+                           "cloud_api", &redis_cloud_api, "local_api", &redis_local_api,
+                           "stats", &statsJ, "trigger", &triggerJ, "retry", &retryJ,
+                           "congestion", &congestionJ, "idempotent", &idempotent,
+                           "pipeline_depth", &ctx->params.pipeline_depth, "retention", &retentionJ);
     if (err) {
         AFB_API_ERROR(api, "Cannot parse JSON config at '%s'. Error is: %s", 
                       json_object_to_json_string(cloudSectionJ), wrap_json_get_error_string(err));
         goto error_exit;
     }
 
+    // the Redis APIs of the metadata 'require' entry may be overridden
+    if (redis_cloud_api) {
+        ctx->params.redis_cloud_api = redis_cloud_api;
+        if (afb_api_require_api(api, redis_cloud_api, 0) < 0) {
+            AFB_API_ERROR(api, "Cannot require cloud API '%s'!", redis_cloud_api);
+            goto error_exit;
+        }
+    }
+    if (redis_local_api) {
+        ctx->params.redis_local_api = redis_local_api;
+        if (afb_api_require_api(api, redis_local_api, 0) < 0) {
+            AFB_API_ERROR(api, "Cannot require local API '%s'!", redis_local_api);
+            goto error_exit;
+        }
+    }
+
+    if (ctx->params.publish_freq <= 0 || ctx->params.max_inflight_queries <= 0) {
+        AFB_API_ERROR(api, "Publication frequency and in-flight query limit must be positive!");
+        goto error_exit;
+    }
+
+    if (ctx->params.max_samples_per_batch < 0 || ctx->params.max_bytes_per_batch < 0 ||
+        ctx->params.max_inflight_batches <= 0) {
+        AFB_API_ERROR(api, "Batch limits must be positive or zero, and in-flight batch limit positive!");
+        goto error_exit;
+    }
+
+    if (ctx->params.pipeline_depth <= 0) {
+        AFB_API_ERROR(api, "Pipeline depth must be positive!");
+        goto error_exit;
+    }
+    if (ring_init(&ctx->state.ready, (size_t)ctx->params.pipeline_depth) < 0) {
+        AFB_API_ERROR(api, "Cannot allocate the ring of staged rounds: %s", strerror(errno));
+        goto error_exit;
+    }
+
+    if (strcmp(encoding, "json") == 0) {
+        ctx->params.encoding = ENCODING_JSON;
+    } else if (strcmp(encoding, "auto") == 0) {
+        ctx->params.encoding = ENCODING_AUTO;
+    } else if (strcmp(encoding, "gorilla") == 0) {
+        ctx->params.encoding = ENCODING_GORILLA;
+    } else {
+        AFB_API_ERROR(api, "Invalid encoding '%s', expecting 'json', 'auto' or 'gorilla'", encoding);
+        goto error_exit;
+    }
+
     if (!json_object_is_type(sensorsJ, json_type_array)) {
         AFB_API_ERROR(api, "Sensor configuration must be an array! Found %s instead.", 
                       json_object_to_json_string(sensorsJ));
@@ -448,35 +2484,103 @@ static int cloud_config(afb_api_t api, CtlSectionT *section, json_object *cloudS
                       json_object_to_json_string(sensorsJ));
         goto error_exit;
     } else {
-        binding_params.cloud_sensors = calloc (count + 1, sizeof (cloudSensorT));
-        if (binding_params.cloud_sensors == NULL) {
+        ctx->params.cloud_sensors = calloc (count + 1, sizeof (cloudSensorT));
+        if (ctx->params.cloud_sensors == NULL) {
             AFB_API_ERROR(api, "Cannot allocate array for sensor configuration: %s", strerror (errno));
             goto error_exit;
             }
+        ctx->params.sensor_count = (int)count;
     }
 
+    // the scheduler ticks at the pace of the fastest class
+    ctx->params.tick = ctx->params.publish_freq;
+
     for (ix = 0 ; ix < count; ix++) {
         json_object * obj = json_object_array_get_idx(sensorsJ, ix);
 
-        err = wrap_json_unpack(obj, "{s:s !}", "class", &binding_params.cloud_sensors[ix].class);
+        // classes are published at the global frequency unless told otherwise
+        ctx->params.cloud_sensors[ix].publish_period = ctx->params.publish_freq;
+
+        aggregationJ = NULL;
+        deadbandJ = NULL;
+        err = wrap_json_unpack(obj, "{s:s, s?:i, s?:o, s?:o !}", "class", &ctx->params.cloud_sensors[ix].class,
+                               "publish_period_ms", &ctx->params.cloud_sensors[ix].publish_period,
+                               "aggregation", &aggregationJ, "deadband", &deadbandJ);
         if (err) {
             AFB_API_ERROR(api, "Cannot parse sensor config at '%s'. Error is: %s", 
                         json_object_to_json_string(obj), wrap_json_get_error_string(err));
             goto error_exit;
         }
+        if (ctx->params.cloud_sensors[ix].publish_period <= 0) {
+            AFB_API_ERROR(api, "Invalid publication period for sensor '%s'",
+                          ctx->params.cloud_sensors[ix].class);
+            goto error_exit;
+        }
+        if (ctx->params.cloud_sensors[ix].publish_period < ctx->params.tick)
+            ctx->params.tick = ctx->params.cloud_sensors[ix].publish_period;
+        if (aggregate_config(api, &ctx->params.cloud_sensors[ix].aggregation, aggregationJ) < 0)
+            goto error_exit;
+        if (deadband_config(api, &ctx->params.cloud_sensors[ix].deadband, deadbandJ) < 0)
+            goto error_exit;
         // substract 3 bytes for ID suffix
-        snprintf(binding_params.cloud_sensors[ix].class_id, SENSOR_CLASS_ID_MAX_LEN-3, "ID-%s", 
-                 binding_params.cloud_sensors[ix].class); 
+        snprintf(ctx->params.cloud_sensors[ix].class_id, SENSOR_CLASS_ID_MAX_LEN-3, "ID-%s", 
+                 ctx->params.cloud_sensors[ix].class); 
+
+        ctx->params.cloud_sensors[ix].read_to = WATERMARK_NONE;
+        ctx->params.cloud_sensors[ix].catch_up = WATERMARK_NONE;
+        if (watermark_init(&ctx->params.cloud_sensors[ix].watermark, scope,
+                           ctx->params.cloud_sensors[ix].class) < 0) {
+            AFB_API_ERROR(api, "Cannot allocate watermark for sensor '%s'",
+                          ctx->params.cloud_sensors[ix].class);
+            goto error_exit;
+        }
     }
 
+    // historical sync defaults to the first sensor class
+    if (sync_config(api, &ctx->sync, syncJ, ctx->params.cloud_sensors[0].class, scope) < 0)
+        goto error_exit;
+
+    // samples are spooled to disk while the cloud side is away, if configured
+    if (spool_config(api, &ctx->params.spool, spoolJ) < 0 || spool_open(&ctx->params.spool) < 0)
+        goto error_exit;
+
+    if (compress_config(api, &ctx->params.compressor, compressionJ) < 0)
+        goto error_exit;
+
+    if (bandwidth_config(api, &ctx->params.bandwidth, bandwidthJ) < 0)
+        goto error_exit;
+
+    if (trigger_config(api, &ctx->params.trigger, triggerJ, ctx->params.publish_freq) < 0)
+        goto error_exit;
+
+    if (backoff_config(api, &ctx->params.backoff, retryJ) < 0)
+        goto error_exit;
+
+    if (congestion_config(api, &ctx->params.congestion, congestionJ, ctx->params.tick,
+                          ctx->params.max_bytes_per_batch ? ctx->params.max_bytes_per_batch :
+                          DEFAULT_MAX_BYTES_PER_BATCH) < 0)
+        goto error_exit;
+
+    if (stats_config(api, &ctx->stats, statsJ, ctx->params.backoff.levels) < 0)
+        goto error_exit;
+
+    if (retention_config(api, &ctx->params.retention, retentionJ, ctx->params.sensor_count) < 0)
+        goto error_exit;
+
+    // batch IDs are unique to this context and binder run
+    idempotent_init(&ctx->params.idempotence, idempotent, scope ? scope : afb_api_name(api));
+
     // Visual inspection of parameters 
-    AFB_API_DEBUG(api, "Publishing data every %d ms", binding_params.publish_freq);
+    AFB_API_DEBUG(api, "Publishing from '%s' to '%s'", ctx->params.redis_local_api, ctx->params.redis_cloud_api);
+    AFB_API_DEBUG(api, "Publishing data every %d ms (scheduler tick: %d ms, %d queries in flight)",
+                  ctx->params.publish_freq, ctx->params.tick, ctx->params.max_inflight_queries);
     AFB_API_DEBUG(api, "Binding autostart is: %s", 
-                  strcmp(binding_params.autostart, "yes") ? "disabled": "enabled");
-    for (ix = 0; binding_params.cloud_sensors[ix].class; ix++) {
-        AFB_API_DEBUG(api, "Publishing data for sensor %d: %s - %s", ix, 
-                      binding_params.cloud_sensors[ix].class, 
-                      binding_params.cloud_sensors[ix].class_id);
+                  strcmp(ctx->params.autostart, "yes") ? "disabled": "enabled");
+    for (ix = 0; ctx->params.cloud_sensors[ix].class; ix++) {
+        AFB_API_DEBUG(api, "Publishing data for sensor %d: %s - %s every %d ms", ix, 
+                      ctx->params.cloud_sensors[ix].class, 
+                      ctx->params.cloud_sensors[ix].class_id,
+                      ctx->params.cloud_sensors[ix].publish_period);
     }
 
     return 0;
@@ -484,6 +2588,109 @@ error_exit:
     return -1;
 }
 
+static cloudPubCtxT * ctx_new(afb_api_t api, const char * redis_cloud_api, const char * redis_local_api) {
+    cloudPubCtxT * ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->api = api;
+    pthread_mutex_init(&ctx->state.lock, NULL);
+    ctx->params.redis_cloud_api = redis_cloud_api;
+    ctx->params.redis_local_api = redis_local_api;
+    return ctx;
+}
+
+// Pre-initialization of the APIs of the contexts after the first one
+static int ctx_preinit(void * closure, afb_api_t api) {
+    cloudPubCtxT * ctx = closure;
+
+    ctx->api = api;
+    afb_api_set_userdata(api, ctx);
+
+    if (ctx_config(api, ctx, ctx->configJ, afb_api_name(api)) < 0)
+        return -1;
+    ctx->configJ = NULL;
+
+    if (afb_api_set_verbs_v3(api, CtrlApiVerbs) < 0) {
+        AFB_API_ERROR(api, "fail to register static API verbs");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Create the publication contexts of the 'cloud-pub' section
+ *
+ * The section is either one context configuration or an array of them. The
+ * first context is served by the binding API, each of the others by the API
+ * named by its "api" key.
+ */
+static int cloud_config(afb_api_t api, CtlSectionT *section, json_object *cloudSectionJ) {
+    CtlConfigT * ctrlConfig;
+    cloudPubCtxT * ctx;
+    json_object * entryJ;
+    const char * redis_cloud_api;
+    const char * redis_local_api;
+    const char * name;
+    const char * info;
+    size_t count, ix;
+
+    // the exec call comes once the contexts are configured: nothing to do
+    if (section->handle)
+        return 0;
+
+    if (cloudSectionJ == NULL) {
+        AFB_API_ERROR(api, "cloud binding configuration section is NULL!");
+        return -1;
+    }
+
+    // during the config call, the API userdata is the controller configuration
+    ctrlConfig = afb_api_get_userdata(api);
+    if (process_required_apis(api, ctrlConfig->requireJ, &redis_cloud_api, &redis_local_api) != 0)
+        return -1;
+
+    count = json_object_is_type(cloudSectionJ, json_type_array) ? json_object_array_length(cloudSectionJ) : 1;
+    if (count == 0) {
+        AFB_API_ERROR(api, "cloud binding configuration section is empty!");
+        return -1;
+    }
+
+    for (ix = 0; ix < count; ix++) {
+        entryJ = json_object_is_type(cloudSectionJ, json_type_array) ?
+                 json_object_array_get_idx(cloudSectionJ, ix) : cloudSectionJ;
+
+        ctx = ctx_new(api, redis_cloud_api, redis_local_api);
+        if (ctx == NULL) {
+            AFB_API_ERROR(api, "Cannot allocate publication context: %s", strerror (errno));
+            return -1;
+        }
+
+        if (ix == 0) {
+            if (ctx_config(api, ctx, entryJ, NULL) < 0)
+                return -1;
+            section->handle = ctx;
+            continue;
+        }
+
+        info = "Redpesk cloud publication service";
+        if (wrap_json_unpack(entryJ, "{s:s, s?:s}", "api", &name, "info", &info)) {
+            AFB_API_ERROR(api, "Publication context %zu must have an 'api' name!", ix);
+            return -1;
+        }
+
+        ctx->configJ = entryJ;
+        if (afb_api_new_api(api, name, info, 0, ctx_preinit, ctx) == NULL) {
+            AFB_API_ERROR(api, "Cannot create publication context API '%s'", name);
+            return -1;
+        }
+        AFB_API_NOTICE(api, "Publication context API '%s' created", name);
+    }
+
+    return 0;
+}
+
 static int CtrlInitOneApiCloud(afb_api_t api) {
     int err = 0;
 
@@ -496,8 +2703,8 @@ static int CtrlInitOneApiCloud(afb_api_t api) {
         return err;
     }
 
-    // make userdata available to API users
-    afb_api_set_userdata (api, NULL);
+    // from now on, the API userdata is the publication context
+    afb_api_set_userdata (api, ctrlStaticSectionsCloud[0].handle);
     return err;
 }
 
@@ -526,12 +2733,13 @@ static int CtrlLoadOneApiCloud(void* vcbdata, afb_api_t api) {
  * @return -1 if there was any error in the parameter structure or a parsing error
  */
 
-static int process_required_apis (afb_api_t api, json_object * requireJ) {
+static int process_required_apis (afb_api_t api, json_object * requireJ, const char ** redis_cloud_api,
+                                  const char ** redis_local_api) {
     // Check required APIs
     // By convention, the first entry is the cloud side, the second one is the local side
 
-    json_object * redis_cloud_api;
-    json_object * redis_local_api;
+    json_object * redis_cloud_apiJ;
+    json_object * redis_local_apiJ;
 
     if (requireJ == NULL) {
         AFB_API_ERROR(api, "could not find a 'require' entry in binding 'metadata' section!");
@@ -550,27 +2758,27 @@ static int process_required_apis (afb_api_t api, json_object * requireJ) {
         goto _error;
     }
 
-    redis_cloud_api = json_object_array_get_idx(requireJ,0);
-    redis_local_api = json_object_array_get_idx(requireJ,1);
+    redis_cloud_apiJ = json_object_array_get_idx(requireJ,0);
+    redis_local_apiJ = json_object_array_get_idx(requireJ,1);
 
-    if (redis_cloud_api == NULL || redis_local_api == NULL) {
+    if (redis_cloud_apiJ == NULL || redis_local_apiJ == NULL) {
         AFB_API_ERROR(api, "Cannot retrieve binding required APIs from %s", 
                       json_object_to_json_string(requireJ));
         goto _error;
     }
 
-    binding_params.redis_local_api = json_object_get_string(redis_local_api);
-    binding_params.redis_cloud_api = json_object_get_string(redis_cloud_api);
+    *redis_local_api = json_object_get_string(redis_local_apiJ);
+    *redis_cloud_api = json_object_get_string(redis_cloud_apiJ);
 
-    if (binding_params.redis_cloud_api == NULL || \
-        binding_params.redis_local_api == NULL) {
+    if (*redis_cloud_api == NULL || \
+        *redis_local_api == NULL) {
         AFB_API_ERROR(api, "Cannot process binding required APIs info from %s", 
                       json_object_to_json_string(requireJ));
         goto _error;
     }
 
-    AFB_API_DEBUG(api, "Redis cloud API name is '%s'", binding_params.redis_cloud_api);
-    AFB_API_DEBUG(api, "Redis local API name is '%s'", binding_params.redis_local_api);
+    AFB_API_DEBUG(api, "Redis cloud API name is '%s'", *redis_cloud_api);
+    AFB_API_DEBUG(api, "Redis local API name is '%s'", *redis_local_api);
     return 0;
 
 _error:
@@ -607,11 +2815,6 @@ int afbBindingEntry(afb_api_t api) {
 
     AFB_API_NOTICE(api, "Controller API='%s' info='%s'", ctrlConfig->api, ctrlConfig->info);
 
-    if (process_required_apis(api, ctrlConfig->requireJ) != 0) {
-        status = ERROR;
-        goto _exit_afbBindingEntry;
-    }
-
     handle = afb_api_new_api(api, ctrlConfig->api, ctrlConfig->info, 0, CtrlLoadOneApiCloud, ctrlConfig);
     if (!handle){
         AFB_API_ERROR(api, "afbBindingEntry failed to create API");
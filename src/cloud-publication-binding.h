@@ -29,6 +29,8 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #define  AFB_BINDING_VERSION 3
 #include <afb/afb-binding.h>
@@ -38,6 +40,86 @@
   #define ERROR -1
 #endif
 
+// Plain (non time series) key verbs of the redis binding, used to persist the
+// publication state on the local side. Arguments are { "key": ..., "value": ... }
+// and 'get' replies with the stored string, or null if the key does not exist.
+#define REDIS_VERB_GET "get"
+#define REDIS_VERB_SET "set"
+#define REDIS_VERB_DEL "del"
+
+// Key and time series introspection verbs of the redis binding:
+// - 'keys' takes { "pattern": ... } and replies with an array of key names
+// - 'ts_info' takes { "key": ... } and replies with { "first_timestamp": ...,
+//   "last_timestamp": ..., "total_samples": ... }
+#define REDIS_VERB_KEYS "keys"
+#define REDIS_VERB_TS_INFO "ts_info"
+
+// Time series creation verbs of the redis binding, used to prepare the cloud
+// side keys before a historical sync:
+// - 'ts_create' takes { "key": ..., "labels": { ... }, "duplicate_policy": ... }
+// - 'ts_createrule' takes { "source": ..., "dest": ..., "aggregation":
+//   { "type": ..., "bucket": ... } }
+// Both fail, with the RedisTimeSeries error as info, when the key or rule
+// exists.
+#define REDIS_VERB_TS_CREATE "ts_create"
+#define REDIS_VERB_TS_CREATERULE "ts_createrule"
+
+// RedisTimeSeries errors, forwarded by the redis binding as the info of the
+// failed calls, prefixed with "ERR "
+#define REDIS_TSDB_KEY_EXISTS "TSDB: key already exists"
+#define REDIS_TSDB_RULE_EXISTS "TSDB: the destination key already has a src rule"
+// TS.MADD of a sample already stored, by a key with the BLOCK duplicate policy
+#define REDIS_TSDB_UPSERT_BLOCKED "TSDB: Error at upsert, update is not supported when DUPLICATE_POLICY is set to BLOCK mode"
+
+// Packed sample encodings of the cloud side:
+// - 'ts_encodings' takes no argument and replies with the array of the
+//   encodings 'ts_minsert_encoded' accepts, e.g. [ "gorilla/1" ]
+// - 'ts_minsert_encoded' takes a ts_minsert() argument object packed by
+//   codec_encode_minsert_args()
+#define REDIS_VERB_TS_ENCODINGS "ts_encodings"
+#define REDIS_VERB_TS_MINSERT_ENCODED "ts_minsert_encoded"
+
+// Compressed calls of the cloud side: 'ts_compressed' takes the compressed
+// arguments of another verb, built by compress_wrap()
+#define REDIS_VERB_TS_COMPRESSED "ts_compressed"
+
+// Errors of the cloud side telling that it does not serve a verb, or the
+// content it was given (codec, encoding, wrapped verb): the binding then falls
+// back to plainer calls. Other errors of these verbs are taken as transient.
+#define REDIS_ERROR_UNKNOWN_VERB "unknown-verb"
+#define REDIS_ERROR_UNSUPPORTED "unsupported"
+
+// Identified batches of the cloud side: 'ts_batch' takes the arguments of
+// another verb along with a batch ID and the sample ranges they hold, built by
+// idempotent_wrap(), and replies with { "duplicate": true } when the batch was
+// already applied
+#define REDIS_VERB_TS_BATCH "ts_batch"
+
+// Sample deletion of the local side: 'ts_mdel' takes { "class": ..., "fromts":
+// ..., "tots": ... } as ts_mrange() does, and deletes the samples of the keys
+// of the class within these bounds
+#define REDIS_VERB_TS_MDEL "ts_mdel"
+
 extern const char * info_verbS;
 
+static inline int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic clock in microseconds, for durations
+// Whether a failed call reported a given RedisTimeSeries error
+static inline bool redis_tsdb_error(const char * error, const char * info, const char * tsdb_error) {
+    return (error && strstr(error, tsdb_error)) || (info && strstr(info, tsdb_error));
+}
+
+static inline int64_t mono_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif /* _CLOUD_PUB_BINDING_ */
@@ -0,0 +1,599 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+/*
+ * Packed sample codec.
+ *
+ * A packed series starts with its sample count as an unsigned LEB128 varint,
+ * followed by a bit stream, most significant bit first:
+ * - the first timestamp and value, as raw 64-bit words;
+ * - then for every other sample, the timestamp delta-of-delta in a
+ *   variable-length bucket ('0', '10' + 7 bits, '110' + 9 bits, '1110' +
+ *   12 bits or '1111' + 64 bits, two's complement), followed by the XOR of the
+ *   value with the previous one ('0' when equal, '10' + the meaningful bits
+ *   when they fit in the previous window, '11' + 5 bits of leading zeros +
+ *   6 bits of length - 1 + the meaningful bits otherwise).
+ *
+ * Regularly sampled, slowly changing sensors thus cost a few bits per sample
+ * instead of tens of bytes in JSON.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cloud-publication-codec.h"
+#include "cloud-publication-batch.h"
+
+#define CODEC_INITIAL_SIZE 64
+#define CODEC_NO_WINDOW 0xff
+
+typedef struct bitWriter {
+    uint8_t * data;
+    size_t capacity;
+    size_t bits;
+} bitWriterT;
+
+typedef struct bitReader {
+    const uint8_t * data;
+    size_t size;
+    size_t bits;
+} bitReaderT;
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int bw_reserve(bitWriterT * bw, size_t bits) {
+    size_t needed = (bw->bits + bits + 7) / 8;
+    size_t capacity;
+    uint8_t * data;
+
+    if (needed <= bw->capacity)
+        return 0;
+
+    capacity = bw->capacity ? bw->capacity : CODEC_INITIAL_SIZE;
+    while (capacity < needed)
+        capacity *= 2;
+
+    data = realloc(bw->data, capacity);
+    if (data == NULL)
+        return -1;
+    memset(data + bw->capacity, 0, capacity - bw->capacity);
+    bw->data = data;
+    bw->capacity = capacity;
+    return 0;
+}
+
+static int bw_put(bitWriterT * bw, uint64_t value, unsigned nbits) {
+    unsigned room, take;
+    uint64_t chunk;
+
+    if (bw_reserve(bw, nbits) < 0)
+        return -1;
+
+    while (nbits > 0) {
+        room = 8 - (unsigned)(bw->bits % 8);
+        take = nbits < room ? nbits : room;
+        chunk = (value >> (nbits - take)) & ((1u << take) - 1);
+        bw->data[bw->bits / 8] |= (uint8_t)(chunk << (room - take));
+        bw->bits += take;
+        nbits -= take;
+    }
+    return 0;
+}
+
+static int bw_put_varint(bitWriterT * bw, uint64_t value) {
+    do {
+        if (bw_put(bw, (value & 0x7f) | (value > 0x7f ? 0x80 : 0), 8) < 0)
+            return -1;
+        value >>= 7;
+    } while (value);
+    return 0;
+}
+
+static int br_get(bitReaderT * br, unsigned nbits, uint64_t * value) {
+    unsigned room, take;
+
+    if (br->bits + nbits > br->size * 8)
+        return -1;
+
+    *value = 0;
+    while (nbits > 0) {
+        room = 8 - (unsigned)(br->bits % 8);
+        take = nbits < room ? nbits : room;
+        *value = (*value << take) | ((br->data[br->bits / 8] >> (room - take)) & ((1u << take) - 1));
+        br->bits += take;
+        nbits -= take;
+    }
+    return 0;
+}
+
+static int br_get_varint(bitReaderT * br, uint64_t * value) {
+    uint64_t byte;
+    unsigned shift = 0;
+
+    *value = 0;
+    do {
+        if (shift > 63 || br_get(br, 8, &byte) < 0)
+            return -1;
+        *value |= (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+static int64_t sign_extend(uint64_t value, unsigned nbits) {
+    if (nbits < 64 && (value & (1ULL << (nbits - 1))))
+        return (int64_t)(value | ~((1ULL << nbits) - 1));
+    return (int64_t)value;
+}
+
+static uint64_t double_bits(double value) {
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double bits_double(uint64_t bits) {
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static int encode_dod(bitWriterT * bw, int64_t dod) {
+    if (dod == 0)
+        return bw_put(bw, 0, 1);
+    if (dod >= -64 && dod <= 63)
+        return bw_put(bw, 0x2, 2) | bw_put(bw, (uint64_t)dod & 0x7f, 7);
+    if (dod >= -256 && dod <= 255)
+        return bw_put(bw, 0x6, 3) | bw_put(bw, (uint64_t)dod & 0x1ff, 9);
+    if (dod >= -2048 && dod <= 2047)
+        return bw_put(bw, 0xe, 4) | bw_put(bw, (uint64_t)dod & 0xfff, 12);
+    return bw_put(bw, 0xf, 4) | bw_put(bw, (uint64_t)dod, 64);
+}
+
+static int decode_dod(bitReaderT * br, int64_t * dod) {
+    static const unsigned widths[] = { 7, 9, 12, 64 };
+    uint64_t bit, value;
+    unsigned bucket;
+
+    for (bucket = 0; bucket < 4; bucket++) {
+        if (br_get(br, 1, &bit) < 0)
+            return -1;
+        if (bit == 0)
+            break;
+    }
+
+    if (bucket == 0) {
+        *dod = 0;
+        return 0;
+    }
+
+    if (br_get(br, widths[bucket - 1], &value) < 0)
+        return -1;
+    *dod = sign_extend(value, widths[bucket - 1]);
+    return 0;
+}
+
+/**
+ * @brief Pack a series of samples
+ *
+ * @param timestamps - the sample timestamps, in ms
+ * @param values - the sample values
+ * @param count - the number of samples
+ * @param out - set to the packed buffer, to be freed by the caller
+ * @return the packed size, 0 on allocation failure
+ */
+size_t codec_gorilla_encode(const int64_t * timestamps, const double * values, size_t count, uint8_t ** out) {
+    bitWriterT bw = { NULL, 0, 0 };
+    int64_t delta, prev_delta = 0;
+    uint64_t bits, prev_bits, xor;
+    unsigned lead, trail, sig;
+    unsigned prev_lead = CODEC_NO_WINDOW, prev_trail = 0;
+    size_t ix;
+    int err;
+
+    err = bw_put_varint(&bw, count);
+    if (count > 0) {
+        err |= bw_put(&bw, (uint64_t)timestamps[0], 64);
+        prev_bits = double_bits(values[0]);
+        err |= bw_put(&bw, prev_bits, 64);
+
+        for (ix = 1; !err && ix < count; ix++) {
+            delta = timestamps[ix] - timestamps[ix - 1];
+            err |= encode_dod(&bw, delta - prev_delta);
+            prev_delta = delta;
+
+            bits = double_bits(values[ix]);
+            xor = bits ^ prev_bits;
+            prev_bits = bits;
+            if (xor == 0) {
+                err |= bw_put(&bw, 0, 1);
+                continue;
+            }
+
+            lead = (unsigned)__builtin_clzll(xor);
+            trail = (unsigned)__builtin_ctzll(xor);
+            if (lead > 31)
+                lead = 31;
+
+            if (prev_lead != CODEC_NO_WINDOW && lead >= prev_lead && trail >= prev_trail) {
+                err |= bw_put(&bw, 0x2, 2);
+                err |= bw_put(&bw, xor >> prev_trail, 64 - prev_lead - prev_trail);
+            } else {
+                sig = 64 - lead - trail;
+                err |= bw_put(&bw, 0x3, 2);
+                err |= bw_put(&bw, lead, 5);
+                err |= bw_put(&bw, sig - 1, 6);
+                err |= bw_put(&bw, xor >> trail, sig);
+                prev_lead = lead;
+                prev_trail = trail;
+            }
+        }
+    }
+
+    if (err) {
+        free(bw.data);
+        return 0;
+    }
+
+    *out = bw.data;
+    return (bw.bits + 7) / 8;
+}
+
+/**
+ * @brief Unpack a series packed by codec_gorilla_encode()
+ *
+ * @return 0 on success, -1 on malformed input or allocation failure
+ */
+int codec_gorilla_decode(const uint8_t * buffer, size_t size, int64_t ** timestamps, double ** values,
+                         size_t * count) {
+    bitReaderT br = { buffer, size, 0 };
+    uint64_t n, word, bit;
+    int64_t delta = 0, dod;
+    uint64_t prev_bits;
+    unsigned lead = 0, trail = 0, sig;
+    size_t ix;
+
+    if (br_get_varint(&br, &n) < 0 || n > size * 8)
+        return -1;
+
+    *count = (size_t)n;
+    *timestamps = malloc((n ? n : 1) * sizeof(int64_t));
+    *values = malloc((n ? n : 1) * sizeof(double));
+    if (*timestamps == NULL || *values == NULL)
+        goto error;
+
+    if (n == 0)
+        return 0;
+
+    if (br_get(&br, 64, &word) < 0)
+        goto error;
+    (*timestamps)[0] = (int64_t)word;
+    if (br_get(&br, 64, &prev_bits) < 0)
+        goto error;
+    (*values)[0] = bits_double(prev_bits);
+
+    for (ix = 1; ix < n; ix++) {
+        if (decode_dod(&br, &dod) < 0)
+            goto error;
+        delta += dod;
+        (*timestamps)[ix] = (*timestamps)[ix - 1] + delta;
+
+        if (br_get(&br, 1, &bit) < 0)
+            goto error;
+        if (bit) {
+            if (br_get(&br, 1, &bit) < 0)
+                goto error;
+            if (bit) {
+                if (br_get(&br, 5, &word) < 0)
+                    goto error;
+                lead = (unsigned)word;
+                if (br_get(&br, 6, &word) < 0)
+                    goto error;
+                sig = (unsigned)word + 1;
+                if (lead + sig > 64)
+                    goto error;
+                trail = 64 - lead - sig;
+            }
+            if (br_get(&br, 64 - lead - trail, &word) < 0)
+                goto error;
+            prev_bits ^= word << trail;
+        }
+        (*values)[ix] = bits_double(prev_bits);
+    }
+    return 0;
+
+error:
+    free(*timestamps);
+    free(*values);
+    *timestamps = NULL;
+    *values = NULL;
+    return -1;
+}
+
+char * codec_base64_encode(const uint8_t * data, size_t size) {
+    char * text;
+    size_t ix, out = 0;
+    uint32_t triple;
+
+    text = malloc(4 * ((size + 2) / 3) + 1);
+    if (text == NULL)
+        return NULL;
+
+    for (ix = 0; ix < size; ix += 3) {
+        triple = (uint32_t)data[ix] << 16;
+        if (ix + 1 < size)
+            triple |= (uint32_t)data[ix + 1] << 8;
+        if (ix + 2 < size)
+            triple |= data[ix + 2];
+
+        text[out++] = base64_chars[(triple >> 18) & 0x3f];
+        text[out++] = base64_chars[(triple >> 12) & 0x3f];
+        text[out++] = ix + 1 < size ? base64_chars[(triple >> 6) & 0x3f] : '=';
+        text[out++] = ix + 2 < size ? base64_chars[triple & 0x3f] : '=';
+    }
+    text[out] = '\0';
+    return text;
+}
+
+static int base64_value(char c) {
+    const char * pos;
+
+    if (c == '\0')
+        return -1;
+    pos = strchr(base64_chars, c);
+    return pos ? (int)(pos - base64_chars) : -1;
+}
+
+uint8_t * codec_base64_decode(const char * text, size_t * size) {
+    size_t len = strlen(text);
+    size_t ix, out = 0;
+    uint8_t * data;
+    uint32_t quad;
+    int value, jx;
+
+    if (len % 4)
+        return NULL;
+
+    data = malloc(len / 4 * 3 + 1);
+    if (data == NULL)
+        return NULL;
+
+    for (ix = 0; ix < len; ix += 4) {
+        quad = 0;
+        for (jx = 0; jx < 4; jx++) {
+            value = text[ix + jx] == '=' ? 0 : base64_value(text[ix + jx]);
+            if (value < 0) {
+                free(data);
+                return NULL;
+            }
+            quad = quad << 6 | (uint32_t)value;
+        }
+        data[out++] = (uint8_t)(quad >> 16);
+        if (text[ix + 2] != '=')
+            data[out++] = (uint8_t)(quad >> 8);
+        if (text[ix + 3] != '=')
+            data[out++] = (uint8_t)quad;
+    }
+
+    *size = out;
+    return data;
+}
+
+// Pack one series, NULL if it cannot be packed. Tells whether its values are
+// all integers.
+static json_object * encode_series(json_object * seriesJ, bool * integers) {
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    json_object * valueJ;
+    json_object * packedJ = NULL;
+    int64_t * timestamps;
+    double * values;
+    uint8_t * packed = NULL;
+    char * text;
+    size_t len, ix, size;
+    int64_t integer;
+
+    *integers = true;
+    if (!json_object_object_get_ex(seriesJ, SERIES_FIELD_TIMESTAMPS, &timestampsJ) ||
+        !json_object_object_get_ex(seriesJ, SERIES_FIELD_VALUES, &valuesJ) ||
+        !json_object_is_type(timestampsJ, json_type_array) ||
+        !json_object_is_type(valuesJ, json_type_array))
+        return NULL;
+
+    len = json_object_array_length(timestampsJ);
+    if (len != json_object_array_length(valuesJ))
+        return NULL;
+
+    timestamps = malloc((len ? len : 1) * sizeof(int64_t));
+    values = malloc((len ? len : 1) * sizeof(double));
+    if (timestamps == NULL || values == NULL)
+        goto out;
+
+    for (ix = 0; ix < len; ix++) {
+        valueJ = json_object_array_get_idx(valuesJ, ix);
+        if (json_object_is_type(valueJ, json_type_int)) {
+            integer = json_object_get_int64(valueJ);
+            if (integer > CODEC_MAX_EXACT_INTEGER || integer < -CODEC_MAX_EXACT_INTEGER)
+                goto out;
+        } else if (json_object_is_type(valueJ, json_type_double)) {
+            *integers = false;
+        } else {
+            goto out;
+        }
+        timestamps[ix] = json_object_get_int64(json_object_array_get_idx(timestampsJ, ix));
+        values[ix] = json_object_get_double(valueJ);
+    }
+
+    size = codec_gorilla_encode(timestamps, values, len, &packed);
+    if (size == 0)
+        goto out;
+
+    text = codec_base64_encode(packed, size);
+    if (text != NULL) {
+        packedJ = json_object_new_string(text);
+        free(text);
+    }
+
+out:
+    free(packed);
+    free(timestamps);
+    free(values);
+    return packedJ;
+}
+
+/**
+ * @brief Pack ts_minsert() arguments
+ *
+ * @param argsJ - the ts_minsert() arguments, left untouched
+ * @return the packed arguments, NULL on allocation failure
+ */
+json_object * codec_encode_minsert_args(json_object * argsJ) {
+    json_object * encodedJ;
+    json_object * seriesJ;
+    json_object * rawJ;
+    json_object * integersJ;
+    json_object * packedJ;
+    bool integers;
+
+    encodedJ = json_object_new_object();
+    seriesJ = json_object_new_object();
+    rawJ = json_object_new_object();
+    integersJ = json_object_new_array();
+    if (encodedJ == NULL || seriesJ == NULL || rawJ == NULL || integersJ == NULL)
+        goto error;
+
+    json_object_object_add(encodedJ, CODEC_FIELD_ENCODING, json_object_new_string(CODEC_ENCODING_GORILLA));
+    json_object_object_add(encodedJ, CODEC_FIELD_SERIES, seriesJ);
+    json_object_object_add(encodedJ, CODEC_FIELD_RAW, rawJ);
+    json_object_object_add(encodedJ, CODEC_FIELD_INTEGERS, integersJ);
+
+    json_object_object_foreach(argsJ, key, keySeriesJ) {
+        packedJ = encode_series(keySeriesJ, &integers);
+        if (packedJ == NULL) {
+            json_object_object_add(rawJ, key, json_object_get(keySeriesJ));
+            continue;
+        }
+        json_object_object_add(seriesJ, key, packedJ);
+        if (integers)
+            json_object_array_add(integersJ, json_object_new_string(key));
+    }
+
+    return encodedJ;
+
+error:
+    json_object_put(encodedJ);
+    json_object_put(seriesJ);
+    json_object_put(rawJ);
+    json_object_put(integersJ);
+    return NULL;
+}
+
+// Whether a packed series is listed in the "integers" field
+static bool decode_is_integer(json_object * integersJ, const char * key) {
+    size_t ix, count;
+
+    if (integersJ == NULL || !json_object_is_type(integersJ, json_type_array))
+        return false;
+
+    count = json_object_array_length(integersJ);
+    for (ix = 0; ix < count; ix++) {
+        if (strcmp(json_object_get_string(json_object_array_get_idx(integersJ, ix)), key) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Unpack arguments packed by codec_encode_minsert_args()
+ *
+ * @return the plain ts_minsert() arguments, NULL on malformed input
+ */
+json_object * codec_decode_minsert_args(json_object * encodedJ) {
+    json_object * argsJ;
+    json_object * encodingJ;
+    json_object * seriesJ;
+    json_object * rawJ = NULL;
+    json_object * integersJ = NULL;
+    json_object * keySeriesJ;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    uint8_t * packed;
+    int64_t * timestamps;
+    double * values;
+    size_t size, count, ix;
+    bool integers;
+    int err;
+
+    if (!json_object_object_get_ex(encodedJ, CODEC_FIELD_ENCODING, &encodingJ) ||
+        strcmp(json_object_get_string(encodingJ), CODEC_ENCODING_GORILLA) != 0 ||
+        !json_object_object_get_ex(encodedJ, CODEC_FIELD_SERIES, &seriesJ) ||
+        !json_object_is_type(seriesJ, json_type_object))
+        return NULL;
+
+    argsJ = json_object_new_object();
+    if (argsJ == NULL)
+        return NULL;
+
+    json_object_object_get_ex(encodedJ, CODEC_FIELD_INTEGERS, &integersJ);
+    json_object_object_foreach(seriesJ, key, packedJ) {
+        packed = codec_base64_decode(json_object_get_string(packedJ), &size);
+        if (packed == NULL)
+            goto error;
+        err = codec_gorilla_decode(packed, size, &timestamps, &values, &count);
+        free(packed);
+        if (err < 0)
+            goto error;
+
+        integers = decode_is_integer(integersJ, key);
+        keySeriesJ = json_object_new_object();
+        timestampsJ = json_object_new_array();
+        valuesJ = json_object_new_array();
+        for (ix = 0; ix < count; ix++) {
+            json_object_array_add(timestampsJ, json_object_new_int64(timestamps[ix]));
+            json_object_array_add(valuesJ, integers ? json_object_new_int64((int64_t)values[ix]) :
+                                  json_object_new_double(values[ix]));
+        }
+        free(timestamps);
+        free(values);
+
+        json_object_object_add(keySeriesJ, SERIES_FIELD_TIMESTAMPS, timestampsJ);
+        json_object_object_add(keySeriesJ, SERIES_FIELD_VALUES, valuesJ);
+        json_object_object_add(argsJ, key, keySeriesJ);
+    }
+
+    if (json_object_object_get_ex(encodedJ, CODEC_FIELD_RAW, &rawJ) &&
+        json_object_is_type(rawJ, json_type_object)) {
+        json_object_object_foreach(rawJ, rawKey, rawSeriesJ)
+            json_object_object_add(argsJ, rawKey, json_object_get(rawSeriesJ));
+    }
+
+    return argsJ;
+
+error:
+    json_object_put(argsJ);
+    return NULL;
+}
@@ -0,0 +1,62 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_CODEC_
+#define _CLOUD_PUB_CODEC_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <json-c/json.h>
+
+// Packed encoding of time series samples: delta-of-delta timestamps and XOR
+// compressed float values, as in Facebook's Gorilla paper.
+#define CODEC_ENCODING_GORILLA "gorilla/1"
+
+// Fields of a packed ts_minsert() argument object:
+// { "encoding": "gorilla/1",
+//   "series": { "<key>": "<base64 packed samples>", ... },
+//   "raw": { "<key>": { "timestamps": [...], "values": [...] }, ... },
+//   "integers": [ "<key>", ... ] }
+// Series whose values are not all numbers are left as is in "raw". Values are
+// packed as doubles: the packed series whose values were all integers are
+// listed in "integers", so that they are decoded back as integers. Integers
+// beyond 2^53, that doubles cannot hold exactly, are left in "raw".
+#define CODEC_FIELD_ENCODING "encoding"
+#define CODEC_FIELD_SERIES "series"
+#define CODEC_FIELD_RAW "raw"
+#define CODEC_FIELD_INTEGERS "integers"
+
+// Largest integer magnitude a double holds exactly
+#define CODEC_MAX_EXACT_INTEGER (INT64_C(1) << 53)
+
+size_t codec_gorilla_encode(const int64_t * timestamps, const double * values, size_t count, uint8_t ** out);
+int codec_gorilla_decode(const uint8_t * buffer, size_t size, int64_t ** timestamps, double ** values,
+                         size_t * count);
+char * codec_base64_encode(const uint8_t * data, size_t size);
+uint8_t * codec_base64_decode(const char * text, size_t * size);
+
+json_object * codec_encode_minsert_args(json_object * argsJ);
+json_object * codec_decode_minsert_args(json_object * encodedJ);
+
+#endif /* _CLOUD_PUB_CODEC_ */
@@ -0,0 +1,435 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+/*
+ * Payload compression stage.
+ *
+ * The arguments of a call to the cloud side are serialized, compressed with
+ * zstd or LZ4 and sent base64 encoded to its 'ts_compressed' verb, which
+ * forwards them to the verb they are meant for. Payloads smaller than the
+ * threshold are sent as is, compression not paying off for them.
+ *
+ * The stock redis binding does not serve 'ts_compressed': the cloud side must
+ * be extended with it. Until it is, the first rejection turns compression off.
+ *
+ * The codecs are optional build dependencies: HAVE_ZSTD and HAVE_LZ4 are set
+ * by the build system when libzstd and liblz4 are found.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "cloud-publication-compress.h"
+#include "cloud-publication-batch.h"
+#include "cloud-publication-codec.h"
+
+static const char * compress_codec_names[] = { "none", "zstd", "lz4" };
+
+static bool compress_codec_available(compressCodecT codec) {
+    switch (codec) {
+    case COMPRESS_NONE:
+        return true;
+    case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case COMPRESS_LZ4:
+#ifdef HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+int compress_config(afb_api_t api, cloudCompressorT * compressor, json_object * compressionJ) {
+    int err;
+    int ix;
+    int threshold = COMPRESS_DEFAULT_THRESHOLD_BYTES;
+    int use_dictionary = 1;
+    const char * codec = NULL;
+
+    memset(compressor, 0, sizeof(*compressor));
+    pthread_mutex_init(&compressor->lock, NULL);
+    compressor->api = api;
+    compressor->level = COMPRESS_DEFAULT_LEVEL;
+    compressor->acceleration = COMPRESS_DEFAULT_ACCELERATION;
+
+    if (compressionJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(compressionJ, "{s:s, s?:i, s?:i, s?:i, s?:b !}", "codec", &codec,
+                           "level", &compressor->level, "acceleration", &compressor->acceleration,
+                           "threshold_bytes", &threshold, "dictionary", &use_dictionary);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse compression config at '%s'. Error is: %s",
+                      json_object_to_json_string(compressionJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    for (ix = COMPRESS_NONE; ix <= COMPRESS_LZ4; ix++) {
+        if (strcmp(codec, compress_codec_names[ix]) == 0)
+            break;
+    }
+    if (ix > COMPRESS_LZ4) {
+        AFB_API_ERROR(api, "Unknown compression codec '%s'!", codec);
+        return -1;
+    }
+    if (!compress_codec_available((compressCodecT)ix)) {
+        AFB_API_ERROR(api, "Compression codec '%s' is not available in this build!", codec);
+        return -1;
+    }
+    if (threshold < 0) {
+        AFB_API_ERROR(api, "Compression threshold must not be negative!");
+        return -1;
+    }
+    if (compressor->acceleration < 1) {
+        AFB_API_ERROR(api, "LZ4 acceleration must be 1 at least!");
+        return -1;
+    }
+
+    compressor->codec = (compressCodecT)ix;
+    compressor->threshold = (size_t)threshold;
+    compressor->use_dictionary = use_dictionary;
+
+#ifdef HAVE_ZSTD
+    if (compressor->codec == COMPRESS_ZSTD) {
+        compressor->cctx = ZSTD_createCCtx();
+        if (compressor->cctx == NULL) {
+            AFB_API_ERROR(api, "Cannot allocate zstd compression context!");
+            return -1;
+        }
+    }
+#endif
+
+    AFB_API_DEBUG(api, "Compressing payloads of %d bytes at least with %s (level %d, acceleration %d, "
+                  "%s dictionary)", threshold, codec, compressor->level, compressor->acceleration,
+                  use_dictionary ? "with" : "without");
+    return 0;
+}
+
+bool compress_enabled(cloudCompressorT * compressor) {
+    return compressor->codec != COMPRESS_NONE && !__atomic_load_n(&compressor->disabled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Stop compressing, e.g. because the cloud side does not support it
+ */
+void compress_disable(cloudCompressorT * compressor) {
+    __atomic_store_n(&compressor->disabled, true, __ATOMIC_RELEASE);
+}
+
+static void dictionary_append(char * dictionary, size_t * size, const char * text) {
+    size_t len = strlen(text);
+
+    if (*size + len > COMPRESS_MAX_DICTIONARY_SIZE)
+        return;
+    memcpy(dictionary + *size, text, len);
+    *size += len;
+}
+
+// Whether most keys of a batch are missing from the dictionary. Lock held.
+static bool compress_dictionary_stale(cloudCompressorT * compressor, json_object * plainJ) {
+    char * entry;
+    size_t keys = 0;
+    size_t missing = 0;
+
+    if (compressor->dictionary == NULL)
+        return true;
+    if (!json_object_is_type(plainJ, json_type_object))
+        return false;
+
+    json_object_object_foreach(plainJ, key, seriesJ) {
+        (void)seriesJ;
+        if (asprintf(&entry, "\"%s\":", key) < 0)
+            return false;
+        keys++;
+        if (memmem(compressor->dictionary, compressor->dictionary_size, entry, strlen(entry)) == NULL)
+            missing++;
+        free(entry);
+    }
+
+    return missing * 2 > keys;
+}
+
+static void compress_release_dictionary(cloudCompressorT * compressor) {
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict(compressor->cdict);
+    compressor->cdict = NULL;
+#endif
+    free(compressor->dictionary);
+    compressor->dictionary = NULL;
+    compressor->dictionary_size = 0;
+}
+
+// Seed the dictionary with the serialized form of the keys of a batch,
+// replacing the former one. Lock held.
+static void compress_build_dictionary(cloudCompressorT * compressor, json_object * plainJ) {
+    char * dictionary;
+    char * entry;
+    size_t size = 0;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t ix;
+
+    if (!json_object_is_type(plainJ, json_type_object))
+        return;
+
+    // payloads are compressed under the lock: nothing uses the former one
+    compress_release_dictionary(compressor);
+
+    dictionary = malloc(COMPRESS_MAX_DICTIONARY_SIZE);
+    if (dictionary == NULL)
+        return;
+
+    dictionary_append(dictionary, &size, "\"" SERIES_FIELD_TIMESTAMPS "\":[");
+    dictionary_append(dictionary, &size, "],\"" SERIES_FIELD_VALUES "\":[");
+    json_object_object_foreach(plainJ, key, seriesJ) {
+        (void)seriesJ;
+        if (asprintf(&entry, "\"%s\":", key) < 0)
+            break;
+        dictionary_append(dictionary, &size, entry);
+        free(entry);
+    }
+
+    if (size == 0) {
+        free(dictionary);
+        return;
+    }
+
+    for (ix = 0; ix < size; ix++)
+        hash = (hash ^ (uint8_t)dictionary[ix]) * 0x100000001b3ULL;
+
+#ifdef HAVE_ZSTD
+    if (compressor->codec == COMPRESS_ZSTD) {
+        compressor->cdict = ZSTD_createCDict(dictionary, size, compressor->level);
+        if (compressor->cdict == NULL) {
+            free(dictionary);
+            return;
+        }
+    }
+#endif
+
+    compressor->dictionary = dictionary;
+    compressor->dictionary_size = size;
+    // ids are kept positive to fit JSON integers of any cloud side parser
+    compressor->dictionary_id = (int64_t)(hash >> 1);
+    compressor->dictionary_acked = false;
+    // generation 0 means no dictionary sent, see compress_wrap()
+    if (++compressor->dictionary_generation == 0)
+        compressor->dictionary_generation = 1;
+    AFB_API_DEBUG(compressor->api, "compression dictionary %" PRId64 " built (%zu bytes)",
+                  compressor->dictionary_id, size);
+}
+
+// Compress a buffer, return the compressed size or 0 on failure. Lock held.
+static size_t compress_buffer(cloudCompressorT * compressor, const char * src, size_t size, char ** out) {
+    size_t done = 0;
+
+    switch (compressor->codec) {
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t bound = ZSTD_compressBound(size);
+
+        *out = malloc(bound);
+        if (*out == NULL)
+            return 0;
+        if (compressor->cdict)
+            done = ZSTD_compress_usingCDict(compressor->cctx, *out, bound, src, size, compressor->cdict);
+        else
+            done = ZSTD_compressCCtx(compressor->cctx, *out, bound, src, size, compressor->level);
+        if (ZSTD_isError(done))
+            done = 0;
+        break;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        LZ4_stream_t * stream;
+        int bound, len;
+
+        if (size > LZ4_MAX_INPUT_SIZE)
+            return 0;
+        bound = LZ4_compressBound((int)size);
+        *out = malloc((size_t)bound);
+        stream = LZ4_createStream();
+        if (*out == NULL || stream == NULL) {
+            LZ4_freeStream(stream);
+            return 0;
+        }
+        if (compressor->dictionary)
+            LZ4_loadDict(stream, compressor->dictionary, (int)compressor->dictionary_size);
+        // LZ4 has no levels, the acceleration factor trades ratio for speed
+        len = LZ4_compress_fast_continue(stream, src, *out, (int)size, bound, compressor->acceleration);
+        LZ4_freeStream(stream);
+        done = len > 0 ? (size_t)len : 0;
+        break;
+    }
+#endif
+    default:
+        *out = NULL;
+        break;
+    }
+
+    return done;
+}
+
+static int64_t thread_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Build the compressed arguments of a call to the cloud side
+ *
+ * @param compressor - the compression stage
+ * @param verb - the cloud side verb the payload is meant for
+ * @param payloadJ - the arguments of that verb, left untouched
+ * @param plainJ - the plain ts_minsert() arguments, whose keys seed the dictionary
+ * @param dictionary_sent - set to the dictionary generation when the
+ *                          dictionary is part of the arguments, 0 otherwise
+ * @return the 'ts_compressed' arguments, NULL if the payload is to be sent as is
+ */
+json_object * compress_wrap(cloudCompressorT * compressor, const char * verb, json_object * payloadJ,
+                            json_object * plainJ, unsigned * dictionary_sent) {
+    const char * payload;
+    size_t size, compressed_size = 0;
+    char * compressed = NULL;
+    char * payloadB64 = NULL;
+    char * dictionaryB64 = NULL;
+    json_object * argsJ = NULL;
+    int64_t started;
+    int err;
+
+    *dictionary_sent = 0;
+    if (!compress_enabled(compressor))
+        return NULL;
+
+    payload = json_object_to_json_string_ext(payloadJ, JSON_C_TO_STRING_PLAIN);
+    size = strlen(payload);
+
+    pthread_mutex_lock(&compressor->lock);
+    if (size < compressor->threshold) {
+        compressor->skipped++;
+        goto out;
+    }
+
+    started = thread_cpu_ns();
+    if (compressor->use_dictionary && compress_dictionary_stale(compressor, plainJ))
+        compress_build_dictionary(compressor, plainJ);
+
+    compressed_size = compress_buffer(compressor, payload, size, &compressed);
+    if (compressed_size == 0) {
+        AFB_API_WARNING(compressor->api, "%s compression of %zu bytes failed, sending them as is",
+                        compress_codec_names[compressor->codec], size);
+        goto out;
+    }
+
+    payloadB64 = codec_base64_encode((const uint8_t *)compressed, compressed_size);
+    if (payloadB64 && compressor->dictionary && !compressor->dictionary_acked)
+        dictionaryB64 = codec_base64_encode((const uint8_t *)compressor->dictionary,
+                                            compressor->dictionary_size);
+    if (payloadB64 == NULL || (compressor->dictionary && !compressor->dictionary_acked && dictionaryB64 == NULL))
+        goto out;
+
+    err = wrap_json_pack(&argsJ, "{s:s, s:s, s:I, s:s}",
+                         COMPRESS_FIELD_VERB, verb,
+                         COMPRESS_FIELD_CODEC, compress_codec_names[compressor->codec],
+                         COMPRESS_FIELD_SIZE, (int64_t)size,
+                         COMPRESS_FIELD_PAYLOAD, payloadB64);
+    if (err) {
+        argsJ = NULL;
+        goto out;
+    }
+    if (compressor->dictionary)
+        json_object_object_add(argsJ, COMPRESS_FIELD_DICTIONARY, json_object_new_int64(compressor->dictionary_id));
+    if (dictionaryB64) {
+        json_object_object_add(argsJ, COMPRESS_FIELD_DICTIONARY_DATA, json_object_new_string(dictionaryB64));
+        *dictionary_sent = compressor->dictionary_generation;
+    }
+
+    compressor->batches++;
+    compressor->bytes_in += size;
+    compressor->bytes_out += compressed_size;
+    compressor->last_ratio = (double)size / (double)compressed_size;
+    compressor->last_cpu_us = (thread_cpu_ns() - started) / 1000;
+    compressor->cpu_ns += (uint64_t)(compressor->last_cpu_us * 1000);
+    AFB_API_DEBUG(compressor->api, "%s: %zu bytes compressed to %zu (ratio %.2f) in %" PRId64 " us",
+                  compress_codec_names[compressor->codec], size, compressed_size, compressor->last_ratio,
+                  compressor->last_cpu_us);
+
+out:
+    pthread_mutex_unlock(&compressor->lock);
+    free(compressed);
+    free(payloadB64);
+    free(dictionaryB64);
+    return argsJ;
+}
+
+/**
+ * @brief Record that the cloud side has the dictionary, no need to send it again
+ *
+ * @param generation - the generation given by compress_wrap(), the
+ *                     acknowledgement of a former dictionary being ignored
+ */
+void compress_dictionary_acked(cloudCompressorT * compressor, unsigned generation) {
+    pthread_mutex_lock(&compressor->lock);
+    if (generation == compressor->dictionary_generation)
+        compressor->dictionary_acked = true;
+    pthread_mutex_unlock(&compressor->lock);
+}
+
+json_object * compress_status(cloudCompressorT * compressor) {
+    json_object * statusJ = NULL;
+
+    if (compressor->codec == COMPRESS_NONE)
+        return json_object_new_object();
+
+    pthread_mutex_lock(&compressor->lock);
+    wrap_json_pack(&statusJ, "{s:s, s:b, s:I, s:I, s:I, s:I, s:I, s:I, s:f, s:f, s:I, s:I}",
+                   "codec", compress_codec_names[compressor->codec],
+                   "enabled", !__atomic_load_n(&compressor->disabled, __ATOMIC_RELAXED),
+                   "threshold_bytes", (int64_t)compressor->threshold,
+                   "dictionary_size", (int64_t)compressor->dictionary_size,
+                   "batches", (int64_t)compressor->batches,
+                   "skipped", (int64_t)compressor->skipped,
+                   "bytes_in", (int64_t)compressor->bytes_in,
+                   "bytes_out", (int64_t)compressor->bytes_out,
+                   "ratio", compressor->bytes_out ? (double)compressor->bytes_in / (double)compressor->bytes_out : 0.0,
+                   "last_ratio", compressor->last_ratio,
+                   "cpu_us_per_batch", compressor->batches ? (int64_t)(compressor->cpu_ns / compressor->batches / 1000) : 0,
+                   "last_cpu_us", compressor->last_cpu_us);
+    pthread_mutex_unlock(&compressor->lock);
+    return statusJ;
+}
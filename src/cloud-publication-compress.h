@@ -0,0 +1,107 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_COMPRESS_
+#define _CLOUD_PUB_COMPRESS_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_DEFAULT_LEVEL 3
+#define COMPRESS_DEFAULT_ACCELERATION 1
+#define COMPRESS_DEFAULT_THRESHOLD_BYTES 4096
+
+// LZ4 only uses the last 64 kB of a dictionary
+#define COMPRESS_MAX_DICTIONARY_SIZE 65536
+
+// Fields of a compressed call argument object:
+// { "verb": "<cloud side verb the payload is meant for>",
+//   "codec": "zstd" | "lz4",
+//   "size": <payload size before compression>,
+//   "payload": "<base64 compressed JSON string of the verb arguments>",
+//   "dictionary": <dictionary id, if any>,
+//   "dictionary_data": "<base64 dictionary, until the cloud side has it>" }
+#define COMPRESS_FIELD_VERB "verb"
+#define COMPRESS_FIELD_CODEC "codec"
+#define COMPRESS_FIELD_SIZE "size"
+#define COMPRESS_FIELD_PAYLOAD "payload"
+#define COMPRESS_FIELD_DICTIONARY "dictionary"
+#define COMPRESS_FIELD_DICTIONARY_DATA "dictionary_data"
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4
+} compressCodecT;
+
+// Compression stage of the calls to the cloud side. The dictionary is built
+// from the key names of a compressed batch, which make most of the redundancy
+// of small payloads, and built again when most keys of a batch are not in it.
+typedef struct cloudCompressor {
+    // configuration, compression is disabled with COMPRESS_NONE. 'level' is
+    // the zstd level, 'acceleration' the LZ4 acceleration factor.
+    compressCodecT codec;
+    int level;
+    int acceleration;
+    size_t threshold;
+    bool use_dictionary;
+
+    afb_api_t api;
+    pthread_mutex_t lock;
+    bool disabled;
+
+    char * dictionary;
+    size_t dictionary_size;
+    int64_t dictionary_id;
+    // bumped at each build, tells the acknowledgements of former dictionaries
+    unsigned dictionary_generation;
+    bool dictionary_acked;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx * cctx;
+    ZSTD_CDict * cdict;
+#endif
+
+    // statistics
+    uint64_t batches;
+    uint64_t skipped;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_ns;
+    double last_ratio;
+    int64_t last_cpu_us;
+} cloudCompressorT;
+
+int compress_config(afb_api_t api, cloudCompressorT * compressor, json_object * compressionJ);
+bool compress_enabled(cloudCompressorT * compressor);
+json_object * compress_wrap(cloudCompressorT * compressor, const char * verb, json_object * payloadJ,
+                            json_object * plainJ, unsigned * dictionary_sent);
+void compress_dictionary_acked(cloudCompressorT * compressor, unsigned generation);
+void compress_disable(cloudCompressorT * compressor);
+json_object * compress_status(cloudCompressorT * compressor);
+
+#endif /* _CLOUD_PUB_COMPRESS_ */
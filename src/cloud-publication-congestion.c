@@ -0,0 +1,254 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "cloud-publication-congestion.h"
+
+/**
+ * @brief Parse the 'retry' entry of a publication context
+ *
+ * { "initial_delay_ms": 1000, "max_delay_ms": 10000 }
+ *
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int backoff_config(afb_api_t api, cloudBackoffT * backoff, json_object * retryJ) {
+    int delay;
+    int err;
+
+    backoff->initial_ms = BACKOFF_DEFAULT_INITIAL_MS;
+    backoff->max_ms = BACKOFF_DEFAULT_MAX_MS;
+    backoff->seed = (unsigned int)(now_ms() ^ (intptr_t)backoff);
+
+    if (retryJ) {
+        err = wrap_json_unpack(retryJ, "{s?:i, s?:i !}", "initial_delay_ms", &backoff->initial_ms,
+                               "max_delay_ms", &backoff->max_ms);
+        if (err) {
+            AFB_API_ERROR(api, "Cannot parse retry config at '%s'. Error is: %s",
+                          json_object_to_json_string(retryJ), wrap_json_get_error_string(err));
+            return -1;
+        }
+    }
+
+    if (backoff->initial_ms <= 0 || backoff->max_ms < backoff->initial_ms) {
+        AFB_API_ERROR(api, "Retry delays must be positive, the maximum one not below the initial one!");
+        return -1;
+    }
+
+    backoff->levels = 1;
+    for (delay = backoff->initial_ms; delay < backoff->max_ms; delay *= 2)
+        backoff->levels++;
+
+    return 0;
+}
+
+/**
+ * @brief Delay before a retry
+ *
+ * @param attempt - the count of retries made since the last success
+ */
+int backoff_delay(cloudBackoffT * backoff, int attempt) {
+    int64_t delay = backoff->initial_ms;
+
+    while (attempt-- > 0 && delay < backoff->max_ms)
+        delay *= 2;
+    if (delay > backoff->max_ms)
+        delay = backoff->max_ms;
+
+    // the seed is shared by the retries of the context, a lost update only
+    // repeats a draw
+    return (int)(delay / 2 + rand_r(&backoff->seed) % (delay / 2 + 1));
+}
+
+// Statistics level of a retry, the retries at the maximum delay sharing the last one
+int backoff_level(const cloudBackoffT * backoff, int attempt) {
+    return attempt < backoff->levels ? attempt : backoff->levels - 1;
+}
+
+/**
+ * @brief Parse the 'congestion' entry of a publication context
+ *
+ * { "min_tick_ms": 1000, "max_tick_ms": 60000, "min_batch_bytes": 16384,
+ *   "max_batch_bytes": 1048576, "target_rtt_ms": 2000 }
+ *
+ * The tick starts at the configured publication pace and the batch size at
+ * max_bytes_per_batch, which also give the default lower tick and upper batch
+ * size bounds.
+ *
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int congestion_config(afb_api_t api, cloudCongestionT * congestion, json_object * congestionJ,
+                      int tick_ms, int batch_bytes) {
+    int target_rtt_ms = CONGESTION_DEFAULT_TARGET_RTT_MS;
+    int err;
+
+    memset(congestion, 0, sizeof(*congestion));
+    pthread_mutex_init(&congestion->lock, NULL);
+    if (congestionJ == NULL)
+        return 0;
+
+    congestion->min_tick_ms = tick_ms;
+    congestion->max_tick_ms = tick_ms * CONGESTION_DEFAULT_MAX_TICK_FACTOR;
+    congestion->min_batch_bytes = CONGESTION_DEFAULT_MIN_BATCH_BYTES;
+    congestion->max_batch_bytes = batch_bytes;
+
+    err = wrap_json_unpack(congestionJ, "{s?:i, s?:i, s?:i, s?:i, s?:i !}",
+                           "min_tick_ms", &congestion->min_tick_ms, "max_tick_ms", &congestion->max_tick_ms,
+                           "min_batch_bytes", &congestion->min_batch_bytes,
+                           "max_batch_bytes", &congestion->max_batch_bytes, "target_rtt_ms", &target_rtt_ms);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse congestion config at '%s'. Error is: %s",
+                      json_object_to_json_string(congestionJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (congestion->min_tick_ms <= 0 || congestion->max_tick_ms < congestion->min_tick_ms ||
+        congestion->min_batch_bytes <= 0 || congestion->max_batch_bytes < congestion->min_batch_bytes ||
+        target_rtt_ms <= 0) {
+        AFB_API_ERROR(api, "Congestion bounds must be positive, and each maximum not below its minimum!");
+        return -1;
+    }
+
+    congestion->target_rtt_us = (int64_t)target_rtt_ms * 1000;
+    congestion->tick_ms = congestion->min_tick_ms;
+    congestion->batch_bytes = congestion->max_batch_bytes;
+    congestion->enabled = true;
+    return 0;
+}
+
+// Multiplicative decrease, at most once per round as TCP does once per round
+// trip: the batches in flight of a slow round all report it. Called with the
+// lock held.
+static void congestion_decrease(cloudCongestionT * congestion) {
+    if (congestion->round_congested)
+        return;
+
+    congestion->batch_bytes /= 2;
+    if (congestion->batch_bytes < congestion->min_batch_bytes)
+        congestion->batch_bytes = congestion->min_batch_bytes;
+    congestion->round_congested = true;
+    congestion->decreases++;
+}
+
+/**
+ * @brief Account for a batch acknowledged by the cloud side
+ *
+ * @param bytes - the estimated size of the batch
+ * @param rtt_us - the time from its sending to its acknowledgement
+ */
+void congestion_ack(cloudCongestionT * congestion, size_t bytes, int64_t rtt_us) {
+    int step;
+
+    if (!congestion->enabled || rtt_us <= 0)
+        return;
+
+    pthread_mutex_lock(&congestion->lock);
+    if (congestion->srtt_us == 0) {
+        congestion->srtt_us = (double)rtt_us;
+        congestion->throughput = (double)bytes * 1e6 / (double)rtt_us;
+    } else {
+        congestion->srtt_us += CONGESTION_SMOOTHING * ((double)rtt_us - congestion->srtt_us);
+        congestion->throughput += CONGESTION_SMOOTHING *
+                                  ((double)bytes * 1e6 / (double)rtt_us - congestion->throughput);
+    }
+
+    if (rtt_us > congestion->target_rtt_us) {
+        congestion_decrease(congestion);
+    } else if (congestion->batch_bytes < congestion->max_batch_bytes) {
+        step = (congestion->max_batch_bytes - congestion->min_batch_bytes) / CONGESTION_STEPS;
+        congestion->batch_bytes += step > 0 ? step : 1;
+        if (congestion->batch_bytes > congestion->max_batch_bytes)
+            congestion->batch_bytes = congestion->max_batch_bytes;
+        congestion->increases++;
+    }
+    pthread_mutex_unlock(&congestion->lock);
+}
+
+/**
+ * @brief Account for a disconnection of the cloud side
+ */
+void congestion_loss(cloudCongestionT * congestion) {
+    if (!congestion->enabled)
+        return;
+
+    pthread_mutex_lock(&congestion->lock);
+    congestion_decrease(congestion);
+    pthread_mutex_unlock(&congestion->lock);
+}
+
+/**
+ * @brief Adapt the tick once a round is over, slowing down for good when the
+ * round met congestion, speeding up one step otherwise
+ */
+void congestion_round_end(cloudCongestionT * congestion) {
+    int step;
+
+    if (!congestion->enabled)
+        return;
+
+    pthread_mutex_lock(&congestion->lock);
+    if (congestion->round_congested) {
+        congestion->tick_ms = congestion->tick_ms > congestion->max_tick_ms / 2 ?
+                              congestion->max_tick_ms : congestion->tick_ms * 2;
+    } else {
+        step = (congestion->max_tick_ms - congestion->min_tick_ms) / CONGESTION_STEPS;
+        congestion->tick_ms -= step > 0 ? step : 1;
+        if (congestion->tick_ms < congestion->min_tick_ms)
+            congestion->tick_ms = congestion->min_tick_ms;
+    }
+    congestion->round_congested = false;
+    pthread_mutex_unlock(&congestion->lock);
+}
+
+// The scheduler tick, default_tick_ms when not adapted
+int congestion_tick(cloudCongestionT * congestion, int default_tick_ms) {
+    return congestion->enabled ? __atomic_load_n(&congestion->tick_ms, __ATOMIC_RELAXED) : default_tick_ms;
+}
+
+// The batch size limit, default_bytes when not adapted
+size_t congestion_batch_bytes(cloudCongestionT * congestion, size_t default_bytes) {
+    return congestion->enabled ? (size_t)__atomic_load_n(&congestion->batch_bytes, __ATOMIC_RELAXED) :
+           default_bytes;
+}
+
+/**
+ * @brief Current pace and link estimates, null when not adapted
+ */
+json_object * congestion_status(cloudCongestionT * congestion) {
+    json_object * statusJ = NULL;
+
+    if (!congestion->enabled)
+        return NULL;
+
+    pthread_mutex_lock(&congestion->lock);
+    wrap_json_pack(&statusJ, "{s:i, s:i, s:I, s:I, s:I, s:I}", "tick_ms", congestion->tick_ms,
+                   "batch_bytes", congestion->batch_bytes, "srtt_ms", (int64_t)(congestion->srtt_us / 1000),
+                   "throughput_bytes_per_s", (int64_t)congestion->throughput,
+                   "increases", (int64_t)congestion->increases, "decreases", (int64_t)congestion->decreases);
+    pthread_mutex_unlock(&congestion->lock);
+
+    return statusJ;
+}
@@ -0,0 +1,93 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_CONGESTION_
+#define _CLOUD_PUB_CONGESTION_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+
+#define BACKOFF_DEFAULT_INITIAL_MS 1000
+#define BACKOFF_DEFAULT_MAX_MS 10000
+
+#define CONGESTION_DEFAULT_TARGET_RTT_MS 2000
+#define CONGESTION_DEFAULT_MAX_TICK_FACTOR 10
+#define CONGESTION_DEFAULT_MIN_BATCH_BYTES 16384
+// the additive steps are this fraction of the adaptation range
+#define CONGESTION_STEPS 16
+// smoothing of the round trip time and throughput, as TCP does
+#define CONGESTION_SMOOTHING 0.125
+
+// Retry delays after a disconnection: doubling from initial_ms up to max_ms,
+// each of them drawn in [delay/2, delay] so that the contexts of a fleet do not
+// reconnect in lockstep
+typedef struct cloudBackoff {
+    int initial_ms;
+    int max_ms;
+    // doublings up to max_ms, plus one
+    int levels;
+    unsigned int seed;
+} cloudBackoffT;
+
+// Adaptation of the publication pace to the cloud link. Rounds trips longer
+// than target_rtt_us, and disconnections, divide the batch size and multiply
+// the scheduler tick by two; faster ones grow the batch size and shorten the
+// tick one step at a time, within the configured bounds.
+typedef struct cloudCongestion {
+    // configuration
+    bool enabled;
+    int min_tick_ms;
+    int max_tick_ms;
+    int min_batch_bytes;
+    int max_batch_bytes;
+    int64_t target_rtt_us;
+
+    // runtime state
+    pthread_mutex_t lock;
+    int tick_ms;
+    int batch_bytes;
+    bool round_congested;
+    double srtt_us;
+    double throughput;
+
+    // statistics
+    uint64_t increases;
+    uint64_t decreases;
+} cloudCongestionT;
+
+int backoff_config(afb_api_t api, cloudBackoffT * backoff, json_object * retryJ);
+int backoff_delay(cloudBackoffT * backoff, int attempt);
+int backoff_level(const cloudBackoffT * backoff, int attempt);
+
+int congestion_config(afb_api_t api, cloudCongestionT * congestion, json_object * congestionJ,
+                      int tick_ms, int batch_bytes);
+void congestion_ack(cloudCongestionT * congestion, size_t bytes, int64_t rtt_us);
+void congestion_loss(cloudCongestionT * congestion);
+void congestion_round_end(cloudCongestionT * congestion);
+int congestion_tick(cloudCongestionT * congestion, int default_tick_ms);
+size_t congestion_batch_bytes(cloudCongestionT * congestion, size_t default_bytes);
+json_object * congestion_status(cloudCongestionT * congestion);
+
+#endif /* _CLOUD_PUB_CONGESTION_ */
@@ -0,0 +1,285 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "cloud-publication-deadband.h"
+
+static int thresholds_config(afb_api_t api, deadbandThresholdsT * thresholds, json_object * thresholdsJ) {
+    int err;
+
+    err = wrap_json_unpack(thresholdsJ, "{s?:F, s?:F, s?:I !}", "absolute", &thresholds->absolute,
+                           "relative", &thresholds->relative, "max_silence_ms", &thresholds->max_silence_ms);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse deadband thresholds at '%s'. Error is: %s",
+                      json_object_to_json_string(thresholdsJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (thresholds->absolute < 0 || thresholds->relative < 0 || thresholds->max_silence_ms < 0) {
+        AFB_API_ERROR(api, "Deadband thresholds must not be negative!");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse the 'deadband' entry of a sensor class
+ *
+ * { "absolute": 0.5, "relative": 0.01, "max_silence_ms": 600000,
+ *   "keys": { "<key>": { "absolute": 2 }, ... } }
+ *
+ * Per key entries override the class thresholds they set.
+ *
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int deadband_config(afb_api_t api, cloudDeadbandT * deadband, json_object * deadbandJ) {
+    json_object * keysJ = NULL;
+    json_object * classJ;
+    deadbandThresholdsT thresholds;
+    int err;
+
+    memset(deadband, 0, sizeof(*deadband));
+    if (deadbandJ == NULL)
+        return 0;
+
+    if (!json_object_is_type(deadbandJ, json_type_object)) {
+        AFB_API_ERROR(api, "Deadband configuration must be an object!");
+        return -1;
+    }
+
+    // the class thresholds are the entry without its 'keys'
+    classJ = json_object_new_object();
+    if (classJ == NULL)
+        return -1;
+    json_object_object_foreach(deadbandJ, name, valueJ) {
+        if (strcmp(name, "keys") == 0)
+            keysJ = valueJ;
+        else
+            json_object_object_add(classJ, name, json_object_get(valueJ));
+    }
+    err = thresholds_config(api, &deadband->defaults, classJ);
+    json_object_put(classJ);
+    if (err < 0)
+        return -1;
+
+    if (keysJ) {
+        if (!json_object_is_type(keysJ, json_type_object)) {
+            AFB_API_ERROR(api, "Deadband keys must be an object!");
+            return -1;
+        }
+        // validated now, applied when the key is first seen
+        json_object_object_foreach(keysJ, key, thresholdsJ) {
+            thresholds = deadband->defaults;
+            if (thresholds_config(api, &thresholds, thresholdsJ) < 0) {
+                AFB_API_ERROR(api, "Invalid deadband thresholds for key '%s'", key);
+                return -1;
+            }
+        }
+        deadband->overridesJ = json_object_get(keysJ);
+    }
+
+    deadband->key_indexJ = json_object_new_object();
+    if (deadband->key_indexJ == NULL)
+        return -1;
+
+    deadband->enabled = true;
+    return 0;
+}
+
+static deadbandKeyT * deadband_key(cloudDeadbandT * deadband, const char * key) {
+    json_object * indexJ;
+    json_object * thresholdsJ;
+    deadbandKeyT * keys;
+    deadbandKeyT * state;
+    size_t capacity;
+
+    if (json_object_object_get_ex(deadband->key_indexJ, key, &indexJ))
+        return &deadband->keys[json_object_get_int64(indexJ)];
+
+    if (deadband->key_count == deadband->key_capacity) {
+        capacity = deadband->key_capacity ? deadband->key_capacity * 2 : DEADBAND_INITIAL_KEYS;
+        keys = realloc(deadband->keys, capacity * sizeof(*keys));
+        if (keys == NULL)
+            return NULL;
+        deadband->keys = keys;
+        deadband->key_capacity = capacity;
+    }
+
+    state = &deadband->keys[deadband->key_count];
+    memset(state, 0, sizeof(*state));
+    state->thresholds = deadband->defaults;
+    if (deadband->overridesJ && json_object_object_get_ex(deadband->overridesJ, key, &thresholdsJ))
+        wrap_json_unpack(thresholdsJ, "{s?:F, s?:F, s?:I}", "absolute", &state->thresholds.absolute,
+                         "relative", &state->thresholds.relative,
+                         "max_silence_ms", &state->thresholds.max_silence_ms);
+
+    json_object_object_add(deadband->key_indexJ, key, json_object_new_int64((int64_t)deadband->key_count));
+    deadband->key_count++;
+    return state;
+}
+
+static bool is_number(json_object * valueJ) {
+    return json_object_is_type(valueJ, json_type_double) || json_object_is_type(valueJ, json_type_int);
+}
+
+// Tell whether a sample is to be published, given the last published one
+static bool deadband_pass(const deadbandThresholdsT * thresholds, json_object * refJ, int64_t ref_ts,
+                          json_object * valueJ, int64_t ts) {
+    double ref, delta;
+
+    if (refJ == NULL)
+        return true;
+
+    if (thresholds->max_silence_ms && ts - ref_ts >= thresholds->max_silence_ms)
+        return true;
+
+    if (!is_number(valueJ) || !is_number(refJ))
+        return !json_object_equal(valueJ, refJ);
+
+    ref = json_object_get_double(refJ);
+    delta = fabs(json_object_get_double(valueJ) - ref);
+    if (thresholds->absolute == 0 && thresholds->relative == 0)
+        return delta != 0;
+
+    return (thresholds->absolute && delta > thresholds->absolute) ||
+           (thresholds->relative && delta > thresholds->relative * fabs(ref));
+}
+
+/**
+ * @brief Drop the samples of a series too close to the last published one
+ *
+ * Samples are compared to the last acknowledged sample of the key, then to
+ * the last one let through: a round read again after a failure is filtered
+ * the same way.
+ *
+ * @return the number of dropped samples
+ */
+static size_t deadband_filter_series(cloudDeadbandT * deadband, cloudSeriesT * series) {
+    deadbandKeyT * state;
+    json_object * timestampsJ;
+    json_object * valuesJ;
+    json_object * refJ;
+    json_object * valueJ;
+    int64_t ref_ts, ts;
+    size_t ix, kept = 0, len = series->samples;
+
+    state = deadband_key(deadband, series->key);
+    timestampsJ = json_object_new_array();
+    valuesJ = json_object_new_array();
+    if (state == NULL || timestampsJ == NULL || valuesJ == NULL) {
+        json_object_put(timestampsJ);
+        json_object_put(valuesJ);
+        return 0;
+    }
+
+    refJ = state->refJ;
+    ref_ts = state->ref_ts;
+    for (ix = 0; ix < len; ix++) {
+        ts = json_object_get_int64(json_object_array_get_idx(series->timestamps, ix));
+        valueJ = json_object_array_get_idx(series->values, ix);
+        if (!deadband_pass(&state->thresholds, refJ, ref_ts, valueJ, ts))
+            continue;
+
+        json_object_array_add(timestampsJ, json_object_get(json_object_array_get_idx(series->timestamps, ix)));
+        json_object_array_add(valuesJ, json_object_get(valueJ));
+        refJ = valueJ;
+        ref_ts = ts;
+        kept++;
+    }
+
+    json_object_put(state->pendingJ);
+    state->pendingJ = kept ? json_object_get(refJ) : NULL;
+    state->pending_ts = ref_ts;
+
+    if (kept == len) {
+        json_object_put(timestampsJ);
+        json_object_put(valuesJ);
+        return 0;
+    }
+
+    json_object_put(series->timestamps);
+    json_object_put(series->values);
+    series->timestamps = timestampsJ;
+    series->values = valuesJ;
+    series->samples = kept;
+    return len - kept;
+}
+
+/**
+ * @brief Filter the series of a freshly read batch
+ *
+ * Series left without samples are removed: their samples are nonetheless
+ * acknowledged along with the round, as the horizon moves past them.
+ *
+ * @return the number of dropped samples
+ */
+size_t deadband_filter_batch(cloudDeadbandT * deadband, cloudBatchT * batch) {
+    size_t ix, dropped = 0;
+
+    if (!deadband->enabled)
+        return 0;
+
+    for (ix = 0; ix < batch->count; ix++)
+        dropped += deadband_filter_series(deadband, &batch->series[ix]);
+
+    deadband->passed += batch->samples - dropped;
+    deadband->dropped += dropped;
+    if (dropped)
+        batch_compact(batch);
+
+    return dropped;
+}
+
+/**
+ * @brief Record the samples let through as published, once acknowledged
+ *
+ * @param batch - the acknowledged batch, without the series deferred to a
+ *                later round
+ */
+void deadband_commit(cloudDeadbandT * deadband, const cloudBatchT * batch) {
+    json_object * indexJ;
+    deadbandKeyT * state;
+    size_t ix;
+
+    if (!deadband->enabled)
+        return;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        if (!json_object_object_get_ex(deadband->key_indexJ, batch->series[ix].key, &indexJ))
+            continue;
+        state = &deadband->keys[json_object_get_int64(indexJ)];
+        if (state->pendingJ == NULL)
+            continue;
+
+        json_object_put(state->refJ);
+        state->refJ = state->pendingJ;
+        state->ref_ts = state->pending_ts;
+        state->pendingJ = NULL;
+    }
+}
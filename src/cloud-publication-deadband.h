@@ -0,0 +1,75 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_DEADBAND_
+#define _CLOUD_PUB_DEADBAND_
+
+#include "cloud-publication-binding.h"
+#include "cloud-publication-batch.h"
+
+#define DEADBAND_INITIAL_KEYS 16
+
+// Publication thresholds of a key. A sample is published when it moves away
+// from the last published one by more than 'absolute', or by more than
+// 'relative' times its magnitude, or when nothing was published for
+// max_silence_ms. Without threshold, any change is published. 0 disables a
+// threshold.
+typedef struct deadbandThresholds {
+    double absolute;
+    double relative;
+    int64_t max_silence_ms;
+} deadbandThresholdsT;
+
+// Filter state of a key: the last published sample, and the last one let
+// through by the round in progress, which becomes the published one once the
+// round is acknowledged
+typedef struct deadbandKey {
+    deadbandThresholdsT thresholds;
+    json_object * refJ;
+    int64_t ref_ts;
+    json_object * pendingJ;
+    int64_t pending_ts;
+} deadbandKeyT;
+
+// Change-only publication filter of a sensor class
+typedef struct cloudDeadband {
+    bool enabled;
+    deadbandThresholdsT defaults;
+    json_object * overridesJ;
+
+    json_object * key_indexJ;
+    deadbandKeyT * keys;
+    size_t key_count;
+    size_t key_capacity;
+
+    // statistics
+    uint64_t passed;
+    uint64_t dropped;
+} cloudDeadbandT;
+
+int deadband_config(afb_api_t api, cloudDeadbandT * deadband, json_object * deadbandJ);
+size_t deadband_filter_batch(cloudDeadbandT * deadband, cloudBatchT * batch);
+void deadband_commit(cloudDeadbandT * deadband, const cloudBatchT * batch);
+
+#endif /* _CLOUD_PUB_DEADBAND_ */
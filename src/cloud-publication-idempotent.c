@@ -0,0 +1,119 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+
+#include "cloud-publication-idempotent.h"
+#include "cloud-publication-batch.h"
+
+void idempotent_init(cloudIdempotenceT * idempotence, bool enabled, const char * scope) {
+    memset(idempotence, 0, sizeof(*idempotence));
+    idempotence->enabled = enabled;
+    snprintf(idempotence->prefix, sizeof(idempotence->prefix), "%s-%" PRId64, scope, now_ms());
+}
+
+bool idempotent_enabled(const cloudIdempotenceT * idempotence) {
+    return __atomic_load_n(&idempotence->enabled, __ATOMIC_RELAXED);
+}
+
+// Fall back to plain calls, when the cloud side does not know 'ts_batch'
+void idempotent_disable(cloudIdempotenceT * idempotence) {
+    __atomic_store_n(&idempotence->enabled, false, __ATOMIC_RELAXED);
+}
+
+// { "<key>": [first_ts, last_ts, samples], ... } of ts_minsert() arguments
+static json_object * idempotent_ranges(json_object * plainJ) {
+    json_object * rangesJ;
+    json_object * rangeJ;
+    json_object * timestampsJ;
+    size_t len;
+
+    rangesJ = json_object_new_object();
+    if (rangesJ == NULL)
+        return NULL;
+
+    json_object_object_foreach(plainJ, key, seriesJ) {
+        if (!json_object_object_get_ex(seriesJ, SERIES_FIELD_TIMESTAMPS, &timestampsJ) ||
+            (len = json_object_array_length(timestampsJ)) == 0)
+            continue;
+
+        if (wrap_json_pack(&rangeJ, "[O, O, I]", json_object_array_get_idx(timestampsJ, 0),
+                           json_object_array_get_idx(timestampsJ, len - 1), (int64_t)len)) {
+            json_object_put(rangesJ);
+            return NULL;
+        }
+        json_object_object_add(rangesJ, key, rangeJ);
+    }
+
+    return rangesJ;
+}
+
+/**
+ * @brief Wrap a cloud call into an identified batch
+ *
+ * { "id": "<prefix>-<sequence>", "ranges": { "<key>": [first_ts, last_ts,
+ *   samples], ... }, "verb": "<verb>", "args": <payload> }
+ *
+ * The call is built once per batch, its retries thus keeping its ID.
+ *
+ * @param verb - the cloud side verb to call, with payloadJ as arguments
+ * @param payloadJ - the arguments of that verb, left untouched
+ * @param plainJ - the plain ts_minsert() arguments, giving the ranges
+ * @return the 'ts_batch' arguments, NULL if the payload is to be sent as is
+ */
+json_object * idempotent_wrap(cloudIdempotenceT * idempotence, const char * verb, json_object * payloadJ,
+                              json_object * plainJ) {
+    json_object * rangesJ;
+    json_object * argsJ;
+    char id[IDEMPOTENT_PREFIX_MAX_LEN + 24];
+
+    if (!idempotent_enabled(idempotence))
+        return NULL;
+
+    rangesJ = idempotent_ranges(plainJ);
+    if (rangesJ == NULL)
+        return NULL;
+
+    snprintf(id, sizeof(id), "%s-%" PRIu64, idempotence->prefix,
+             __atomic_add_fetch(&idempotence->sequence, 1, __ATOMIC_RELAXED));
+    if (wrap_json_pack(&argsJ, "{s:s, s:o, s:s, s:O}", "id", id, "ranges", rangesJ,
+                       "verb", verb, "args", payloadJ))
+        return NULL;
+
+    return argsJ;
+}
+
+/**
+ * @brief Account for an acknowledged batch, { "duplicate": true } telling it
+ * was already applied
+ */
+void idempotent_acked(cloudIdempotenceT * idempotence, json_object * resultJ) {
+    json_object * duplicateJ;
+
+    __atomic_add_fetch(&idempotence->batches, 1, __ATOMIC_RELAXED);
+    if (json_object_object_get_ex(resultJ, "duplicate", &duplicateJ) && json_object_get_boolean(duplicateJ))
+        __atomic_add_fetch(&idempotence->duplicates, 1, __ATOMIC_RELAXED);
+}
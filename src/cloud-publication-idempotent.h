@@ -0,0 +1,59 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_IDEMPOTENT_
+#define _CLOUD_PUB_IDEMPOTENT_
+
+#include "cloud-publication-binding.h"
+
+#define IDEMPOTENT_PREFIX_MAX_LEN 96
+
+// Batch identification, for the cloud side to apply each batch once.
+//
+// Every cloud call is wrapped into a 'ts_batch' call with a batch ID, unique
+// to the binder run, and with the range of samples of each key. The cloud side
+// acknowledges a batch whose ID it already applied without writing its samples
+// again. Ranges are informative only: concurrent batches may split a key and
+// arrive out of order, so a range below what the cloud side holds does not
+// make a replay. Samples read again after a restart come in new batches and
+// are written again, with the same values.
+typedef struct cloudIdempotence {
+    bool enabled;
+    // <context API>-<start time>, the batch sequence number being appended
+    char prefix[IDEMPOTENT_PREFIX_MAX_LEN];
+    uint64_t sequence;
+
+    // statistics
+    uint64_t batches;
+    uint64_t duplicates;
+} cloudIdempotenceT;
+
+void idempotent_init(cloudIdempotenceT * idempotence, bool enabled, const char * scope);
+json_object * idempotent_wrap(cloudIdempotenceT * idempotence, const char * verb, json_object * payloadJ,
+                              json_object * plainJ);
+void idempotent_acked(cloudIdempotenceT * idempotence, json_object * resultJ);
+void idempotent_disable(cloudIdempotenceT * idempotence);
+bool idempotent_enabled(const cloudIdempotenceT * idempotence);
+
+#endif /* _CLOUD_PUB_IDEMPOTENT_ */
@@ -0,0 +1,170 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+/*
+ * Adaptive sync interval planner.
+ *
+ * Rather than slicing the database time span into fixed-size windows, the span
+ * is split so that each interval holds about the same number of samples. The
+ * samples of a key are assumed evenly spread between its first and last
+ * timestamps, which is all the database scan tells about them.
+ *
+ * The plan only depends on the scan results, never on the order keys were
+ * scanned in, so that a sync planned again from the same database gets the
+ * same intervals and can be resumed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cloud-publication-planner.h"
+
+#define PLAN_INITIAL_CAPACITY 64
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static int key_info_cmp(const void * a, const void * b) {
+    const syncKeyInfoT * ka = a;
+    const syncKeyInfoT * kb = b;
+
+    if (ka->first_ts != kb->first_ts)
+        return ka->first_ts < kb->first_ts ? -1 : 1;
+    if (ka->last_ts != kb->last_ts)
+        return ka->last_ts < kb->last_ts ? -1 : 1;
+    if (ka->samples != kb->samples)
+        return ka->samples < kb->samples ? -1 : 1;
+    return 0;
+}
+
+// Estimated number of samples between two timestamps, both included
+static double plan_estimate(const syncKeyInfoT * infos, size_t count, int64_t start, int64_t end) {
+    double total = 0;
+    int64_t lo, hi;
+    size_t ix;
+
+    for (ix = 0; ix < count; ix++) {
+        lo = start > infos[ix].first_ts ? start : infos[ix].first_ts;
+        hi = end < infos[ix].last_ts ? end : infos[ix].last_ts;
+        if (lo > hi)
+            continue;
+        total += (double)infos[ix].samples * (double)(hi - lo + 1) /
+                 (double)(infos[ix].last_ts - infos[ix].first_ts + 1);
+    }
+
+    return total;
+}
+
+static int plan_append(syncPlanT * plan, int64_t end) {
+    int64_t capacity;
+    int64_t * ends;
+
+    if (plan->count == plan->capacity) {
+        capacity = plan->capacity ? plan->capacity * 2 : PLAN_INITIAL_CAPACITY;
+        ends = realloc(plan->ends, (size_t)capacity * sizeof(int64_t));
+        if (ends == NULL)
+            return -1;
+        plan->ends = ends;
+        plan->capacity = capacity;
+    }
+
+    plan->ends[plan->count++] = end;
+    return 0;
+}
+
+static int64_t plan_fingerprint(const syncPlanT * plan, int64_t max_samples) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint64_t value;
+    int64_t ix;
+    int byte;
+
+    for (ix = -1; ix < plan->count; ix++) {
+        value = (uint64_t)(ix < 0 ? max_samples : plan->ends[ix]);
+        for (byte = 0; byte < 8; byte++) {
+            hash ^= (value >> (byte * 8)) & 0xff;
+            hash *= FNV_PRIME;
+        }
+    }
+
+    // Keep it positive and clear of any sign handling
+    return (int64_t)(hash >> 2);
+}
+
+/**
+ * @brief Split a time span into intervals of about the same sample count
+ *
+ * Each interval is as wide as possible while holding at most max_samples
+ * samples, and at least 1 ms wide whatever its density.
+ *
+ * @param plan - the plan to fill, released by plan_release()
+ * @param infos - the scanned keys, sorted in place
+ * @param count - the number of scanned keys
+ * @param first_ts - the first timestamp to synchronize
+ * @param last_ts - the last timestamp to synchronize
+ * @param max_samples - the target sample count of one interval
+ * @return 0 on success, -1 on allocation failure
+ */
+int plan_adaptive(syncPlanT * plan, syncKeyInfoT * infos, size_t count,
+                  int64_t first_ts, int64_t last_ts, int64_t max_samples) {
+    int64_t start, end, lo, hi, mid;
+
+    memset(plan, 0, sizeof(*plan));
+    qsort(infos, count, sizeof(syncKeyInfoT), key_info_cmp);
+
+    for (start = first_ts; ; start = end + 1) {
+        if (plan_estimate(infos, count, start, last_ts) <= (double)max_samples) {
+            end = last_ts;
+        } else {
+            // Widest interval that fits, found by bisection as the estimate
+            // grows with the interval end
+            lo = start;
+            hi = last_ts - 1;
+            while (lo < hi) {
+                mid = lo + (hi - lo + 1) / 2;
+                if (plan_estimate(infos, count, start, mid) <= (double)max_samples)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            end = lo;
+        }
+
+        if (plan_append(plan, end) < 0) {
+            plan_release(plan);
+            return -1;
+        }
+
+        if (end >= last_ts)
+            break;
+    }
+
+    plan->fingerprint = plan_fingerprint(plan, max_samples);
+    return 0;
+}
+
+void plan_release(syncPlanT * plan) {
+    free(plan->ends);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,51 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_PLANNER_
+#define _CLOUD_PUB_PLANNER_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What the database scan tells about one time series key
+typedef struct syncKeyInfo {
+    int64_t first_ts;
+    int64_t last_ts;
+    int64_t samples;
+} syncKeyInfoT;
+
+// The upper bounds of the planned sync intervals. Interval 0 starts on the
+// first timestamp of the database, interval N on the end of interval N-1 + 1.
+typedef struct syncPlan {
+    int64_t * ends;
+    int64_t count;
+    int64_t capacity;
+    // Digest of the bounds, changing whenever the plan does
+    int64_t fingerprint;
+} syncPlanT;
+
+int plan_adaptive(syncPlanT * plan, syncKeyInfoT * infos, size_t count,
+                  int64_t first_ts, int64_t last_ts, int64_t max_samples);
+void plan_release(syncPlanT * plan);
+
+#endif /* _CLOUD_PUB_PLANNER_ */
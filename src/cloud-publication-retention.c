@@ -0,0 +1,413 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cloud-publication-retention.h"
+#include "cloud-publication-watermark.h"
+#include "cloud-publication-batch.h"
+
+/**
+ * @brief Parse the 'retention' entry of a publication context
+ *
+ * { "keep_ms": 604800000, "period_ms": 60000, "max_span_ms": 3600000 }
+ *
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int retention_config(afb_api_t api, cloudRetentionT * retention, json_object * retentionJ, int class_count) {
+    int ix;
+    int err;
+
+    retention->period_ms = RETENTION_DEFAULT_PERIOD_MS;
+    retention->max_span_ms = RETENTION_DEFAULT_MAX_SPAN_MS;
+
+    if (retentionJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(retentionJ, "{s:I, s?:i, s?:I !}", "keep_ms", &retention->keep_ms,
+                           "period_ms", &retention->period_ms, "max_span_ms", &retention->max_span_ms);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse retention config at '%s'. Error is: %s",
+                      json_object_to_json_string(retentionJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (retention->keep_ms <= 0 || retention->period_ms <= 0 || retention->max_span_ms <= 0) {
+        AFB_API_ERROR(api, "Retention durations must be positive!");
+        return -1;
+    }
+
+    retention->trimmed_to = malloc((size_t)class_count * sizeof(int64_t));
+    retention->pinned = calloc((size_t)class_count, sizeof(bool));
+    if (retention->trimmed_to == NULL || retention->pinned == NULL) {
+        AFB_API_ERROR(api, "Cannot allocate retention state");
+        return -1;
+    }
+    for (ix = 0; ix < class_count; ix++)
+        retention->trimmed_to[ix] = RETENTION_NONE;
+
+    retention->class_count = class_count;
+    retention->enabled = true;
+    return 0;
+}
+
+/**
+ * @brief Claim the right to delete samples, one deletion being made at a time
+ */
+bool retention_begin(cloudRetentionT * retention) {
+    bool idle = false;
+
+    return __atomic_compare_exchange_n(&retention->busy, &idle, true, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void retention_end(cloudRetentionT * retention) {
+    __atomic_store_n(&retention->busy, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Upper bound of the samples of a class to delete
+ *
+ * @param acked_to - upper bound of the samples of the class acknowledged by
+ *                   the cloud side, WATERMARK_NONE if none
+ * @return the bound, RETENTION_NONE if nothing is to be deleted
+ */
+int64_t retention_bound(const cloudRetentionT * retention, int class_idx, int64_t acked_to, int64_t now) {
+    int64_t upto = now - retention->keep_ms;
+
+    if (acked_to == WATERMARK_NONE || retention->pinned[class_idx])
+        return RETENTION_NONE;
+    if (acked_to < upto)
+        upto = acked_to;
+    if (upto <= retention->trimmed_to[class_idx])
+        return RETENTION_NONE;
+
+    return upto;
+}
+
+struct retention_closure {
+    cloudRetentionT * retention;
+    afb_api_t api;
+    const char * local_api;
+    const char * cloud_api;
+    int class_idx;
+    const char * sensor_class;
+    bool exact;
+    int64_t upto;
+    char fromts[RETENTION_TIMESTAMP_MAX_LEN];
+    char tots[RETENTION_TIMESTAMP_MAX_LEN];
+    // keys of the class probed before its first deletion, and the oldest
+    // sample found, RETENTION_NONE if none
+    json_object * probe_keysJ;
+    size_t probe_idx;
+    int64_t first_ts;
+    // local sample counts of the span, until compared with the cloud side ones
+    json_object * localJ;
+};
+
+static void retention_done(struct retention_closure * trim) {
+    retention_end(trim->retention);
+    json_object_put(trim->probe_keysJ);
+    json_object_put(trim->localJ);
+    free(trim);
+}
+
+// Either side cannot serve retention: stop trying
+static void retention_disable(struct retention_closure * trim, const char * what, const char * error) {
+    AFB_API_WARNING(trim->api, "cannot %s the samples of '%s' [%s], disabling retention", what,
+                    trim->sensor_class, error);
+    trim->retention->enabled = false;
+}
+
+static void retention_delete_cb(void *closure, struct json_object *resultJ,
+                                const char *error, const char * info, afb_api_t api) {
+    struct retention_closure * trim = closure;
+    cloudRetentionT * retention = trim->retention;
+
+    if (error && strcmp(error, "disconnected") == 0) {
+        AFB_API_DEBUG(api, "local side disconnected, trimming '%s' later", trim->sensor_class);
+    } else if (error) {
+        retention_disable(trim, "trim", error);
+    } else {
+        AFB_API_DEBUG(api, "trimmed the samples of '%s' up to %" PRId64, trim->sensor_class, trim->upto);
+        retention->trimmed_to[trim->class_idx] = trim->upto;
+        __atomic_add_fetch(&retention->deletions, 1, __ATOMIC_RELAXED);
+        retention->last_deletion_at = now_ms();
+    }
+
+    retention_done(trim);
+}
+
+static void retention_delete(struct retention_closure * trim) {
+    json_object * argsJ;
+
+    if (wrap_json_pack(&argsJ, "{s:s, s:s, s:s}", "class", trim->sensor_class, "fromts", trim->fromts,
+                       "tots", trim->tots)) {
+        AFB_API_ERROR(trim->api, "ts_mdel() argument packing failed!");
+        retention_done(trim);
+        return;
+    }
+
+    afb_api_call(trim->api, trim->local_api, REDIS_VERB_TS_MDEL, argsJ, retention_delete_cb, trim);
+}
+
+// Sample count of each key of a ts_mrange() reply aggregated by count
+static int64_t retention_key_count(json_object * replyJ, const char * key) {
+    json_object * seriesJ;
+    json_object * valuesJ;
+    int64_t count = 0;
+    size_t ix;
+
+    if (!json_object_is_type(replyJ, json_type_object) ||
+        !json_object_object_get_ex(replyJ, key, &seriesJ) ||
+        !json_object_object_get_ex(seriesJ, SERIES_FIELD_VALUES, &valuesJ) ||
+        !json_object_is_type(valuesJ, json_type_array))
+        return 0;
+
+    for (ix = 0; ix < json_object_array_length(valuesJ); ix++)
+        count += (int64_t)json_object_get_double(json_object_array_get_idx(valuesJ, ix));
+    return count;
+}
+
+/**
+ * @brief Tell whether the cloud side holds the samples of the span
+ *
+ * Classes whose samples are published as is must have as many samples on the
+ * cloud side. Downsampled or deadband-filtered ones only need some samples
+ * of each key there.
+ */
+static bool retention_span_published(struct retention_closure * trim, json_object * cloudJ) {
+    int64_t local, cloud;
+
+    if (!json_object_is_type(trim->localJ, json_type_object))
+        return true;
+
+    json_object_object_foreach(trim->localJ, key, seriesJ) {
+        (void)seriesJ;
+        local = retention_key_count(trim->localJ, key);
+        cloud = retention_key_count(cloudJ, key);
+        if (local > 0 && (trim->exact ? cloud < local : cloud == 0))
+            return false;
+    }
+    return true;
+}
+
+static json_object * retention_count_args(struct retention_closure * trim) {
+    json_object * argsJ;
+    int64_t from = trim->fromts[0] == '-' ? 0 : strtoll(trim->fromts, NULL, 10);
+
+    if (wrap_json_pack(&argsJ, "{s:s, s:s, s:s, s:{s:s, s:I}}", "class", trim->sensor_class,
+                       "fromts", trim->fromts, "tots", trim->tots, "aggregation",
+                       "type", RETENTION_VERIFY_AGGREGATOR, "bucket", trim->upto - from + 1))
+        return NULL;
+    return argsJ;
+}
+
+static void retention_cloud_counted_cb(void *closure, struct json_object *resultJ,
+                                       const char *error, const char * info, afb_api_t api) {
+    struct retention_closure * trim = closure;
+    cloudRetentionT * retention = trim->retention;
+
+    if (error && strcmp(error, "disconnected") == 0) {
+        AFB_API_DEBUG(api, "cloud side disconnected, trimming '%s' later", trim->sensor_class);
+        retention_done(trim);
+        return;
+    }
+    if (error) {
+        retention_disable(trim, "compare", error);
+        retention_done(trim);
+        return;
+    }
+
+    if (!retention_span_published(trim, resultJ)) {
+        AFB_API_WARNING(api, "samples of '%s' between %s and %s are missing on the cloud side, "
+                        "no longer trimming that class", trim->sensor_class, trim->fromts, trim->tots);
+        retention->pinned[trim->class_idx] = true;
+        __atomic_add_fetch(&retention->pinned_classes, 1, __ATOMIC_RELAXED);
+        retention_done(trim);
+        return;
+    }
+
+    retention_delete(trim);
+}
+
+static void retention_local_counted_cb(void *closure, struct json_object *resultJ,
+                                       const char *error, const char * info, afb_api_t api) {
+    struct retention_closure * trim = closure;
+    json_object * argsJ;
+
+    if (error && strcmp(error, "disconnected") == 0) {
+        retention_done(trim);
+        return;
+    }
+    if (error) {
+        retention_disable(trim, "count", error);
+        retention_done(trim);
+        return;
+    }
+
+    trim->localJ = json_object_get(resultJ);
+    argsJ = retention_count_args(trim);
+    if (argsJ == NULL) {
+        AFB_API_ERROR(api, "ts_mrange() argument packing failed!");
+        retention_done(trim);
+        return;
+    }
+
+    afb_api_call(api, trim->cloud_api, "ts_mrange", argsJ, retention_cloud_counted_cb, trim);
+}
+
+/**
+ * @brief Count the samples of the next span on both sides, deleting them
+ * only if the cloud side holds them
+ */
+static void retention_verify(struct retention_closure * trim) {
+    cloudRetentionT * retention = trim->retention;
+    int64_t trimmed_to = retention->trimmed_to[trim->class_idx];
+    json_object * argsJ;
+
+    // bounded span: the oldest samples first. The first one starts before
+    // any sample, keys older than the probed ones included, and is bounded
+    // from the oldest probed sample.
+    if (trimmed_to == RETENTION_NONE) {
+        snprintf(trim->fromts, sizeof(trim->fromts), "-");
+        if (trim->first_ts != RETENTION_NONE && trim->upto - trim->first_ts >= retention->max_span_ms)
+            trim->upto = trim->first_ts + retention->max_span_ms - 1;
+    } else {
+        snprintf(trim->fromts, sizeof(trim->fromts), "%" PRId64, trimmed_to + 1);
+        if (trim->upto - trimmed_to > retention->max_span_ms)
+            trim->upto = trimmed_to + retention->max_span_ms;
+    }
+    snprintf(trim->tots, sizeof(trim->tots), "%" PRId64, trim->upto);
+
+    argsJ = retention_count_args(trim);
+    if (argsJ == NULL) {
+        AFB_API_ERROR(trim->api, "ts_mrange() argument packing failed!");
+        retention_done(trim);
+        return;
+    }
+
+    afb_api_call(trim->api, trim->local_api, "ts_mrange", argsJ, retention_local_counted_cb, trim);
+}
+
+static void retention_probe(struct retention_closure * trim);
+
+static void retention_probe_cb(void *closure, struct json_object *resultJ,
+                               const char *error, const char * info, afb_api_t api) {
+    struct retention_closure * trim = closure;
+    int64_t first_ts;
+
+    if (error && strcmp(error, "disconnected") == 0) {
+        retention_done(trim);
+        return;
+    }
+
+    // keys the local side does not know anymore are skipped
+    if (error == NULL && wrap_json_unpack(resultJ, "{s:I}", "first_timestamp", &first_ts) == 0 &&
+        first_ts > 0 && (trim->first_ts == RETENTION_NONE || first_ts < trim->first_ts))
+        trim->first_ts = first_ts;
+
+    retention_probe(trim);
+}
+
+/**
+ * @brief Find the oldest sample of the class, one key after the other,
+ * before its first deletion
+ */
+static void retention_probe(struct retention_closure * trim) {
+    json_object * argsJ;
+    const char * key;
+
+    while (trim->probe_idx < json_object_array_length(trim->probe_keysJ)) {
+        key = json_object_get_string(json_object_array_get_idx(trim->probe_keysJ, trim->probe_idx++));
+        if (key == NULL || wrap_json_pack(&argsJ, "{s:s}", "key", key))
+            continue;
+        afb_api_call(trim->api, trim->local_api, REDIS_VERB_TS_INFO, argsJ, retention_probe_cb, trim);
+        return;
+    }
+
+    retention_verify(trim);
+}
+
+/**
+ * @brief Delete the oldest samples of a class, up to a bound
+ *
+ * The first deletion of a class starts before its oldest sample, and spans
+ * max_span_ms from the oldest sample of its known keys, found through
+ * ts_info(). The next ones each span at most max_span_ms from the previous
+ * one. The samples of the span are counted on both sides first (see
+ * retention_span_published()). Ends the deletion claimed by retention_begin().
+ *
+ * @param cloud_api - the cloud side, holding the published samples
+ * @param probe_keysJ - the known keys of the class, NULL if none, taken over
+ * @param exact - whether the class is published as is, neither downsampled
+ *                nor filtered
+ * @param upto - the bound given by retention_bound()
+ */
+void retention_trim(cloudRetentionT * retention, afb_api_t api, const char * local_api,
+                    const char * cloud_api, int class_idx, const char * sensor_class, json_object * probe_keysJ,
+                    bool exact, int64_t upto) {
+    struct retention_closure * trim;
+
+    trim = calloc(1, sizeof(*trim));
+    if (trim == NULL) {
+        json_object_put(probe_keysJ);
+        retention_end(retention);
+        return;
+    }
+    trim->retention = retention;
+    trim->api = api;
+    trim->local_api = local_api;
+    trim->cloud_api = cloud_api;
+    trim->class_idx = class_idx;
+    trim->sensor_class = sensor_class;
+    trim->exact = exact;
+    trim->upto = upto;
+    trim->first_ts = RETENTION_NONE;
+    trim->probe_keysJ = probe_keysJ;
+
+    if (retention->trimmed_to[class_idx] != RETENTION_NONE || probe_keysJ == NULL) {
+        retention_verify(trim);
+        return;
+    }
+
+    retention_probe(trim);
+}
+
+json_object * retention_status(cloudRetentionT * retention) {
+    json_object * statusJ = NULL;
+
+    if (!retention->enabled)
+        return NULL;
+
+    wrap_json_pack(&statusJ, "{s:I, s:I, s:I}",
+                   "deletions", (int64_t)__atomic_load_n(&retention->deletions, __ATOMIC_RELAXED),
+                   "last_deletion_at", retention->last_deletion_at,
+                   "pinned_classes", (int64_t)__atomic_load_n(&retention->pinned_classes, __ATOMIC_RELAXED));
+    return statusJ;
+}
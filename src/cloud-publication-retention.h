@@ -0,0 +1,81 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_RETENTION_
+#define _CLOUD_PUB_RETENTION_
+
+#include "cloud-publication-binding.h"
+
+#define RETENTION_DEFAULT_PERIOD_MS 60000
+#define RETENTION_DEFAULT_MAX_SPAN_MS 3600000
+
+#define RETENTION_NONE INT64_MIN
+
+#define RETENTION_TIMESTAMP_MAX_LEN 24
+
+// aggregation of the ts_mrange() calls comparing both sides before a deletion
+#define RETENTION_VERIFY_AGGREGATOR "count"
+
+// Local retention: the samples of a class older than keep_ms are deleted from
+// the local side, once acknowledged by the cloud side. At most one deletion is
+// made every period_ms, over at most max_span_ms of samples, so that trimming
+// a long history does not stall the local database.
+//
+// The watermark does not tell every sample below it was published: samples
+// stored late, below it, are not read again. Each span is thus counted on both
+// sides before being deleted, and a class whose span holds samples the cloud
+// side lacks is pinned: it is not trimmed anymore.
+typedef struct cloudRetention {
+    bool enabled;
+    int64_t keep_ms;
+    int period_ms;
+    int64_t max_span_ms;
+
+    // runtime state: one deletion at a time, classes taking turns
+    bool job_queued;
+    bool busy;
+    int next_class;
+    int class_count;
+    // per class, the upper bound of the deleted samples, RETENTION_NONE until
+    // known
+    int64_t * trimmed_to;
+    // per class, set once unpublished samples were found below the watermark
+    bool * pinned;
+
+    // statistics
+    uint64_t deletions;
+    int64_t last_deletion_at;
+    uint64_t pinned_classes;
+} cloudRetentionT;
+
+int retention_config(afb_api_t api, cloudRetentionT * retention, json_object * retentionJ, int class_count);
+bool retention_begin(cloudRetentionT * retention);
+void retention_end(cloudRetentionT * retention);
+int64_t retention_bound(const cloudRetentionT * retention, int class_idx, int64_t acked_to, int64_t now);
+void retention_trim(cloudRetentionT * retention, afb_api_t api, const char * local_api,
+                    const char * cloud_api, int class_idx, const char * sensor_class, json_object * probe_keysJ,
+                    bool exact, int64_t upto);
+json_object * retention_status(cloudRetentionT * retention);
+
+#endif /* _CLOUD_PUB_RETENTION_ */
@@ -0,0 +1,91 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#include <stdlib.h>
+
+#include "cloud-publication-ring.h"
+
+int ring_init(cloudRingT * ring, size_t capacity) {
+    ring->slots = calloc(capacity, sizeof(void *));
+    if (ring->slots == NULL)
+        return -1;
+
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    return 0;
+}
+
+void ring_release(cloudRingT * ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->capacity = 0;
+}
+
+/**
+ * @brief Queue an item, from the producer side
+ *
+ * @return false if the ring is full
+ */
+bool ring_push(cloudRingT * ring, void * item) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->capacity)
+        return false;
+
+    ring->slots[tail % ring->capacity] = item;
+    // publish the item along with the slot
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Dequeue the oldest item, from the consumer side
+ *
+ * @return the item, NULL if the ring is empty
+ */
+void * ring_pop(cloudRingT * ring) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    void * item;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    item = ring->slots[head % ring->capacity];
+    // hand the slot back to the producer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// Approximate when called concurrently with a push or a pop, but never wrapped
+size_t ring_count(const cloudRingT * ring) {
+    // head first: it never passes the tail read after it
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+bool ring_full(const cloudRingT * ring) {
+    return ring_count(ring) >= ring->capacity;
+}
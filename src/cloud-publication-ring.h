@@ -0,0 +1,53 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_RING_
+#define _CLOUD_PUB_RING_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bounded single-producer single-consumer queue of pointers.
+//
+// One stage pushes while another one pops, possibly from different binder
+// threads, without locking: each end only writes its own counter, and reads
+// the other one with acquire semantics. The counters grow forever, their
+// difference being the number of queued items.
+typedef struct cloudRing {
+    void ** slots;
+    size_t capacity;
+    // next item to pop, written by the consumer only
+    size_t head;
+    // next slot to fill, written by the producer only
+    size_t tail;
+} cloudRingT;
+
+int ring_init(cloudRingT * ring, size_t capacity);
+void ring_release(cloudRingT * ring);
+bool ring_push(cloudRingT * ring, void * item);
+void * ring_pop(cloudRingT * ring);
+size_t ring_count(const cloudRingT * ring);
+bool ring_full(const cloudRingT * ring);
+
+#endif /* _CLOUD_PUB_RING_ */
@@ -0,0 +1,555 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+/*
+ * Store-and-forward spool.
+ *
+ * Each record is the plain JSON string of one ts_minsert() argument object,
+ * prefixed by its length as a 32-bit little-endian integer. Records are only
+ * ever appended, to the last segment file, and synced to disk before being
+ * reported as stored. The read position is saved in a cursor file after each
+ * acknowledgement, so that publication resumes where it stopped after a
+ * restart. A record may thus be published twice, never lost. Records the cloud
+ * side keeps rejecting are moved, in the same format, to a dead-letter file
+ * left alongside the segments.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cloud-publication-spool.h"
+
+#define SPOOL_SEGMENT_PREFIX "segment-"
+#define SPOOL_SEGMENT_SUFFIX ".spool"
+#define SPOOL_CURSOR_FILE "cursor"
+#define SPOOL_REJECTED_FILE "rejected" SPOOL_SEGMENT_SUFFIX
+#define SPOOL_RECORD_HEADER_SIZE 4
+
+static const char * spool_policy_names[] = {
+    [SPOOL_DROP_OLDEST] = "drop_oldest",
+    [SPOOL_DROP_NEWEST] = "drop_newest",
+};
+
+static void spool_segment_path(cloudSpoolT * spool, uint64_t segment, char * path, size_t size) {
+    snprintf(path, size, "%s/" SPOOL_SEGMENT_PREFIX "%016" PRIu64 SPOOL_SEGMENT_SUFFIX, spool->dir, segment);
+}
+
+static off_t spool_segment_end(cloudSpoolT * spool, uint64_t segment) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (segment == spool->last_segment)
+        return spool->write_size;
+
+    spool_segment_path(spool, segment, path, sizeof(path));
+    if (stat(path, &st) < 0)
+        return 0;
+    return st.st_size;
+}
+
+static void spool_save_cursor(cloudSpoolT * spool) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    FILE * file;
+
+    snprintf(path, sizeof(path), "%s/" SPOOL_CURSOR_FILE, spool->dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        AFB_API_WARNING(spool->api, "spool: cannot save read position: %s", strerror(errno));
+        return;
+    }
+    fprintf(file, "%" PRIu64 " %jd\n", spool->read.segment, (intmax_t)spool->read.offset);
+    fclose(file);
+
+    if (rename(tmp_path, path) < 0)
+        AFB_API_WARNING(spool->api, "spool: cannot save read position: %s", strerror(errno));
+}
+
+static void spool_load_cursor(cloudSpoolT * spool, spoolPosT * pos) {
+    char path[PATH_MAX];
+    FILE * file;
+    intmax_t offset;
+
+    snprintf(path, sizeof(path), "%s/" SPOOL_CURSOR_FILE, spool->dir);
+    file = fopen(path, "r");
+    if (file == NULL)
+        return;
+
+    if (fscanf(file, "%" SCNu64 " %jd", &pos->segment, &offset) == 2)
+        pos->offset = (off_t)offset;
+    fclose(file);
+}
+
+// Remove the segment at the read position, acknowledged or not
+static void spool_remove_first(cloudSpoolT * spool) {
+    char path[PATH_MAX];
+    off_t size;
+
+    size = spool_segment_end(spool, spool->read.segment);
+    if (spool->read.segment == spool->last_segment && spool->write_fd >= 0) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    spool_segment_path(spool, spool->read.segment, path, sizeof(path));
+    if (unlink(path) < 0 && errno != ENOENT)
+        AFB_API_WARNING(spool->api, "spool: cannot remove %s: %s", path, strerror(errno));
+
+    spool->total_size -= (size_t)size < spool->total_size ? (size_t)size : spool->total_size;
+    spool->inflight = false;
+
+    if (--spool->segment_count == 0) {
+        spool->total_size = 0;
+        spool->write_size = 0;
+        spool->read.segment = spool->last_segment + 1;
+    } else {
+        spool->read.segment++;
+    }
+    spool->read.offset = 0;
+}
+
+// Remove the segments whose records have all been acknowledged
+static void spool_collect(cloudSpoolT * spool) {
+    while (spool->segment_count > 0 &&
+           spool->read.offset >= spool_segment_end(spool, spool->read.segment))
+        spool_remove_first(spool);
+}
+
+static int spool_write_all(int fd, const void * buffer, size_t size) {
+    const char * data = buffer;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+// Write a record, header included, synced to disk
+static int spool_write_record(int fd, const char * payload, size_t len) {
+    unsigned char header[SPOOL_RECORD_HEADER_SIZE];
+
+    header[0] = (unsigned char)(len & 0xff);
+    header[1] = (unsigned char)((len >> 8) & 0xff);
+    header[2] = (unsigned char)((len >> 16) & 0xff);
+    header[3] = (unsigned char)((len >> 24) & 0xff);
+
+    if (spool_write_all(fd, header, sizeof(header)) < 0 || spool_write_all(fd, payload, len) < 0 ||
+        fdatasync(fd) < 0)
+        return -1;
+    return 0;
+}
+
+static int spool_open_segment(cloudSpoolT * spool) {
+    char path[PATH_MAX];
+    uint64_t segment = spool->last_segment + 1;
+
+    spool_segment_path(spool, segment, path, sizeof(path));
+    spool->write_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (spool->write_fd < 0) {
+        AFB_API_ERROR(spool->api, "spool: cannot create %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (spool->segment_count++ == 0) {
+        spool->read.segment = segment;
+        spool->read.offset = 0;
+    }
+    spool->last_segment = segment;
+    spool->write_size = 0;
+    return 0;
+}
+
+/**
+ * @brief Parse the optional 'spool' configuration section
+ *
+ * @return 0 on success, -1 on parsing error
+ */
+int spool_config(afb_api_t api, cloudSpoolT * spool, json_object * spoolJ) {
+    int err;
+    int max_size_mb = SPOOL_DEFAULT_MAX_SIZE_MB;
+    int segment_size_kb = SPOOL_DEFAULT_SEGMENT_SIZE_KB;
+    const char * policy = NULL;
+
+    memset(spool, 0, sizeof(*spool));
+    pthread_mutex_init(&spool->lock, NULL);
+    spool->api = api;
+    spool->write_fd = -1;
+
+    if (spoolJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(spoolJ, "{s:s, s?:i, s?:i, s?:s !}", "dir", &spool->dir,
+                           "max_size_mb", &max_size_mb, "segment_size_kb", &segment_size_kb,
+                           "drop_policy", &policy);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse spool config at '%s'. Error is: %s",
+                      json_object_to_json_string(spoolJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (policy == NULL || strcmp(policy, spool_policy_names[SPOOL_DROP_OLDEST]) == 0) {
+        spool->policy = SPOOL_DROP_OLDEST;
+    } else if (strcmp(policy, spool_policy_names[SPOOL_DROP_NEWEST]) == 0) {
+        spool->policy = SPOOL_DROP_NEWEST;
+    } else {
+        AFB_API_ERROR(api, "Unknown spool drop policy '%s'!", policy);
+        return -1;
+    }
+
+    spool->max_size = (size_t)max_size_mb * 1024 * 1024;
+    spool->segment_size = (size_t)segment_size_kb * 1024;
+    if (segment_size_kb <= 0 || max_size_mb <= 0 || spool->max_size < 2 * spool->segment_size) {
+        AFB_API_ERROR(api, "Spool size must be positive and hold at least two segments!");
+        return -1;
+    }
+
+    AFB_API_DEBUG(api, "Spool in %s: %d MB at most, %d kB segments, %s", spool->dir, max_size_mb,
+                  segment_size_kb, spool_policy_names[spool->policy]);
+    return 0;
+}
+
+/**
+ * @brief Open the spool directory and recover the records left by a previous run
+ *
+ * @return 0 on success, -1 if the spool directory cannot be used
+ */
+int spool_open(cloudSpoolT * spool) {
+    DIR * dir;
+    struct dirent * entry;
+    uint64_t segment, first = UINT64_MAX, last = 0;
+    spoolPosT cursor = { 0, 0 };
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!spool_enabled(spool))
+        return 0;
+
+    if (mkdir(spool->dir, 0750) < 0 && errno != EEXIST) {
+        AFB_API_ERROR(spool->api, "spool: cannot create %s: %s", spool->dir, strerror(errno));
+        return -1;
+    }
+
+    dir = opendir(spool->dir);
+    if (dir == NULL) {
+        AFB_API_ERROR(spool->api, "spool: cannot open %s: %s", spool->dir, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, SPOOL_SEGMENT_PREFIX "%" SCNu64, &segment) != 1)
+            continue;
+        spool_segment_path(spool, segment, path, sizeof(path));
+        if (stat(path, &st) < 0)
+            continue;
+
+        spool->segment_count++;
+        spool->total_size += (size_t)st.st_size;
+        if (segment < first)
+            first = segment;
+        if (segment >= last) {
+            last = segment;
+            spool->write_size = st.st_size;
+        }
+    }
+    closedir(dir);
+
+    // New records always go to a new segment: a previous run may have left
+    // a partially written record at the end of the last one.
+    spool->last_segment = last;
+    spool->write_fd = -1;
+
+    if (spool->segment_count == 0) {
+        spool->read.segment = last + 1;
+        spool->read.offset = 0;
+        return 0;
+    }
+
+    // Segment numbers are contiguous, records before the cursor are acknowledged
+    spool->segment_count = (unsigned)(last - first + 1);
+    spool->read.segment = first;
+    spool->read.offset = 0;
+    spool_load_cursor(spool, &cursor);
+    while (spool->segment_count > 0 && spool->read.segment < cursor.segment)
+        spool_remove_first(spool);
+    if (spool->segment_count > 0 && spool->read.segment == cursor.segment)
+        spool->read.offset = cursor.offset;
+    spool_collect(spool);
+
+    AFB_API_NOTICE(spool->api, "spool: %u segments, %zu kB left to publish from a previous run",
+                   spool->segment_count, spool->total_size / 1024);
+    return 0;
+}
+
+/**
+ * @brief Store one ts_minsert() argument object
+ *
+ * The record is on disk when the function returns 0. When the spool is full,
+ * room is made by dropping the oldest segments, or the record is refused,
+ * depending on the drop policy.
+ *
+ * @return 0 if stored
+ * @return 1 if refused because the spool is full
+ * @return -1 on I/O error
+ */
+int spool_append(cloudSpoolT * spool, json_object * argsJ) {
+    const char * payload;
+    size_t len, record_size;
+    int status = 0;
+
+    payload = json_object_to_json_string_ext(argsJ, JSON_C_TO_STRING_PLAIN);
+    len = strlen(payload);
+    record_size = SPOOL_RECORD_HEADER_SIZE + len;
+    if (len > UINT32_MAX)
+        return 1;
+
+    pthread_mutex_lock(&spool->lock);
+
+    if (record_size > spool->max_size) {
+        spool->dropped++;
+        status = 1;
+        goto out;
+    }
+
+    if (spool->write_fd >= 0 && (size_t)spool->write_size >= spool->segment_size) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    while (spool->total_size + record_size > spool->max_size) {
+        if (spool->policy == SPOOL_DROP_NEWEST || spool->segment_count == 0) {
+            spool->dropped++;
+            status = 1;
+            goto out;
+        }
+        AFB_API_WARNING(spool->api, "spool: full, dropping segment %" PRIu64, spool->read.segment);
+        spool->dropped++;
+        spool_remove_first(spool);
+        spool_save_cursor(spool);
+    }
+
+    if (spool->write_fd < 0 && spool_open_segment(spool) < 0) {
+        status = -1;
+        goto out;
+    }
+
+    if (spool_write_record(spool->write_fd, payload, len) < 0) {
+        AFB_API_ERROR(spool->api, "spool: cannot write record: %s", strerror(errno));
+        // do not leave a partial record behind
+        if (ftruncate(spool->write_fd, spool->write_size) < 0)
+            AFB_API_WARNING(spool->api, "spool: cannot truncate segment: %s", strerror(errno));
+        status = -1;
+        goto out;
+    }
+
+    spool->write_size += (off_t)record_size;
+    spool->total_size += record_size;
+    spool->appended++;
+
+out:
+    pthread_mutex_unlock(&spool->lock);
+    return status;
+}
+
+/**
+ * @brief Read the oldest record not acknowledged yet
+ *
+ * The record is consumed by spool_ack() once the cloud side acknowledged it.
+ * Unreadable records are skipped.
+ *
+ * @return the ts_minsert() argument object, NULL if the spool is empty
+ */
+json_object * spool_peek(cloudSpoolT * spool) {
+    char path[PATH_MAX];
+    unsigned char header[SPOOL_RECORD_HEADER_SIZE];
+    json_object * recordJ = NULL;
+    char * payload;
+    size_t len;
+    off_t end;
+    int fd;
+
+    pthread_mutex_lock(&spool->lock);
+
+    while (recordJ == NULL) {
+        spool_collect(spool);
+        if (spool->segment_count == 0)
+            break;
+
+        end = spool_segment_end(spool, spool->read.segment);
+        spool_segment_path(spool, spool->read.segment, path, sizeof(path));
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            AFB_API_WARNING(spool->api, "spool: cannot open %s: %s", path, strerror(errno));
+            spool_remove_first(spool);
+            continue;
+        }
+
+        len = 0;
+        payload = NULL;
+        if (pread(fd, header, sizeof(header), spool->read.offset) == sizeof(header)) {
+            len = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+            if (spool->read.offset + SPOOL_RECORD_HEADER_SIZE + (off_t)len <= end)
+                payload = malloc(len + 1);
+        }
+
+        if (payload == NULL ||
+            pread(fd, payload, len, spool->read.offset + SPOOL_RECORD_HEADER_SIZE) != (ssize_t)len) {
+            // truncated by a crash: nothing more to read from this segment
+            AFB_API_WARNING(spool->api, "spool: skipping truncated record in %s", path);
+            spool->read.offset = end;
+        } else {
+            payload[len] = '\0';
+            recordJ = json_tokener_parse(payload);
+            if (recordJ == NULL) {
+                AFB_API_WARNING(spool->api, "spool: skipping unreadable record in %s", path);
+                spool->read.offset += SPOOL_RECORD_HEADER_SIZE + (off_t)len;
+            } else {
+                spool->inflight = true;
+                spool->inflight_next.segment = spool->read.segment;
+                spool->inflight_next.offset = spool->read.offset + SPOOL_RECORD_HEADER_SIZE + (off_t)len;
+            }
+        }
+
+        free(payload);
+        close(fd);
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return recordJ;
+}
+
+/**
+ * @brief Consume the record returned by the last spool_peek()
+ *
+ * Segments are removed once all their records are acknowledged. Nothing is
+ * done if the record was dropped meanwhile.
+ */
+void spool_ack(cloudSpoolT * spool) {
+    pthread_mutex_lock(&spool->lock);
+
+    if (spool->inflight && spool->inflight_next.segment == spool->read.segment) {
+        spool->read = spool->inflight_next;
+        spool->inflight = false;
+        spool->acked++;
+        spool_collect(spool);
+        spool_save_cursor(spool);
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+/**
+ * @brief Move the record returned by the last spool_peek() aside, the cloud
+ * side rejecting it for good
+ *
+ * The record is appended to the dead-letter file of the spool directory, then
+ * consumed as if acknowledged: the next records are published.
+ *
+ * @return 0 on success, -1 if the record could not be written aside, being
+ * consumed nevertheless
+ */
+int spool_reject(cloudSpoolT * spool, json_object * recordJ) {
+    char path[PATH_MAX];
+    const char * payload;
+    size_t len;
+    int fd;
+    int status = 0;
+
+    payload = json_object_to_json_string_ext(recordJ, JSON_C_TO_STRING_PLAIN);
+    len = strlen(payload);
+
+    snprintf(path, sizeof(path), "%s/" SPOOL_REJECTED_FILE, spool->dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0 || spool_write_record(fd, payload, len) < 0) {
+        AFB_API_ERROR(spool->api, "spool: cannot write rejected record to %s: %s", path, strerror(errno));
+        status = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_lock(&spool->lock);
+    if (spool->inflight && spool->inflight_next.segment == spool->read.segment) {
+        spool->read = spool->inflight_next;
+        spool->inflight = false;
+        spool->rejected++;
+        spool_collect(spool);
+        spool_save_cursor(spool);
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return status;
+}
+
+bool spool_enabled(cloudSpoolT * spool) {
+    return spool->dir != NULL;
+}
+
+bool spool_empty(cloudSpoolT * spool) {
+    bool empty;
+
+    if (!spool_enabled(spool))
+        return true;
+
+    pthread_mutex_lock(&spool->lock);
+    empty = spool->segment_count == 0 ||
+            (spool->read.segment == spool->last_segment && spool->read.offset >= spool->write_size);
+    pthread_mutex_unlock(&spool->lock);
+    return empty;
+}
+
+json_object * spool_status(cloudSpoolT * spool) {
+    json_object * statusJ = NULL;
+
+    if (!spool_enabled(spool))
+        return json_object_new_object();
+
+    pthread_mutex_lock(&spool->lock);
+    wrap_json_pack(&statusJ, "{s:s, s:s, s:i, s:I, s:I, s:I, s:I, s:I, s:I}",
+                   "dir", spool->dir,
+                   "drop_policy", spool_policy_names[spool->policy],
+                   "segments", (int)spool->segment_count,
+                   "size_kb", (int64_t)(spool->total_size / 1024),
+                   "max_size_kb", (int64_t)(spool->max_size / 1024),
+                   "appended", (int64_t)spool->appended,
+                   "acked", (int64_t)spool->acked,
+                   "dropped", (int64_t)spool->dropped,
+                   "rejected", (int64_t)spool->rejected);
+    pthread_mutex_unlock(&spool->lock);
+    return statusJ;
+}
@@ -0,0 +1,95 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_SPOOL_
+#define _CLOUD_PUB_SPOOL_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "cloud-publication-binding.h"
+
+#define SPOOL_DEFAULT_MAX_SIZE_MB 256
+#define SPOOL_DEFAULT_SEGMENT_SIZE_KB 1024
+
+// Consecutive rejections of a record by the cloud side before it is moved to
+// the dead-letter file of the spool directory
+#define SPOOL_MAX_REJECTIONS 3
+
+typedef enum {
+    SPOOL_DROP_OLDEST,
+    SPOOL_DROP_NEWEST
+} spoolDropPolicyT;
+
+// Position of one record in the spool
+typedef struct spoolPos {
+    uint64_t segment;
+    off_t offset;
+} spoolPosT;
+
+// Append-only store of the ts_minsert() arguments that could not be published
+// while the cloud side was away. Records are stored in numbered segment files
+// and read back in order; a segment file is removed once all its records have
+// been acknowledged.
+typedef struct cloudSpool {
+    // configuration, the spool is disabled without a directory
+    const char * dir;
+    size_t max_size;
+    size_t segment_size;
+    spoolDropPolicyT policy;
+
+    afb_api_t api;
+    pthread_mutex_t lock;
+
+    // the segment_count segments on disk are numbered read.segment to
+    // last_segment, the records before the read position being acknowledged
+    unsigned segment_count;
+    uint64_t last_segment;
+    int write_fd;
+    off_t write_size;
+    size_t total_size;
+
+    // next record to publish, and the position right after the record being
+    // published if any
+    spoolPosT read;
+    spoolPosT inflight_next;
+    bool inflight;
+
+    // statistics
+    uint64_t appended;
+    uint64_t acked;
+    uint64_t dropped;
+    uint64_t rejected;
+} cloudSpoolT;
+
+int spool_config(afb_api_t api, cloudSpoolT * spool, json_object * spoolJ);
+int spool_open(cloudSpoolT * spool);
+int spool_append(cloudSpoolT * spool, json_object * argsJ);
+json_object * spool_peek(cloudSpoolT * spool);
+void spool_ack(cloudSpoolT * spool);
+int spool_reject(cloudSpoolT * spool, json_object * recordJ);
+bool spool_enabled(cloudSpoolT * spool);
+bool spool_empty(cloudSpoolT * spool);
+json_object * spool_status(cloudSpoolT * spool);
+
+#endif /* _CLOUD_PUB_SPOOL_ */
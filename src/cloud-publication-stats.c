@@ -0,0 +1,281 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "cloud-publication-stats.h"
+
+#define STATS_INITIAL_KEYS 64
+
+static const double stats_percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+static const char * stats_percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+int stats_config(afb_api_t api, cloudStatsT * stats, json_object * statsJ, int backoff_levels) {
+    int err;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->api = api;
+    stats->started_at = now_ms();
+    stats->backoff_levels = backoff_levels < STATS_MAX_BACKOFF_LEVELS ? backoff_levels : STATS_MAX_BACKOFF_LEVELS;
+    stats->key_indexJ = json_object_new_object();
+    if (stats->key_indexJ == NULL)
+        return -1;
+
+    if (statsJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(statsJ, "{s?:i !}", "event_period_ms", &stats->event_period_ms);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse stats config at '%s'. Error is: %s",
+                      json_object_to_json_string(statsJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (stats->event_period_ms < 0) {
+        AFB_API_ERROR(api, "Stats event period must not be negative!");
+        return -1;
+    }
+
+    if (stats->event_period_ms > 0) {
+        stats->event = afb_api_make_event(api, STATS_EVENT_NAME);
+        if (!afb_event_is_valid(stats->event)) {
+            AFB_API_ERROR(api, "Cannot create the stats event!");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static size_t histogram_index(uint64_t value) {
+    unsigned msb;
+
+    if (value >= (1ULL << STATS_HISTOGRAM_MAX_BITS))
+        value = (1ULL << STATS_HISTOGRAM_MAX_BITS) - 1;
+    if (value < STATS_HISTOGRAM_SUB_COUNT)
+        return (size_t)value;
+
+    msb = 63 - (unsigned)__builtin_clzll(value);
+    return (size_t)(msb - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB_COUNT +
+           (size_t)((value >> (msb - STATS_HISTOGRAM_SUB_BITS)) - STATS_HISTOGRAM_SUB_COUNT);
+}
+
+// Highest value of a bucket
+static uint64_t histogram_bucket_value(size_t index) {
+    size_t shift;
+    uint64_t top;
+
+    if (index < STATS_HISTOGRAM_SUB_COUNT)
+        return index;
+
+    shift = index / STATS_HISTOGRAM_SUB_COUNT - 1;
+    top = index % STATS_HISTOGRAM_SUB_COUNT + STATS_HISTOGRAM_SUB_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+void stats_histogram_record(statsHistogramT * histogram, int64_t value) {
+    uint64_t v = value > 0 ? (uint64_t)value : 0;
+    uint64_t max;
+
+    __atomic_fetch_add(&histogram->counts[histogram_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, v, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&histogram->max, &max, v, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_count(uint64_t * counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static json_object * histogram_to_json(statsHistogramT * histogram) {
+    json_object * histogramJ;
+    uint64_t total, max, seen = 0;
+    uint64_t value;
+    size_t ix, px = 0;
+    double rank;
+
+    histogramJ = json_object_new_object();
+    if (histogramJ == NULL)
+        return NULL;
+
+    total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    json_object_object_add(histogramJ, "count", json_object_new_int64((int64_t)total));
+    json_object_object_add(histogramJ, "mean_us", json_object_new_int64(
+                           total ? (int64_t)(__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / total) : 0));
+    json_object_object_add(histogramJ, "max_us", json_object_new_int64((int64_t)max));
+
+    // percentiles are the highest value of the bucket they fall in
+    for (ix = 0; ix < STATS_HISTOGRAM_BUCKETS && px < sizeof(stats_percentiles) / sizeof(*stats_percentiles); ix++) {
+        seen += __atomic_load_n(&histogram->counts[ix], __ATOMIC_RELAXED);
+        while (px < sizeof(stats_percentiles) / sizeof(*stats_percentiles)) {
+            rank = stats_percentiles[px] * (double)total / 100.0;
+            if (total && (double)seen < rank)
+                break;
+            value = total ? histogram_bucket_value(ix) : 0;
+            json_object_object_add(histogramJ, stats_percentile_names[px],
+                                   json_object_new_int64((int64_t)(value < max ? value : max)));
+            px++;
+        }
+    }
+
+    return histogramJ;
+}
+
+// Return the counters of a key, created if needed. Lock held.
+static statsKeyT * stats_key(cloudStatsT * stats, const char * key) {
+    json_object * indexJ;
+    statsKeyT * keys;
+    size_t capacity;
+
+    if (json_object_object_get_ex(stats->key_indexJ, key, &indexJ))
+        return &stats->keys[json_object_get_int64(indexJ)];
+
+    if (stats->key_count == stats->key_capacity) {
+        capacity = stats->key_capacity ? stats->key_capacity * 2 : STATS_INITIAL_KEYS;
+        keys = realloc(stats->keys, capacity * sizeof(*keys));
+        if (keys == NULL)
+            return NULL;
+        stats->keys = keys;
+        stats->key_capacity = capacity;
+    }
+
+    memset(&stats->keys[stats->key_count], 0, sizeof(statsKeyT));
+    stats->keys[stats->key_count].key = strdup(key);
+    if (stats->keys[stats->key_count].key == NULL)
+        return NULL;
+
+    json_object_object_add(stats->key_indexJ, key, json_object_new_int64((int64_t)stats->key_count));
+    return &stats->keys[stats->key_count++];
+}
+
+/**
+ * @brief Account for the samples of a key read from the local side, or
+ * published to the cloud side
+ */
+void stats_record_series(cloudStatsT * stats, const char * key, size_t samples, size_t bytes, bool published) {
+    statsKeyT * counters;
+
+    pthread_mutex_lock(&stats->lock);
+    counters = stats_key(stats, key);
+    if (counters && published) {
+        counters->samples_published += samples;
+        counters->bytes_published += bytes;
+    } else if (counters) {
+        counters->samples_read += samples;
+        counters->bytes_read += bytes;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/**
+ * @brief Account for a disconnection of the cloud side, and the back-off
+ * delay it leads to
+ *
+ * @param stats - the statistics
+ * @param level - the index of the delay in the back-off delay table
+ * @param delay_ms - the back-off delay
+ */
+void stats_record_backoff(cloudStatsT * stats, int level, int delay_ms) {
+    stats_count(&stats->disconnects);
+    if (level < 0 || level >= stats->backoff_levels)
+        return;
+
+    __atomic_fetch_add(&stats->backoff_count[level], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->backoff_ms[level], (uint64_t)delay_ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Build the statistics reply
+ *
+ * @return a new JSON object, NULL on allocation failure
+ */
+json_object * stats_to_json(cloudStatsT * stats) {
+    json_object * statsJ = NULL;
+    json_object * keysJ;
+    json_object * backoffJ;
+    json_object * keyJ;
+    uint64_t samples_read = 0, samples_published = 0, bytes_read = 0, bytes_published = 0;
+    int64_t uptime_ms;
+    size_t ix;
+    int level;
+
+    keysJ = json_object_new_object();
+    backoffJ = json_object_new_array();
+    if (keysJ == NULL || backoffJ == NULL)
+        goto error;
+
+    pthread_mutex_lock(&stats->lock);
+    for (ix = 0; ix < stats->key_count; ix++) {
+        if (wrap_json_pack(&keyJ, "{s:I, s:I, s:I, s:I}",
+                           "samples_read", (int64_t)stats->keys[ix].samples_read,
+                           "bytes_read", (int64_t)stats->keys[ix].bytes_read,
+                           "samples_published", (int64_t)stats->keys[ix].samples_published,
+                           "bytes_published", (int64_t)stats->keys[ix].bytes_published) == 0)
+            json_object_object_add(keysJ, stats->keys[ix].key, keyJ);
+        samples_read += stats->keys[ix].samples_read;
+        bytes_read += stats->keys[ix].bytes_read;
+        samples_published += stats->keys[ix].samples_published;
+        bytes_published += stats->keys[ix].bytes_published;
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    for (level = 0; level < stats->backoff_levels; level++) {
+        if (wrap_json_pack(&keyJ, "{s:I, s:I}",
+                           "count", (int64_t)__atomic_load_n(&stats->backoff_count[level], __ATOMIC_RELAXED),
+                           "time_ms", (int64_t)__atomic_load_n(&stats->backoff_ms[level], __ATOMIC_RELAXED)) == 0)
+            json_object_array_add(backoffJ, keyJ);
+    }
+
+    uptime_ms = now_ms() - stats->started_at;
+    if (wrap_json_pack(&statsJ, "{s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:o, s:o, s:o, s:o}",
+                       "uptime_ms", uptime_ms,
+                       "rounds", (int64_t)__atomic_load_n(&stats->rounds, __ATOMIC_RELAXED),
+                       "samples_read", (int64_t)samples_read,
+                       "bytes_read", (int64_t)bytes_read,
+                       "samples_published", (int64_t)samples_published,
+                       "bytes_published", (int64_t)bytes_published,
+                       "bytes_published_per_s", uptime_ms > 0 ? (int64_t)bytes_published * 1000 / uptime_ms : 0,
+                       "retries", (int64_t)__atomic_load_n(&stats->retries, __ATOMIC_RELAXED),
+                       "disconnects", (int64_t)__atomic_load_n(&stats->disconnects, __ATOMIC_RELAXED),
+                       "reader_stalls", (int64_t)__atomic_load_n(&stats->reader_stalls, __ATOMIC_RELAXED),
+                       "backoff", backoffJ,
+                       "ts_mrange_latency", histogram_to_json(&stats->mrange_latency),
+                       "ts_minsert_latency", histogram_to_json(&stats->minsert_latency),
+                       "keys", keysJ))
+        return NULL;
+
+    return statsJ;
+
+error:
+    json_object_put(keysJ);
+    json_object_put(backoffJ);
+    return NULL;
+}
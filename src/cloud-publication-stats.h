@@ -0,0 +1,98 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_STATS_
+#define _CLOUD_PUB_STATS_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+
+#define STATS_EVENT_NAME "stats"
+
+// Log-linear latency histograms, in microseconds: each power of two is split
+// into 2^STATS_HISTOGRAM_SUB_BITS buckets, bounding the relative error of the
+// reported values to 12.5%, up to 2^STATS_HISTOGRAM_MAX_BITS us (12 days).
+#define STATS_HISTOGRAM_SUB_BITS 3
+#define STATS_HISTOGRAM_SUB_COUNT (1 << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_MAX_BITS 40
+#define STATS_HISTOGRAM_BUCKETS ((STATS_HISTOGRAM_MAX_BITS - STATS_HISTOGRAM_SUB_BITS + 1) * \
+                                 STATS_HISTOGRAM_SUB_COUNT)
+
+#define STATS_MAX_BACKOFF_LEVELS 8
+
+// Recording only takes relaxed atomic increments, so that histograms can be
+// updated from concurrent reply callbacks without locking
+typedef struct statsHistogram {
+    uint64_t counts[STATS_HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} statsHistogramT;
+
+typedef struct statsKey {
+    char * key;
+    uint64_t samples_read;
+    uint64_t bytes_read;
+    uint64_t samples_published;
+    uint64_t bytes_published;
+} statsKeyT;
+
+// Live publication metrics of one publication context
+typedef struct cloudStats {
+    afb_api_t api;
+    pthread_mutex_t lock;
+    int64_t started_at;
+
+    // per key counters, keys being indexed by key_indexJ
+    json_object * key_indexJ;
+    statsKeyT * keys;
+    size_t key_count;
+    size_t key_capacity;
+
+    statsHistogramT mrange_latency;
+    statsHistogramT minsert_latency;
+
+    uint64_t rounds;
+    uint64_t retries;
+    uint64_t disconnects;
+    // reads held back until the publication catches up
+    uint64_t reader_stalls;
+    int backoff_levels;
+    uint64_t backoff_count[STATS_MAX_BACKOFF_LEVELS];
+    uint64_t backoff_ms[STATS_MAX_BACKOFF_LEVELS];
+
+    // periodic event, pushed while subscribed to
+    afb_event_t event;
+    int event_period_ms;
+    bool event_running;
+} cloudStatsT;
+
+int stats_config(afb_api_t api, cloudStatsT * stats, json_object * statsJ, int backoff_levels);
+void stats_histogram_record(statsHistogramT * histogram, int64_t value);
+void stats_record_series(cloudStatsT * stats, const char * key, size_t samples, size_t bytes, bool published);
+void stats_record_backoff(cloudStatsT * stats, int level, int delay_ms);
+void stats_count(uint64_t * counter);
+json_object * stats_to_json(cloudStatsT * stats);
+
+#endif /* _CLOUD_PUB_STATS_ */
@@ -0,0 +1,1661 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+/*
+ * Native interval synchronization engine.
+ *
+ * This is a port of the Python engine (python/sync.py, sync_intervals()): the
+ * local database time span is split into fixed-size intervals, each interval is
+ * read with one ts_mrange() call and written to the cloud side key by key with
+ * ts_minsert(). Progress is persisted on the local side using the same
+ * CLOUD_PUB_SYNC_* keys as the Python engine, so that an interrupted sync can
+ * be resumed. Unlike the Python engine, several interval reads and key writes
+ * may be in flight at once (see the interval pipeline below).
+ *
+ * Like the Python engine (sync_keys()), the cloud side keys and their
+ * compaction rules are created before any interval is written.
+ *
+ * Every step is asynchronous. Steps are chained through binder jobs rather than
+ * direct calls so that the stack does not grow with the number of keys when the
+ * redis binding replies synchronously.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "cloud-publication-sync.h"
+#include "cloud-publication-batch.h"
+
+static const char * sync_metric_keys[SYNC_METRIC_COUNT] = {
+    [SYNC_METRIC_INTERVAL_IDX] = "CLOUD_PUB_SYNC_INTERVAL_IDX",
+    [SYNC_METRIC_INTERVAL_KEY] = "CLOUD_PUB_SYNC_INTERVAL_KEY",
+    [SYNC_METRIC_INTERVAL_KEY_IDX] = "CLOUD_PUB_SYNC_INTERVAL_KEY_IDX",
+    [SYNC_METRIC_TS_START] = "CLOUD_PUB_SYNC_TS_START",
+    [SYNC_METRIC_TS_END] = "CLOUD_PUB_SYNC_TS_END",
+    [SYNC_METRIC_INTERVALS_TOTAL_CNT] = "CLOUD_PUB_SYNC_INTERVALS_TOTAL_CNT",
+    [SYNC_METRIC_INTERVAL_SIZE] = "CLOUD_PUB_SYNC_INTERVAL_SIZE",
+    [SYNC_METRIC_FINISHED] = "CLOUD_PUB_SYNC_FINISHED",
+    [SYNC_METRIC_BANDWIDTH_LEVEL] = "CLOUD_PUB_SYNC_BANDWIDTH_LEVEL",
+};
+
+static const char * sync_state_names[] = {
+    [SYNC_STATE_IDLE] = "idle",
+    [SYNC_STATE_SCANNING] = "scanning",
+    [SYNC_STATE_LOADING] = "loading",
+    [SYNC_STATE_RUNNING] = "running",
+    [SYNC_STATE_FINISHED] = "finished",
+    [SYNC_STATE_STOPPED] = "stopped",
+    [SYNC_STATE_FAILED] = "failed",
+};
+
+#define SYNC_WORKERS_KEY "CLOUD_PUB_SYNC_WORKERS"
+
+// Cloud side hash of the Python engine, recording the last timestamp written
+// for each key (see python/sync.py sync_intervals())
+#define SYNC_LEDGER_KEY "CLOUD_PUB_SYNC_LEDGER"
+
+/**
+ * @brief Scope a resumption point key by the name of its publication context
+ *
+ * @return 0 on success, -1 when the name does not fit
+ */
+static int sync_key_name(char * buffer, const char * key, const char * scope) {
+    int len;
+
+    len = snprintf(buffer, SYNC_KEY_MAX_LEN, "%s%s%s", key, scope ? "." : "", scope ? scope : "");
+    return len < 0 || len >= SYNC_KEY_MAX_LEN ? -1 : 0;
+}
+
+struct sync_get_closure {
+    cloudSyncT * sync;
+    char * db_value;
+    bool * in_db;
+};
+
+static void sync_pump(cloudSyncT * sync);
+
+/*
+ * Persisted metrics helpers
+ */
+
+static void metric_set_str(cloudSyncT * sync, syncMetricIdT id, const char * value) {
+    snprintf(sync->metrics[id].value, SYNC_VALUE_MAX_LEN, "%s", value);
+}
+
+static void metric_set_int(cloudSyncT * sync, syncMetricIdT id, int64_t value) {
+    snprintf(sync->metrics[id].value, SYNC_VALUE_MAX_LEN, "%" PRId64, value);
+}
+
+static int64_t metric_int(cloudSyncT * sync, syncMetricIdT id) {
+    return strtoll(sync->metrics[id].value, NULL, 10);
+}
+
+static int64_t metric_db_int(cloudSyncT * sync, syncMetricIdT id) {
+    return strtoll(sync->metrics[id].db_value, NULL, 10);
+}
+
+static bool metric_matches_db(cloudSyncT * sync, syncMetricIdT id) {
+    return strcmp(sync->metrics[id].value, sync->metrics[id].db_value) == 0;
+}
+
+/*
+ * Asynchronous operation bookkeeping: a step issues a known number of calls and
+ * the next step is run once all of them have completed.
+ */
+
+static void sync_complete_job(int signum, void * arg) {
+    cloudSyncT * sync = arg;
+
+    if (signum) {
+        AFB_API_ERROR(sync->api, "sync: signal %s caught in sync job", strsignal(signum));
+        sync->state = SYNC_STATE_FAILED;
+        return;
+    }
+
+    sync->on_complete(sync);
+}
+
+static void sync_ops_begin(cloudSyncT * sync, int count, void (*on_complete)(cloudSyncT * sync)) {
+    pthread_mutex_lock(&sync->lock);
+    sync->pending = count;
+    sync->op_failed = false;
+    sync->disconnected = false;
+    sync->on_complete = on_complete;
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static void sync_op_done(cloudSyncT * sync) {
+    bool complete;
+
+    pthread_mutex_lock(&sync->lock);
+    complete = --sync->pending == 0;
+    pthread_mutex_unlock(&sync->lock);
+
+    if (complete && afb_api_queue_job(sync->api, sync_complete_job, sync, NULL, 0) < 0) {
+        AFB_API_ERROR(sync->api, "sync: failure to queue sync job!");
+        sync->state = SYNC_STATE_FAILED;
+    }
+}
+
+static void sync_op_failed(cloudSyncT * sync) {
+    sync->op_failed = true;
+    sync_op_done(sync);
+}
+
+static void sync_slot_release(cloudSyncT * sync, syncSlotT * slot) {
+    sync->memory_used -= slot->bytes;
+    free(slot->records);
+    free(slot->key_states);
+    json_object_put(slot->recordsJ);
+    slot->records = NULL;
+    slot->key_states = NULL;
+    slot->recordsJ = NULL;
+    slot->record_count = 0;
+    slot->acked_prefix = 0;
+    slot->bytes = 0;
+    slot->state = SYNC_SLOT_FREE;
+}
+
+static void sync_release_slots(cloudSyncT * sync) {
+    int ix;
+
+    if (sync->slots == NULL)
+        return;
+
+    for (ix = 0; ix < sync->read_window; ix++)
+        sync_slot_release(sync, &sync->slots[ix]);
+    free(sync->slots);
+    sync->slots = NULL;
+}
+
+static void sync_release(cloudSyncT * sync) {
+    sync_release_slots(sync);
+    json_object_put(sync->keysJ);
+    sync->keysJ = NULL;
+    free(sync->key_infos);
+    sync->key_infos = NULL;
+    sync->key_info_count = 0;
+    plan_release(&sync->plan);
+}
+
+static void sync_fail(cloudSyncT * sync, const char * reason) {
+    AFB_API_ERROR(sync->api, "sync: %s", reason);
+    sync_release(sync);
+    sync->state = SYNC_STATE_FAILED;
+}
+
+static bool sync_stopped(cloudSyncT * sync) {
+    if (!sync->stop_requested)
+        return false;
+
+    AFB_API_NOTICE(sync->api, "sync: stopped at interval index %" PRId64 ", key index %" PRId64,
+                   sync->interval_idx, sync->interval_key_idx);
+    sync_release(sync);
+    sync->state = SYNC_STATE_STOPPED;
+    return true;
+}
+
+static void sync_set_cb(void *closure, struct json_object *resultJ,
+                        const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+
+    if (error) {
+        AFB_API_ERROR(api, "sync: cannot persist sync info: %s [%s]", error, info ? info : "-");
+        sync_op_failed(sync);
+        return;
+    }
+    sync_op_done(sync);
+}
+
+static void sync_persist_op(cloudSyncT * sync, const char * key, const char * value) {
+    json_object * argsJ;
+
+    if (wrap_json_pack(&argsJ, "{s:s, s:s}", "key", key, "value", value)) {
+        sync_op_failed(sync);
+        return;
+    }
+    afb_api_call(sync->api, sync->redis_local_api, REDIS_VERB_SET, argsJ, sync_set_cb, sync);
+}
+
+static void sync_del_op(cloudSyncT * sync, const char * key) {
+    json_object * argsJ;
+
+    if (wrap_json_pack(&argsJ, "{s:s}", "key", key)) {
+        sync_op_failed(sync);
+        return;
+    }
+    afb_api_call(sync->api, sync->redis_local_api, REDIS_VERB_DEL, argsJ, sync_set_cb, sync);
+}
+
+static void sync_get_cb(void *closure, struct json_object *valueJ,
+                        const char *error, const char * info, afb_api_t api) {
+    struct sync_get_closure * get = closure;
+    cloudSyncT * sync = get->sync;
+    char * db_value = get->db_value;
+    bool * in_db = get->in_db;
+
+    free(get);
+
+    if (error) {
+        AFB_API_ERROR(api, "sync: cannot load sync info: %s [%s]", error, info ? info : "-");
+        sync_op_failed(sync);
+        return;
+    }
+
+    *in_db = valueJ != NULL && !json_object_is_type(valueJ, json_type_null);
+    if (*in_db)
+        snprintf(db_value, SYNC_VALUE_MAX_LEN, "%s", json_object_get_string(valueJ));
+    else
+        snprintf(db_value, SYNC_VALUE_MAX_LEN, "-1");
+
+    sync_op_done(sync);
+}
+
+static void sync_get_op(cloudSyncT * sync, const char * key, char * db_value, bool * in_db) {
+    json_object * argsJ;
+    struct sync_get_closure * get;
+
+    get = malloc(sizeof(*get));
+    if (get == NULL || wrap_json_pack(&argsJ, "{s:s}", "key", key)) {
+        free(get);
+        sync_op_failed(sync);
+        return;
+    }
+    get->sync = sync;
+    get->db_value = db_value;
+    get->in_db = in_db;
+    afb_api_call(sync->api, sync->redis_local_api, REDIS_VERB_GET, argsJ, sync_get_cb, get);
+}
+
+/*
+ * Completion
+ */
+
+static void sync_finished(cloudSyncT * sync) {
+    int64_t elapsed;
+
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot persist sync completion marker!");
+        return;
+    }
+
+    elapsed = now_ms() - sync->started_at;
+    AFB_API_NOTICE(sync->api, "sync: finished syncing database: %" PRId64 " samples in %" PRId64 " ms",
+                   sync->samples_synced, elapsed);
+    sync_release(sync);
+    sync->state = SYNC_STATE_FINISHED;
+}
+
+static void sync_finish_mark(cloudSyncT * sync) {
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot delete sync resumption data!");
+        return;
+    }
+
+    // Set the finish marker once the resumption data is gone
+    metric_set_int(sync, SYNC_METRIC_FINISHED, 1);
+    sync_ops_begin(sync, 1, sync_finished);
+    sync_persist_op(sync, sync->metric_keys[SYNC_METRIC_FINISHED], sync->metrics[SYNC_METRIC_FINISHED].value);
+}
+
+static void sync_finish(cloudSyncT * sync) {
+    int id, ix;
+
+    sync_ops_begin(sync, SYNC_METRIC_COUNT + (sync->worker_count > 1 ? 1 + 2 * sync->worker_count : 0),
+                   sync_finish_mark);
+    for (id = 0; id < SYNC_METRIC_COUNT; id++)
+        sync_del_op(sync, sync->metric_keys[id]);
+
+    if (sync->worker_count > 1) {
+        sync_del_op(sync, sync->workers_key);
+        for (ix = 0; ix < sync->worker_count; ix++) {
+            sync_del_op(sync, sync->workers[ix].key_name);
+            sync_del_op(sync, sync->workers[ix].key_idx_name);
+        }
+    }
+}
+
+/*
+ * Interval pipeline
+ *
+ * Up to read_window intervals are read ahead in a ring of slots, and up to
+ * write_window ts_minsert() calls are in flight, oldest interval first. The
+ * persisted progress only ever points to the oldest interval not fully
+ * acknowledged by the cloud side, so a resumption never skips any data.
+ *
+ * Decisions are taken by sync_pump() under the sync lock and calls are issued
+ * outside of it. Replies only update the slots and queue a pump job.
+ */
+
+struct sync_write_closure {
+    syncSlotT * slot;
+    size_t key_idx;
+    size_t samples;
+};
+
+typedef enum {
+    SYNC_ACTION_NONE,
+    SYNC_ACTION_READ,
+    SYNC_ACTION_WRITE,
+    SYNC_ACTION_PERSIST,
+    SYNC_ACTION_FINISH,
+    SYNC_ACTION_STOP,
+    SYNC_ACTION_FAIL
+} syncActionT;
+
+static void sync_pump_job(int signum, void * arg) {
+    cloudSyncT * sync = arg;
+
+    if (signum) {
+        AFB_API_ERROR(sync->api, "sync: signal %s caught in pump job", strsignal(signum));
+        sync->state = SYNC_STATE_FAILED;
+        return;
+    }
+
+    sync_pump(sync);
+}
+
+static void sync_pump_later(cloudSyncT * sync, int delay) {
+    if (afb_api_queue_job(sync->api, sync_pump_job, sync, NULL, -delay) < 0) {
+        AFB_API_ERROR(sync->api, "sync: failure to queue sync job!");
+        sync->state = SYNC_STATE_FAILED;
+    }
+}
+
+static syncSlotT * sync_slot(cloudSyncT * sync, int64_t interval_idx) {
+    return &sync->slots[interval_idx % sync->read_window];
+}
+
+// Keys of an interval are sharded across the workers by index
+static int sync_key_worker(cloudSyncT * sync, size_t key_idx) {
+    return (int)(key_idx % (size_t)sync->worker_count);
+}
+
+static bool sync_head_ready(cloudSyncT * sync) {
+    return sync->interval_idx < sync->next_read &&
+           sync_slot(sync, sync->interval_idx)->state == SYNC_SLOT_READY;
+}
+
+// Called with the sync lock held
+static void sync_fail_locked(cloudSyncT * sync) {
+    sync->pipeline_failed = true;
+}
+
+static size_t record_samples(const syncRecordT * record) {
+    json_object * timestampsJ;
+
+    if (!json_object_object_get_ex(record->seriesJ, SERIES_FIELD_TIMESTAMPS, &timestampsJ))
+        return 0;
+
+    return json_object_array_length(timestampsJ);
+}
+
+/*
+ * Move the head of the pipeline past the acknowledged keys and intervals.
+ * Returns true if the resumption point moved.
+ */
+static bool sync_advance(cloudSyncT * sync) {
+    syncSlotT * slot;
+    bool moved = false;
+
+    while (sync->interval_idx < sync->next_read) {
+        slot = sync_slot(sync, sync->interval_idx);
+        if (slot->state != SYNC_SLOT_READY)
+            break;
+
+        while (slot->acked_prefix < slot->record_count &&
+               slot->key_states[slot->acked_prefix] == SYNC_KEY_ACKED) {
+            slot->acked_prefix++;
+            moved = true;
+        }
+        if (slot->acked_prefix < slot->record_count)
+            break;
+
+        sync_slot_release(sync, slot);
+        sync->interval_idx++;
+        sync->interval_key_idx = 0;
+        moved = true;
+    }
+
+    if (sync_head_ready(sync))
+        sync->interval_key_idx = (int64_t)sync_slot(sync, sync->interval_idx)->acked_prefix;
+
+    return moved;
+}
+
+static void sync_progress_add(cloudSyncT * sync, const char * key, const char * value) {
+    syncProgressStepT * step = &sync->progress[sync->progress_count++];
+
+    step->key = key;
+    snprintf(step->value, SYNC_VALUE_MAX_LEN, "%s", value);
+}
+
+// Global index of the first key of a worker shard not yet acknowledged
+static size_t sync_worker_cursor(cloudSyncT * sync, syncSlotT * slot, int worker) {
+    size_t ix;
+
+    for (ix = slot->acked_prefix; ix < slot->record_count; ix++) {
+        if (sync_key_worker(sync, ix) == worker && slot->key_states[ix] != SYNC_KEY_ACKED)
+            break;
+    }
+    return ix;
+}
+
+/*
+ * Prepare the writes recording the resumption point. The values are not
+ * written atomically, hence the order: when moving to another interval the
+ * key index is reset first, so that the key index of one interval is never
+ * applied to another one, and the key name is always written before its
+ * index, so that a torn update fails the resumption key check.
+ *
+ * The global cursor is the one of the Python engine: all keys before it are
+ * acknowledged. With several workers, each one also records its own cursor,
+ * and the worker count is recorded along so that cursors are only ever used
+ * with the sharding that produced them.
+ */
+static void sync_progress_prepare(cloudSyncT * sync) {
+    syncSlotT * slot = sync_slot(sync, sync->interval_idx);
+    syncWorkerT * worker;
+    char value[SYNC_VALUE_MAX_LEN];
+    size_t cursor;
+    int ix;
+
+    sync->progress_count = 0;
+    sync->progress_step = 0;
+
+    if (sync->interval_idx != sync->persisted_interval_idx) {
+        for (ix = 0; sync->worker_count > 1 && ix < sync->worker_count; ix++)
+            sync_progress_add(sync, sync->workers[ix].key_idx_name, "0");
+        sync_progress_add(sync, sync->metric_keys[SYNC_METRIC_INTERVAL_KEY_IDX], "0");
+        if (sync->worker_count > 1) {
+            snprintf(value, sizeof(value), "%d", sync->worker_count);
+            sync_progress_add(sync, sync->workers_key, value);
+        }
+        snprintf(value, sizeof(value), "%" PRId64, sync->interval_idx);
+        sync_progress_add(sync, sync->metric_keys[SYNC_METRIC_INTERVAL_IDX], value);
+        sync->persisted_interval_idx = sync->interval_idx;
+    }
+
+    sync_progress_add(sync, sync->metric_keys[SYNC_METRIC_INTERVAL_KEY], slot->records[slot->acked_prefix].key);
+    snprintf(value, sizeof(value), "%zu", slot->acked_prefix);
+    sync_progress_add(sync, sync->metric_keys[SYNC_METRIC_INTERVAL_KEY_IDX], value);
+
+    for (ix = 0; sync->worker_count > 1 && ix < sync->worker_count; ix++) {
+        worker = &sync->workers[ix];
+        cursor = sync_worker_cursor(sync, slot, ix);
+        sync_progress_add(sync, worker->key_name, cursor < slot->record_count ? slot->records[cursor].key : "");
+        snprintf(value, sizeof(value), "%zu", cursor);
+        sync_progress_add(sync, worker->key_idx_name, value);
+    }
+
+    metric_set_int(sync, SYNC_METRIC_INTERVAL_IDX, sync->interval_idx);
+    metric_set_str(sync, SYNC_METRIC_INTERVAL_KEY, slot->records[slot->acked_prefix].key);
+    metric_set_int(sync, SYNC_METRIC_INTERVAL_KEY_IDX, sync->interval_key_idx);
+
+    sync->progress_dirty = false;
+    sync->progress_pending = true;
+}
+
+static void sync_progress_next(cloudSyncT * sync);
+
+static void sync_progress_cb(void *closure, struct json_object *resultJ,
+                             const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+    bool done;
+
+    pthread_mutex_lock(&sync->lock);
+    if (error) {
+        AFB_API_ERROR(api, "sync: cannot persist key progress: %s [%s]", error, info ? info : "-");
+        sync_fail_locked(sync);
+        done = true;
+    } else {
+        done = ++sync->progress_step >= sync->progress_count;
+    }
+    if (done)
+        sync->progress_pending = false;
+    pthread_mutex_unlock(&sync->lock);
+
+    if (done)
+        sync_pump_later(sync, 0);
+    else
+        sync_progress_next(sync);
+}
+
+static void sync_progress_next(cloudSyncT * sync) {
+    syncProgressStepT * step = &sync->progress[sync->progress_step];
+    json_object * argsJ;
+
+    if (wrap_json_pack(&argsJ, "{s:s, s:s}", "key", step->key, "value", step->value)) {
+        pthread_mutex_lock(&sync->lock);
+        sync_fail_locked(sync);
+        sync->progress_pending = false;
+        pthread_mutex_unlock(&sync->lock);
+        sync_pump_later(sync, 0);
+        return;
+    }
+    afb_api_call(sync->api, sync->redis_local_api, REDIS_VERB_SET, argsJ, sync_progress_cb, sync);
+}
+
+static void sync_write_cb(void *closure, struct json_object *resultJ,
+                          const char *error, const char * info, afb_api_t api) {
+    struct sync_write_closure * write = closure;
+    syncSlotT * slot = write->slot;
+    cloudSyncT * sync = slot->sync;
+    syncWorkerT * worker = &sync->workers[sync_key_worker(sync, write->key_idx)];
+    int delay = 0;
+
+    pthread_mutex_lock(&sync->lock);
+    sync->writes_inflight--;
+    worker->writes_inflight--;
+
+    // Keys the sync did not create keep their duplicate policy, BLOCK by
+    // default: samples written again on resumption, or already published
+    // live, are refused although the cloud side holds them
+    if (error && redis_tsdb_error(error, info, REDIS_TSDB_UPSERT_BLOCKED)) {
+        AFB_API_DEBUG(api, "sync: %s already holds some of the samples", slot->records[write->key_idx].key);
+        error = NULL;
+    }
+
+    if (error && strcmp(error, "disconnected") == 0) {
+        // The cloud side went away: this worker writes the same key again later
+        slot->key_states[write->key_idx] = SYNC_KEY_PENDING;
+        delay = backoff_delay(sync->backoff, worker->retry_count++);
+        worker->resume_at = now_ms() + delay;
+        AFB_API_NOTICE(api, "sync: cloud side %s disconnected, retrying in %d ms (attempt %d)",
+                       worker->cloud_api, delay, worker->retry_count);
+    } else if (error) {
+        // The key is not acknowledged: the cursor stays on it, and the sync
+        // fails if the cloud side keeps rejecting it
+        AFB_API_WARNING(api, "sync: redis error for %s: %s [%s]",
+                        slot->records[write->key_idx].key, error, info ? info : "-");
+        slot->key_states[write->key_idx] = SYNC_KEY_PENDING;
+        if (worker->error_count + 1 >= SYNC_MAX_WRITE_ERRORS) {
+            sync_fail_locked(sync);
+        } else {
+            delay = backoff_delay(sync->backoff, worker->error_count++);
+            worker->resume_at = now_ms() + delay;
+        }
+    } else {
+        slot->key_states[write->key_idx] = SYNC_KEY_ACKED;
+        sync->samples_synced += (int64_t)write->samples;
+        worker->retry_count = 0;
+        worker->error_count = 0;
+        // Worker cursors move on their own, ahead of the global one
+        if (sync->worker_count > 1 && slot->interval_idx == sync->interval_idx)
+            sync->progress_dirty = true;
+    }
+    pthread_mutex_unlock(&sync->lock);
+
+    free(write);
+    sync_pump_later(sync, delay);
+}
+
+static void sync_write_key(cloudSyncT * sync, syncSlotT * slot, size_t key_idx) {
+    syncRecordT * record = &slot->records[key_idx];
+    struct sync_write_closure * write;
+    json_object * argsJ;
+
+    write = malloc(sizeof(*write));
+    if (write == NULL || wrap_json_pack(&argsJ, "{s:O}", record->key, record->seriesJ)) {
+        free(write);
+        pthread_mutex_lock(&sync->lock);
+        sync->writes_inflight--;
+        sync->workers[sync_key_worker(sync, key_idx)].writes_inflight--;
+        sync_fail_locked(sync);
+        pthread_mutex_unlock(&sync->lock);
+        return;
+    }
+    write->slot = slot;
+    write->key_idx = key_idx;
+    write->samples = record_samples(record);
+
+    AFB_API_DEBUG(sync->api, "sync: [%" PRId64 "/%" PRId64 "] [%zu/%zu] inserting %zu records for %s",
+                  slot->interval_idx + 1, sync->intervals_total_cnt, key_idx,
+                  slot->record_count, write->samples, record->key);
+
+    afb_api_call(sync->api, sync->workers[sync_key_worker(sync, key_idx)].cloud_api, "ts_minsert",
+                 argsJ, sync_write_cb, write);
+}
+
+// Resume a worker from its own cursor, when it lies ahead of the global one
+static void sync_resume_worker(cloudSyncT * sync, syncSlotT * slot, int worker_idx) {
+    syncWorkerT * worker = &sync->workers[worker_idx];
+    size_t key_idx, ix;
+
+    if (!worker->key_in_db || !worker->key_idx_in_db)
+        return;
+
+    key_idx = (size_t)strtoull(worker->db_key_idx, NULL, 10);
+    if (key_idx <= slot->acked_prefix)
+        return;
+
+    if (key_idx < slot->record_count && strcmp(slot->records[key_idx].key, worker->db_key) != 0) {
+        AFB_API_NOTICE(sync->api, "sync: worker %d resumption key %s does not match at index %zu, "
+                       "resuming it from index %zu", worker_idx, worker->db_key, key_idx, slot->acked_prefix);
+        return;
+    }
+
+    for (ix = slot->acked_prefix; ix < key_idx && ix < slot->record_count; ix++) {
+        if (sync_key_worker(sync, ix) == worker_idx)
+            slot->key_states[ix] = SYNC_KEY_ACKED;
+    }
+}
+
+/*
+ * We rely on the ts_mrange() key order being stable to resume a sync: the key
+ * found at the resumption index must be the recorded one, the keys before it
+ * having already been acknowledged. Unlike the Python engine, a mismatch does
+ * not abort the sync: the whole interval is written again instead.
+ */
+static void sync_resume_check(cloudSyncT * sync, syncSlotT * slot) {
+    const char * interval_key = sync->metrics[SYNC_METRIC_INTERVAL_KEY].value;
+    size_t key_idx = (size_t)sync->interval_key_idx;
+    size_t ix;
+    int worker;
+
+    sync->resumation_done = true;
+
+    if (key_idx >= slot->record_count || strcmp(slot->records[key_idx].key, interval_key) != 0) {
+        if (key_idx > 0)
+            AFB_API_WARNING(sync->api, "sync: discrepancy: mismatch between resumption key and "
+                            "interval_key %s at index %zu, syncing the whole interval again", interval_key, key_idx);
+        key_idx = 0;
+    } else {
+        AFB_API_NOTICE(sync->api, "sync: sanity check passed: resumption key %s matches at index %zu",
+                       interval_key, key_idx);
+    }
+
+    sync->interval_key_idx = (int64_t)key_idx;
+    for (ix = 0; ix < key_idx; ix++)
+        slot->key_states[ix] = SYNC_KEY_ACKED;
+    slot->acked_prefix = key_idx;
+
+    // Worker cursors are only meaningful with the sharding that produced them
+    if (sync->worker_count > 1 && sync->workers_in_db &&
+        strtol(sync->db_workers, NULL, 10) == sync->worker_count) {
+        for (worker = 0; worker < sync->worker_count; worker++)
+            sync_resume_worker(sync, slot, worker);
+    }
+}
+
+static void sync_read_cb(void *closure, struct json_object *recordsJ,
+                         const char *error, const char * info, afb_api_t api) {
+    syncSlotT * slot = closure;
+    cloudSyncT * sync = slot->sync;
+    syncRecordT * record;
+    size_t count;
+
+    pthread_mutex_lock(&sync->lock);
+    sync->reads_inflight--;
+
+    if (error) {
+        AFB_API_ERROR(api, "sync: ts_mrange() failed: %s [%s]", error, info ? info : "-");
+        sync_fail_locked(sync);
+        goto done;
+    }
+
+    count = 0;
+    if (recordsJ != NULL && json_object_is_type(recordsJ, json_type_object))
+        count = (size_t)json_object_object_length(recordsJ);
+
+    slot->records = calloc(count ? count : 1, sizeof(syncRecordT));
+    slot->key_states = calloc(count ? count : 1, sizeof(syncKeyStateT));
+    if (slot->records == NULL || slot->key_states == NULL) {
+        sync_fail_locked(sync);
+        goto done;
+    }
+
+    if (count) {
+        slot->recordsJ = json_object_get(recordsJ);
+        json_object_object_foreach(recordsJ, key, seriesJ) {
+            record = &slot->records[slot->record_count];
+            record->key = key;
+            record->seriesJ = seriesJ;
+            // Empty keys have nothing to write
+            if (record_samples(record) == 0)
+                slot->key_states[slot->record_count] = SYNC_KEY_ACKED;
+            slot->bytes += record_samples(record) * SYNC_SAMPLE_SIZE_ESTIMATE;
+            slot->record_count++;
+        }
+    }
+
+    sync->memory_used += slot->bytes;
+    slot->state = SYNC_SLOT_READY;
+
+    if (sync->resumable && !sync->resumation_done && slot->interval_idx == sync->interval_idx)
+        sync_resume_check(sync, slot);
+
+done:
+    pthread_mutex_unlock(&sync->lock);
+    sync_pump_later(sync, 0);
+}
+
+// Interval bounds, following python/redis_db.py generate_sync_intervals()
+// unless planned by the adaptive planner
+static void sync_interval_bounds(cloudSyncT * sync, int64_t idx, int64_t * start, int64_t * end) {
+    int64_t upper = sync->first_ts + (idx + 1) * sync->interval_size;
+
+    if (sync->adaptive) {
+        *start = idx == 0 ? sync->first_ts : sync->plan.ends[idx - 1] + 1;
+        *end = sync->plan.ends[idx];
+        return;
+    }
+
+    *start = idx == 0 ? sync->first_ts : sync->first_ts + idx * sync->interval_size + 1;
+    *end = (idx == 0 || upper < sync->last_ts) ? upper : sync->last_ts;
+}
+
+static void sync_read_interval(cloudSyncT * sync, syncSlotT * slot) {
+    json_object * argsJ;
+    int64_t start, end;
+    char fromts[SYNC_VALUE_MAX_LEN];
+    char tots[SYNC_VALUE_MAX_LEN];
+
+    sync_interval_bounds(sync, slot->interval_idx, &start, &end);
+    snprintf(fromts, sizeof(fromts), "%" PRId64, start);
+    snprintf(tots, sizeof(tots), "%" PRId64, end);
+    if (wrap_json_pack(&argsJ, "{s:s, s:s, s:s}", "class", sync->key_label_ts,
+                       "fromts", fromts, "tots", tots)) {
+        AFB_API_ERROR(sync->api, "sync: ts_mrange() argument packing failed!");
+        pthread_mutex_lock(&sync->lock);
+        sync->reads_inflight--;
+        sync_fail_locked(sync);
+        pthread_mutex_unlock(&sync->lock);
+        return;
+    }
+
+    AFB_API_INFO(sync->api, "sync: [%" PRId64 "/%" PRId64 "] synchronizing interval %" PRId64 " => %" PRId64,
+                 slot->interval_idx + 1, sync->intervals_total_cnt, start, end);
+    afb_api_call(sync->api, sync->redis_local_api, "ts_mrange", argsJ, sync_read_cb, slot);
+}
+
+// Pick the next thing to do. Called with the sync lock held.
+static syncActionT sync_pump_select(cloudSyncT * sync, syncSlotT ** slotp, size_t * key_idx) {
+    syncSlotT * slot;
+    syncWorkerT * worker;
+    int64_t idx, now;
+    size_t ix;
+    bool idle;
+
+    if (sync->pipeline_closed)
+        return SYNC_ACTION_NONE;
+
+    if (sync_advance(sync))
+        sync->progress_dirty = true;
+
+    idle = sync->reads_inflight == 0 && sync->writes_inflight == 0 && !sync->progress_pending;
+    now = now_ms();
+
+    if (sync->pipeline_failed) {
+        sync->pipeline_closed = idle;
+        return idle ? SYNC_ACTION_FAIL : SYNC_ACTION_NONE;
+    }
+
+    // Progress can only be recorded once the keys of the head interval are known
+    if (sync->progress_dirty && !sync->progress_pending && sync_head_ready(sync)) {
+        sync_progress_prepare(sync);
+        return SYNC_ACTION_PERSIST;
+    }
+
+    if (sync->stop_requested) {
+        sync->pipeline_closed = idle;
+        return idle ? SYNC_ACTION_STOP : SYNC_ACTION_NONE;
+    }
+
+    if (sync->interval_idx >= sync->intervals_total_cnt) {
+        sync->pipeline_closed = idle;
+        return idle ? SYNC_ACTION_FINISH : SYNC_ACTION_NONE;
+    }
+
+    // Writes go first, oldest interval first, so that the head moves on. Each
+    // worker has its own write window.
+    if (sync->writes_inflight < sync->write_window * sync->worker_count) {
+        for (idx = sync->interval_idx; idx < sync->next_read; idx++) {
+            slot = sync_slot(sync, idx);
+            if (slot->state != SYNC_SLOT_READY)
+                continue;
+            for (ix = slot->acked_prefix; ix < slot->record_count; ix++) {
+                if (slot->key_states[ix] != SYNC_KEY_PENDING)
+                    continue;
+                worker = &sync->workers[sync_key_worker(sync, ix)];
+                if (worker->writes_inflight >= sync->write_window || now < worker->resume_at)
+                    continue;
+                slot->key_states[ix] = SYNC_KEY_INFLIGHT;
+                sync->writes_inflight++;
+                worker->writes_inflight++;
+                *slotp = slot;
+                *key_idx = ix;
+                return SYNC_ACTION_WRITE;
+            }
+        }
+    }
+
+    // Read ahead within the window, as long as the memory cap allows it. The
+    // head interval is always read, whatever its size.
+    if (sync->next_read < sync->intervals_total_cnt &&
+        sync->next_read - sync->interval_idx < sync->read_window &&
+        (sync->memory_used == 0 || sync->memory_used < sync->memory_cap)) {
+        slot = sync_slot(sync, sync->next_read);
+        slot->state = SYNC_SLOT_READING;
+        slot->interval_idx = sync->next_read++;
+        sync->reads_inflight++;
+        *slotp = slot;
+        return SYNC_ACTION_READ;
+    }
+
+    return SYNC_ACTION_NONE;
+}
+
+static void sync_pump(cloudSyncT * sync) {
+    syncActionT action;
+    syncSlotT * slot = NULL;
+    size_t key_idx = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&sync->lock);
+        action = sync_pump_select(sync, &slot, &key_idx);
+        pthread_mutex_unlock(&sync->lock);
+
+        switch (action) {
+            case SYNC_ACTION_READ:
+                sync_read_interval(sync, slot);
+                break;
+            case SYNC_ACTION_WRITE:
+                sync_write_key(sync, slot, key_idx);
+                break;
+            case SYNC_ACTION_PERSIST:
+                sync_progress_next(sync);
+                break;
+            case SYNC_ACTION_FINISH:
+                sync_finish(sync);
+                return;
+            case SYNC_ACTION_STOP:
+                sync_stopped(sync);
+                return;
+            case SYNC_ACTION_FAIL:
+                sync_fail(sync, "interval synchronization failed!");
+                return;
+            default:
+                return;
+        }
+    }
+}
+
+static void sync_run(cloudSyncT * sync) {
+    int ix;
+
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot persist sync info!");
+        return;
+    }
+
+    sync->resumation_done = false;
+    if (sync->resumable) {
+        sync->interval_idx = metric_int(sync, SYNC_METRIC_INTERVAL_IDX);
+        sync->interval_key_idx = metric_int(sync, SYNC_METRIC_INTERVAL_KEY_IDX);
+        if (sync->interval_key_idx < 0)
+            sync->interval_key_idx = 0;
+        AFB_API_NOTICE(sync->api, "sync: resuming synchronization at interval index %" PRId64
+                       ", on key at index #%" PRId64 " - %s", sync->interval_idx, sync->interval_key_idx,
+                       sync->metrics[SYNC_METRIC_INTERVAL_KEY].value);
+    } else {
+        sync->interval_idx = 0;
+        sync->interval_key_idx = 0;
+        AFB_API_NOTICE(sync->api, "sync: resume information not available. Syncing from scratch.");
+    }
+
+    sync->slots = calloc((size_t)sync->read_window, sizeof(syncSlotT));
+    if (sync->slots == NULL) {
+        sync_fail(sync, "cannot allocate the interval pipeline!");
+        return;
+    }
+    for (ix = 0; ix < sync->read_window; ix++)
+        sync->slots[ix].sync = sync;
+
+    sync->next_read = sync->interval_idx;
+    sync->persisted_interval_idx = sync->resumable ? sync->interval_idx : -1;
+    sync->reads_inflight = 0;
+    sync->writes_inflight = 0;
+    sync->memory_used = 0;
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        sync->workers[ix].writes_inflight = 0;
+        sync->workers[ix].resume_at = 0;
+        sync->workers[ix].retry_count = 0;
+        sync->workers[ix].error_count = 0;
+    }
+    sync->progress_dirty = false;
+    sync->progress_pending = false;
+    sync->pipeline_failed = false;
+    sync->pipeline_closed = false;
+    sync->state = SYNC_STATE_RUNNING;
+
+    AFB_API_INFO(sync->api, "sync: pipeline of %d interval reads and %d workers of %d key writes, "
+                 "%zu kB memory cap", sync->read_window, sync->worker_count, sync->write_window,
+                 sync->memory_cap / 1024);
+    sync_pump(sync);
+}
+
+/*
+ * Resumption check, following python/sync.py SyncInfo.is_sync_resumable()
+ */
+static bool sync_is_resumable(cloudSyncT * sync) {
+    int id;
+
+    // Any missing sync value means we cannot resume sync
+    for (id = 0; id < SYNC_METRIC_COUNT; id++) {
+        if (!sync->metrics[id].in_db) {
+            AFB_API_INFO(sync->api, "sync: did not find any DB value for %s, cannot resume sync.",
+                         sync->metric_keys[id]);
+            return false;
+        }
+    }
+
+    // Consistency check for stored values: we must have computed the same
+    // values as the stored ones for the sync to be properly resumed.
+    if (metric_db_int(sync, SYNC_METRIC_INTERVAL_IDX) == -1) {
+        AFB_API_INFO(sync->api, "sync: interval index value is -1. Syncing from scratch.");
+        return false;
+    }
+
+    for (id = SYNC_METRIC_TS_START; id <= SYNC_METRIC_BANDWIDTH_LEVEL; id++) {
+        if (id == SYNC_METRIC_FINISHED)
+            continue;
+        if (!metric_matches_db(sync, id)) {
+            AFB_API_INFO(sync->api, "sync: mismatch: %s db: %s | computed: %s. Cannot resume sync.",
+                         sync->metric_keys[id], sync->metrics[id].db_value, sync->metrics[id].value);
+            return false;
+        }
+    }
+
+    // Retrieved values are consistent, use them
+    for (id = SYNC_METRIC_INTERVAL_IDX; id <= SYNC_METRIC_INTERVAL_KEY_IDX; id++)
+        metric_set_str(sync, id, sync->metrics[id].db_value);
+
+    AFB_API_INFO(sync->api, "sync: resumption counters OK. Sync is resumable.");
+    return true;
+}
+
+/*
+ * Cloud side keys creation, following python/sync.py sync_keys()
+ */
+
+static void sync_create_cb(void *closure, struct json_object *resultJ,
+                           const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+
+    // Keys and rules created by a previous sync, the other engine or the
+    // live publication are fine
+    if (error && !redis_tsdb_error(error, info, REDIS_TSDB_KEY_EXISTS) &&
+        !redis_tsdb_error(error, info, REDIS_TSDB_RULE_EXISTS)) {
+        AFB_API_ERROR(api, "sync: cannot create cloud side key or rule: %s [%s]", error, info ? info : "-");
+        sync_op_failed(sync);
+        return;
+    }
+    sync_op_done(sync);
+}
+
+// Name of the compacted counterpart of a key: the key label gets the suffix
+static void sync_compaction_key(cloudSyncT * sync, const char * key, char * buffer, size_t size) {
+    size_t label_len = strlen(sync->key_label_ts);
+
+    snprintf(buffer, size, "%s%s%s", sync->key_label_ts, sync->compaction_suffix,
+             strncmp(key, sync->key_label_ts, label_len) == 0 ? key + label_len : key);
+}
+
+static void sync_create_op(cloudSyncT * sync, const char * key, const char * label) {
+    json_object * argsJ;
+
+    // Samples written again after a resumption replace the stored ones
+    if (wrap_json_pack(&argsJ, "{s:s, s:{s:s}, s:s}", "key", key, "labels", "class", label,
+                       "duplicate_policy", "last")) {
+        sync_op_failed(sync);
+        return;
+    }
+    afb_api_call(sync->api, sync->redis_cloud_api, REDIS_VERB_TS_CREATE, argsJ, sync_create_cb, sync);
+}
+
+static void sync_create_rule_op(cloudSyncT * sync, const char * key, const char * compaction_key) {
+    json_object * argsJ;
+
+    if (wrap_json_pack(&argsJ, "{s:s, s:s, s:{s:s, s:I}}", "source", key, "dest", compaction_key,
+                       "aggregation", "type", sync->compaction_aggregator,
+                       "bucket", sync->compaction_bucket)) {
+        sync_op_failed(sync);
+        return;
+    }
+    afb_api_call(sync->api, sync->redis_cloud_api, REDIS_VERB_TS_CREATERULE, argsJ, sync_create_cb, sync);
+}
+
+static void sync_keys_created(cloudSyncT * sync);
+
+/**
+ * @brief Create the cloud side keys of the next local keys
+ *
+ * Keys, along with their compacted counterpart, are created SYNC_SCAN_WINDOW
+ * at a time, then the compaction rules, once both ends of each of them exist.
+ */
+static void sync_create_next(cloudSyncT * sync) {
+    char compaction_key[SYNC_VALUE_MAX_LEN];
+    char compaction_label[SYNC_VALUE_MAX_LEN];
+    const char * key;
+    size_t count, batch, ix;
+
+    if (sync_stopped(sync))
+        return;
+
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot create cloud side keys!");
+        return;
+    }
+
+    count = json_object_array_length(sync->keysJ);
+    if (sync->key_create_idx >= count && sync->compaction && !sync->key_create_rules) {
+        sync->key_create_rules = true;
+        sync->key_create_idx = 0;
+    }
+    if (sync->key_create_idx >= count) {
+        sync_keys_created(sync);
+        return;
+    }
+
+    batch = count - sync->key_create_idx;
+    if (batch > SYNC_SCAN_WINDOW)
+        batch = SYNC_SCAN_WINDOW;
+
+    snprintf(compaction_label, sizeof(compaction_label), "%s%s", sync->key_label_ts,
+             sync->compaction ? sync->compaction_suffix : "");
+    sync_ops_begin(sync, (int)batch * (sync->compaction && !sync->key_create_rules ? 2 : 1),
+                   sync_create_next);
+    for (ix = 0; ix < batch; ix++) {
+        key = json_object_get_string(json_object_array_get_idx(sync->keysJ, sync->key_create_idx++));
+        if (sync->compaction)
+            sync_compaction_key(sync, key, compaction_key, sizeof(compaction_key));
+
+        if (sync->key_create_rules) {
+            sync_create_rule_op(sync, key, compaction_key);
+            continue;
+        }
+        sync_create_op(sync, key, sync->key_label_ts);
+        if (sync->compaction)
+            sync_create_op(sync, compaction_key, compaction_label);
+    }
+}
+
+static void sync_restart(cloudSyncT * sync) {
+    int id;
+
+    // Sync to disk to resync from scratch
+    sync_ops_begin(sync, SYNC_METRIC_COUNT, sync_run);
+    for (id = 0; id < SYNC_METRIC_COUNT; id++)
+        sync_persist_op(sync, sync->metric_keys[id], sync->metrics[id].value);
+}
+
+static void sync_ledger_reset(cloudSyncT * sync) {
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot reset the cloud side ledger!");
+        return;
+    }
+    sync_restart(sync);
+}
+
+static void sync_ledger_del_cb(void *closure, struct json_object *resultJ,
+                               const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+
+    if (error) {
+        AFB_API_ERROR(api, "sync: cannot reset the cloud side ledger: %s [%s]", error, info ? info : "-");
+        sync_op_failed(sync);
+        return;
+    }
+    sync_op_done(sync);
+}
+
+// The cloud side API of a worker, unless an earlier worker already uses it
+static const char * sync_ledger_api(cloudSyncT * sync, int ix) {
+    const char * cloud_api = sync->workers[ix].cloud_api ? sync->workers[ix].cloud_api : sync->redis_cloud_api;
+    const char * other_api;
+    int jx;
+
+    for (jx = 0; jx < ix; jx++) {
+        other_api = sync->workers[jx].cloud_api ? sync->workers[jx].cloud_api : sync->redis_cloud_api;
+        if (strcmp(cloud_api, other_api) == 0)
+            return NULL;
+    }
+    return cloud_api;
+}
+
+/**
+ * @brief Reset the Python engine ledger before syncing from scratch
+ *
+ * The Python engine skips the samples at or below the timestamp its ledger
+ * records for each key. Left from the sync being restarted, the ledger would
+ * make a later Python resumption skip samples the cloud side may no longer
+ * hold. It is deleted through every cloud side API of the workers, before the
+ * new resumption point is saved. The native engine does not use it otherwise.
+ */
+static void sync_ledger_delete(cloudSyncT * sync) {
+    json_object * argsJ;
+    const char * cloud_api;
+    int ix, count = 0;
+
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        if (sync_ledger_api(sync, ix))
+            count++;
+    }
+
+    sync_ops_begin(sync, count, sync_ledger_reset);
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        cloud_api = sync_ledger_api(sync, ix);
+        if (cloud_api == NULL)
+            continue;
+        if (wrap_json_pack(&argsJ, "{s:s}", "key", SYNC_LEDGER_KEY)) {
+            sync_op_failed(sync);
+            continue;
+        }
+        afb_api_call(sync->api, cloud_api, REDIS_VERB_DEL, argsJ, sync_ledger_del_cb, sync);
+    }
+}
+
+static void sync_keys_created(cloudSyncT * sync) {
+    sync->resumable = sync_is_resumable(sync);
+    if (sync->resumable) {
+        sync_run(sync);
+        return;
+    }
+
+    if (sync->python_keys)
+        sync_ledger_delete(sync);
+    else
+        sync_restart(sync);
+}
+
+static void sync_loaded(cloudSyncT * sync) {
+    if (sync->op_failed) {
+        sync_fail(sync, "cannot load sync info!");
+        return;
+    }
+
+    // The sync completion indicator value is driven by what is in the DB
+    metric_set_str(sync, SYNC_METRIC_FINISHED, sync->metrics[SYNC_METRIC_FINISHED].db_value);
+    if (metric_int(sync, SYNC_METRIC_FINISHED) == 1) {
+        AFB_API_NOTICE(sync->api, "sync: database fully synchronized, nothing to do.");
+        sync_release(sync);
+        sync->state = SYNC_STATE_FINISHED;
+        return;
+    }
+
+    sync->key_create_idx = 0;
+    sync->key_create_rules = false;
+    sync_create_next(sync);
+}
+
+static void sync_load(cloudSyncT * sync) {
+    syncWorkerT * worker;
+    int id, ix;
+
+    sync->state = SYNC_STATE_LOADING;
+    sync_ops_begin(sync, SYNC_METRIC_COUNT + (sync->worker_count > 1 ? 1 + 2 * sync->worker_count : 0),
+                   sync_loaded);
+    for (id = 0; id < SYNC_METRIC_COUNT; id++)
+        sync_get_op(sync, sync->metric_keys[id], sync->metrics[id].db_value, &sync->metrics[id].in_db);
+
+    if (sync->worker_count > 1) {
+        sync_get_op(sync, sync->workers_key, sync->db_workers, &sync->workers_in_db);
+        for (ix = 0; ix < sync->worker_count; ix++) {
+            worker = &sync->workers[ix];
+            sync_get_op(sync, worker->key_name, worker->db_key, &worker->key_in_db);
+            sync_get_op(sync, worker->key_idx_name, worker->db_key_idx, &worker->key_idx_in_db);
+        }
+    }
+}
+
+/*
+ * Database scan: sync time range over all keys
+ */
+
+static int sync_plan(cloudSyncT * sync) {
+    int64_t span, max_samples;
+
+    if (!sync->adaptive) {
+        span = sync->last_ts - sync->first_ts;
+        sync->intervals_total_cnt = span <= 0 ? 1 : (span + sync->interval_size - 1) / sync->interval_size;
+        return 0;
+    }
+
+    max_samples = (int64_t)sync->byte_budget_kb * 1024 / SYNC_SAMPLE_SIZE_ESTIMATE;
+    if (sync->target_samples < max_samples)
+        max_samples = sync->target_samples;
+
+    if (plan_adaptive(&sync->plan, sync->key_infos, sync->key_info_count,
+                      sync->first_ts, sync->last_ts, max_samples) < 0)
+        return -1;
+
+    sync->intervals_total_cnt = sync->plan.count;
+    AFB_API_INFO(sync->api, "sync: adaptive plan of about %" PRId64 " samples per interval", max_samples);
+    return 0;
+}
+
+static void sync_scan_done(cloudSyncT * sync) {
+    int id;
+
+    if (json_object_array_length(sync->keysJ) == 0 || sync->first_ts > sync->last_ts) {
+        AFB_API_NOTICE(sync->api, "sync: no time series found for %s.*, nothing to do.", sync->key_label_ts);
+        sync_release(sync);
+        sync->state = SYNC_STATE_FINISHED;
+        return;
+    }
+
+    if (sync_plan(sync) < 0) {
+        sync_fail(sync, "cannot plan sync intervals!");
+        return;
+    }
+
+    AFB_API_NOTICE(sync->api, "sync: %zu keys, %" PRId64 " samples, time range %" PRId64 " to %" PRId64
+                   " split into %" PRId64 " intervals", json_object_array_length(sync->keysJ),
+                   sync->total_samples, sync->first_ts, sync->last_ts, sync->intervals_total_cnt);
+
+    // Use -1 as a special initialization value, as the Python engine does
+    for (id = 0; id < SYNC_METRIC_COUNT; id++) {
+        sync->metrics[id].in_db = false;
+        metric_set_int(sync, id, -1);
+    }
+    metric_set_int(sync, SYNC_METRIC_TS_START, sync->first_ts);
+    metric_set_int(sync, SYNC_METRIC_TS_END, sync->last_ts);
+    metric_set_int(sync, SYNC_METRIC_INTERVALS_TOTAL_CNT, sync->intervals_total_cnt);
+    // An adaptive plan has no interval size: its fingerprint is recorded
+    // instead, negated so that it never matches a fixed size. A sync is thus
+    // only resumed with the very same plan, and never by the Python engine.
+    metric_set_int(sync, SYNC_METRIC_INTERVAL_SIZE, sync->adaptive ? -sync->plan.fingerprint : sync->interval_size);
+    metric_set_str(sync, SYNC_METRIC_BANDWIDTH_LEVEL, SYNC_DEFAULT_BANDWIDTH_LEVEL);
+
+    sync_load(sync);
+}
+
+static void sync_scan_next(cloudSyncT * sync);
+
+static void sync_ts_info_cb(void *closure, struct json_object *infoJ,
+                            const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+    int64_t first_ts, last_ts, samples;
+
+    if (error || wrap_json_unpack(infoJ, "{s:I, s:I, s:I}", "first_timestamp", &first_ts,
+                                  "last_timestamp", &last_ts, "total_samples", &samples)) {
+        AFB_API_ERROR(api, "sync: cannot retrieve time series info: %s [%s]",
+                      error ? error : "unexpected reply", info ? info : "-");
+        sync_op_failed(sync);
+        return;
+    }
+
+    // Empty series do not contribute to the time range
+    pthread_mutex_lock(&sync->lock);
+    if (samples > 0) {
+        if (first_ts < sync->first_ts)
+            sync->first_ts = first_ts;
+        if (last_ts > sync->last_ts)
+            sync->last_ts = last_ts;
+        sync->total_samples += samples;
+
+        if (sync->key_infos != NULL) {
+            sync->key_infos[sync->key_info_count].first_ts = first_ts;
+            sync->key_infos[sync->key_info_count].last_ts = last_ts;
+            sync->key_infos[sync->key_info_count].samples = samples;
+            sync->key_info_count++;
+        }
+    }
+    pthread_mutex_unlock(&sync->lock);
+
+    sync_op_done(sync);
+}
+
+/**
+ * @brief Retrieve the time series info of the next keys
+ *
+ * Up to SYNC_SCAN_WINDOW ts_info() calls are issued at once, the next ones
+ * once all of them are answered, so that the scan takes a handful of round
+ * trips rather than one per key.
+ */
+static void sync_scan_next(cloudSyncT * sync) {
+    json_object * argsJ;
+    json_object * keyJ;
+    size_t count, batch, ix;
+
+    if (sync_stopped(sync))
+        return;
+
+    if (sync->op_failed) {
+        sync_fail(sync, "database scan failed!");
+        return;
+    }
+
+    count = json_object_array_length(sync->keysJ);
+    if (sync->key_scan_idx >= count) {
+        sync_scan_done(sync);
+        return;
+    }
+
+    batch = count - sync->key_scan_idx;
+    if (batch > SYNC_SCAN_WINDOW)
+        batch = SYNC_SCAN_WINDOW;
+
+    sync_ops_begin(sync, (int)batch, sync_scan_next);
+    for (ix = 0; ix < batch; ix++) {
+        keyJ = json_object_array_get_idx(sync->keysJ, sync->key_scan_idx++);
+        if (wrap_json_pack(&argsJ, "{s:O}", "key", keyJ)) {
+            AFB_API_ERROR(sync->api, "sync: ts_info() argument packing failed!");
+            sync_op_failed(sync);
+            continue;
+        }
+        afb_api_call(sync->api, sync->redis_local_api, REDIS_VERB_TS_INFO, argsJ, sync_ts_info_cb, sync);
+    }
+}
+
+static void sync_keys_cb(void *closure, struct json_object *keysJ,
+                         const char *error, const char * info, afb_api_t api) {
+    cloudSyncT * sync = closure;
+
+    if (error || keysJ == NULL || !json_object_is_type(keysJ, json_type_array)) {
+        AFB_API_ERROR(api, "sync: cannot list database keys: %s [%s]",
+                      error ? error : "unexpected reply", info ? info : "-");
+        sync_fail(sync, "database scan failed!");
+        return;
+    }
+
+    sync->keysJ = json_object_get(keysJ);
+    sync->key_scan_idx = 0;
+    sync->key_info_count = 0;
+    if (sync->adaptive) {
+        sync->key_infos = calloc(json_object_array_length(keysJ) + 1, sizeof(syncKeyInfoT));
+        if (sync->key_infos == NULL) {
+            sync_fail(sync, "cannot allocate database scan results!");
+            return;
+        }
+    }
+    sync->first_ts = INT64_MAX;
+    sync->last_ts = INT64_MIN;
+    sync->total_samples = 0;
+    sync->op_failed = false;
+
+    AFB_API_INFO(api, "sync: found %zu keys using %s.*", json_object_array_length(keysJ), sync->key_label_ts);
+
+    sync->on_complete = sync_scan_next;
+    if (afb_api_queue_job(sync->api, sync_complete_job, sync, NULL, 0) < 0)
+        sync_fail(sync, "failure to queue sync job!");
+}
+
+/*
+ * Public entry points
+ */
+
+/**
+ * @brief Parse the optional 'sync' configuration section
+ *
+ * @param api - the binding API
+ * @param sync - the sync engine to configure
+ * @param syncJ - the 'sync' section, may be NULL
+ * @param default_label - the key label to use when none is configured
+ * @param scope - the name of the publication context, NULL for the first one
+ * @return 0 on success, -1 on parsing error
+ */
+int sync_config(afb_api_t api, cloudSyncT * sync, json_object * syncJ, const char * default_label,
+                const char * scope) {
+    int err, ix, id;
+    int memory_cap_kb = SYNC_DEFAULT_MEMORY_CAP_KB;
+    json_object * cloudApisJ = NULL;
+    const char * planner = NULL;
+    json_object * compactionJ = NULL;
+    syncWorkerT * worker;
+    size_t api_count = 0;
+
+    memset(sync, 0, sizeof(*sync));
+    pthread_mutex_init(&sync->lock, NULL);
+
+    for (id = 0; id < SYNC_METRIC_COUNT; id++) {
+        if (sync_key_name(sync->metric_keys[id], sync_metric_keys[id], scope) < 0) {
+            AFB_API_ERROR(api, "Context name '%s' too long for the sync keys!", scope);
+            return -1;
+        }
+    }
+    if (sync_key_name(sync->workers_key, SYNC_WORKERS_KEY, scope) < 0) {
+        AFB_API_ERROR(api, "Context name '%s' too long for the sync keys!", scope);
+        return -1;
+    }
+    sync->key_label_ts = default_label;
+    sync->python_keys = scope == NULL;
+    sync->interval_size = SYNC_DEFAULT_INTERVAL_SIZE;
+    sync->read_window = SYNC_DEFAULT_READ_WINDOW;
+    sync->write_window = SYNC_DEFAULT_WRITE_WINDOW;
+    sync->memory_cap = (size_t)memory_cap_kb * 1024;
+    sync->target_samples = SYNC_DEFAULT_TARGET_SAMPLES;
+    sync->byte_budget_kb = SYNC_DEFAULT_BYTE_BUDGET_KB;
+    sync->worker_count = 1;
+    sync->compaction_aggregator = SYNC_DEFAULT_COMPACTION_AGGREGATOR;
+    sync->compaction_bucket = SYNC_DEFAULT_COMPACTION_BUCKET;
+    sync->state = SYNC_STATE_IDLE;
+
+    if (syncJ == NULL)
+        return 0;
+
+    sync->worker_count = 0;
+    err = wrap_json_unpack(syncJ, "{s?:s, s?:I, s?:s, s?:I, s?:i, s?:i, s?:i, s?:i, s?:i, s?:o, s?:o}",
+                           "key_label_ts", &sync->key_label_ts,
+                           "time_interval_size", &sync->interval_size,
+                           "interval_planner", &planner,
+                           "target_samples", &sync->target_samples,
+                           "byte_budget_kb", &sync->byte_budget_kb,
+                           "read_window", &sync->read_window,
+                           "write_window", &sync->write_window,
+                           "memory_cap_kb", &memory_cap_kb,
+                           "workers", &sync->worker_count,
+                           "cloud_apis", &cloudApisJ, "compaction", &compactionJ);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse sync config at '%s'. Error is: %s",
+                      json_object_to_json_string(syncJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (sync->interval_size <= 0) {
+        AFB_API_ERROR(api, "Sync time interval size must be positive!");
+        return -1;
+    }
+
+    if (compactionJ != NULL) {
+        err = wrap_json_unpack(compactionJ, "{s:s, s?:s, s?:I !}", "key_suffix", &sync->compaction_suffix,
+                               "aggregator", &sync->compaction_aggregator,
+                               "bucket_duration", &sync->compaction_bucket);
+        if (err) {
+            AFB_API_ERROR(api, "Cannot parse sync compaction config at '%s'. Error is: %s",
+                          json_object_to_json_string(compactionJ), wrap_json_get_error_string(err));
+            return -1;
+        }
+        if (sync->compaction_bucket <= 0) {
+            AFB_API_ERROR(api, "Sync compaction bucket duration must be positive!");
+            return -1;
+        }
+        sync->compaction = true;
+    }
+
+    if (planner != NULL && strcmp(planner, "adaptive") == 0) {
+        sync->adaptive = true;
+    } else if (planner != NULL && strcmp(planner, "fixed") != 0) {
+        AFB_API_ERROR(api, "Unknown sync interval planner '%s', expected 'fixed' or 'adaptive'!", planner);
+        return -1;
+    }
+
+    if (sync->adaptive && (sync->target_samples <= 0 || sync->byte_budget_kb <= 0)) {
+        AFB_API_ERROR(api, "Sync target samples and byte budget must be positive!");
+        return -1;
+    }
+
+    if (sync->read_window <= 0 || sync->write_window <= 0 || memory_cap_kb <= 0) {
+        AFB_API_ERROR(api, "Sync read window, write window and memory cap must be positive!");
+        return -1;
+    }
+    sync->memory_cap = (size_t)memory_cap_kb * 1024;
+
+    if (cloudApisJ != NULL) {
+        if (!json_object_is_type(cloudApisJ, json_type_array) ||
+            (api_count = json_object_array_length(cloudApisJ)) == 0) {
+            AFB_API_ERROR(api, "Sync cloud APIs must be a non-empty array of API names!");
+            return -1;
+        }
+    }
+
+    // One worker per cloud side connection unless told otherwise
+    if (sync->worker_count == 0)
+        sync->worker_count = api_count ? (int)api_count : 1;
+
+    if (sync->worker_count < 0 || sync->worker_count > SYNC_MAX_WORKERS) {
+        AFB_API_ERROR(api, "Sync worker count must be between 1 and %d!", SYNC_MAX_WORKERS);
+        return -1;
+    }
+
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        worker = &sync->workers[ix];
+        if (snprintf(worker->key_name, sizeof(worker->key_name), "%s.%d",
+                     sync->metric_keys[SYNC_METRIC_INTERVAL_KEY], ix) >= (int)sizeof(worker->key_name) ||
+            snprintf(worker->key_idx_name, sizeof(worker->key_idx_name), "%s.%d",
+                     sync->metric_keys[SYNC_METRIC_INTERVAL_KEY_IDX], ix) >= (int)sizeof(worker->key_idx_name)) {
+            AFB_API_ERROR(api, "Context name '%s' too long for the sync keys!", scope);
+            return -1;
+        }
+
+        // Workers share the configured cloud APIs round-robin. Without any,
+        // they all use the binding cloud side API.
+        if (api_count == 0)
+            continue;
+        worker->cloud_api = json_object_get_string(json_object_array_get_idx(cloudApisJ, (size_t)ix % api_count));
+        if (worker->cloud_api == NULL) {
+            AFB_API_ERROR(api, "Invalid sync cloud API at index %d!", ix);
+            return -1;
+        }
+        if ((size_t)ix < api_count && afb_api_require_api(api, worker->cloud_api, 0) < 0) {
+            AFB_API_ERROR(api, "Cannot require sync cloud API '%s'!", worker->cloud_api);
+            return -1;
+        }
+    }
+
+    if (sync->adaptive)
+        AFB_API_DEBUG(api, "Sync engine: key label %s, adaptive intervals of %" PRId64 " samples "
+                      "and %d kB at most", sync->key_label_ts, sync->target_samples, sync->byte_budget_kb);
+    else
+        AFB_API_DEBUG(api, "Sync engine: key label %s, time interval size %" PRId64 " ms",
+                      sync->key_label_ts, sync->interval_size);
+    AFB_API_DEBUG(api, "Sync engine: read window %d, %d workers, write window %d, memory cap %d kB",
+                  sync->read_window, sync->worker_count, sync->write_window, memory_cap_kb);
+    return 0;
+}
+
+/**
+ * @brief Start synchronizing the local database with the cloud side
+ *
+ * @return 0 on success
+ * @return -1 if a sync is already in progress or cannot be started
+ */
+int sync_start(cloudSyncT * sync, afb_api_t api, const char * redis_local_api,
+               const char * redis_cloud_api, cloudBackoffT * backoff) {
+    json_object * argsJ;
+    char pattern[SYNC_VALUE_MAX_LEN];
+    int ix;
+
+    if (sync->state == SYNC_STATE_SCANNING || sync->state == SYNC_STATE_LOADING ||
+        sync->state == SYNC_STATE_RUNNING)
+        return -1;
+
+    snprintf(pattern, sizeof(pattern), "%s.*", sync->key_label_ts);
+    if (wrap_json_pack(&argsJ, "{s:s}", "pattern", pattern))
+        return -1;
+
+    sync->api = api;
+    sync->redis_local_api = redis_local_api;
+    sync->redis_cloud_api = redis_cloud_api;
+    sync->backoff = backoff;
+    sync->stop_requested = false;
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        if (sync->workers[ix].cloud_api == NULL)
+            sync->workers[ix].cloud_api = redis_cloud_api;
+    }
+    sync->samples_synced = 0;
+    sync->started_at = now_ms();
+    sync->state = SYNC_STATE_SCANNING;
+
+    afb_api_call(api, redis_local_api, REDIS_VERB_KEYS, argsJ, sync_keys_cb, sync);
+    return 0;
+}
+
+/**
+ * @brief Request the current sync to stop
+ *
+ * The sync stops once the calls in flight have completed. Progress is kept on
+ * the local side so that it can be resumed by the next start.
+ *
+ * @return 0 on success, -1 if no sync is in progress
+ */
+int sync_stop(cloudSyncT * sync) {
+    if (sync->state != SYNC_STATE_SCANNING && sync->state != SYNC_STATE_LOADING &&
+        sync->state != SYNC_STATE_RUNNING)
+        return -1;
+
+    sync->stop_requested = true;
+    return 0;
+}
+
+json_object * sync_status(cloudSyncT * sync) {
+    json_object * statusJ = NULL;
+    json_object * workersJ;
+    json_object * workerJ;
+    int64_t elapsed;
+    int ix;
+
+    elapsed = sync->started_at ? now_ms() - sync->started_at : 0;
+    wrap_json_pack(&statusJ, "{s:s, s:s, s:I, s:I, s:I, s:s, s:I, s:I, s:I, s:I, s:I, s:i, s:i, s:I}",
+                   "state", sync_state_names[sync->state],
+                   "key_label_ts", sync->key_label_ts,
+                   "interval_index", sync->interval_idx,
+                   "intervals_total_cnt", sync->intervals_total_cnt,
+                   "interval_key_index", sync->interval_key_idx,
+                   "interval_key", sync->metrics[SYNC_METRIC_INTERVAL_KEY].value,
+                   "ts_start", sync->first_ts,
+                   "ts_end", sync->last_ts,
+                   "samples_synced", sync->samples_synced,
+                   "elapsed_ms", elapsed,
+                   "samples_per_sec", elapsed > 0 ? sync->samples_synced * 1000 / elapsed : (int64_t)0,
+                   "reads_inflight", sync->reads_inflight,
+                   "writes_inflight", sync->writes_inflight,
+                   "memory_used_kb", (int64_t)(sync->memory_used / 1024));
+    if (statusJ == NULL)
+        return NULL;
+
+    workersJ = json_object_new_array();
+    for (ix = 0; ix < sync->worker_count; ix++) {
+        if (wrap_json_pack(&workerJ, "{s:s?, s:i, s:i}",
+                           "cloud_api", sync->workers[ix].cloud_api,
+                           "writes_inflight", sync->workers[ix].writes_inflight,
+                           "retry_count", sync->workers[ix].retry_count) == 0)
+            json_object_array_add(workersJ, workerJ);
+    }
+    json_object_object_add(statusJ, "workers", workersJ);
+    json_object_object_add(statusJ, "interval_planner", json_object_new_string(sync->adaptive ? "adaptive" : "fixed"));
+    return statusJ;
+}
@@ -0,0 +1,249 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_SYNC_
+#define _CLOUD_PUB_SYNC_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+#include "cloud-publication-planner.h"
+#include "cloud-publication-congestion.h"
+
+#define SYNC_DEFAULT_INTERVAL_SIZE 1800000
+#define SYNC_DEFAULT_BANDWIDTH_LEVEL "medium"
+#define SYNC_DEFAULT_READ_WINDOW 1
+#define SYNC_DEFAULT_WRITE_WINDOW 1
+#define SYNC_DEFAULT_MEMORY_CAP_KB 32768
+#define SYNC_DEFAULT_TARGET_SAMPLES 100000
+#define SYNC_DEFAULT_BYTE_BUDGET_KB 8192
+
+#define SYNC_MAX_WORKERS 16
+
+// ts_info() calls in flight during the database scan, and ts_create() calls
+// in flight when preparing the cloud side keys
+#define SYNC_SCAN_WINDOW 64
+
+// Consecutive write errors of a worker, other than disconnections, after which
+// the sync fails
+#define SYNC_MAX_WRITE_ERRORS 3
+
+#define SYNC_DEFAULT_COMPACTION_AGGREGATOR "avg"
+#define SYNC_DEFAULT_COMPACTION_BUCKET 1800000
+
+// Rough in-memory footprint of one sample of a ts_mrange() reply, used to
+// enforce the pipeline memory cap
+#define SYNC_SAMPLE_SIZE_ESTIMATE 128
+
+#define SYNC_VALUE_MAX_LEN 256
+
+// Local side keys of the resumption point: CLOUD_PUB_SYNC_*[.<context API>],
+// the bare names being those of the first context, shared with the Python
+// engine
+#define SYNC_KEY_MAX_LEN 128
+
+// The persisted synchronization metrics. Key names and value formats are
+// shared with the Python engine (see python/sync.py SyncInfo) so that a sync
+// started by one engine can be resumed by the other.
+typedef enum {
+    SYNC_METRIC_INTERVAL_IDX,
+    SYNC_METRIC_INTERVAL_KEY,
+    SYNC_METRIC_INTERVAL_KEY_IDX,
+    SYNC_METRIC_TS_START,
+    SYNC_METRIC_TS_END,
+    SYNC_METRIC_INTERVALS_TOTAL_CNT,
+    SYNC_METRIC_INTERVAL_SIZE,
+    SYNC_METRIC_FINISHED,
+    SYNC_METRIC_BANDWIDTH_LEVEL,
+    SYNC_METRIC_COUNT
+} syncMetricIdT;
+
+typedef struct syncMetric {
+    bool in_db;
+    char db_value[SYNC_VALUE_MAX_LEN];
+    char value[SYNC_VALUE_MAX_LEN];
+} syncMetricT;
+
+typedef enum {
+    SYNC_STATE_IDLE,
+    SYNC_STATE_SCANNING,
+    SYNC_STATE_LOADING,
+    SYNC_STATE_RUNNING,
+    SYNC_STATE_FINISHED,
+    SYNC_STATE_STOPPED,
+    SYNC_STATE_FAILED
+} syncStateT;
+
+// One key worth of records of the interval being synchronized
+typedef struct syncRecord {
+    const char * key;
+    json_object * seriesJ;
+} syncRecordT;
+
+typedef enum {
+    SYNC_KEY_PENDING,
+    SYNC_KEY_INFLIGHT,
+    SYNC_KEY_ACKED
+} syncKeyStateT;
+
+typedef enum {
+    SYNC_SLOT_FREE,
+    SYNC_SLOT_READING,
+    SYNC_SLOT_READY
+} syncSlotStateT;
+
+// One interval of the pipeline read window
+typedef struct syncSlot {
+    struct cloudSync * sync;
+    syncSlotStateT state;
+    int64_t interval_idx;
+    json_object * recordsJ;
+    syncRecordT * records;
+    syncKeyStateT * key_states;
+    size_t record_count;
+    // keys [0, acked_prefix) are acknowledged by the cloud side
+    size_t acked_prefix;
+    size_t bytes;
+} syncSlotT;
+
+// One sync worker: the keys of every interval are sharded across the workers,
+// each of them writing its shard through its own cloud side connection and
+// recording its own resumption cursor.
+typedef struct syncWorker {
+    const char * cloud_api;
+    int writes_inflight;
+    int retry_count;
+    int error_count;
+    int64_t resume_at;
+
+    // CLOUD_PUB_SYNC_INTERVAL_KEY[_IDX][.<context API>].<worker> keys, used
+    // with several workers
+    char key_name[SYNC_KEY_MAX_LEN];
+    char key_idx_name[SYNC_KEY_MAX_LEN];
+    bool key_in_db;
+    bool key_idx_in_db;
+    char db_key[SYNC_VALUE_MAX_LEN];
+    char db_key_idx[SYNC_VALUE_MAX_LEN];
+} syncWorkerT;
+
+// One write of the resumption point
+#define SYNC_PROGRESS_MAX_STEPS (4 + 3 * SYNC_MAX_WORKERS + 1)
+typedef struct syncProgressStep {
+    const char * key;
+    char value[SYNC_VALUE_MAX_LEN];
+} syncProgressStepT;
+
+typedef struct cloudSync {
+    // configuration
+    const char * key_label_ts;
+    int64_t interval_size;
+    bool adaptive;
+    int64_t target_samples;
+    int byte_budget_kb;
+    int read_window;
+    int write_window;
+    size_t memory_cap;
+    int worker_count;
+    afb_api_t api;
+    const char * redis_local_api;
+    const char * redis_cloud_api;
+    // retry delays, shared with the publication of the context
+    cloudBackoffT * backoff;
+    // compacted counterpart of each cloud side key, as the Python engine does
+    bool compaction;
+    const char * compaction_suffix;
+    const char * compaction_aggregator;
+    int64_t compaction_bucket;
+
+    // runtime state
+    syncStateT state;
+    bool stop_requested;
+    pthread_mutex_t lock;
+    int pending;
+    bool op_failed;
+    bool disconnected;
+    void (*on_complete)(struct cloudSync * sync);
+
+    // database scan
+    json_object * keysJ;
+    size_t key_scan_idx;
+    int64_t first_ts;
+    int64_t last_ts;
+    int64_t total_samples;
+    syncKeyInfoT * key_infos;
+    size_t key_info_count;
+    syncPlanT plan;
+
+    // cloud side keys creation, keys first and compaction rules next
+    size_t key_create_idx;
+    bool key_create_rules;
+
+    // interval iteration: interval_idx and interval_key_idx point to the
+    // oldest interval not fully acknowledged by the cloud side
+    syncMetricT metrics[SYNC_METRIC_COUNT];
+    char metric_keys[SYNC_METRIC_COUNT][SYNC_KEY_MAX_LEN];
+    char workers_key[SYNC_KEY_MAX_LEN];
+    // the keys are those of the Python engine, whose cloud side ledger is
+    // reset along with them
+    bool python_keys;
+    bool resumable;
+    bool resumation_done;
+    int64_t intervals_total_cnt;
+    int64_t interval_idx;
+    int64_t interval_key_idx;
+
+    // interval pipeline
+    syncSlotT * slots;
+    int64_t next_read;
+    int reads_inflight;
+    int writes_inflight;
+    size_t memory_used;
+    bool pipeline_failed;
+    bool pipeline_closed;
+
+    // workers
+    syncWorkerT workers[SYNC_MAX_WORKERS];
+    bool workers_in_db;
+    char db_workers[SYNC_VALUE_MAX_LEN];
+
+    // resumption point persistence
+    int64_t persisted_interval_idx;
+    bool progress_dirty;
+    bool progress_pending;
+    syncProgressStepT progress[SYNC_PROGRESS_MAX_STEPS];
+    int progress_count;
+    int progress_step;
+
+    // statistics
+    int64_t started_at;
+    int64_t samples_synced;
+} cloudSyncT;
+
+int sync_config(afb_api_t api, cloudSyncT * sync, json_object * syncJ, const char * default_label,
+                const char * scope);
+int sync_start(cloudSyncT * sync, afb_api_t api, const char * redis_local_api,
+               const char * redis_cloud_api, cloudBackoffT * backoff);
+int sync_stop(cloudSyncT * sync);
+json_object * sync_status(cloudSyncT * sync);
+
+#endif /* _CLOUD_PUB_SYNC_ */
@@ -0,0 +1,299 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "cloud-publication-trigger.h"
+
+/**
+ * @brief Parse the 'trigger' entry of a publication context
+ *
+ * { "mode": "event", "event": "redis/ts_insert", "api": "redis",
+ *   "subscribe_verb": "subscribe", "subscribe_args": { ... },
+ *   "min_samples": 1000, "max_delay_ms": 5000 }
+ *
+ * @param default_delay_ms - max_delay_ms when not given, the publication period
+ * @return 0 on success, also without configuration, -1 on invalid configuration
+ */
+int trigger_config(afb_api_t api, cloudTriggerT * trigger, json_object * triggerJ, int default_delay_ms) {
+    const char * mode = "periodic";
+    int err;
+
+    memset(trigger, 0, sizeof(*trigger));
+    pthread_mutex_init(&trigger->lock, NULL);
+    trigger->min_samples = TRIGGER_DEFAULT_MIN_SAMPLES;
+    trigger->max_delay_ms = default_delay_ms;
+    trigger->armed_at = TRIGGER_NONE;
+    trigger->deferred_at = TRIGGER_NONE;
+    if (triggerJ == NULL)
+        return 0;
+
+    err = wrap_json_unpack(triggerJ, "{s?:s, s?:s, s?:s, s?:s, s?:o, s?:I, s?:i !}", "mode", &mode,
+                           "event", &trigger->event, "api", &trigger->api,
+                           "subscribe_verb", &trigger->subscribe_verb,
+                           "subscribe_args", &trigger->subscribe_argsJ,
+                           "min_samples", &trigger->min_samples, "max_delay_ms", &trigger->max_delay_ms);
+    if (err) {
+        AFB_API_ERROR(api, "Cannot parse trigger config at '%s'. Error is: %s",
+                      json_object_to_json_string(triggerJ), wrap_json_get_error_string(err));
+        return -1;
+    }
+
+    if (strcmp(mode, "periodic") == 0)
+        return 0;
+
+    if (strcmp(mode, "event") != 0) {
+        AFB_API_ERROR(api, "Invalid trigger mode '%s', expecting 'periodic' or 'event'", mode);
+        return -1;
+    }
+
+    if (trigger->event == NULL) {
+        AFB_API_ERROR(api, "Event-driven publication requires the 'event' to listen to!");
+        return -1;
+    }
+
+    if (trigger->min_samples <= 0 || trigger->max_delay_ms <= 0) {
+        AFB_API_ERROR(api, "Trigger sample count and delay must be positive!");
+        return -1;
+    }
+
+    json_object_get(trigger->subscribe_argsJ);
+    trigger->enabled = true;
+    return 0;
+}
+
+struct trigger_subscribe_closure {
+    cloudTriggerT * trigger;
+    trigger_subscribed_cb callback;
+    void * closure;
+};
+
+static void trigger_subscribe_cb(void *closure, struct json_object *resultJ,
+                                 const char *error, const char * info, afb_api_t api) {
+    struct trigger_subscribe_closure * subscribe = closure;
+
+    if (error) {
+        AFB_API_WARNING(api, "cannot subscribe to '%s': %s [%s]", subscribe->trigger->event,
+                        error, info ? info : "-");
+    } else {
+        subscribe->trigger->subscribed = true;
+    }
+
+    subscribe->callback(subscribe->trigger, error ? -1 : 0, subscribe->closure);
+    free(subscribe);
+}
+
+/**
+ * @brief Listen to the sample notifications of the local side
+ *
+ * The event handler is installed once, and the subscription verb, if any, is
+ * called once: both last as long as the binding.
+ *
+ * @param handler - the event handler, given the closure
+ * @param callback - called once subscribed, with a negative status on failure
+ */
+void trigger_subscribe(cloudTriggerT * trigger, afb_api_t api, const char * local_api,
+                       trigger_event_cb handler, trigger_subscribed_cb callback, void * closure) {
+    struct trigger_subscribe_closure * subscribe;
+
+    if (!trigger->handler_added) {
+        if (afb_api_event_handler_add(api, trigger->event, handler, closure) < 0) {
+            AFB_API_WARNING(api, "cannot listen to event '%s'", trigger->event);
+            callback(trigger, -1, closure);
+            return;
+        }
+        trigger->handler_added = true;
+    }
+
+    if (trigger->subscribed || trigger->subscribe_verb == NULL) {
+        callback(trigger, 0, closure);
+        return;
+    }
+
+    subscribe = malloc(sizeof(*subscribe));
+    if (subscribe == NULL) {
+        callback(trigger, -1, closure);
+        return;
+    }
+    subscribe->trigger = trigger;
+    subscribe->callback = callback;
+    subscribe->closure = closure;
+
+    afb_api_call(api, trigger->api ? trigger->api : local_api, trigger->subscribe_verb,
+                 json_object_get(trigger->subscribe_argsJ), trigger_subscribe_cb, subscribe);
+}
+
+/**
+ * @brief Start over, a first round being run right away
+ */
+void trigger_reset(cloudTriggerT * trigger) {
+    pthread_mutex_lock(&trigger->lock);
+    trigger->round_running = true;
+    trigger->pending = 0;
+    trigger->armed_at = TRIGGER_NONE;
+    trigger->deferred_at = TRIGGER_NONE;
+    pthread_mutex_unlock(&trigger->lock);
+}
+
+// Delay of the round job to queue for the pending samples or deferred round,
+// -1 when the queued one is due soon enough. Called with the lock held.
+static int trigger_arm(cloudTriggerT * trigger, int64_t now) {
+    int64_t due = TRIGGER_NONE;
+
+    if (trigger->round_running)
+        return -1;
+
+    if (trigger->pending > 0)
+        due = trigger->pending >= trigger->min_samples ? now : trigger->first_pending_at + trigger->max_delay_ms;
+    if (trigger->deferred_at < due)
+        due = trigger->deferred_at;
+    if (due == TRIGGER_NONE || due >= trigger->armed_at)
+        return -1;
+
+    trigger->armed_at = due;
+    return due > now ? (int)(due - now) : 0;
+}
+
+// Sample count of a notification: its 'samples' count, its length when it is
+// an array, one otherwise
+static int64_t trigger_event_samples(json_object * dataJ) {
+    json_object * samplesJ;
+
+    if (json_object_is_type(dataJ, json_type_array))
+        return (int64_t)json_object_array_length(dataJ);
+
+    if (json_object_object_get_ex(dataJ, "samples", &samplesJ) &&
+        json_object_is_type(samplesJ, json_type_int))
+        return json_object_get_int64(samplesJ);
+
+    return 1;
+}
+
+/**
+ * @brief Account for a sample notification of the local side
+ *
+ * @return the delay of the round job to queue, -1 when none is needed
+ */
+int trigger_event(cloudTriggerT * trigger, json_object * dataJ, int64_t now) {
+    int64_t samples = trigger_event_samples(dataJ);
+    int delay;
+
+    if (samples <= 0)
+        return -1;
+
+    pthread_mutex_lock(&trigger->lock);
+    trigger->events++;
+    if (trigger->pending == 0)
+        trigger->first_pending_at = now;
+    trigger->pending += samples;
+    delay = trigger_arm(trigger, now);
+    pthread_mutex_unlock(&trigger->lock);
+
+    return delay;
+}
+
+/**
+ * @brief Have a round started at a given time, without any new notification
+ *
+ * Used for the notified samples of the classes whose publication period is
+ * not over yet, and for the rounds skipped while publication was paused.
+ *
+ * @return the delay of the round job to queue, -1 when none is needed, e.g.
+ * while a round runs: the round is then armed when it ends
+ */
+int trigger_defer(cloudTriggerT * trigger, int64_t at, int64_t now) {
+    int delay;
+
+    pthread_mutex_lock(&trigger->lock);
+    if (at < trigger->deferred_at)
+        trigger->deferred_at = at;
+    delay = trigger_arm(trigger, now);
+    pthread_mutex_unlock(&trigger->lock);
+
+    return delay;
+}
+
+/**
+ * @brief Tell whether a round job is to start a round
+ *
+ * Jobs queued for an earlier deadline may still fire: they are ignored as long
+ * as the latest one is not due.
+ *
+ * @return true when the round is to start, the pending samples being read
+ */
+bool trigger_round_begin(cloudTriggerT * trigger, int64_t now) {
+    bool due;
+
+    pthread_mutex_lock(&trigger->lock);
+    due = trigger->enabled && !trigger->round_running &&
+          ((trigger->pending > 0 &&
+            (trigger->pending >= trigger->min_samples || now >= trigger->armed_at ||
+             now >= trigger->first_pending_at + trigger->max_delay_ms)) ||
+           now >= trigger->deferred_at);
+    if (due) {
+        trigger->round_running = true;
+        trigger->pending = 0;
+        trigger->armed_at = TRIGGER_NONE;
+        trigger->deferred_at = TRIGGER_NONE;
+    }
+    pthread_mutex_unlock(&trigger->lock);
+
+    return due;
+}
+
+/**
+ * @brief End a round, with the samples notified meanwhile
+ *
+ * @return the delay of the round job to queue, -1 when idle
+ */
+int trigger_round_end(cloudTriggerT * trigger, int64_t now) {
+    int delay;
+
+    pthread_mutex_lock(&trigger->lock);
+    trigger->round_running = false;
+    trigger->armed_at = TRIGGER_NONE;
+    delay = trigger_arm(trigger, now);
+    pthread_mutex_unlock(&trigger->lock);
+
+    return delay;
+}
+
+/**
+ * @brief Give up on notifications, publishing periodically instead
+ *
+ * @return true when idle: the periodic rounds are then to be started by the
+ * caller, rather than at the end of the running round
+ */
+bool trigger_fallback(cloudTriggerT * trigger) {
+    bool idle;
+
+    pthread_mutex_lock(&trigger->lock);
+    trigger->enabled = false;
+    idle = !trigger->round_running;
+    pthread_mutex_unlock(&trigger->lock);
+
+    return idle;
+}
@@ -0,0 +1,80 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+
+#ifndef _CLOUD_PUB_TRIGGER_
+#define _CLOUD_PUB_TRIGGER_
+
+#include <pthread.h>
+
+#include "cloud-publication-binding.h"
+
+#define TRIGGER_DEFAULT_MIN_SAMPLES 1000
+
+#define TRIGGER_NONE INT64_MAX
+
+// Event-driven publication: rather than every publish_frequency_ms, a round is
+// started once min_samples new samples are notified by the local side, or
+// max_delay_ms after the first of them, whichever comes first. Without any
+// notification, no round is started at all.
+typedef struct cloudTrigger {
+    // configuration
+    bool enabled;
+    const char * api;
+    const char * event;
+    const char * subscribe_verb;
+    json_object * subscribe_argsJ;
+    int64_t min_samples;
+    int max_delay_ms;
+
+    // runtime state
+    pthread_mutex_t lock;
+    bool handler_added;
+    bool subscribed;
+    bool round_running;
+    // samples notified since the last round started
+    int64_t pending;
+    int64_t first_pending_at;
+    // when the earliest queued round job is due
+    int64_t armed_at;
+    // when notified samples of classes not due yet are to be read
+    int64_t deferred_at;
+
+    // statistics
+    uint64_t events;
+} cloudTriggerT;
+
+typedef void (*trigger_event_cb)(void * closure, const char * event, json_object * dataJ, afb_api_t api);
+typedef void (*trigger_subscribed_cb)(cloudTriggerT * trigger, int status, void * closure);
+
+int trigger_config(afb_api_t api, cloudTriggerT * trigger, json_object * triggerJ, int default_delay_ms);
+void trigger_subscribe(cloudTriggerT * trigger, afb_api_t api, const char * local_api,
+                       trigger_event_cb handler, trigger_subscribed_cb callback, void * closure);
+void trigger_reset(cloudTriggerT * trigger);
+int trigger_event(cloudTriggerT * trigger, json_object * dataJ, int64_t now);
+int trigger_defer(cloudTriggerT * trigger, int64_t at, int64_t now);
+bool trigger_round_begin(cloudTriggerT * trigger, int64_t now);
+int trigger_round_end(cloudTriggerT * trigger, int64_t now);
+bool trigger_fallback(cloudTriggerT * trigger);
+
+#endif /* _CLOUD_PUB_TRIGGER_ */
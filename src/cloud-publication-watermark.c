@@ -0,0 +1,344 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "cloud-publication-watermark.h"
+
+#define WATERMARK_FIELD_HORIZON "horizon"
+#define WATERMARK_FIELD_KEYS "keys"
+#define WATERMARK_FIELD_DEFERRED "deferred"
+
+struct watermark_load_closure {
+    cloudWatermarkT * wm;
+    watermark_loaded_cb callback;
+    void * closure;
+};
+
+/**
+ * @brief Initialize an empty watermark
+ *
+ * @param wm - the watermark to initialize
+ * @param scope - the name of the publication context, NULL for the first one
+ * @param sensor_class - the sensor class of the watermark
+ * @return 0 on success, -1 on allocation failure
+ */
+int watermark_init(cloudWatermarkT * wm, const char * scope, const char * sensor_class) {
+    memset(wm, 0, sizeof(*wm));
+
+    if (asprintf(&wm->store_key, "%s%s%s%s", WATERMARK_KEY_PREFIX, scope ? scope : "", scope ? "." : "",
+                 sensor_class) < 0) {
+        wm->store_key = NULL;
+        return -1;
+    }
+
+    wm->horizon = WATERMARK_NONE;
+    wm->marksJ = json_object_new_object();
+    wm->deferredJ = json_object_new_object();
+    if (wm->marksJ == NULL || wm->deferredJ == NULL)
+        return -1;
+
+    return 0;
+}
+
+void watermark_release(cloudWatermarkT * wm) {
+    free(wm->store_key);
+    json_object_put(wm->marksJ);
+    json_object_put(wm->deferredJ);
+    memset(wm, 0, sizeof(*wm));
+}
+
+/**
+ * @brief Format the lower bound of the next ts_mrange() query
+ *
+ * Redis ranges are inclusive, hence the query starts right after the horizon.
+ */
+void watermark_fromts(const cloudWatermarkT * wm, char * buffer, size_t size) {
+    if (wm->horizon == WATERMARK_NONE)
+        snprintf(buffer, size, "-");
+    else
+        snprintf(buffer, size, "%" PRId64, wm->horizon + 1);
+}
+
+static int64_t watermark_key_mark(const cloudWatermarkT * wm, const char * key) {
+    json_object * markJ;
+
+    if (!json_object_object_get_ex(wm->marksJ, key, &markJ))
+        return WATERMARK_NONE;
+
+    return json_object_get_int64(markJ);
+}
+
+/**
+ * @brief Drop the already acknowledged samples from a freshly read batch
+ *
+ * @return the number of dropped samples
+ */
+size_t watermark_trim_batch(const cloudWatermarkT * wm, cloudBatchT * batch) {
+    size_t ix;
+    size_t dropped = 0;
+    int64_t mark;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        mark = watermark_key_mark(wm, batch->series[ix].key);
+        if (mark != WATERMARK_NONE)
+            dropped += batch_series_trim(&batch->series[ix], mark);
+    }
+
+    if (dropped)
+        batch_compact(batch);
+
+    return dropped;
+}
+
+/**
+ * @brief Record the first unpublished sample of a deferred key, keeping the
+ * oldest one
+ */
+void watermark_defer(json_object * deferredJ, const char * key, int64_t first_ts) {
+    int64_t deferred = watermark_key_deferred(deferredJ, key);
+
+    if (deferred == WATERMARK_NONE || first_ts < deferred)
+        json_object_object_add(deferredJ, key, json_object_new_int64(first_ts));
+}
+
+/**
+ * @brief Tell the first unpublished sample of a deferred key
+ *
+ * @return the timestamp, WATERMARK_NONE when the key is not deferred
+ */
+int64_t watermark_key_deferred(json_object * deferredJ, const char * key) {
+    json_object * deferredTsJ;
+
+    if (deferredJ == NULL || !json_object_object_get_ex(deferredJ, key, &deferredTsJ))
+        return WATERMARK_NONE;
+
+    return json_object_get_int64(deferredTsJ);
+}
+
+/**
+ * @brief Copy the committed deferred keys, the reader stage tracking its own
+ * deferrals on top of them
+ */
+json_object * watermark_deferred(const cloudWatermarkT * wm) {
+    json_object * deferredJ = json_object_new_object();
+
+    if (deferredJ == NULL)
+        return NULL;
+
+    json_object_object_foreach(wm->deferredJ, key, deferredTsJ)
+        json_object_object_add(deferredJ, key, json_object_new_int64(json_object_get_int64(deferredTsJ)));
+
+    return deferredJ;
+}
+
+/**
+ * @brief Tell the oldest unpublished sample of the deferred keys
+ *
+ * @return the timestamp, WATERMARK_NONE when no key is deferred
+ */
+int64_t watermark_deferred_from(const cloudWatermarkT * wm) {
+    int64_t from = WATERMARK_NONE;
+    int64_t deferred;
+
+    json_object_object_foreach(wm->deferredJ, key, deferredTsJ) {
+        (void)key;
+        deferred = json_object_get_int64(deferredTsJ);
+        if (from == WATERMARK_NONE || deferred < from)
+            from = deferred;
+    }
+
+    return from;
+}
+
+/**
+ * @brief Advance the watermark once a batch has been acknowledged
+ *
+ * The horizon moves past the keys deferred by the round: they are recorded
+ * instead, and forgotten once a later round publishes them.
+ *
+ * @param wm - the watermark to update
+ * @param batch - the acknowledged batch, may be empty
+ * @param horizon - the upper bound of the query the batch originates from
+ * @param deferredJ - the keys deferred by the round, with their first
+ *                    unpublished sample, NULL if none
+ */
+void watermark_commit(cloudWatermarkT * wm, const cloudBatchT * batch, int64_t horizon,
+                      json_object * deferredJ) {
+    size_t ix;
+
+    for (ix = 0; ix < batch->count; ix++) {
+        if (batch->series[ix].last_ts > watermark_key_mark(wm, batch->series[ix].key))
+            json_object_object_add(wm->marksJ, batch->series[ix].key,
+                                   json_object_new_int64(batch->series[ix].last_ts));
+        json_object_object_del(wm->deferredJ, batch->series[ix].key);
+    }
+
+    if (deferredJ) {
+        json_object_object_foreach(deferredJ, key, deferredTsJ)
+            watermark_defer(wm->deferredJ, key, json_object_get_int64(deferredTsJ));
+    }
+
+    if (horizon > wm->horizon)
+        wm->horizon = horizon;
+}
+
+static void watermark_load_cb(void *closure, struct json_object *valueJ,
+                              const char *error, const char * info, afb_api_t api) {
+    struct watermark_load_closure * load = closure;
+    cloudWatermarkT * wm = load->wm;
+    json_object * storedJ = NULL;
+    json_object * horizonJ;
+    json_object * marksJ;
+    json_object * deferredJ;
+    int status = 0;
+
+    if (error) {
+        AFB_API_WARNING(api, "cannot retrieve watermark '%s': %s [%s]", wm->store_key,
+                        error, info ? info : "-");
+        status = -1;
+        goto done;
+    }
+
+    // Key not found: nothing was ever published for this class
+    if (valueJ == NULL || !json_object_is_type(valueJ, json_type_string))
+        goto done;
+
+    storedJ = json_tokener_parse(json_object_get_string(valueJ));
+    if (storedJ == NULL ||
+        !json_object_object_get_ex(storedJ, WATERMARK_FIELD_HORIZON, &horizonJ) ||
+        !json_object_object_get_ex(storedJ, WATERMARK_FIELD_KEYS, &marksJ) ||
+        !json_object_is_type(marksJ, json_type_object)) {
+        AFB_API_WARNING(api, "ignoring malformed watermark '%s': %s", wm->store_key,
+                        json_object_get_string(valueJ));
+        status = -1;
+        goto done;
+    }
+
+    wm->horizon = json_object_get_int64(horizonJ);
+    json_object_put(wm->marksJ);
+    wm->marksJ = json_object_get(marksJ);
+
+    // absent from the watermarks stored by older versions
+    if (json_object_object_get_ex(storedJ, WATERMARK_FIELD_DEFERRED, &deferredJ) &&
+        json_object_is_type(deferredJ, json_type_object)) {
+        json_object_put(wm->deferredJ);
+        wm->deferredJ = json_object_get(deferredJ);
+    }
+    AFB_API_DEBUG(api, "restored watermark '%s' at %" PRId64 " (%d keys)", wm->store_key,
+                  wm->horizon, json_object_object_length(wm->marksJ));
+
+done:
+    json_object_put(storedJ);
+    wm->loaded = true;
+    load->callback(wm, status, load->closure);
+    free(load);
+}
+
+/**
+ * @brief Restore a persisted watermark from the local side
+ *
+ * Completion is signaled through the callback. A missing or unreadable stored
+ * state leaves the watermark empty, meaning the whole history is published.
+ */
+void watermark_load(cloudWatermarkT * wm, afb_api_t api, const char * redis_api,
+                    watermark_loaded_cb callback, void * closure) {
+    struct watermark_load_closure * load;
+    json_object * argsJ;
+
+    wm->api = api;
+    wm->redis_api = redis_api;
+
+    if (wm->loaded) {
+        callback(wm, 0, closure);
+        return;
+    }
+
+    load = malloc(sizeof(*load));
+    if (load == NULL || wrap_json_pack(&argsJ, "{s:s}", "key", wm->store_key)) {
+        free(load);
+        callback(wm, -1, closure);
+        return;
+    }
+    load->wm = wm;
+    load->callback = callback;
+    load->closure = closure;
+
+    afb_api_call(api, redis_api, REDIS_VERB_GET, argsJ, watermark_load_cb, load);
+}
+
+static void watermark_persist_cb(void *closure, struct json_object *resultJ,
+                                 const char *error, const char * info, afb_api_t api) {
+    cloudWatermarkT * wm = closure;
+
+    if (error)
+        AFB_API_WARNING(api, "cannot persist watermark '%s': %s [%s]", wm->store_key,
+                        error, info ? info : "-");
+
+    wm->persist_pending = false;
+    if (wm->persist_again) {
+        wm->persist_again = false;
+        watermark_persist(wm);
+    }
+}
+
+/**
+ * @brief Save the watermark on the local side
+ *
+ * Only one write is in flight at a time so that an older state can never
+ * overwrite a newer one. Updates made meanwhile are written once it completes.
+ */
+void watermark_persist(cloudWatermarkT * wm) {
+    json_object * storedJ;
+    json_object * argsJ;
+    int err;
+
+    if (wm->api == NULL)
+        return;
+
+    if (wm->persist_pending) {
+        wm->persist_again = true;
+        return;
+    }
+
+    err = wrap_json_pack(&storedJ, "{s:I, s:O, s:O}", WATERMARK_FIELD_HORIZON, wm->horizon,
+                         WATERMARK_FIELD_KEYS, wm->marksJ, WATERMARK_FIELD_DEFERRED, wm->deferredJ);
+    if (err) {
+        AFB_API_ERROR(wm->api, "watermark '%s' packing failed!", wm->store_key);
+        return;
+    }
+
+    err = wrap_json_pack(&argsJ, "{s:s, s:s}", "key", wm->store_key,
+                         "value", json_object_to_json_string_ext(storedJ, JSON_C_TO_STRING_PLAIN));
+    json_object_put(storedJ);
+    if (err) {
+        AFB_API_ERROR(wm->api, "watermark '%s' packing failed!", wm->store_key);
+        return;
+    }
+
+    wm->persist_pending = true;
+    afb_api_call(wm->api, wm->redis_api, REDIS_VERB_SET, argsJ, watermark_persist_cb, wm);
+}
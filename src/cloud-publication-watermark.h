@@ -0,0 +1,73 @@
+/*
+* Copyright (C) 2020-2021 IoT.bzh Company
+* Author Vincent Rubiolo <vincent.rubiolo@iot.bzh>
+*
+* $RP_BEGIN_LICENSE$
+* Commercial License Usage
+*  Licensees holding valid commercial IoT.bzh licenses may use this file in
+*  accordance with the commercial license agreement provided with the
+*  Software or, alternatively, in accordance with the terms contained in
+*  a written agreement between you and The IoT.bzh Company. For licensing terms
+*  and conditions see https://www.iot.bzh/terms-conditions. For further
+*  information use the contact form at https://www.iot.bzh/contact.
+*
+* GNU General Public License Usage
+*  Alternatively, this file may be used under the terms of the GNU General
+*  Public license version 3. This license is as published by the Free Software
+*  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+*  of this file. Please review the following information to ensure the GNU
+*  General Public License requirements will be met
+*  https://www.gnu.org/licenses/gpl-3.0.html.
+* $RP_END_LICENSE$
+*/
+
+#ifndef _CLOUD_PUB_WATERMARK_
+#define _CLOUD_PUB_WATERMARK_
+
+#include "cloud-publication-binding.h"
+#include "cloud-publication-batch.h"
+
+// Prefix of the local side keys holding the persisted watermarks, one per
+// sensor class and publication context:
+// CLOUD_PUB_WATERMARK.[<context API>.]<sensor class>
+#define WATERMARK_KEY_PREFIX "CLOUD_PUB_WATERMARK."
+
+#define WATERMARK_NONE -1
+
+// High-watermark state for one sensor class.
+//
+// The horizon is the upper bound of the last ts_mrange() query whose results
+// were fully acknowledged by the cloud side: nothing at or below it needs to be
+// read again. Per-key marks record the last acknowledged sample of each key
+// and protect against re-publishing samples when query windows overlap. The
+// keys deferred by the bandwidth scheduler record their first unpublished
+// sample, below the horizon: they are read again from there.
+typedef struct cloudWatermark {
+    char * store_key;
+    int64_t horizon;
+    json_object * marksJ;
+    json_object * deferredJ;
+    bool loaded;
+    bool persist_pending;
+    bool persist_again;
+    afb_api_t api;
+    const char * redis_api;
+} cloudWatermarkT;
+
+typedef void (*watermark_loaded_cb)(cloudWatermarkT * wm, int status, void * closure);
+
+int watermark_init(cloudWatermarkT * wm, const char * scope, const char * sensor_class);
+void watermark_release(cloudWatermarkT * wm);
+void watermark_fromts(const cloudWatermarkT * wm, char * buffer, size_t size);
+size_t watermark_trim_batch(const cloudWatermarkT * wm, cloudBatchT * batch);
+void watermark_commit(cloudWatermarkT * wm, const cloudBatchT * batch, int64_t horizon,
+                      json_object * deferredJ);
+void watermark_defer(json_object * deferredJ, const char * key, int64_t first_ts);
+int64_t watermark_key_deferred(json_object * deferredJ, const char * key);
+json_object * watermark_deferred(const cloudWatermarkT * wm);
+int64_t watermark_deferred_from(const cloudWatermarkT * wm);
+void watermark_load(cloudWatermarkT * wm, afb_api_t api, const char * redis_api,
+                    watermark_loaded_cb callback, void * closure);
+void watermark_persist(cloudWatermarkT * wm);
+
+#endif /* _CLOUD_PUB_WATERMARK_ */